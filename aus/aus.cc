@@ -1,3 +1,4 @@
+#include "blend.h"
 #include "draw_line.h"
 #include "framebuffer.h"
 
@@ -76,8 +77,75 @@ static void draw_line_bench(int seed) {
   }
 }
 
+static void blend_bench(int seed) {
+  Framebuffer fb{1200, 800}, src{1200, 800};
+
+  std::mt19937 r;
+  r.seed(seed);
+  std::uniform_int_distribution<Pixel> col(0, UINT_MAX);
+  for (size_t y = 0; y < fb.height; ++y)
+    for (size_t x = 0; x < fb.width; ++x) {
+      fb.scanline(y)[x] = col(r);
+      src.scanline(y)[x] = col(r);
+    }
+
+  const char* const kModeNames[] = {"source-over", "multiply", "screen"};
+  const BlendMode kModes[] = {BlendMode::kSourceOver, BlendMode::kMultiply,
+                              BlendMode::kScreen};
+  const char* const kImplNames[] = {"scalar", "sse2", "avx2"};
+  const BlendImpl kImpls[] = {BlendImpl::kScalar, BlendImpl::kSse2,
+                              BlendImpl::kAvx2};
+
+  for (int m = 0; m < 3; ++m) {
+    for (int i = 0; i < 3; ++i) {
+      if (!blend_impl_supported(kImpls[i]))
+        continue;
+
+      const int N = 20;
+      const double pixels = double(N) * fb.width * fb.height;
+      Pixel color = col(r);
+
+      auto start = std::chrono::steady_clock::now();
+      for (int n = 0; n < N; ++n)
+        for (size_t y = 0; y < fb.height; ++y)
+          blend_fill(kImpls[i], kModes[m], fb.scanline(y), color, fb.width);
+      auto mid = std::chrono::steady_clock::now();
+      for (int n = 0; n < N; ++n)
+        for (size_t y = 0; y < fb.height; ++y)
+          blend_span(kImpls[i], kModes[m], fb.scanline(y), src.scanline(y),
+                     fb.width);
+      auto end = std::chrono::steady_clock::now();
+
+      std::chrono::duration<double, std::micro> fill_us = mid - start;
+      std::chrono::duration<double, std::micro> span_us = end - mid;
+      printf("%-11s %-6s fill %7.1f Mpixels/s, span %7.1f Mpixels/s\n",
+             kModeNames[m], kImplNames[i], pixels / fill_us.count(),
+             pixels / span_us.count());
+    }
+  }
+
+  Surface s = fb.surface();
+  std::uniform_int_distribution<int> x(0, fb.width - 1);
+  std::uniform_int_distribution<int> y(0, fb.height - 1);
+  for (int m = 0; m < 3; ++m) {
+    const int N = 1'000'000;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+      int y0 = y(r);
+      draw_line(s, x(r), y0, x(r), y0, col(r), kModes[m]);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::chrono::duration<double, std::milli> ms = end - start;
+    printf("%d horizontal %s draw_line calls took %.2f ms\n", N,
+           kModeNames[m], ms.count());
+  }
+}
+
 int main(int argc, char* argv[]) {
   draw_line_bench(argc);
+  blend_bench(argc);
 
   Framebuffer fb{1200, 800};
 
@@ -0,0 +1,214 @@
+#include "blend.h"
+
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AUS_X86 1
+#include <immintrin.h>
+#endif
+
+Pixel blend(BlendMode mode, Pixel src, Pixel dst) {
+  switch (mode) {
+    case BlendMode::kCopy:
+      return blend<BlendMode::kCopy>(src, dst);
+    case BlendMode::kSourceOver:
+      return blend<BlendMode::kSourceOver>(src, dst);
+    case BlendMode::kMultiply:
+      return blend<BlendMode::kMultiply>(src, dst);
+    case BlendMode::kScreen:
+      return blend<BlendMode::kScreen>(src, dst);
+  }
+  return dst;
+}
+
+namespace {
+
+// With kSolid, src points to a single color.
+template <BlendMode kMode, bool kSolid>
+void blend_scalar(Pixel* dst, const Pixel* src, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = blend<kMode>(kSolid ? *src : src[i], dst[i]);
+}
+
+#if AUS_X86
+
+// The SIMD kernels widen each channel to a 16-bit lane, so that products and
+// sums don't overflow, and pack back with unsigned saturation, which does the
+// clamp to 255.  That gives exactly the scalar results.
+
+__m128i mul255_sse2(__m128i a, __m128i b) {
+  __m128i x = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Copies each pixel's alpha lane to its other three lanes.
+__m128i alpha_sse2(__m128i v) {
+  return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff);
+}
+
+template <BlendMode kMode>
+__m128i blend16_sse2(__m128i s, __m128i d) {
+  __m128i inv_sa = _mm_sub_epi16(_mm_set1_epi16(255), alpha_sse2(s));
+  if (kMode == BlendMode::kSourceOver)
+    return _mm_add_epi16(s, mul255_sse2(d, inv_sa));
+  if (kMode == BlendMode::kMultiply) {
+    __m128i inv_da = _mm_sub_epi16(_mm_set1_epi16(255), alpha_sse2(d));
+    return _mm_add_epi16(
+        _mm_add_epi16(mul255_sse2(s, d), mul255_sse2(s, inv_da)),
+        mul255_sse2(d, inv_sa));
+  }
+  return _mm_sub_epi16(_mm_add_epi16(s, d), mul255_sse2(s, d));
+}
+
+template <BlendMode kMode, bool kSolid>
+void blend_sse2(Pixel* dst, const Pixel* src, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i color = _mm_set1_epi32(*src);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = kSolid ? color : _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i lo = blend16_sse2<kMode>(_mm_unpacklo_epi8(s, zero),
+                                     _mm_unpacklo_epi8(d, zero));
+    __m128i hi = blend16_sse2<kMode>(_mm_unpackhi_epi8(s, zero),
+                                     _mm_unpackhi_epi8(d, zero));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+  blend_scalar<kMode, kSolid>(dst + i, kSolid ? src : src + i, n - i);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 __m256i mul255_avx2(__m256i a, __m256i b) {
+  __m256i x =
+      _mm256_add_epi16(_mm256_mullo_epi16(a, b), _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+AVX2 __m256i alpha_avx2(__m256i v) {
+  return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, 0xff), 0xff);
+}
+
+template <BlendMode kMode>
+AVX2 __m256i blend16_avx2(__m256i s, __m256i d) {
+  __m256i inv_sa = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha_avx2(s));
+  if (kMode == BlendMode::kSourceOver)
+    return _mm256_add_epi16(s, mul255_avx2(d, inv_sa));
+  if (kMode == BlendMode::kMultiply) {
+    __m256i inv_da = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha_avx2(d));
+    return _mm256_add_epi16(
+        _mm256_add_epi16(mul255_avx2(s, d), mul255_avx2(s, inv_da)),
+        mul255_avx2(d, inv_sa));
+  }
+  return _mm256_sub_epi16(_mm256_add_epi16(s, d), mul255_avx2(s, d));
+}
+
+// The unpacks and the pack work within each 128-bit half, so pixels come
+// back out in the order they went in.
+template <BlendMode kMode, bool kSolid>
+AVX2 void blend_avx2(Pixel* dst, const Pixel* src, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i color = _mm256_set1_epi32(*src);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i s =
+        kSolid ? color : _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i lo = blend16_avx2<kMode>(_mm256_unpacklo_epi8(s, zero),
+                                     _mm256_unpacklo_epi8(d, zero));
+    __m256i hi = blend16_avx2<kMode>(_mm256_unpackhi_epi8(s, zero),
+                                     _mm256_unpackhi_epi8(d, zero));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+  }
+  blend_sse2<kMode, kSolid>(dst + i, kSolid ? src : src + i, n - i);
+}
+
+#undef AVX2
+
+#endif  // AUS_X86
+
+template <BlendMode kMode, bool kSolid>
+void blend_impl(BlendImpl impl, Pixel* dst, const Pixel* src, size_t n) {
+  assert(blend_impl_supported(impl));
+  if (kMode == BlendMode::kCopy) {
+    if (kSolid)
+      std::fill(dst, dst + n, *src);
+    else
+      std::copy(src, src + n, dst);
+    return;
+  }
+  switch (impl) {
+    case BlendImpl::kScalar:
+      return blend_scalar<kMode, kSolid>(dst, src, n);
+#if AUS_X86
+    case BlendImpl::kSse2:
+      return blend_sse2<kMode, kSolid>(dst, src, n);
+    case BlendImpl::kAvx2:
+      return blend_avx2<kMode, kSolid>(dst, src, n);
+#else
+    default:
+      return blend_scalar<kMode, kSolid>(dst, src, n);
+#endif
+  }
+}
+
+template <bool kSolid>
+void blend_impl(BlendImpl impl, BlendMode mode, Pixel* dst, const Pixel* src,
+                size_t n) {
+  switch (mode) {
+    case BlendMode::kCopy:
+      return blend_impl<BlendMode::kCopy, kSolid>(impl, dst, src, n);
+    case BlendMode::kSourceOver:
+      return blend_impl<BlendMode::kSourceOver, kSolid>(impl, dst, src, n);
+    case BlendMode::kMultiply:
+      return blend_impl<BlendMode::kMultiply, kSolid>(impl, dst, src, n);
+    case BlendMode::kScreen:
+      return blend_impl<BlendMode::kScreen, kSolid>(impl, dst, src, n);
+  }
+}
+
+BlendImpl best_impl() {
+  static const BlendImpl impl = blend_impl_supported(BlendImpl::kAvx2)
+                                    ? BlendImpl::kAvx2
+                                : blend_impl_supported(BlendImpl::kSse2)
+                                    ? BlendImpl::kSse2
+                                    : BlendImpl::kScalar;
+  return impl;
+}
+
+}  // namespace
+
+bool blend_impl_supported(BlendImpl impl) {
+  switch (impl) {
+    case BlendImpl::kScalar:
+      return true;
+#if AUS_X86
+    case BlendImpl::kSse2:
+      return __builtin_cpu_supports("sse2");
+    case BlendImpl::kAvx2:
+      return __builtin_cpu_supports("avx2");
+#else
+    default:
+      return false;
+#endif
+  }
+  return false;
+}
+
+void blend_fill(BlendImpl impl, BlendMode mode, Pixel* dst, Pixel color,
+                size_t n) {
+  blend_impl<true>(impl, mode, dst, &color, n);
+}
+
+void blend_span(BlendImpl impl, BlendMode mode, Pixel* dst, const Pixel* src,
+                size_t n) {
+  blend_impl<false>(impl, mode, dst, src, n);
+}
+
+void blend_fill(BlendMode mode, Pixel* dst, Pixel color, size_t n) {
+  blend_fill(best_impl(), mode, dst, color, n);
+}
+
+void blend_span(BlendMode mode, Pixel* dst, const Pixel* src, size_t n) {
+  blend_span(best_impl(), mode, dst, src, n);
+}
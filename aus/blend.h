@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <algorithm>
+
+#include "pixel.h"
+
+// Porter-Duff and separable blend modes on premultiplied ARGB.  Channel
+// products are rounded with the usual (x + 128 + ((x + 128) >> 8)) >> 8,
+// which is exactly round(x / 255) for x in [0, 255 * 255].  Results are
+// clamped to 255, which only matters for pixels that aren't validly
+// premultiplied.
+//
+// See https://www.w3.org/TR/compositing-1/
+enum class BlendMode {
+  kCopy,        // src
+  kSourceOver,  // src + dst * (1 - src.a)
+  kMultiply,    // src * dst + src * (1 - dst.a) + dst * (1 - src.a)
+  kScreen,      // src + dst - src * dst
+};
+
+inline uint32_t mul255(uint32_t a, uint32_t b) {
+  uint32_t x = a * b + 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+// Scalar reference for one pixel.  All four channels, alpha included, use
+// the same formula.
+template <BlendMode kMode>
+inline Pixel blend(Pixel src, Pixel dst) {
+  if (kMode == BlendMode::kCopy)
+    return src;
+
+  uint32_t sa = src >> 24, da = dst >> 24;
+  Pixel out = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t s = (src >> shift) & 0xff, d = (dst >> shift) & 0xff, c;
+    if (kMode == BlendMode::kSourceOver)
+      c = s + mul255(d, 255 - sa);
+    else if (kMode == BlendMode::kMultiply)
+      c = mul255(s, d) + mul255(s, 255 - da) + mul255(d, 255 - sa);
+    else
+      c = s + d - mul255(s, d);
+    out |= std::min(c, 255u) << shift;
+  }
+  return out;
+}
+
+Pixel blend(BlendMode mode, Pixel src, Pixel dst);
+
+// dst[i] = blend(mode, color, dst[i]) for i in [0, n).
+void blend_fill(BlendMode mode, Pixel* dst, Pixel color, size_t n);
+
+// dst[i] = blend(mode, src[i], dst[i]) for i in [0, n).
+void blend_span(BlendMode mode, Pixel* dst, const Pixel* src, size_t n);
+
+// The implementations behind blend_fill() and blend_span(), for tests and
+// benchmarks.  By default, the fastest supported one is used.
+enum class BlendImpl {
+  kScalar,
+  kSse2,  // 4 pixels at a time.
+  kAvx2,  // 8 pixels at a time.
+};
+
+bool blend_impl_supported(BlendImpl impl);
+
+// |impl| must be supported.
+void blend_fill(BlendImpl impl, BlendMode mode, Pixel* dst, Pixel color,
+                size_t n);
+void blend_span(BlendImpl impl, BlendMode mode, Pixel* dst, const Pixel* src,
+                size_t n);
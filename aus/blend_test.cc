@@ -0,0 +1,174 @@
+#include "blend.h"
+#include "draw_line.h"
+#include "framebuffer.h"
+
+#include <stdio.h>
+
+#include <random>
+#include <vector>
+
+namespace {
+
+constexpr Pixel argb(uint8_t a, uint8_t r, uint8_t g, uint8_t b) {
+  return (a << 24) | rgb(r, g, b);
+}
+
+const char* const kModeNames[] = {"copy", "source-over", "multiply", "screen"};
+const BlendMode kModes[] = {BlendMode::kCopy, BlendMode::kSourceOver,
+                            BlendMode::kMultiply, BlendMode::kScreen};
+
+const char* const kImplNames[] = {"scalar", "sse2", "avx2"};
+const BlendImpl kImpls[] = {BlendImpl::kScalar, BlendImpl::kSse2,
+                            BlendImpl::kAvx2};
+
+void expect_eq(const char* name, Pixel expected, Pixel actual) {
+  if (expected == actual)
+    return;
+  fprintf(stderr, "Test '%s' failed.\n", name);
+  fprintf(stderr, "Expected: %08x\nActual:   %08x\n", expected, actual);
+}
+
+void mul255_test() {
+  for (uint32_t a = 0; a < 256; ++a)
+    for (uint32_t b = 0; b < 256; ++b)
+      if (mul255(a, b) != (2 * a * b + 255) / 510) {
+        fprintf(stderr, "Test 'mul255' failed at %u * %u.\n", a, b);
+        return;
+      }
+}
+
+void blend_values_test() {
+  const Pixel half_red = argb(128, 128, 0, 0);
+  const Pixel opaque_blue = argb(255, 0, 0, 255);
+  const Pixel gray = argb(255, 128, 128, 128);
+
+  expect_eq("source-over opaque", opaque_blue,
+            blend(BlendMode::kSourceOver, opaque_blue, gray));
+  expect_eq("source-over transparent", gray,
+            blend(BlendMode::kSourceOver, 0, gray));
+  expect_eq("source-over half", argb(255, 128, 0, 127),
+            blend(BlendMode::kSourceOver, half_red, opaque_blue));
+
+  expect_eq("multiply white", gray,
+            blend(BlendMode::kMultiply, argb(255, 255, 255, 255), gray));
+  expect_eq("multiply black", argb(255, 0, 0, 0),
+            blend(BlendMode::kMultiply, argb(255, 0, 0, 0), gray));
+  expect_eq("multiply transparent", gray,
+            blend(BlendMode::kMultiply, 0, gray));
+  expect_eq("multiply onto transparent", half_red,
+            blend(BlendMode::kMultiply, half_red, 0));
+
+  expect_eq("screen black", gray,
+            blend(BlendMode::kScreen, argb(255, 0, 0, 0), gray));
+  expect_eq("screen white", argb(255, 255, 255, 255),
+            blend(BlendMode::kScreen, argb(255, 255, 255, 255), gray));
+  expect_eq("screen gray", argb(255, 192, 192, 192),
+            blend(BlendMode::kScreen, gray, gray));
+
+  // Not validly premultiplied: clamps instead of wrapping.
+  expect_eq("source-over clamps", argb(255, 255, 255, 255),
+            blend(BlendMode::kSourceOver, 0x00ffffff, argb(255, 1, 1, 1)));
+}
+
+// Every implementation has to match the scalar reference exactly, for spans
+// with every length up to a few vectors and at every alignment.
+void span_exactness_test() {
+  std::mt19937 r(25);
+  std::uniform_int_distribution<Pixel> any(0, UINT32_MAX);
+  std::uniform_int_distribution<int> byte(0, 255);
+
+  // Mostly validly premultiplied pixels, with opaque and transparent ones
+  // overrepresented, plus some arbitrary ones to check the clamping.
+  auto pixel = [&]() -> Pixel {
+    switch (byte(r) % 8) {
+      case 0:
+        return 0;
+      case 1:
+        return 0xff000000 | (any(r) & 0xffffff);
+      case 2:
+        return any(r);
+      default:
+        uint32_t a = byte(r);
+        return argb(a, mul255(a, byte(r)), mul255(a, byte(r)),
+                    mul255(a, byte(r)));
+    }
+  };
+
+  const size_t kMaxLength = 40, kMaxOffset = 8;
+  for (int round = 0; round < 200; ++round) {
+    std::vector<Pixel> src(kMaxLength + kMaxOffset),
+        dst(kMaxLength + kMaxOffset);
+    for (Pixel& p : src)
+      p = pixel();
+    for (Pixel& p : dst)
+      p = pixel();
+    const Pixel color = pixel();
+
+    for (int m = 0; m < 4; ++m)
+      for (int i = 0; i < 3; ++i) {
+        if (!blend_impl_supported(kImpls[i]))
+          continue;
+        size_t offset = round % kMaxOffset, n = round % (kMaxLength + 1);
+
+        std::vector<Pixel> expected = dst, actual = dst;
+        for (size_t j = 0; j < n; ++j)
+          expected[offset + j] =
+              blend(kModes[m], src[offset + j], dst[offset + j]);
+        blend_span(kImpls[i], kModes[m], actual.data() + offset,
+                   src.data() + offset, n);
+        if (actual != expected) {
+          fprintf(stderr, "Test 'blend_span %s %s' failed, length %zu.\n",
+                  kImplNames[i], kModeNames[m], n);
+          return;
+        }
+
+        expected = actual = dst;
+        for (size_t j = 0; j < n; ++j)
+          expected[offset + j] = blend(kModes[m], color, dst[offset + j]);
+        blend_fill(kImpls[i], kModes[m], actual.data() + offset, color, n);
+        if (actual != expected) {
+          fprintf(stderr, "Test 'blend_fill %s %s' failed, length %zu.\n",
+                  kImplNames[i], kModeNames[m], n);
+          return;
+        }
+      }
+  }
+}
+
+// The lines blend each pixel they touch, and only those.
+void draw_line_blend_test() {
+  const Pixel gray = argb(255, 128, 128, 128);
+  const Pixel half_red = argb(128, 128, 0, 0);
+  const Pixel expected = blend(BlendMode::kSourceOver, half_red, gray);
+
+  Framebuffer fb{20, 20};
+  Surface s = fb.surface();
+  for (size_t y = 0; y < fb.height; ++y)
+    for (size_t x = 0; x < fb.width; ++x)
+      fb.scanline(y)[x] = gray;
+
+  draw_line(s, 2, 1, 17, 1, half_red, BlendMode::kSourceOver);
+  draw_line(s, 1, 3, 1, 18, half_red, BlendMode::kSourceOver);
+  draw_line(s, 3, 3, 18, 18, half_red, BlendMode::kSourceOver);
+
+  for (size_t y = 0; y < fb.height; ++y)
+    for (size_t x = 0; x < fb.width; ++x) {
+      bool on = (y == 1 && x >= 2 && x <= 17) ||
+                (x == 1 && y >= 3 && y <= 18) ||
+                (x == y && x >= 3 && x <= 18);
+      if (fb.scanline(y)[x] != (on ? expected : gray)) {
+        fprintf(stderr, "Test 'draw_line source-over' failed at %zu, %zu.\n",
+                x, y);
+        return;
+      }
+    }
+}
+
+}  // namespace
+
+void blend_test() {
+  mul255_test();
+  blend_values_test();
+  span_exactness_test();
+  draw_line_blend_test();
+}
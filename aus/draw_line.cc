@@ -7,41 +7,54 @@
 #include "framebuffer.h"
 
 void draw_horizontal_line(const Surface& s, size_t x1, size_t y1, size_t x2,
-               Pixel color) {
+               Pixel color, BlendMode mode) {
   assert(x1 < s.width);
   assert(y1 < s.height);
   assert(x2 < s.width);
 
   Pixel* dst = s.scanline(y1);
-  std::fill(dst + std::min(x1, x2), dst + std::max(x1, x2) + 1, color);
+  if (mode == BlendMode::kCopy)
+    std::fill(dst + std::min(x1, x2), dst + std::max(x1, x2) + 1, color);
+  else
+    blend_fill(mode, dst + std::min(x1, x2), color,
+               std::max(x1, x2) - std::min(x1, x2) + 1);
 }
 
-void draw_vertical_line(const Surface& s, size_t x1, size_t y1, size_t y2,
-               Pixel color) {
-  assert(x1 < s.width);
-  assert(y1 < s.height);
-  assert(y2 < s.height);
-
+// The vertical and general lines touch one pixel per scanline or so, so they
+// blend one pixel at a time, with the mode as a template parameter to keep
+// the switch out of the loop.
+template <BlendMode kMode>
+static void draw_vertical_line(const Surface& s, size_t x1, size_t y1,
+                               size_t y2, Pixel color) {
   // clang's auto-vectorizer gets all excited and adds vector code for the
   // rare occurence that the surface has a width <= 8 or even 1. This could
   // be disabled with
   // `#pragma clang loop vectorize(disable) interleave(disable)`.
   for (size_t y = std::min(y1, y2), e = std::max(y1, y2); y <= e; ++y)
-    s.scanline(y)[x1] = color;
+    s.scanline(y)[x1] = blend<kMode>(color, s.scanline(y)[x1]);
 }
 
-void draw_line(const Surface& s, size_t x1, size_t y1, size_t x2, size_t y2,
-               Pixel color) {
-  if (y1 == y2)
-    return draw_horizontal_line(s, x1, y1, x2, color);
-  if (x1 == x2)
-    return draw_vertical_line(s, x1, y1, y2, color);
-
+void draw_vertical_line(const Surface& s, size_t x1, size_t y1, size_t y2,
+               Pixel color, BlendMode mode) {
   assert(x1 < s.width);
   assert(y1 < s.height);
-  assert(x2 < s.width);
   assert(y2 < s.height);
 
+  switch (mode) {
+    case BlendMode::kCopy:
+      return draw_vertical_line<BlendMode::kCopy>(s, x1, y1, y2, color);
+    case BlendMode::kSourceOver:
+      return draw_vertical_line<BlendMode::kSourceOver>(s, x1, y1, y2, color);
+    case BlendMode::kMultiply:
+      return draw_vertical_line<BlendMode::kMultiply>(s, x1, y1, y2, color);
+    case BlendMode::kScreen:
+      return draw_vertical_line<BlendMode::kScreen>(s, x1, y1, y2, color);
+  }
+}
+
+template <BlendMode kMode>
+static void draw_line(const Surface& s, size_t x1, size_t y1, size_t x2,
+                      size_t y2, Pixel color) {
   ssize_t dx = x2 - x1, ix = 1;
   if (dx < 0) {
     dx = -dx;
@@ -61,7 +74,7 @@ void draw_line(const Surface& s, size_t x1, size_t y1, size_t x2, size_t y2,
     ssize_t D = 2 * dy - dx;
 
     for (int i = 0; i <= dx; ++i) {
-      dst[x] = color;
+      dst[x] = blend<kMode>(color, dst[x]);
       x += ix;
 
       // Using `if (D > 0 || (D == 0 && i < dx/2))` here instead would produce
@@ -78,7 +91,7 @@ void draw_line(const Surface& s, size_t x1, size_t y1, size_t x2, size_t y2,
     ssize_t D = 2 * dx - dy;
 
     for (int i = 0; i <= dy; ++i) {
-      dst[x] = color;
+      dst[x] = blend<kMode>(color, dst[x]);
       dst += iy;
 
       if (D > 0) {
@@ -89,3 +102,27 @@ void draw_line(const Surface& s, size_t x1, size_t y1, size_t x2, size_t y2,
     }
   }
 }
+
+void draw_line(const Surface& s, size_t x1, size_t y1, size_t x2, size_t y2,
+               Pixel color, BlendMode mode) {
+  if (y1 == y2)
+    return draw_horizontal_line(s, x1, y1, x2, color, mode);
+  if (x1 == x2)
+    return draw_vertical_line(s, x1, y1, y2, color, mode);
+
+  assert(x1 < s.width);
+  assert(y1 < s.height);
+  assert(x2 < s.width);
+  assert(y2 < s.height);
+
+  switch (mode) {
+    case BlendMode::kCopy:
+      return draw_line<BlendMode::kCopy>(s, x1, y1, x2, y2, color);
+    case BlendMode::kSourceOver:
+      return draw_line<BlendMode::kSourceOver>(s, x1, y1, x2, y2, color);
+    case BlendMode::kMultiply:
+      return draw_line<BlendMode::kMultiply>(s, x1, y1, x2, y2, color);
+    case BlendMode::kScreen:
+      return draw_line<BlendMode::kScreen>(s, x1, y1, x2, y2, color);
+  }
+}
@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 
+#include "blend.h"
 #include "pixel.h"
 
 struct Surface;
@@ -9,10 +10,11 @@ struct Surface;
 // Coordinates must be clipped to surface size already.
 // Both x1,y1 and x2,y2 are on the line.
 // Integer coordinates are in each pixel's center.
+// Each pixel on the line is replaced with blend(mode, color, pixel).
 void draw_line(const Surface& s, size_t x1, size_t y1, size_t x2, size_t y2,
-               Pixel color);
+               Pixel color, BlendMode mode = BlendMode::kCopy);
 
 void draw_horizontal_line(const Surface& s, size_t x1, size_t y1, size_t x2,
-               Pixel color);
+               Pixel color, BlendMode mode = BlendMode::kCopy);
 void draw_vertical_line(const Surface& s, size_t x1, size_t y1, size_t y2,
-               Pixel color);
+               Pixel color, BlendMode mode = BlendMode::kCopy);
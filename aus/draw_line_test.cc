@@ -3,6 +3,8 @@
 
 #include <string>
 
+void blend_test();  // In blend_test.cc.
+
 struct TestSurface {
   TestSurface(size_t w, size_t h, const char* name) : fb{w, h}, name(name) {}
 
@@ -115,6 +117,7 @@ int main() {
                  ......##.
                  ........#)");
 
+  blend_test();
 }
 
 TestSurface& TestSurface::draw_line(int x1, int y1, int x2, int y2) {
@@ -1,81 +1,21 @@
-// c++ -std=c++1y -O2 bktree.cc -o bktree
+// c++ -std=c++1y -O2 bktree.cc -o bktree -pthread
+
+#include <string.h>
 
 #include <algorithm>
 #include <chrono>
 #include <fstream>
 #include <iostream>
-#include <map>
-#include <memory>
+#include <iterator>
 #include <string>
 #include <vector>
+
+#include "bktree.h"
 using namespace std;
+using namespace bktree;
 
 namespace {
 
-struct StringRef {
-  StringRef(const string& s) : s_(s.data()), n_(s.size()) {}
-  const char* s_;
-  size_t n_;
-
-  string AsString() const { return string(s_, n_); }
-};
-
-// The algorithm implemented below is the "classic"
-// dynamic-programming algorithm for computing the Levenshtein
-// distance, which is described here:
-//
-//   http://en.wikipedia.org/wiki/Levenshtein_distance
-//
-// Although the algorithm is typically described using an m x n
-// array, only one row plus one element are used at a time, so this
-// implementation just keeps one vector for the row.  To update one entry,
-// only the entries to the left, top, and top-left are needed.  The left
-// entry is in Row[x-1], the top entry is what's in Row[x] from the last
-// iteration, and the top-left entry is stored in Previous.
-int edit_distance(const StringRef& s1, const StringRef& s2) {
-  int m = s1.n_, n = s2.n_;
-
-  int row[n + 1];
-  for (int i = 1; i <= n; ++i)
-    row[i] = i;
-
-  for (int y = 1; y <= m; ++y) {
-    row[0] = y;
-    for (int x = 1, previous = y - 1; x <= n; ++x) {
-      int old_row = row[x];
-      row[x] = min(previous + (s1.s_[y - 1] == s2.s_[x - 1] ? 0 : 1),
-                   min(row[x - 1], row[x]) + 1);  // row[x] is from last round.
-      previous = old_row;
-    }
-  }
-
-  return row[n];
-}
-
-// Same, but with an early exit given an upper bound for the result.
-int edit_distance_bound(StringRef s1, StringRef s2, int upper_bound) {
-  int m = s1.n_, n = s2.n_;
-
-  int row[n + 1];
-  for (int i = 1; i <= n; ++i)
-    row[i] = i;
-
-  for (int y = 1; y <= m; ++y) {
-    int best_this_row = row[0] = y;
-    for (int x = 1, previous = y - 1; x <= n; ++x) {
-      int old_row = row[x];
-      row[x] = min(previous + (s1.s_[y - 1] == s2.s_[x - 1] ? 0 : 1),
-                   min(row[x - 1], row[x]) + 1);  // row[x] is from last round.
-      previous = old_row;
-      best_this_row = min(best_this_row, row[x]);
-    }
-    if (best_this_row > upper_bound)
-      return upper_bound + 1;
-  }
-
-  return row[n];
-}
-
 // Returns an empty vector on error.  This is just a toy program.
 vector<string> read_words(const char* file) {
   ifstream input(file);
@@ -83,53 +23,12 @@ vector<string> read_words(const char* file) {
                         istream_iterator<string>());
 }
 
-// See http://blog.notdot.net/2007/4/Damn-Cool-Algorithms-Part-1-BK-Trees
-class BkTree {
-  StringRef value;
-  using Edges = map<int, unique_ptr<BkTree>>;
-  Edges children;
-
- public:
-  BkTree(StringRef value) : value(value) {}
-
-  void insert(StringRef word) {
-    int d = edit_distance(value, word);
-    const auto& it = children.find(d);
-    if (it == children.end())
-      children[d] = make_unique<BkTree>(word);
-    else
-      it->second->insert(word);
-  }
-
-  // Prints matches to stdout.
-  void query(StringRef word, int n, int* count) {
-    ++*count;
-    int d = edit_distance(value, word);
-    if (d <= n)
-      cout << value.AsString() << endl;
-    for (auto&& it = children.lower_bound(d - n),
-             && end = children.upper_bound(d + n);
-         it != end; ++it) {
-      it->second->query(word, n, count);
-    }
-  }
-
-  int depth() const {
-    int d = 0;
-    for (auto&& it : children)
-      d = max(d, it.second->depth());
-    return d + 1;
-  }
-
-  void dump_dot() const {
-    for (auto&& it : children) {
-      cout << "  " << value.AsString() << " -> " << it.second->value.AsString()
-           << " [label=\"" << it.first << "\"];" << endl;
-    }
-    for (auto&& it : children)
-      it.second->dump_dot();
-  }
-};
+void print_matches(const string& query, const vector<BkIndex::Match>& matches) {
+  cout << query << ":";
+  for (const BkIndex::Match& match : matches)
+    cout << " " << match.word.AsString() << " (" << match.distance << ")";
+  cout << '\n';
+}
 
 }  // namespace
 
@@ -137,68 +36,174 @@ int main(int argc, char* argv[]) {
   bool use_index = true;
   bool dump_dot = false;
   const char* wordfile = "/usr/share/dict/words";
-  for (; argc > 1 && argv[1][0] == '-'; ++argv, --argc) {
+  const char* build_file = nullptr;
+  const char* index_file = nullptr;
+  int num_threads = 0;
+  size_t k = 0;
+  for (; argc > 1 && argv[1][0] == '-' && argv[1][1]; ++argv, --argc) {
     if (strcmp(argv[1], "-b") == 0)  // Brute force mode
       use_index = false;
     else if(strcmp(argv[1], "-dot") == 0)
       dump_dot = true;
-    else if(strcmp(argv[1], "-w") == 0) {
+    else if (strcmp(argv[1], "-w") == 0 || strcmp(argv[1], "-j") == 0 ||
+             strcmp(argv[1], "-k") == 0 || strcmp(argv[1], "-build") == 0 ||
+             strcmp(argv[1], "-index") == 0) {
       if (argc < 3) {
-        cerr << "-w needs wordfile argument" << endl;
+        cerr << argv[1] << " needs an argument" << endl;
         return EXIT_FAILURE;
       }
-      wordfile = argv[2];
+      if (strcmp(argv[1], "-w") == 0)
+        wordfile = argv[2];
+      else if (strcmp(argv[1], "-j") == 0)
+        num_threads = atoi(argv[2]);
+      else if (strcmp(argv[1], "-k") == 0)
+        k = atoi(argv[2]);
+      else if (strcmp(argv[1], "-build") == 0)
+        build_file = argv[2];
+      else
+        index_file = argv[2];
       ++argv;
       --argc;
     }
   }
 
-  if (argc < 2 || argc > 3) {
-    cerr << "Usage: bktree [-w wordfile] [-dot] [-b] [n] query" << endl;
+  if (build_file) {
+    // Build an index file for -index, and exit.
+    const vector<string> words = read_words(wordfile);
+    if (words.empty())
+      return EXIT_FAILURE;
+    auto start_time = chrono::high_resolution_clock::now();
+    BkIndex index(words, num_threads);
+    auto end_time = chrono::high_resolution_clock::now();
+    cout << "Index construction took "
+         << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+                .count() << "ms" << endl;
+    string err;
+    if (!index.save(build_file, &err)) {
+      cerr << err << endl;
+      return EXIT_FAILURE;
+    }
+    cout << "Wrote " << build_file << " (" << index.size() << " words)"
+         << endl;
+    return EXIT_SUCCESS;
+  }
+
+  if (argc < 2 || argc > 3 || (k && !use_index) ||
+      (index_file && !use_index)) {
+    cerr << "Usage: bktree [-w wordfile | -index file] [-dot] [-b] "
+            "[-j threads] [-k count] [n] query" << endl
+         << "       bktree [-w wordfile] [-j threads] -build file" << endl
+         << "With -k, prints the count closest words within distance n." << endl
+         << "If query is -, answers all queries from stdin, one line each."
+         << endl
+         << "-build writes an index file that -index maps instead of reading "
+            "a word list and building the index." << endl;
     return EXIT_FAILURE;
   }
 
   int n = argc == 3 ? atoi(argv[1]) : 2;
   string query(argv[argc - 1]);
 
-  const vector<string> words = read_words(wordfile);
-  if (words.empty())
-    return EXIT_FAILURE;
+  vector<string> words;
+  if (!index_file) {
+    words = read_words(wordfile);
+    if (words.empty())
+      return EXIT_FAILURE;
+  }
+
+  // Builds the index, or loads it with -index.
+  auto make_index = [&](BkIndex* index) {
+    if (!index_file) {
+      *index = BkIndex(words, num_threads);
+      return true;
+    }
+    string err;
+    if (!index->load(index_file, /*verify=*/true, &err)) {
+      cerr << err << endl;
+      return false;
+    }
+    return true;
+  };
+  const char* index_timing =
+      index_file ? "Index loading took " : "Index construction took ";
+
+  if (query == "-") {
+    // Spell-suggest mode.  Results are collected per query in parallel and
+    // printed in input order.
+    vector<string> queries((istream_iterator<string>(cin)),
+                           istream_iterator<string>());
+    auto start_time = chrono::high_resolution_clock::now();
+    BkIndex index;
+    if (use_index && !make_index(&index))
+      return EXIT_FAILURE;
+    auto build_time = chrono::high_resolution_clock::now();
+    vector<vector<BkIndex::Match>> matches(queries.size());
+    BkIndex::parallel_for(queries.size(), num_threads, [&](size_t i) {
+      if (k)
+        matches[i] = index.nearest(queries[i], k, n);
+      else if (use_index)
+        matches[i] = index.query(queries[i], n);
+      else
+        brute_force_query(words, queries[i], n, [&](StringRef word, int d) {
+          matches[i].push_back(BkIndex::Match{word, d});
+        });
+    });
+    auto end_time = chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < queries.size(); ++i)
+      print_matches(queries[i], matches[i]);
+    cerr << index_timing
+         << chrono::duration_cast<chrono::milliseconds>(build_time - start_time)
+                .count() << "ms" << endl;
+    cerr << queries.size() << " queries took "
+         << chrono::duration_cast<chrono::milliseconds>(end_time - build_time)
+                .count() << "ms" << endl;
+    return EXIT_SUCCESS;
+  }
 
   if (use_index) {
     auto start_time = chrono::high_resolution_clock::now();
-    BkTree index(words[0]);
-    for (size_t i = 1; i < words.size(); ++i)
-      index.insert(words[i]);
+    BkIndex index;
+    if (!make_index(&index))
+      return EXIT_FAILURE;
     auto end_time = chrono::high_resolution_clock::now();
 
     if (dump_dot) {
-      cout << "digraph G {" << endl;
-      index.dump_dot();
+      cout << "digraph G {" << '\n';
+      index.for_each_edge([](StringRef parent, StringRef child, int d) {
+        cout << "  " << parent.AsString() << " -> " << child.AsString()
+             << " [label=\"" << d << "\"];" << '\n';
+      });
       cout << "}" << endl;
     } else {
-      cout << "Index construction took "
+      cout << index_timing
            << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
                   .count() << "ms" << endl;
-      cout << "Index depth: " << index.depth() << " (size: " << words.size()
+      cout << "Index depth: " << index.depth() << " (size: " << index.size()
            << ")" << endl;
 
-      int count = 0;
       auto start_time = chrono::high_resolution_clock::now();
-      index.query(query, n, &count);
+      size_t count = 0;
+      if (k) {
+        for (const BkIndex::Match& match : index.nearest(query, k, n))
+          cout << match.word.AsString() << " (" << match.distance << ")\n";
+      } else {
+        count = index.query(query, n, [](StringRef word, int) {
+          cout << word.AsString() << '\n';
+        });
+      }
       auto end_time = chrono::high_resolution_clock::now();
       cout << "Indexed query took "
            << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
                   .count() << "ms" << endl;
-      cout << "Queried " << count << " (" << (100 * count / words.size())
-           << "%)" << endl;
+      if (!k)
+        cout << "Queried " << count << " (" << (100 * count / index.size())
+             << "%)" << endl;
     }
   } else {
     auto start_time = chrono::high_resolution_clock::now();
-    for (auto&& word : words) {
-      if (edit_distance_bound(word, query, n) <= n)
-        cout << word << endl;
-    }
+    brute_force_query(words, query, n, [](StringRef word, int) {
+      cout << word.AsString() << '\n';
+    });
     auto end_time = chrono::high_resolution_clock::now();
     cout << "Brute force query took "
          << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
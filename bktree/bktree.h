@@ -0,0 +1,889 @@
+// A BK-tree over a fixed word list, for finding all words within a given
+// edit distance of a query word.
+//
+// See http://blog.notdot.net/2007/4/Damn-Cool-Algorithms-Part-1-BK-Trees
+//
+// Instead of one heap object per node with a map of children, the whole tree
+// lives in three arrays: all nodes, all child edges (each node's edges are
+// one contiguous slice, sorted by distance), and one string pool with the
+// bytes of all words.  Nodes are stored in depth-first order, so a subtree
+// and its words are close together in memory.
+//
+// The arrays hold no pointers, so they can be written to a file and mapped
+// back in without any parsing, see BkIndex::save() and BkIndex::load().
+
+#ifndef BKTREE_H_
+#define BKTREE_H_
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BKTREE_X86 1
+#include <immintrin.h>
+#define BKTREE_TARGET(x) __attribute__((target(x)))
+#endif
+
+namespace bktree {
+
+struct StringRef {
+  StringRef(const std::string& s) : s_(s.data()), n_(s.size()) {}
+  StringRef() : s_(nullptr), n_(0) {}
+  StringRef(const char* s, size_t n) : s_(s), n_(n) {}
+  const char* s_;
+  size_t n_;
+
+  std::string AsString() const { return std::string(s_, n_); }
+};
+
+// The algorithm implemented below is the "classic"
+// dynamic-programming algorithm for computing the Levenshtein
+// distance, which is described here:
+//
+//   http://en.wikipedia.org/wiki/Levenshtein_distance
+//
+// Although the algorithm is typically described using an m x n
+// array, only one row plus one element are used at a time, so this
+// implementation just keeps one vector for the row.  To update one entry,
+// only the entries to the left, top, and top-left are needed.  The left
+// entry is in Row[x-1], the top entry is what's in Row[x] from the last
+// iteration, and the top-left entry is stored in Previous.
+inline int edit_distance(const StringRef& s1, const StringRef& s2) {
+  int m = s1.n_, n = s2.n_;
+
+  int row[n + 1];
+  for (int i = 0; i <= n; ++i)
+    row[i] = i;
+
+  for (int y = 1; y <= m; ++y) {
+    row[0] = y;
+    for (int x = 1, previous = y - 1; x <= n; ++x) {
+      int old_row = row[x];
+      row[x] = std::min(previous + (s1.s_[y - 1] == s2.s_[x - 1] ? 0 : 1),
+                        std::min(row[x - 1], row[x]) + 1);  // From last round.
+      previous = old_row;
+    }
+  }
+
+  return row[n];
+}
+
+// Same, but with an early exit given an upper bound for the result.
+inline int edit_distance_bound(StringRef s1, StringRef s2, int upper_bound) {
+  int m = s1.n_, n = s2.n_;
+
+  int row[n + 1];
+  for (int i = 0; i <= n; ++i)
+    row[i] = i;
+
+  for (int y = 1; y <= m; ++y) {
+    int best_this_row = row[0] = y;
+    for (int x = 1, previous = y - 1; x <= n; ++x) {
+      int old_row = row[x];
+      row[x] = std::min(previous + (s1.s_[y - 1] == s2.s_[x - 1] ? 0 : 1),
+                        std::min(row[x - 1], row[x]) + 1);  // From last round.
+      previous = old_row;
+      best_this_row = std::min(best_this_row, row[x]);
+    }
+    if (best_this_row > upper_bound)
+      return upper_bound + 1;
+  }
+
+  return row[n];
+}
+
+// Bit-parallel Levenshtein distance from one pattern to many texts, after
+// "A Fast Bit-Vector Algorithm for Approximate String Matching Based on
+// Dynamic Programming" (Myers 1999), in the form from "Explaining and
+// Extending the Bit-parallel Approximate String Matching Algorithm of Myers"
+// (Hyyrö 2001).
+//
+// One column of the DP matrix is kept as two bit vectors of vertical deltas
+// (+1 in pv, -1 in mv, 0 else), one bit per pattern character, and advancing
+// it by one text character takes a constant number of word operations.  So a
+// distance takes O(text length) instead of O(pattern length * text length).
+// Patterns longer than 64 bytes don't fit in a word and use the DP above.
+//
+// The pattern is referenced, not copied.
+class Matcher {
+ public:
+  // distance_batch() computes this many distances at once.
+  enum { kBatchSize = 16 };
+
+  explicit Matcher(StringRef pattern) : pattern_(pattern) {
+    if (pattern.n_ > 64)
+      return;
+    memset(peq_, 0, sizeof(peq_));
+    for (size_t i = 0; i < pattern.n_; ++i)
+      peq_[(unsigned char)pattern.s_[i]] |= uint64_t(1) << i;
+  }
+
+  int distance(StringRef text) const {
+    if (pattern_.n_ > 64)
+      return edit_distance(pattern_, text);
+    return distance64(text, (int)text.n_ + (int)pattern_.n_);
+  }
+
+  // Returns upper_bound + 1 if the distance is larger than |upper_bound|.
+  int distance_bound(StringRef text, int upper_bound) const {
+    if (abs((int)pattern_.n_ - (int)text.n_) > upper_bound)
+      return upper_bound + 1;
+    if (pattern_.n_ > 64)
+      return edit_distance_bound(pattern_, text, upper_bound);
+    return distance64(text, upper_bound);
+  }
+
+  // out[i] = distance(texts[i]) for i < count <= kBatchSize.
+  void distance_batch(const StringRef* texts, int count, int* out) const {
+#if BKTREE_X86
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2 && pattern_.n_ <= 32) {
+      distance_batch_avx2(texts, count, out);
+      return;
+    }
+#endif
+    for (int i = 0; i < count; ++i)
+      out[i] = distance(texts[i]);
+  }
+
+  // Scalar version of distance_batch(), for testing.
+  void distance_batch_scalar(const StringRef* texts, int count,
+                             int* out) const {
+    for (int i = 0; i < count; ++i)
+      out[i] = distance(texts[i]);
+  }
+
+ private:
+  // The final score changes by at most 1 per remaining text character, so
+  // once score - remaining exceeds |upper_bound|, the result will too.
+  int distance64(StringRef text, int upper_bound) const {
+    int m = pattern_.n_, n = text.n_;
+    if (m == 0)
+      return n;
+    uint64_t pv = ~uint64_t(0), mv = 0, high_bit = uint64_t(1) << (m - 1);
+    int score = m;
+    for (int x = 0; x < n; ++x) {
+      uint64_t eq = peq_[(unsigned char)text.s_[x]];
+      uint64_t xv = eq | mv;
+      uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+      uint64_t ph = mv | ~(xh | pv);
+      uint64_t mh = pv & xh;
+      if (ph & high_bit)
+        ++score;
+      else if (mh & high_bit)
+        --score;
+      if (score - (n - x - 1) > upper_bound)
+        return upper_bound + 1;
+      ph = (ph << 1) | 1;  // The top row increases by 1 per column.
+      mh <<= 1;
+      pv = mh | ~(xv | ph);
+      mv = ph & xv;
+    }
+    return score;
+  }
+
+#if BKTREE_X86
+  // The same recurrence with one text per 32-bit lane, two vectors of 8
+  // lanes each.  Needs the pattern to fit in 32 bits.  Lanes keep computing
+  // after their text ends, but their score stops changing.
+  BKTREE_TARGET("avx2")
+  static void step_avx2(__m256i eq, __m256i length, __m256i pos,
+                        __m256i high_bit, __m256i* pv, __m256i* mv,
+                        __m256i* score) {
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i xv = _mm256_or_si256(eq, *mv);
+    __m256i xh = _mm256_or_si256(
+        _mm256_xor_si256(_mm256_add_epi32(_mm256_and_si256(eq, *pv), *pv), *pv),
+        eq);
+    __m256i ph = _mm256_or_si256(
+        *mv, _mm256_xor_si256(_mm256_or_si256(xh, *pv), ones));
+    __m256i mh = _mm256_and_si256(*pv, xh);
+    // Compare masks are -1 where true.
+    __m256i active = _mm256_cmpgt_epi32(length, pos);
+    __m256i up = _mm256_cmpeq_epi32(_mm256_and_si256(ph, high_bit), high_bit);
+    __m256i down = _mm256_cmpeq_epi32(_mm256_and_si256(mh, high_bit), high_bit);
+    *score = _mm256_sub_epi32(*score, _mm256_and_si256(up, active));
+    *score = _mm256_add_epi32(*score, _mm256_and_si256(down, active));
+    ph = _mm256_or_si256(_mm256_slli_epi32(ph, 1), _mm256_set1_epi32(1));
+    mh = _mm256_slli_epi32(mh, 1);
+    *pv = _mm256_or_si256(mh, _mm256_xor_si256(_mm256_or_si256(xv, ph), ones));
+    *mv = _mm256_and_si256(ph, xv);
+  }
+
+  BKTREE_TARGET("avx2")
+  void distance_batch_avx2(const StringRef* texts, int count, int* out) const {
+    alignas(32) int32_t lengths[kBatchSize] = {};
+    int max_length = 0;
+    for (int i = 0; i < count; ++i) {
+      lengths[i] = texts[i].n_;
+      max_length = std::max(max_length, lengths[i]);
+    }
+    int m = pattern_.n_;
+    if (m == 0) {
+      for (int i = 0; i < count; ++i)
+        out[i] = lengths[i];
+      return;
+    }
+
+    const __m256i high_bit = _mm256_set1_epi32(1u << (m - 1));
+    const __m256i length0 = _mm256_load_si256((const __m256i*)lengths);
+    const __m256i length1 = _mm256_load_si256((const __m256i*)(lengths + 8));
+    __m256i pv0 = _mm256_set1_epi32(-1), mv0 = _mm256_setzero_si256();
+    __m256i pv1 = pv0, mv1 = mv0;
+    __m256i score0 = _mm256_set1_epi32(m), score1 = score0;
+
+    // The texts are transposed into |columns| 64 characters at a time, so
+    // that the 16 characters at one text position are one load.  Their
+    // match bits are then gathered from the low halves of peq_.
+    const int kChunk = 64;
+    alignas(16) uint8_t columns[kChunk][kBatchSize];
+    for (int x0 = 0; x0 < max_length; x0 += kChunk) {
+      int chunk = std::min(kChunk, max_length - x0);
+      memset(columns, 0, sizeof(columns[0]) * chunk);
+      for (int i = 0; i < count; ++i)
+        for (int x = x0; x < std::min(lengths[i], x0 + chunk); ++x)
+          columns[x - x0][i] = texts[i].s_[x];
+      for (int x = 0; x < chunk; ++x) {
+        __m128i c = _mm_load_si128((const __m128i*)columns[x]);
+        __m256i eq0 = _mm256_i32gather_epi32(
+            (const int*)peq_, _mm256_cvtepu8_epi32(c), 8);
+        __m256i eq1 = _mm256_i32gather_epi32(
+            (const int*)peq_, _mm256_cvtepu8_epi32(_mm_srli_si128(c, 8)), 8);
+        __m256i pos = _mm256_set1_epi32(x0 + x);
+        step_avx2(eq0, length0, pos, high_bit, &pv0, &mv0, &score0);
+        step_avx2(eq1, length1, pos, high_bit, &pv1, &mv1, &score1);
+      }
+    }
+    alignas(32) int32_t scores[kBatchSize];
+    _mm256_store_si256((__m256i*)scores, score0);
+    _mm256_store_si256((__m256i*)(scores + 8), score1);
+    for (int i = 0; i < count; ++i)
+      out[i] = scores[i];
+  }
+#endif
+
+  StringRef pattern_;
+  uint64_t peq_[256];  // Bit i set in peq_[c] if pattern_[i] == c.
+};
+
+// Calls |f(StringRef word, int distance)| for every word in |words| within
+// distance |n| of |word|, in order.  Words that are too long or too short to
+// match are skipped, the rest are compared Matcher::kBatchSize at a time.
+// Returns the number of words compared.
+template <class F>
+size_t brute_force_query(const std::vector<std::string>& words,
+                         StringRef word, int n, F f) {
+  Matcher matcher(word);
+  StringRef batch[Matcher::kBatchSize];
+  int distances[Matcher::kBatchSize];
+  int k = 0;
+  size_t count = 0;
+  auto flush = [&]() {
+    matcher.distance_batch(batch, k, distances);
+    for (int i = 0; i < k; ++i)
+      if (distances[i] <= n)
+        f(batch[i], distances[i]);
+    count += k;
+    k = 0;
+  };
+  for (const std::string& w : words) {
+    if (abs((int)w.size() - (int)word.n_) > n)
+      continue;
+    batch[k++] = w;
+    if (k == Matcher::kBatchSize)
+      flush();
+  }
+  flush();
+  return count;
+}
+
+// A word found by a query.  |word| points into the index and is valid as long
+// as the index is.
+struct Match {
+  StringRef word;
+  int distance;
+};
+
+// The interface shared by BkIndex and the engines in fuzzy.h, so that the
+// engine can be picked per workload.
+class FuzzyIndex {
+ public:
+  virtual ~FuzzyIndex() {}
+
+  // Appends all words within distance |n| of |word| to |matches|, in no
+  // particular order.  Returns the number of words whose distance to |word|
+  // was computed, as a measure of work.  Safe to call concurrently.
+  virtual size_t find(StringRef word, int n,
+                      std::vector<Match>* matches) const = 0;
+
+  // Bytes used by the index.
+  virtual size_t memory_usage() const = 0;
+};
+
+class BkIndex : public FuzzyIndex {
+ public:
+  struct Node {
+    uint32_t word_offset;  // Into the string pool.
+    uint32_t word_size;
+    uint32_t first_edge;
+    uint32_t num_edges;
+  };
+  struct Edge {
+    uint32_t distance;
+    uint32_t child;
+  };
+  typedef bktree::Match Match;
+
+  // The tree is the same as the one from inserting |words| one by one, with
+  // words[0] at the root.  The subtrees below the root are built on up to
+  // |num_threads| threads, 0 means one per core.
+  explicit BkIndex(const std::vector<std::string>& words, int num_threads = 0);
+  BkIndex() {}
+
+  // All query functions are const and can be called from several threads at
+  // once.
+
+  // Calls |f(StringRef word, int distance)| for every word within distance
+  // |n| of |word|, in depth-first order.  Returns the number of nodes
+  // visited.
+  template <class F>
+  size_t query(StringRef word, int n, F f) const {
+    if (nodes.empty())
+      return 0;
+    Matcher matcher(word);
+    return query(0, matcher.distance(this->word(nodes[0])), matcher, n, f);
+  }
+
+  std::vector<Match> query(StringRef word, int n) const {
+    std::vector<Match> matches;
+    query(word, n, [&](StringRef w, int d) { matches.push_back(Match{w, d}); });
+    return matches;
+  }
+
+  // Returns the up to |k| words closest to |word| within distance |n|, by
+  // increasing distance and then by bytes.  The search radius shrinks to the
+  // k-th best distance found so far.
+  std::vector<Match> nearest(StringRef word, size_t k, int n) const {
+    std::vector<Match> heap;  // Max-heap, worst match on top.
+    if (nodes.empty() || k == 0)
+      return heap;
+    heap.reserve(k + 1);
+    Matcher matcher(word);
+    nearest(0, matcher.distance(this->word(nodes[0])), matcher, k, &n, &heap);
+    std::sort_heap(heap.begin(), heap.end(), match_less);
+    return heap;
+  }
+
+  // Answers |queries| on up to |num_threads| threads, 0 means one per core.
+  // Calls |f(size_t query, StringRef word, int distance)| for every match.
+  // Calls for different queries can happen concurrently, the calls for one
+  // query are on one thread in depth-first order.
+  template <class F>
+  void query_all(const std::vector<std::string>& queries, int n,
+                 int num_threads, F f) const {
+    parallel_for(queries.size(), num_threads, [&](size_t i) {
+      query(queries[i], n, [&](StringRef w, int d) { f(i, w, d); });
+    });
+  }
+
+  std::vector<std::vector<Match>> query_all(
+      const std::vector<std::string>& queries, int n, int num_threads) const {
+    std::vector<std::vector<Match>> matches(queries.size());
+    query_all(queries, n, num_threads, [&](size_t i, StringRef w, int d) {
+      matches[i].push_back(Match{w, d});
+    });
+    return matches;
+  }
+
+  int depth() const { return nodes.empty() ? 0 : depth(0); }
+  size_t size() const { return nodes.size(); }
+
+  size_t find(StringRef word, int n,
+              std::vector<Match>* matches) const override {
+    return query(word, n, [&](StringRef w, int d) {
+      matches->push_back(Match{w, d});
+    });
+  }
+
+  // Bytes used by the three arrays, or by the mapped file.
+  size_t memory_usage() const override {
+    if (mapping)
+      return mapping->size;
+    return node_storage.capacity() * sizeof(Node) +
+           edge_storage.capacity() * sizeof(Edge) + pool_storage.capacity();
+  }
+
+  // An index file is a FileHeader followed by the node, edge and pool
+  // arrays exactly as they are in memory.  All offsets are from the start of
+  // the file, and integers are in host byte order (i.e. little-endian).
+  struct FileHeader {
+    char magic[8];  // "BKTREE\r\n", see file_magic().
+    uint32_t version;  // kFileVersion.
+    uint32_t header_size;
+    uint64_t checksum;  // checksum() of all bytes after the header.
+    uint64_t num_nodes;
+    uint64_t num_edges;
+    uint64_t pool_size;
+    uint64_t nodes_offset;
+    uint64_t edges_offset;
+    uint64_t pool_offset;
+  };
+  static const char* file_magic() { return "BKTREE\r\n"; }
+  enum { kFileVersion = 1 };
+
+  // Writes the index to |path|.  Returns false and sets |err| on error.
+  bool save(const char* path, std::string* err) const;
+
+  // Replaces this index with the one in |path|, written by save().  The file
+  // is mapped read-only and used in place, so processes that load the same
+  // file share its memory.  The nodes and edges are checked to be
+  // consistent, so that a damaged file can't make queries read out of
+  // bounds.  With |verify|, the checksum is checked too, which reads the
+  // whole file.  Returns false and sets |err| on error.
+  bool load(const char* path, bool verify, std::string* err);
+
+  // FNV-1a, but over 8-byte words to make it fast for big files.
+  static uint64_t checksum(const char* data, size_t size) {
+    uint64_t h = 0xcbf29ce484222325;
+    const uint64_t kPrime = 0x100000001b3;
+    for (; size >= 8; data += 8, size -= 8) {
+      uint64_t word;
+      memcpy(&word, data, 8);
+      h = (h ^ word) * kPrime;
+    }
+    for (; size; ++data, --size)
+      h = (h ^ (unsigned char)*data) * kPrime;
+    return h;
+  }
+
+  StringRef word(const Node& node) const {
+    return StringRef(pool.data + node.word_offset, node.word_size);
+  }
+
+  // Calls |f(parent, child, distance)| for all edges, parents in depth-first
+  // order and each parent's edges by increasing distance.
+  template <class F>
+  void for_each_edge(F f) const {
+    for (const Node& node : nodes)
+      for (uint32_t i = 0; i < node.num_edges; ++i) {
+        const Edge& edge = edges[node.first_edge + i];
+        f(word(node), word(nodes[edge.child]), edge.distance);
+      }
+  }
+
+  // Calls |f(i)| for i in [0, n) on up to |num_threads| threads, 0 means one
+  // per core.
+  template <class F>
+  static void parallel_for(size_t n, int num_threads, F f) {
+    if (num_threads <= 0)
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = (int)std::min<size_t>(num_threads, n);
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+      size_t i;
+      while ((i = next++) < n)
+        f(i);
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads; ++i)
+      threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+      thread.join();
+  }
+
+ private:
+  uint32_t add_node(StringRef word) {
+    node_storage.push_back(
+        Node{(uint32_t)pool_storage.size(), (uint32_t)word.n_, 0, 0});
+    pool_storage.insert(pool_storage.end(), word.s_, word.s_ + word.n_);
+    return node_storage.size() - 1;
+  }
+  std::vector<uint32_t> partition(uint32_t* ids, size_t n,
+                                  const std::vector<std::string>& words);
+  uint32_t build(uint32_t* ids, size_t n,
+                 const std::vector<std::string>& words);
+  uint32_t append(const BkIndex& subtree);
+
+  // Computes the distances from the query to the children of node |i| with
+  // distance in [d - n, d + n] in batches, and calls |f(child, distance)|.
+  // |n| is re-read before each call, so callers can shrink it.
+  template <class F>
+  void for_each_child(uint32_t i, int d, const Matcher& matcher, const int& n,
+                      F f) const {
+    const Node& node = nodes[i];
+    const Edge* edge = &edges[node.first_edge];
+    const Edge* end = edge + node.num_edges;
+    for (; edge != end && (int)edge->distance < d - n; ++edge) {}
+    const Edge* last = edge;
+    for (; last != end && (int)last->distance <= d + n; ++last) {}
+    while (edge != last) {
+      int k = std::min<int>(last - edge, Matcher::kBatchSize);
+      StringRef words[Matcher::kBatchSize];
+      int distances[Matcher::kBatchSize];
+      for (int j = 0; j < k; ++j)
+        words[j] = word(nodes[edge[j].child]);
+      if (k == 1)
+        distances[0] = matcher.distance(words[0]);
+      else
+        matcher.distance_batch(words, k, distances);
+      for (int j = 0; j < k; ++j)
+        if (abs((int)edge[j].distance - d) <= n)
+          f(edge[j].child, distances[j]);
+      edge += k;
+    }
+  }
+
+  // |d| is the distance from the query to node |i|.
+  template <class F>
+  size_t query(uint32_t i, int d, const Matcher& matcher, int n,
+               F& f) const {
+    size_t count = 1;
+    if (d <= n)
+      f(word(nodes[i]), d);
+    for_each_child(i, d, matcher, n, [&](uint32_t child, int child_d) {
+      count += query(child, child_d, matcher, n, f);
+    });
+    return count;
+  }
+
+  static bool match_less(const Match& a, const Match& b) {
+    if (a.distance != b.distance)
+      return a.distance < b.distance;
+    int c = memcmp(a.word.s_, b.word.s_, std::min(a.word.n_, b.word.n_));
+    return c != 0 ? c < 0 : a.word.n_ < b.word.n_;
+  }
+
+  void nearest(uint32_t i, int d, const Matcher& matcher, size_t k, int* n,
+               std::vector<Match>* heap) const {
+    if (d <= *n) {
+      Match match{word(nodes[i]), d};
+      if (heap->size() < k || match_less(match, heap->front())) {
+        heap->push_back(match);
+        std::push_heap(heap->begin(), heap->end(), match_less);
+        if (heap->size() > k) {
+          std::pop_heap(heap->begin(), heap->end(), match_less);
+          heap->pop_back();
+        }
+        if (heap->size() == k)
+          *n = heap->front().distance;
+      }
+    }
+    for_each_child(i, d, matcher, *n, [&](uint32_t child, int child_d) {
+      nearest(child, child_d, matcher, k, n, heap);
+    });
+  }
+
+  int depth(uint32_t i) const {
+    int d = 0;
+    for (uint32_t e = 0; e < nodes[i].num_edges; ++e)
+      d = std::max(d, depth(edges[nodes[i].first_edge + e].child));
+    return d + 1;
+  }
+
+  // Points to the vectors below, or into a mapped index file.
+  template <class T>
+  struct Span {
+    const T* data = nullptr;
+    size_t size_ = 0;
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const T& operator[](size_t i) const { return data[i]; }
+    const T* begin() const { return data; }
+    const T* end() const { return data + size_; }
+  };
+  Span<Node> nodes;
+  Span<Edge> edges;
+  Span<char> pool;
+
+  // A read-only mmap()ed index file.
+  struct Mapping {
+    Mapping(void* data, size_t size) : data(data), size(size) {}
+    ~Mapping() { munmap(data, size); }
+    void* data;
+    size_t size;
+  };
+  std::unique_ptr<Mapping> mapping;
+
+  void use_storage() {
+    nodes = Span<Node>{node_storage.data(), node_storage.size()};
+    edges = Span<Edge>{edge_storage.data(), edge_storage.size()};
+    pool = Span<char>{pool_storage.data(), pool_storage.size()};
+  }
+
+  std::vector<Node> node_storage;
+  std::vector<Edge> edge_storage;
+  std::vector<char> pool_storage;
+};
+
+// The root's children are independent subtrees.  They are built into
+// separate BkIndex objects in parallel, biggest first, and then appended
+// in distance order.  That gives exactly the arrays that a serial build
+// would produce.
+inline BkIndex::BkIndex(const std::vector<std::string>& words,
+                        int num_threads) {
+  if (words.empty())
+    return;
+  size_t pool_size = 0;
+  for (const std::string& word : words)
+    pool_size += word.size();
+  pool_storage.reserve(pool_size);
+  node_storage.reserve(words.size());
+  edge_storage.reserve(words.size());
+
+  std::vector<uint32_t> ids(words.size());
+  for (size_t i = 0; i < ids.size(); ++i)
+    ids[i] = i;
+
+  add_node(words[ids[0]]);
+  std::vector<uint32_t> starts = partition(ids.data(), ids.size(), words);
+  std::vector<int> buckets;
+  for (size_t d = 0; d + 1 < starts.size(); ++d)
+    if (starts[d] != starts[d + 1])
+      buckets.push_back(d);
+  node_storage[0].num_edges = buckets.size();
+  edge_storage.resize(buckets.size());
+
+  std::vector<int> order(buckets.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  auto bucket_size = [&](int b) {
+    return starts[buckets[b] + 1] - starts[buckets[b]];
+  };
+  std::sort(order.begin(), order.end(),
+            [&](int a, int b) { return bucket_size(a) > bucket_size(b); });
+  std::vector<BkIndex> subtrees(buckets.size());
+  parallel_for(order.size(), num_threads, [&](size_t i) {
+    int b = order[i];
+    subtrees[b].build(ids.data() + 1 + starts[buckets[b]], bucket_size(b),
+                      words);
+  });
+  for (size_t b = 0; b < buckets.size(); ++b) {
+    edge_storage[b] = Edge{(uint32_t)buckets[b], append(subtrees[b])};
+    subtrees[b] = BkIndex();
+  }
+
+  node_storage.shrink_to_fit();
+  edge_storage.shrink_to_fit();
+  pool_storage.shrink_to_fit();
+  use_storage();
+}
+
+// Reorders ids[1..n) stably by the distance of their word to words[ids[0]].
+// Returns the start of each distance's bucket, relative to ids + 1, plus the
+// end of the last bucket.
+inline std::vector<uint32_t> BkIndex::partition(
+    uint32_t* ids, size_t n, const std::vector<std::string>& words) {
+  std::vector<int> distances(n);
+  int max_distance = 0;
+  Matcher matcher(words[ids[0]]);
+  for (size_t i = 1; i < n; i += Matcher::kBatchSize) {
+    int k = std::min<size_t>(Matcher::kBatchSize, n - i);
+    StringRef batch[Matcher::kBatchSize];
+    for (int j = 0; j < k; ++j)
+      batch[j] = words[ids[i + j]];
+    matcher.distance_batch(batch, k, &distances[i]);
+    for (int j = 0; j < k; ++j)
+      max_distance = std::max(max_distance, distances[i + j]);
+  }
+
+  // Counting sort.
+  std::vector<uint32_t> starts(max_distance + 2);
+  for (size_t i = 1; i < n; ++i)
+    ++starts[distances[i] + 1];
+  for (int d = 0; d <= max_distance; ++d)
+    starts[d + 1] += starts[d];
+  std::vector<uint32_t> sorted(n - 1);
+  std::vector<uint32_t> pos(starts.begin(), starts.end() - 1);
+  for (size_t i = 1; i < n; ++i)
+    sorted[pos[distances[i]]++] = ids[i];
+  std::copy(sorted.begin(), sorted.end(), ids + 1);
+  return starts;
+}
+
+// Builds the subtree for words[ids[0..n)], with words[ids[0]] at its root,
+// and returns the root's node index.  The first word in each distance bucket
+// is where sequential insertion would have put a child node.
+inline uint32_t BkIndex::build(uint32_t* ids, size_t n,
+                               const std::vector<std::string>& words) {
+  uint32_t node = add_node(words[ids[0]]);
+  std::vector<uint32_t> starts = partition(ids, n, words);
+
+  // Reserve this node's edge slice before building the children, so it stays
+  // contiguous.
+  uint32_t first_edge = edge_storage.size();
+  uint32_t num_edges = 0;
+  for (size_t d = 0; d + 1 < starts.size(); ++d)
+    if (starts[d] != starts[d + 1])
+      ++num_edges;
+  node_storage[node].first_edge = first_edge;
+  node_storage[node].num_edges = num_edges;
+  edge_storage.resize(first_edge + num_edges);
+
+  uint32_t e = first_edge;
+  for (size_t d = 0; d + 1 < starts.size(); ++d) {
+    if (starts[d] == starts[d + 1])
+      continue;
+    uint32_t child =
+        build(ids + 1 + starts[d], starts[d + 1] - starts[d], words);
+    edge_storage[e++] = Edge{(uint32_t)d, child};
+  }
+  return node;
+}
+
+// Appends a separately built tree and returns the index of its root.
+inline uint32_t BkIndex::append(const BkIndex& subtree) {
+  uint32_t node_base = node_storage.size(), edge_base = edge_storage.size();
+  uint32_t pool_base = pool_storage.size();
+  for (const Node& node : subtree.node_storage)
+    node_storage.push_back(Node{node.word_offset + pool_base, node.word_size,
+                         node.first_edge + edge_base, node.num_edges});
+  for (const Edge& edge : subtree.edge_storage)
+    edge_storage.push_back(Edge{edge.distance, edge.child + node_base});
+  pool_storage.insert(pool_storage.end(), subtree.pool_storage.begin(),
+                      subtree.pool_storage.end());
+  return node_base;
+}
+
+inline bool BkIndex::save(const char* path, std::string* err) const {
+  FileHeader header = {};
+  memcpy(header.magic, file_magic(), sizeof(header.magic));
+  header.version = kFileVersion;
+  header.header_size = sizeof(header);
+  header.num_nodes = nodes.size();
+  header.num_edges = edges.size();
+  header.pool_size = pool.size();
+  header.nodes_offset = sizeof(header);
+  header.edges_offset = header.nodes_offset + nodes.size() * sizeof(Node);
+  header.pool_offset = header.edges_offset + edges.size() * sizeof(Edge);
+
+  std::string data(header.pool_offset + pool.size(), '\0');
+  std::copy((const char*)nodes.begin(), (const char*)nodes.end(),
+            &data[header.nodes_offset]);
+  std::copy((const char*)edges.begin(), (const char*)edges.end(),
+            &data[header.edges_offset]);
+  std::copy(pool.begin(), pool.end(), &data[header.pool_offset]);
+  header.checksum =
+      checksum(data.data() + sizeof(header), data.size() - sizeof(header));
+  memcpy(&data[0], &header, sizeof(header));
+
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    *err = std::string("Failed to open '") + path + "': " + strerror(errno);
+    return false;
+  }
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok)
+    *err = std::string("Failed to write '") + path + "'";
+  return ok;
+}
+
+inline bool BkIndex::load(const char* path, bool verify, std::string* err) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    *err = std::string("Failed to open '") + path + "': " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *err = std::string("Failed to stat '") + path + "'";
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  if (size < sizeof(FileHeader)) {
+    *err = std::string("'") + path + "' is not an index file";
+    close(fd);
+    return false;
+  }
+  void* data = mmap(/*addr=*/0, size, PROT_READ, MAP_SHARED, fd,
+                    /*offset=*/0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    *err = std::string("Failed to mmap '") + path + "': " + strerror(errno);
+    return false;
+  }
+  std::unique_ptr<Mapping> file(new Mapping(data, size));
+  const char* bytes = static_cast<const char*>(data);
+
+  // The sizes are checked so that a truncated or corrupt header can't make
+  // the arrays point outside the file.
+  FileHeader header;
+  memcpy(&header, bytes, sizeof(header));
+  auto in_file = [size](uint64_t offset, uint64_t count, size_t element) {
+    return offset % 8 == 0 && offset <= size &&
+           count <= (size - offset) / element;
+  };
+  if (memcmp(header.magic, file_magic(), sizeof(header.magic)) != 0) {
+    *err = std::string("'") + path + "' is not an index file";
+    return false;
+  }
+  if (header.version != kFileVersion ||
+      header.header_size != sizeof(header)) {
+    *err = std::string("'") + path + "' has unsupported version " +
+           std::to_string(header.version) + ", expected " +
+           std::to_string(kFileVersion);
+    return false;
+  }
+  if (!in_file(header.nodes_offset, header.num_nodes, sizeof(Node)) ||
+      !in_file(header.edges_offset, header.num_edges, sizeof(Edge)) ||
+      !in_file(header.pool_offset, header.pool_size, 1)) {
+    *err = std::string("'") + path + "' is truncated";
+    return false;
+  }
+  if (verify && checksum(bytes + sizeof(header), size - sizeof(header)) !=
+                    header.checksum) {
+    *err = std::string("'") + path + "' has a bad checksum";
+    return false;
+  }
+
+  // Queries trust the arrays, so check that every word and edge range and
+  // every child is inside them, whether or not the checksum was checked.
+  // Children come after their parent, which also rules out cycles.  This
+  // reads the nodes and edges, but not the words.
+  const Node* file_nodes = (const Node*)(bytes + header.nodes_offset);
+  const Edge* file_edges = (const Edge*)(bytes + header.edges_offset);
+  for (uint64_t i = 0; i < header.num_nodes; ++i) {
+    const Node& node = file_nodes[i];
+    bool ok =
+        (uint64_t)node.word_offset + node.word_size <= header.pool_size &&
+        (uint64_t)node.first_edge + node.num_edges <= header.num_edges;
+    for (uint32_t e = 0; ok && e < node.num_edges; ++e) {
+      uint32_t child = file_edges[node.first_edge + e].child;
+      ok = child > i && child < header.num_nodes;
+    }
+    if (!ok) {
+      *err = std::string("'") + path + "' is corrupt at node " +
+             std::to_string(i);
+      return false;
+    }
+  }
+
+  *this = BkIndex();
+  mapping = std::move(file);
+  nodes = Span<Node>{(const Node*)(bytes + header.nodes_offset),
+                     (size_t)header.num_nodes};
+  edges = Span<Edge>{(const Edge*)(bytes + header.edges_offset),
+                     (size_t)header.num_edges};
+  pool = Span<char>{bytes + header.pool_offset, (size_t)header.pool_size};
+  return true;
+}
+
+}  // namespace bktree
+
+#endif  // BKTREE_H_
@@ -1,19 +1,93 @@
-// c++ -std=c++1y -O2 bktree_bench.cc -o bktree_bench
+// c++ -std=c++1y -O2 bktree_bench.cc -o bktree_bench -pthread
 
-// Benchmark tests for bktree.cc
+// Benchmark harness for bktree.h
 //
+// Runs a fixed, seeded workload of misspelled dictionary words through:
+//
+//   map            the BK-tree with one heap node per word and a map of
+//                  children that bktree.cc used to have
+//   arena          the contiguous BkIndex from bktree.h
+//   edit_distance  the rolling-row edit_distance() from bktree.h against the
+//                  swap-buffers one below, and the bit-parallel Matcher
+//   engines        every FuzzyIndex in fuzzy.h for n = 1..3
+//   startup        time to the first query when rebuilding the index, and
+//                  when mapping a saved index file
+//   threads        BkIndex construction and query throughput by thread count
+//
+// Every result is one "benchmark metric value" line, e.g. "arena p99_us 812",
+// followed by the process's peak RSS.  -b runs only one benchmark, so that
+// the peak RSS is its own and so that bench.py can time it.  -raw prints only
+// the per-query latencies of one series in microseconds, one per line, which
+// ministat reads directly.  To compare per-query latencies before and after a
+// change:
+//
+//   bktree_bench -w words -b arena -raw arena > before.txt
+//   (apply the change, rebuild)
+//   bktree_bench -w words -b arena -raw arena > after.txt
+//   ministat before.txt after.txt
+//
+// Or, to compare wall times of whole runs:
+//
+//   bench.py -o before.txt ./bktree_bench -w words -b arena
+//   (apply the change, rebuild)
+//   bench.py -o after.txt ./bktree_bench -w words -b arena
+//   ministat before.txt after.txt
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <new>
+#include <numeric>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
+
+#include "bktree.h"
+#include "fuzzy.h"
 using namespace std;
 
+// Count live heap bytes, to measure what each layout allocates.  Each block
+// stores its size in front of the returned pointer.  Not inlined, so that
+// gcc doesn't see malloc() and free() paired with new and delete.  Atomic,
+// since BkIndex and some engines build on several threads.
+static atomic<size_t> g_live_bytes{0};
+
+__attribute__((noinline)) void* operator new(size_t size) {
+  size_t* p = static_cast<size_t*>(malloc(size + 16));
+  if (!p)
+    throw bad_alloc();
+  *p = size;
+  g_live_bytes.fetch_add(size, memory_order_relaxed);
+  return p + 2;
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+  if (!ptr)
+    return;
+  size_t* p = static_cast<size_t*>(ptr) - 2;
+  g_live_bytes.fetch_sub(*p, memory_order_relaxed);
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+  operator delete(ptr);
+}
+
 namespace {
 
+// Swap-buffers version of the rolling-row edit_distance() in bktree.h.
 int edit_distance(const string& s1, const string& s2) {
   int m = s1.size();
   int n = s2.size();
@@ -63,6 +137,20 @@ class BkTree {
       children.insert(it, Edges::value_type(d, make_unique<BkTree>(word)));
   }
 
+  // Returns the number of nodes visited.
+  size_t query(const string& word, int n, size_t* matches) const {
+    size_t count = 1;
+    int d = edit_distance(*value, word);
+    if (d <= n)
+      ++*matches;
+    for (auto&& it = children.lower_bound(d - n),
+             && end = children.upper_bound(d + n);
+         it != end; ++it) {
+      count += it->second->query(word, n, matches);
+    }
+    return count;
+  }
+
   int depth() const {
     int d = 0;
     for (auto&& it : children)
@@ -71,35 +159,365 @@ class BkTree {
   }
 };
 
+// |count| random dictionary words with 0 to |max_edits| random insertions,
+// deletions and substitutions each.  The same |seed| gives the same queries.
+vector<string> misspellings(const vector<string>& words, size_t count,
+                            int max_edits, unsigned seed) {
+  mt19937 rng(seed);
+  vector<string> queries;
+  for (size_t i = 0; i < count; ++i) {
+    size_t word = uniform_int_distribution<size_t>(0, words.size() - 1)(rng);
+    string s = words[word];
+    int edits = uniform_int_distribution<int>(0, max_edits)(rng);
+    for (int j = 0; j < edits; ++j) {
+      size_t pos = uniform_int_distribution<size_t>(0, s.size())(rng);
+      char c = 'a' + uniform_int_distribution<int>(0, 25)(rng);
+      switch (uniform_int_distribution<int>(0, 2)(rng)) {
+        case 0: s.insert(s.begin() + pos, c); break;
+        case 1: if (pos < s.size()) s.erase(s.begin() + pos); break;
+        case 2: if (pos < s.size()) s[pos] = c; break;
+      }
+    }
+    queries.push_back(s);
+  }
+  return queries;
+}
+
+int64_t us_since(chrono::high_resolution_clock::time_point start_time) {
+  auto end_time = chrono::high_resolution_clock::now();
+  return chrono::duration_cast<chrono::microseconds>(end_time - start_time)
+      .count();
+}
+
+int64_t ms_since(chrono::high_resolution_clock::time_point start_time) {
+  auto end_time = chrono::high_resolution_clock::now();
+  return chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+      .count();
+}
+
+// Asks the kernel to drop |path| from the page cache, so that the next
+// access reads it from disk.
+void evict(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Calls |f| on each query and returns how long each call took in
+// microseconds.  |f| returns the number of nodes visited or words compared,
+// which is appended to |visited| if it's not null.
+template <class F>
+vector<double> time_each(const vector<string>& queries, F f,
+                         vector<double>* visited) {
+  vector<double> us;
+  for (const string& query : queries) {
+    auto start_time = chrono::high_resolution_clock::now();
+    size_t count = f(query);
+    auto end_time = chrono::high_resolution_clock::now();
+    us.push_back(
+        chrono::duration<double, micro>(end_time - start_time).count());
+    if (visited)
+      visited->push_back(count);
+  }
+  return us;
+}
+
+double percentile(vector<double> v, double p) {
+  if (v.empty())
+    return 0;
+  sort(v.begin(), v.end());
+  return v[min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+double mean(const vector<double>& v) {
+  return v.empty() ? 0 : accumulate(v.begin(), v.end(), 0.0) / v.size();
+}
+
+// The series whose latencies -raw prints, or nullptr.
+const char* g_raw = nullptr;
+
+// Prints one result line, unless -raw is given.
+void print(const string& name, const char* metric, double value) {
+  if (!g_raw)
+    cout << name << " " << metric << " " << value << '\n';
+}
+
+// Prints p50, p99 and mean of the per-query latencies in |us| and of the
+// per-query counts in |visited|, if any.  With -raw, prints just the latencies of the
+// series |name| instead, one per line.
+void print_latencies(const string& name, const vector<double>& us,
+                     const vector<double>& visited) {
+  if (g_raw) {
+    if (name == g_raw)
+      for (double t : us)
+        cout << t << '\n';
+    return;
+  }
+  print(name, "p50_us", percentile(us, 0.5));
+  print(name, "p99_us", percentile(us, 0.99));
+  print(name, "mean_us", mean(us));
+  if (visited.empty())
+    return;
+  print(name, "visited_p50", percentile(visited, 0.5));
+  print(name, "visited_p99", percentile(visited, 0.99));
+  print(name, "visited_mean", mean(visited));
+}
+
 }  // namespace
 
 int main(int argc, char* argv[]) {
   const char* wordfile = "/usr/share/dict/words";
+  const char* only = nullptr;
+  size_t num_queries = 200;
+  int n = 2;
+  unsigned seed = 1;
   for (; argc > 1 && argv[1][0] == '-'; ++argv, --argc) {
-    if(strcmp(argv[1], "-w") == 0) {
-      if (argc < 3) {
-        cerr << "-w needs wordfile argument" << endl;
-        return EXIT_FAILURE;
-      }
+    if (argc < 3) {
+      cerr << argv[1] << " needs an argument" << endl;
+      return EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "-w") == 0)
       wordfile = argv[2];
-      ++argv;
-      --argc;
+    else if (strcmp(argv[1], "-q") == 0)
+      num_queries = max(1, atoi(argv[2]));
+    else if (strcmp(argv[1], "-n") == 0)
+      n = atoi(argv[2]);
+    else if (strcmp(argv[1], "-s") == 0)
+      seed = strtoul(argv[2], nullptr, 10);
+    else if (strcmp(argv[1], "-b") == 0)
+      only = argv[2];
+    else if (strcmp(argv[1], "-raw") == 0)
+      g_raw = argv[2];
+    else {
+      cerr << "Usage: bktree_bench [-w wordfile] [-q num_queries] [-n n] "
+              "[-s seed] [-b benchmark] [-raw series]" << endl;
+      return EXIT_FAILURE;
     }
+    ++argv;
+    --argc;
   }
+  cout.precision(12);
+  auto run = [&](const char* benchmark) {
+    return !only || strcmp(only, benchmark) == 0;
+  };
 
   const vector<string> words = read_words(wordfile);
   if (words.empty())
     return EXIT_FAILURE;
 
-  auto start_time = chrono::high_resolution_clock::now();
-  BkTree index(&words[0]);
-  for (size_t i = 1; i < words.size(); ++i)
-    index.insert(&words[i]);
-  auto end_time = chrono::high_resolution_clock::now();
-  cout << "Index construction took "
-       << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
-              .count() << "ms" << endl;
+  // Misspellings with up to n edits, so that most queries have a match.
+  const vector<string> queries =
+      misspellings(words, num_queries, max(n, 1), seed);
+
+  print("workload", "words", words.size());
+  print("workload", "queries", queries.size());
+  print("workload", "n", n);
+  print("workload", "seed", seed);
+
+  if (run("map")) {
+    size_t bytes_before = g_live_bytes;
+    auto start_time = chrono::high_resolution_clock::now();
+    BkTree index(&words[0]);
+    for (size_t i = 1; i < words.size(); ++i)
+      index.insert(&words[i]);
+    int64_t build_ms = ms_since(start_time);
+    size_t bytes = g_live_bytes - bytes_before + sizeof(index);
+
+    size_t matches = 0;
+    vector<double> visited;
+    vector<double> us = time_each(queries, [&](const string& query) {
+      return index.query(query, n, &matches);
+    }, &visited);
+
+    print("map", "build_ms", build_ms);
+    print("map", "bytes", bytes);
+    print("map", "bytes_per_node", (double)bytes / words.size());
+    print("map", "depth", index.depth());
+    print("map", "matches", matches);
+    print_latencies("map", us, visited);
+  }
+
+  if (run("arena")) {
+    size_t bytes_before = g_live_bytes;
+    auto start_time = chrono::high_resolution_clock::now();
+    bktree::BkIndex index(words);
+    int64_t build_ms = ms_since(start_time);
+    size_t bytes = g_live_bytes - bytes_before + sizeof(index);
+
+    size_t matches = 0;
+    vector<double> visited;
+    vector<double> us = time_each(queries, [&](const string& query) {
+      return index.query(query, n,
+                         [&](bktree::StringRef, int) { ++matches; });
+    }, &visited);
+
+    print("arena", "build_ms", build_ms);
+    print("arena", "bytes", bytes);
+    print("arena", "bytes_per_node", (double)bytes / words.size());
+    print("arena", "depth", index.depth());
+    print("arena", "matches", matches);
+    print_latencies("arena", us, visited);
+  }
+
+  // Each query against the same 1000 dictionary words, with each distance
+  // function.  The sums of all distances must agree.
+  if (run("edit_distance")) {
+    vector<string> sample;
+    size_t stride = max<size_t>(1, words.size() / 1000);
+    for (size_t i = 0; i < words.size() && sample.size() < 1000; i += stride)
+      sample.push_back(words[i]);
+
+    struct Variant {
+      const char* name;
+      function<int(const string&, const string&)> distance;
+    };
+    const Variant variants[] = {
+      {"edit_distance.rolling",
+       [](const string& a, const string& b) {
+         return bktree::edit_distance(a, b);
+       }},
+      {"edit_distance.swap", edit_distance},
+      {"edit_distance.matcher",
+       [](const string& a, const string& b) {
+         return bktree::Matcher(a).distance(b);
+       }},
+    };
+    int64_t expected_sum = -1;
+    for (const Variant& variant : variants) {
+      int64_t sum = 0;
+      vector<double> us = time_each(queries, [&](const string& query) {
+        for (const string& word : sample)
+          sum += variant.distance(query, word);
+        return sample.size();
+      }, nullptr);
+      if (expected_sum >= 0 && sum != expected_sum) {
+        cerr << variant.name << " disagrees: " << sum << " vs "
+             << expected_sum << endl;
+        return EXIT_FAILURE;
+      }
+      expected_sum = sum;
+      print(variant.name, "ns_per_pair", 1000 * mean(us) / sample.size());
+      print_latencies(variant.name, us, {});
+    }
+  }
+
+  // All FuzzyIndex engines for n = 1..3.  The deletion index only supports
+  // up to the n it was built for, so it's rebuilt for each n.
+  if (run("engines")) {
+    struct Engine {
+      const char* name;
+      unique_ptr<bktree::FuzzyIndex> index;
+      int64_t build_ms;
+      size_t bytes;
+    };
+    auto make_engine = [&](const char* name,
+                           function<bktree::FuzzyIndex*()> build) {
+      size_t bytes_before = g_live_bytes;
+      auto start_time = chrono::high_resolution_clock::now();
+      unique_ptr<bktree::FuzzyIndex> index(build());
+      int64_t build_ms = ms_since(start_time);
+      return Engine{name, move(index), build_ms, g_live_bytes - bytes_before};
+    };
+    vector<Engine> engines;
+    engines.push_back(make_engine(
+        "bktree", [&]() { return new bktree::BkIndex(words); }));
+    engines.push_back(make_engine(
+        "brute_force", [&]() { return new bktree::BruteForceIndex(words); }));
+    engines.push_back(make_engine(
+        "qgram", [&]() { return new bktree::QGramIndex(words); }));
+    for (int n = 1; n <= 3; ++n) {
+      engines.push_back(make_engine("deletion", [&]() {
+        return new bktree::DeletionIndex(words, n);
+      }));
+      for (const Engine& engine : engines) {
+        vector<bktree::Match> matches;
+        size_t num_matches = 0;
+        vector<double> compared;
+        vector<double> us = time_each(queries, [&](const string& query) {
+          matches.clear();
+          size_t count = engine.index->find(query, n, &matches);
+          num_matches += matches.size();
+          return count;
+        }, &compared);
+        string name = string(engine.name) + ".n" + to_string(n);
+        print(name, "build_ms", engine.build_ms);
+        print(name, "bytes", engine.bytes);
+        print(name, "bytes_per_word", (double)engine.bytes / words.size());
+        print(name, "matches", num_matches);
+        print_latencies(name, us, compared);
+      }
+      engines.pop_back();
+    }
+  }
+
+  // Time to the first query result: rebuilding from the word list, against
+  // mapping an index file with a cold and a warm page cache.
+  if (run("startup")) {
+    char path[] = "/tmp/bktree_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+      cerr << "mkstemp failed" << endl;
+      return EXIT_FAILURE;
+    }
+    close(fd);
+    string err;
+    if (!bktree::BkIndex(words).save(path, &err)) {
+      cerr << err << endl;
+      return EXIT_FAILURE;
+    }
+
+    auto start_time = chrono::high_resolution_clock::now();
+    {
+      bktree::BkIndex index(read_words(wordfile));
+      index.query(queries[0], n, [](bktree::StringRef, int) {});
+    }
+    print("startup", "rebuild_us", us_since(start_time));
+
+    for (bool cold : {true, false}) {
+      for (bool verify : {false, true}) {
+        if (cold)
+          evict(path);
+        auto start_time = chrono::high_resolution_clock::now();
+        bktree::BkIndex index;
+        if (!index.load(path, verify, &err)) {
+          cerr << err << endl;
+          return EXIT_FAILURE;
+        }
+        index.query(queries[0], n, [](bktree::StringRef, int) {});
+        int64_t us = us_since(start_time);
+        string metric = string(cold ? "cold" : "warm") + "_load" +
+                        (verify ? "_verified_us" : "_us");
+        print("startup", metric.c_str(), us);
+      }
+    }
+    unlink(path);
+  }
+
+  // Construction time and query throughput by thread count.
+  if (run("threads")) {
+    int max_threads = max(4u, thread::hardware_concurrency());
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      auto start_time = chrono::high_resolution_clock::now();
+      bktree::BkIndex index(words, threads);
+      int64_t build_ms = ms_since(start_time);
+
+      atomic<size_t> matches(0);
+      start_time = chrono::high_resolution_clock::now();
+      index.query_all(queries, n, threads,
+                      [&](size_t, bktree::StringRef, int) { ++matches; });
+      auto end_time = chrono::high_resolution_clock::now();
+      double seconds = chrono::duration<double>(end_time - start_time).count();
+      string name = "threads." + to_string(threads);
+      print(name, "build_ms", build_ms);
+      print(name, "queries_per_s", (int64_t)(queries.size() / seconds));
+      print(name, "matches", matches);
+    }
+  }
 
-  cout << "Index depth: " << index.depth() << " (size: " << words.size()
-       << ")" << endl;
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  print("process", "peak_rss_kb", usage.ru_maxrss);
 }
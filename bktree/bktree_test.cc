@@ -0,0 +1,279 @@
+// c++ -std=c++1y -O2 bktree_test.cc -o bktree_test -pthread && ./bktree_test
+
+// Differential test for bktree.h: Checks that the bit-parallel Matcher, its
+// bounded version, and its batch version agree with the DP edit_distance(),
+// that BkIndex and the engines in fuzzy.h find the same words as a DP scan,
+// and that index files round-trip.
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bktree.h"
+#include "fuzzy.h"
+using namespace std;
+using namespace bktree;
+
+static int g_failures = 0;
+
+static void fail(const char* what, const string& a, const string& b, int got,
+                 int expected) {
+  if (++g_failures > 20)
+    return;
+  fprintf(stderr, "FAIL %s(\"%s\", \"%s\"): got %d, expected %d\n", what,
+          a.c_str(), b.c_str(), got, expected);
+}
+
+// Random string with up to |max_size| characters from the first |alphabet|
+// letters of a-z.  Small alphabets give small distances and many ties.
+static string random_string(mt19937* rng, int max_size, int alphabet) {
+  string s(uniform_int_distribution<int>(0, max_size)(*rng), 'a');
+  for (char& c : s)
+    c = 'a' + uniform_int_distribution<int>(0, alphabet - 1)(*rng);
+  return s;
+}
+
+// Applies a few random edits to |s|, so that most pairs are close.
+static string mutate(mt19937* rng, string s, int edits) {
+  for (int i = 0; i < edits; ++i) {
+    size_t pos = uniform_int_distribution<size_t>(0, s.size())(*rng);
+    char c = 'a' + uniform_int_distribution<int>(0, 25)(*rng);
+    switch (uniform_int_distribution<int>(0, 2)(*rng)) {
+      case 0: s.insert(s.begin() + pos, c); break;
+      case 1: if (pos < s.size()) s.erase(s.begin() + pos); break;
+      case 2: if (pos < s.size()) s[pos] = c; break;
+    }
+  }
+  return s;
+}
+
+static void check(const string& a, const vector<string>& bs) {
+  Matcher matcher(a);
+  vector<StringRef> refs(bs.begin(), bs.end());
+  vector<int> expected(bs.size());
+  for (size_t i = 0; i < bs.size(); ++i) {
+    expected[i] = edit_distance(a, bs[i]);
+    int d = matcher.distance(bs[i]);
+    if (d != expected[i])
+      fail("distance", a, bs[i], d, expected[i]);
+    for (int k = 0; k <= 4; ++k) {
+      int want = min(expected[i], k + 1);
+      int got = matcher.distance_bound(bs[i], k);
+      if (got != want)
+        fail("distance_bound", a, bs[i], got, want);
+      got = min(edit_distance_bound(a, bs[i], k), k + 1);
+      if (got != want)
+        fail("edit_distance_bound", a, bs[i], got, want);
+    }
+  }
+  for (size_t i = 0; i < bs.size(); i += Matcher::kBatchSize) {
+    int count = min<int>(Matcher::kBatchSize, bs.size() - i);
+    int batch[Matcher::kBatchSize], scalar[Matcher::kBatchSize];
+    matcher.distance_batch(&refs[i], count, batch);
+    matcher.distance_batch_scalar(&refs[i], count, scalar);
+    for (int j = 0; j < count; ++j) {
+      if (batch[j] != expected[i + j])
+        fail("distance_batch", a, bs[i + j], batch[j], expected[i + j]);
+      if (scalar[j] != expected[i + j])
+        fail("distance_batch_scalar", a, bs[i + j], scalar[j],
+             expected[i + j]);
+    }
+  }
+}
+
+int main() {
+  mt19937 rng(1234);
+
+  // Edge cases: empty strings, and pattern lengths around the 32 and 64 bit
+  // limits of the batch and scalar kernels.
+  for (int size : {0, 1, 31, 32, 33, 63, 64, 65, 100}) {
+    string a(size, 'x');
+    vector<string> bs = {"", "x", a, a + "y", "y" + a, a.substr(0, size / 2)};
+    for (int i = 0; i < 40; ++i)
+      bs.push_back(mutate(&rng, a, i % 5));
+    check(a, bs);
+  }
+
+  for (int iter = 0; iter < 20000; ++iter) {
+    int alphabet = iter % 3 == 0 ? 2 : iter % 3 == 1 ? 4 : 26;
+    int max_size = iter % 10 == 0 ? 80 : 20;
+    string a = random_string(&rng, max_size, alphabet);
+    vector<string> bs;
+    int count = uniform_int_distribution<int>(1, 40)(rng);
+    for (int i = 0; i < count; ++i)
+      bs.push_back(i % 2 ? random_string(&rng, max_size, alphabet)
+                         : mutate(&rng, a, i % 4));
+    check(a, bs);
+  }
+
+  // brute_force_query() finds the same words as a DP scan.
+  vector<string> words;
+  for (int i = 0; i < 2000; ++i)
+    words.push_back(random_string(&rng, 12, 4));
+  for (int iter = 0; iter < 200; ++iter) {
+    string query = random_string(&rng, 12, 4);
+    for (int n = 0; n <= 3; ++n) {
+      vector<string> expected, got;
+      for (const string& w : words)
+        if (edit_distance(w, query) <= n)
+          expected.push_back(w);
+      brute_force_query(words, query, n,
+                        [&](StringRef w, int) { got.push_back(w.AsString()); });
+      if (got != expected)
+        fail("brute_force_query", query, "", got.size(), expected.size());
+    }
+  }
+
+  // The parallel build gives the same tree as the serial one.
+  auto edges = [](const BkIndex& index) {
+    string s;
+    index.for_each_edge([&](StringRef parent, StringRef child, int d) {
+      s += parent.AsString() + " " + child.AsString() + " " + to_string(d);
+      s += "\n";
+    });
+    return s;
+  };
+  BkIndex index(words, 1);
+  if (edges(index) != edges(BkIndex(words, 4)))
+    fail("BkIndex(words, 4)", "", "", 0, 0);
+
+  // An index file maps back to the same tree, and damage is detected.
+  {
+    char path[] = "/tmp/bktree_test_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    string err;
+    BkIndex loaded;
+    if (!index.save(path, &err) || !loaded.load(path, true, &err) ||
+        edges(loaded) != edges(index) || loaded.size() != index.size())
+      fail("save/load", path, err, 0, 0);
+    FILE* f = fopen(path, "r+b");
+    fseek(f, -1, SEEK_END);
+    fputc('!', f);
+    fclose(f);
+    if (loaded.load(path, true, &err))
+      fail("load corrupt", path, "", 1, 0);
+    if (!loaded.load(path, false, &err))
+      fail("load corrupt unverified", path, err, 0, 1);
+    if (truncate(path, sizeof(BkIndex::FileHeader) + 8) != 0 ||
+        loaded.load(path, false, &err))
+      fail("load truncated", path, "", 1, 0);
+
+    // Nodes and edges pointing outside the arrays, or back up the tree, are
+    // rejected also without |verify|, and also with a matching checksum.
+    typedef BkIndex::FileHeader FileHeader;
+    size_t edges_offset =
+        sizeof(FileHeader) + index.size() * sizeof(BkIndex::Node);
+    const struct {
+      const char* name;
+      size_t offset;
+      uint32_t value;
+    } kDamage[] = {
+        {"word_offset", sizeof(FileHeader), 0xffffff00},
+        {"word_size", sizeof(FileHeader) + 4, 0xffffff00},
+        {"first_edge", sizeof(FileHeader) + 8, 0xffffff00},
+        {"num_edges", sizeof(FileHeader) + 12, 0xffffff00},
+        {"child", edges_offset + 4, 0xffffff00},
+        {"child cycle", edges_offset + 4, 0},
+    };
+    for (const auto& damage : kDamage) {
+      index.save(path, &err);
+      FILE* f = fopen(path, "r+b");
+      fseek(f, 0, SEEK_END);
+      string data(ftell(f), '\0');
+      rewind(f);
+      data.resize(fread(&data[0], 1, data.size(), f));
+      memcpy(&data[damage.offset], &damage.value, 4);
+      FileHeader header;
+      memcpy(&header, data.data(), sizeof(header));
+      header.checksum = BkIndex::checksum(data.data() + sizeof(header),
+                                          data.size() - sizeof(header));
+      memcpy(&data[0], &header, sizeof(header));
+      rewind(f);
+      fwrite(data.data(), 1, data.size(), f);
+      fclose(f);
+      for (bool verify : {false, true})
+        if (loaded.load(path, verify, &err))
+          fail("load damaged", damage.name, "", 1, verify);
+    }
+    unlink(path);
+    if (!BkIndex().save(path, &err) || !loaded.load(path, true, &err) ||
+        loaded.size() != 0 || !loaded.query(string("a"), 1).empty())
+      fail("save/load empty", path, err, 0, 0);
+    unlink(path);
+  }
+
+  // query(), query_all() and nearest() agree with the DP scan.
+  vector<string> queries;
+  for (int i = 0; i < 200; ++i)
+    queries.push_back(random_string(&rng, 12, 4));
+  // Long words exercise the DeletionIndex prefix.
+  for (int i = 0; i < 200; ++i)
+    words.push_back(random_string(&rng, 20, 3));
+  for (int i = 0; i < 50; ++i)
+    queries.push_back(mutate(&rng, words[words.size() - 1 - i], i % 4));
+  index = BkIndex(words);
+  BruteForceIndex brute_force(words);
+  DeletionIndex deletion(words, 2);
+  QGramIndex qgram(words);
+  const FuzzyIndex* engines[] = {&index, &brute_force, &deletion, &qgram};
+  for (int n = 0; n <= 3; ++n) {
+    vector<vector<BkIndex::Match>> all = index.query_all(queries, n, 3);
+    for (size_t q = 0; q < queries.size(); ++q) {
+      vector<pair<int, string>> expected, got, got_all;
+      for (const string& w : words) {
+        int d = edit_distance(w, queries[q]);
+        if (d <= n)
+          expected.emplace_back(d, w);
+      }
+      sort(expected.begin(), expected.end());
+      for (const BkIndex::Match& m : index.query(queries[q], n))
+        got.emplace_back(m.distance, m.word.AsString());
+      sort(got.begin(), got.end());
+      for (const BkIndex::Match& m : all[q])
+        got_all.emplace_back(m.distance, m.word.AsString());
+      sort(got_all.begin(), got_all.end());
+      if (got != expected)
+        fail("query", queries[q], "", got.size(), expected.size());
+      if (got_all != expected)
+        fail("query_all", queries[q], "", got_all.size(), expected.size());
+
+      // FuzzyIndex::find() on all engines.  DeletionIndex falls back to a
+      // scan for n = 3.
+      for (const FuzzyIndex* engine : engines) {
+        vector<Match> matches;
+        engine->find(queries[q], n, &matches);
+        vector<pair<int, string>> found;
+        for (const Match& m : matches)
+          found.emplace_back(m.distance, m.word.AsString());
+        sort(found.begin(), found.end());
+        if (found != expected)
+          fail("find", queries[q], "", found.size(), expected.size());
+      }
+
+      // |words| has duplicates, but every copy is its own node.
+      for (size_t k : {1, 5, 50}) {
+        vector<pair<int, string>> nearest;
+        for (const BkIndex::Match& m : index.nearest(queries[q], k, n))
+          nearest.emplace_back(m.distance, m.word.AsString());
+        size_t size = min(k, expected.size());
+        if (nearest != vector<pair<int, string>>(expected.begin(),
+                                                 expected.begin() + size))
+          fail("nearest", queries[q], "", nearest.size(), size);
+      }
+    }
+  }
+
+  // Bytes >= 0x80 must index the match table as unsigned.
+  check("\xc3\xa9t\xc3\xa9", {"ete", "\xc3\xa9t\xc3\xa9", "\xff\xfe"});
+
+  if (g_failures) {
+    fprintf(stderr, "%d failures\n", g_failures);
+    return 1;
+  }
+  printf("passed\n");
+}
@@ -0,0 +1,353 @@
+// Alternatives to the BK-tree in bktree.h, behind its FuzzyIndex interface:
+//
+// - BruteForceIndex compares the query to every word of about the right
+//   length.
+// - DeletionIndex is a "symmetric delete" index like SymSpell's
+//   (https://github.com/wolfgarbe/SymSpell).  If two words are within
+//   distance n, deleting at most n characters from each gives a common
+//   string.  The index stores all such deletion variants of all words, so a
+//   query only has to look up its own variants.  Fast for small n, but the
+//   number of variants grows quickly with n.
+// - QGramIndex maps each bigram to the words containing it.  Words within
+//   distance n of each other share at least max(|a|, |b|) + 1 - 2n bigrams
+//   (counting one padding character at each end), because an edit destroys
+//   at most two bigrams.  Only words that reach that count ("count
+//   filtering") get their distance computed.
+//
+// All three find the same words as BkIndex.
+#ifndef BKTREE_FUZZY_H_
+#define BKTREE_FUZZY_H_
+
+#include "bktree.h"
+
+namespace bktree {
+
+// Words in one string pool, for the engines below.
+class WordList {
+ public:
+  void add(StringRef word) {
+    pool.insert(pool.end(), word.s_, word.s_ + word.n_);
+    ends.push_back(pool.size());
+  }
+  StringRef operator[](uint32_t i) const {
+    uint32_t begin = i ? ends[i - 1] : 0;
+    return StringRef(pool.data() + begin, ends[i] - begin);
+  }
+  size_t size() const { return ends.size(); }
+  size_t memory_usage() const {
+    return pool.capacity() + ends.capacity() * sizeof(uint32_t);
+  }
+
+ private:
+  std::vector<char> pool;
+  std::vector<uint32_t> ends;  // End of each word in |pool|.
+};
+
+class BruteForceIndex : public FuzzyIndex {
+ public:
+  explicit BruteForceIndex(const std::vector<std::string>& words)
+      : words(words) {}
+
+  size_t find(StringRef word, int n,
+              std::vector<Match>* matches) const override {
+    return brute_force_query(words, word, n, [&](StringRef w, int d) {
+      matches->push_back(Match{w, d});
+    });
+  }
+
+  size_t memory_usage() const override {
+    size_t size = words.capacity() * sizeof(std::string);
+    for (const std::string& word : words)
+      if (word.capacity() >= sizeof(std::string))  // Not inline.
+        size += word.capacity() + 1;
+    return size;
+  }
+
+ private:
+  std::vector<std::string> words;
+};
+
+class DeletionIndex : public FuzzyIndex {
+ public:
+  // Indexes variants with up to |max_n| deletions, from the first
+  // |prefix_length| (at most 16) characters of each word.  Restricting
+  // variants to a prefix bounds their number for long words and still finds
+  // all matches: deletions that line up two words line up their prefixes
+  // too, after deleting at most as many characters from the longer prefix's
+  // end.  All candidates are verified with a Matcher.  Queries with n >
+  // max_n fall back to comparing all words.
+  DeletionIndex(const std::vector<std::string>& words, int max_n,
+                int prefix_length = 7);
+
+  size_t find(StringRef word, int n,
+              std::vector<Match>* matches) const override;
+
+  size_t memory_usage() const override {
+    return words.memory_usage() + slots.capacity() * sizeof(Slot) +
+           ids.capacity() * sizeof(uint32_t);
+  }
+
+ private:
+  // Open addressing hash table entry, from a variant's hash to the words
+  // that have that variant, ids[start, start + count).
+  struct Slot {
+    uint64_t key;  // 0 for empty slots.
+    uint32_t start;
+    uint32_t count;
+  };
+
+  // Appends the hashes of the distinct variants of |word|'s prefix with up
+  // to |n| deletions to |hashes|.
+  void variants(StringRef word, int n, std::vector<uint64_t>* hashes) const;
+  static void delete_from(const char* s, int size, int start, int n,
+                          uint32_t deleted, std::vector<uint64_t>* hashes);
+
+  int max_n;
+  int prefix_length;
+  WordList words;
+  std::vector<Slot> slots;  // Power of two size.
+  std::vector<uint32_t> ids;
+};
+
+class QGramIndex : public FuzzyIndex {
+ public:
+  explicit QGramIndex(const std::vector<std::string>& words);
+
+  size_t find(StringRef word, int n,
+              std::vector<Match>* matches) const override;
+
+  size_t memory_usage() const override {
+    return words.memory_usage() +
+           (length_starts.capacity() + gram_starts.capacity() +
+            postings.capacity()) * sizeof(uint32_t);
+  }
+
+ private:
+  // Bigrams of |word| with a 0 byte before and after it, as
+  // (first << 8 | second).  There are |word.n_| + 1 of them.
+  static void grams(StringRef word, std::vector<uint32_t>* out) {
+    out->clear();
+    unsigned prev = 0;
+    for (size_t i = 0; i < word.n_; ++i) {
+      unsigned c = (unsigned char)word.s_[i];
+      out->push_back(prev << 8 | c);
+      prev = c;
+    }
+    out->push_back(prev << 8);
+  }
+
+  // Words are sorted by length, so that the ids in each posting list are
+  // sorted by length too, and a query can skip to the ids with a length
+  // that can match.
+  WordList words;
+  std::vector<uint32_t> length_starts;  // First id of each length, plus end.
+  std::vector<uint32_t> gram_starts;    // Start of each bigram's postings.
+  std::vector<uint32_t> postings;  // Ids, ascending, once per occurrence.
+};
+
+inline DeletionIndex::DeletionIndex(const std::vector<std::string>& words,
+                                    int max_n, int prefix_length)
+    : max_n(max_n), prefix_length(std::min(prefix_length, 16)) {
+  // (variant hash, word id) pairs, sorted, become the table.
+  std::vector<std::pair<uint64_t, uint32_t>> pairs;
+  std::vector<uint64_t> hashes;
+  for (uint32_t i = 0; i < words.size(); ++i) {
+    this->words.add(words[i]);
+    hashes.clear();
+    variants(words[i], max_n, &hashes);
+    for (uint64_t hash : hashes)
+      pairs.emplace_back(hash, i);
+  }
+  std::sort(pairs.begin(), pairs.end());
+
+  size_t num_keys = 0;
+  for (size_t i = 0; i < pairs.size(); ++i)
+    if (i == 0 || pairs[i].first != pairs[i - 1].first)
+      ++num_keys;
+  size_t num_slots = 16;
+  while (num_slots < 2 * num_keys)
+    num_slots *= 2;
+  slots.resize(num_slots);
+  ids.resize(pairs.size());
+  for (size_t i = 0; i < pairs.size();) {
+    size_t j = i;
+    for (; j < pairs.size() && pairs[j].first == pairs[i].first; ++j)
+      ids[j] = pairs[j].second;
+    size_t slot = pairs[i].first & (num_slots - 1);
+    while (slots[slot].key)
+      slot = (slot + 1) & (num_slots - 1);
+    slots[slot] = Slot{pairs[i].first, (uint32_t)i, (uint32_t)(j - i)};
+    i = j;
+  }
+}
+
+inline void DeletionIndex::variants(StringRef word, int n,
+                                    std::vector<uint64_t>* hashes) const {
+  size_t begin = hashes->size();
+  int size = std::min<int>(word.n_, prefix_length);
+  delete_from(word.s_, size, 0, std::min(n, size), 0, hashes);
+  // Deleting different characters can give the same variant ("aab").
+  std::sort(hashes->begin() + begin, hashes->end());
+  hashes->erase(std::unique(hashes->begin() + begin, hashes->end()),
+                hashes->end());
+}
+
+// Adds the variant of s[0, size) without the characters in |deleted|, and
+// recursively the ones with up to |n| more deletions at positions >= start.
+inline void DeletionIndex::delete_from(const char* s, int size, int start,
+                                       int n, uint32_t deleted,
+                                       std::vector<uint64_t>* hashes) {
+  uint64_t h = 0xcbf29ce484222325;  // FNV-1a.
+  for (int i = 0; i < size; ++i)
+    if (!(deleted & (1u << i)))
+      h = (h ^ (unsigned char)s[i]) * 0x100000001b3;
+  hashes->push_back(h ? h : 1);
+  if (n == 0)
+    return;
+  for (int i = start; i < size; ++i)
+    delete_from(s, size, i + 1, n - 1, deleted | (1u << i), hashes);
+}
+
+inline size_t DeletionIndex::find(StringRef word, int n,
+                                  std::vector<Match>* matches) const {
+  Matcher matcher(word);
+  std::vector<uint32_t> candidates;
+  if (n > max_n) {
+    candidates.resize(words.size());
+    for (uint32_t i = 0; i < candidates.size(); ++i)
+      candidates[i] = i;
+  } else {
+    std::vector<uint64_t> hashes;
+    variants(word, n, &hashes);
+    for (uint64_t hash : hashes) {
+      size_t slot = hash & (slots.size() - 1);
+      for (; slots[slot].key; slot = (slot + 1) & (slots.size() - 1)) {
+        if (slots[slot].key != hash)
+          continue;
+        candidates.insert(candidates.end(), &ids[slots[slot].start],
+                          &ids[slots[slot].start] + slots[slot].count);
+        break;
+      }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                     candidates.end());
+  }
+  size_t count = 0;
+  for (uint32_t id : candidates) {
+    StringRef w = words[id];
+    if (abs((int)w.n_ - (int)word.n_) > n)
+      continue;
+    ++count;
+    int d = matcher.distance_bound(w, n);
+    if (d <= n)
+      matches->push_back(Match{w, d});
+  }
+  return count;
+}
+
+inline QGramIndex::QGramIndex(const std::vector<std::string>& words) {
+  std::vector<uint32_t> order(words.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return words[a].size() < words[b].size();
+  });
+  for (uint32_t i : order) {
+    this->words.add(words[i]);
+    while (length_starts.size() <= words[i].size())
+      length_starts.push_back(this->words.size() - 1);
+  }
+  length_starts.push_back(this->words.size());
+
+  // Count, then fill, the postings of each bigram.
+  gram_starts.assign((1 << 16) + 1, 0);
+  std::vector<uint32_t> word_grams;
+  for (uint32_t id = 0; id < this->words.size(); ++id) {
+    grams(this->words[id], &word_grams);
+    for (uint32_t gram : word_grams)
+      ++gram_starts[gram + 1];
+  }
+  for (size_t i = 1; i < gram_starts.size(); ++i)
+    gram_starts[i] += gram_starts[i - 1];
+  postings.resize(gram_starts.back());
+  std::vector<uint32_t> pos(gram_starts.begin(), gram_starts.end() - 1);
+  for (uint32_t id = 0; id < this->words.size(); ++id) {
+    grams(this->words[id], &word_grams);
+    for (uint32_t gram : word_grams)
+      postings[pos[gram]++] = id;
+  }
+}
+
+inline size_t QGramIndex::find(StringRef word, int n,
+                               std::vector<Match>* matches) const {
+  int size = word.n_;
+  int max_length = (int)length_starts.size() - 2;
+  int min_size = std::max(0, size - n);
+  int max_size = std::min(max_length, size + n);
+  if (min_size > max_size)
+    return 0;
+  // Words of length l need this many bigrams in common with |word|.
+  auto threshold = [&](int l) { return std::max(size, l) + 1 - 2 * n; };
+
+  // Shared counts per word id, and the ids with a nonzero count.  Kept per
+  // thread, and zeroed again after each query.
+  static thread_local std::vector<uint16_t> counts;
+  static thread_local std::vector<uint32_t> touched;
+  if (counts.size() < words.size())
+    counts.resize(words.size());
+
+  // Count bigrams in common, with multiplicity, for words of a length
+  // where count filtering can rule anything out.
+  std::vector<uint32_t> query_grams;
+  grams(word, &query_grams);
+  std::sort(query_grams.begin(), query_grams.end());
+  int first_counted = min_size;
+  while (first_counted <= max_size && threshold(first_counted) <= 0)
+    ++first_counted;
+  uint32_t lo = length_starts[first_counted];
+  uint32_t hi = length_starts[max_size + 1];
+  for (size_t i = 0; i < query_grams.size() && lo < hi;) {
+    uint32_t gram = query_grams[i];
+    uint16_t multiplicity = 0;
+    for (; i < query_grams.size() && query_grams[i] == gram; ++i)
+      ++multiplicity;
+    const uint32_t* p = std::lower_bound(&postings[gram_starts[gram]],
+                                         &postings[gram_starts[gram + 1]], lo);
+    const uint32_t* end = &postings[gram_starts[gram + 1]];
+    while (p != end && *p < hi) {
+      uint32_t id = *p;
+      uint16_t run = 0;
+      for (; p != end && *p == id; ++p)
+        ++run;
+      if (!counts[id])
+        touched.push_back(id);
+      counts[id] += std::min(run, multiplicity);
+    }
+  }
+
+  Matcher matcher(word);
+  size_t count = 0;
+  auto verify = [&](uint32_t id) {
+    ++count;
+    StringRef w = words[id];
+    int d = matcher.distance_bound(w, n);
+    if (d <= n)
+      matches->push_back(Match{w, d});
+  };
+  // Lengths where the filter is useless: all words are candidates.
+  for (int l = min_size; l < first_counted; ++l)
+    for (uint32_t id = length_starts[l]; id < length_starts[l + 1]; ++id)
+      verify(id);
+  for (uint32_t id : touched) {
+    if (counts[id] >= threshold(words[id].n_))
+      verify(id);
+    counts[id] = 0;
+  }
+  touched.clear();
+  return count;
+}
+
+}  // namespace bktree
+
+#endif  // BKTREE_FUZZY_H_
@@ -1,6 +1,11 @@
 #include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
 #include <functional>
 #include <optional>
+#include <random>
+#include <string>
 #include <string_view>
 
 using namespace std;
@@ -98,10 +103,8 @@ bool parse_time(string_view& s, JsIsoDate& d)
           parse_timezone(s, d);
 }
 
-// Returns a JsIsoDate if the input matches the format described in
-// https://www.ecma-international.org/ecma-262/#sec-date-time-string-format
-// That means that it returns a valid object even for things like '2020-02-31' or '2020-01-15T24:59'.
-optional<JsIsoDate> parse_js_ios_date(string_view s) {
+// Recursive-descent parser for everything parse_js_ios_date() accepts.
+optional<JsIsoDate> parse_js_ios_date_slow(string_view s) {
   JsIsoDate date;
   if (!parse_year(s, date) ||
       consume(s, '-') && !parse_month_days(s, date) ||
@@ -111,6 +114,81 @@ optional<JsIsoDate> parse_js_ios_date(string_view s) {
   return {};
 }
 
+// Little-endian word with the separator bytes of the 8 bytes at |shape|, or
+// with 0xff at the separator bytes if |mask|.  '0' in |shape| marks a digit.
+constexpr uint64_t shape_word(const char* shape, bool mask) {
+  uint64_t r = 0;
+  for (int i = 0; i < 8; ++i)
+    if (shape[i] != '0')
+      r |= uint64_t(mask ? 0xff : (unsigned char)shape[i]) << (8 * i);
+  return r;
+}
+
+constexpr char kFullShape[] = "0000-00-00T00:00:00.000Z";
+constexpr uint64_t kSeparators[3] = {shape_word(kFullShape, false),
+                                     shape_word(kFullShape + 8, false),
+                                     shape_word(kFullShape + 16, false)};
+constexpr uint64_t kSeparatorMasks[3] = {shape_word(kFullShape, true),
+                                         shape_word(kFullShape + 8, true),
+                                         shape_word(kFullShape + 16, true)};
+
+// Fast path for YYYY-MM-DDTHH:MM:SS.sssZ, which is nearly all real input.
+// Checks all 24 bytes as three 8-byte words, and converts every digit pair in
+// a word with one multiply and one shift.  Returns nothing for any other
+// input, including out-of-range fields, and leaves those to the slow path.
+optional<JsIsoDate> parse_full_date_fast(string_view s) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (s.size() != 24)
+    return {};
+  uint64_t w[3];
+  memcpy(w, s.data(), sizeof(w));
+
+  uint64_t digits[3], pairs[3];
+  for (int i = 0; i < 3; ++i) {
+    if ((w[i] & kSeparatorMasks[i]) != kSeparators[i])
+      return {};
+    // With '0' at the separators, every byte must be in 0x30-0x39: high
+    // nibble 3, and still 3 after adding 6 to the low nibble.
+    uint64_t x = (w[i] & ~kSeparatorMasks[i]) |
+                 (0x3030303030303030 & kSeparatorMasks[i]);
+    if ((x & 0xf0f0f0f0f0f0f0f0) != 0x3030303030303030 ||
+        ((x + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) != 0x3030303030303030)
+      return {};
+    digits[i] = x - 0x3030303030303030;
+    // Byte j becomes 10 * digit j + digit j + 1.  Both are <= 9, so no byte
+    // carries into the next.
+    pairs[i] = digits[i] * 10 + (digits[i] >> 8);
+  }
+
+  auto byte = [](uint64_t x, int i) { return int((x >> (8 * i)) & 0xff); };
+  JsIsoDate date;
+  date.year = byte(pairs[0], 0) * 100 + byte(pairs[0], 2);
+  date.month = byte(pairs[0], 5);
+  date.day = byte(pairs[1], 0);
+  date.hours = byte(pairs[1], 3);
+  date.minutes = byte(pairs[1], 6);
+  date.seconds = byte(pairs[2], 1);
+  date.milliseconds = byte(pairs[2], 4) * 10 + byte(digits[2], 6);
+  date.timezone = 'Z';
+  // The same range checks as the slow path.
+  if (date.month < 1 || date.month > 12 || date.hours > 24 ||
+      date.minutes > 59 || date.seconds > 59)
+    return {};
+  return date;
+#else
+  return {};
+#endif
+}
+
+// Returns a JsIsoDate if the input matches the format described in
+// https://www.ecma-international.org/ecma-262/#sec-date-time-string-format
+// That means that it returns a valid object even for things like '2020-02-31' or '2020-01-15T24:59'.
+optional<JsIsoDate> parse_js_ios_date(string_view s) {
+  if (optional<JsIsoDate> date = parse_full_date_fast(s))
+    return date;
+  return parse_js_ios_date_slow(s);
+}
+
 bool operator==(const JsIsoDate& a, const JsIsoDate& b) {
   return a.year == b.year && a.month == b.month && a.day == b.day &&
          a.hours == b.hours && a.minutes == b.minutes && a.seconds == b.seconds && a.milliseconds == b.milliseconds &&
@@ -119,6 +197,8 @@ bool operator==(const JsIsoDate& a, const JsIsoDate& b) {
 
 bool operator!=(const JsIsoDate& a, const JsIsoDate& b) { return !(a == b); }
 
+// Other files include this one for the parser, with ISO8601_NO_MAIN defined.
+#ifndef ISO8601_NO_MAIN
 int main() {
   if (parse_js_ios_date("2020-"))
     exit(1);
@@ -218,4 +298,61 @@ int main() {
 
   if (parse_js_ios_date("2020-11-12T14:15+-12:13"))
     exit(33);
+
+  // parse_full_date_fast() must not change what parse_js_ios_date() returns:
+  // compare against the slow path on the inputs above, on every byte value at
+  // every position of a full-length date, and on random mutations.
+  auto check = [](string_view s, int code) {
+    if (parse_js_ios_date(s) != parse_js_ios_date_slow(s))
+      exit(code);
+  };
+  const char* cases[] = {"2020-", "2020", "2020-99", "2020-1", "2020-01-",
+    "2020-11", "2020-11-15", "2020-11-15T23", "2020-11-15T23:59",
+    "2020-11-15T23:59:40", "2020-11-15T23:59:40.123",
+    "2020-11-15T23:59:40.123Z", "2020-11-15T23:59:40.123Zo",
+    "2020-11-15T23:59:40.123+14:15", "2020-11-15T23:59:40.123-14:15",
+    "2020-11-15T23:59:40.123=14:15", "2020-11-15Z", "2020T23:59:40.123",
+    "2020-05T23:59:40", "2020-05-20T23:59", "2020-05-20T23:59:40Z",
+    "2020-11-15T23:59Z", "2020-11-15T23:59Z+04:05", "2020-11-15T23:59+04:05Z",
+    "2020-11-15T23:59.123", "+202020", "-202020", "+2020", "2020-+11",
+    "2020-11-+12", "2020-11-12T+14:15", "2020-11-12T14:+15",
+    "2020-11-12T14:15+-12:13"};
+  for (const char* c : cases)
+    check(c, 34);
+
+  if (parse_full_date_fast("2020-11-15T23:59:40.123Z") != JsIsoDate{2020, 11, 15, 23, 59, 40, 123, 'Z'})
+    exit(35);
+
+  for (size_t i = 0; i < 24; ++i) {
+    for (int c = 0; c < 256; ++c) {
+      string s = "2020-11-15T23:59:40.123Z";
+      s[i] = c;
+      check(s, 36);
+    }
+  }
+
+  mt19937 rng(8601);
+  const char alphabet[] = "0123456789-T:.Z+/;@ \xff";
+  int fast = 0;
+  for (int iter = 0; iter < 1000000; ++iter) {
+    string s = "0000-00-00T00:00:00.000Z";
+    for (char& c : s)
+      if (c == '0')
+        c = '0' + uniform_int_distribution<int>(0, 9)(rng);
+    int edits = uniform_int_distribution<int>(0, 3)(rng);
+    for (int j = 0; j < edits; ++j) {
+      size_t pos = uniform_int_distribution<size_t>(0, s.size() - 1)(rng);
+      char c = alphabet[uniform_int_distribution<size_t>(0, sizeof(alphabet) - 2)(rng)];
+      switch (uniform_int_distribution<int>(0, 3)(rng)) {
+        case 0: s.insert(s.begin() + pos, c); break;
+        case 1: s.erase(s.begin() + pos); break;
+        default: s[pos] = c; break;
+      }
+    }
+    check(s, 37);
+    fast += bool(parse_full_date_fast(s));
+  }
+  if (fast == 0)
+    exit(38);
 }
+#endif
@@ -0,0 +1,314 @@
+// c++ -std=c++17 -O2 iso8601_bench.cc -o iso8601_bench && ./iso8601_bench
+
+// Times parse_js_ios_date() from each of iso8601_0.cc to iso8601_16.cc on the
+// same generated corpora:
+//
+//   full     all YYYY-MM-DDTHH:MM:SS.sssZ
+//   logs     99% of those, the rest other shapes and invalid dates
+//   mixed    every shape, from YYYY to +YYYYYY-...+HH:MM, equally often
+//   invalid  valid dates with one byte changed or cut short
+//
+// and prints ns, instructions and branch misses per parse, the last two from
+// perf_event_open() if the kernel allows it, and how many dates each variant
+// accepted.
+//
+//   iso8601_bench [-n dates] [-r repetitions] [corpus...]
+
+// Some variants assert() on inputs that their own checks don't cover, like
+// seconds without minutes.  Time release builds.
+#ifndef NDEBUG
+#define NDEBUG
+#endif
+#include <assert.h>
+#include <ctype.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Every variant is a whole program with the same names, so each goes into a
+// namespace of its own, with its main() renamed.
+#define main iso8601_main
+namespace v0 {
+#include "iso8601_0.cc"
+}
+namespace v1 {
+#include "iso8601_1.cc"
+}
+namespace v2 {
+#include "iso8601_2.cc"
+}
+namespace v3 {
+#include "iso8601_3.cc"
+}
+namespace v4 {
+#include "iso8601_4.cc"
+}
+namespace v5 {
+#include "iso8601_5.cc"
+}
+namespace v6 {
+#include "iso8601_6.cc"
+}
+namespace v7 {
+#include "iso8601_7.cc"
+}
+namespace v8 {
+#include "iso8601_8.cc"
+}
+namespace v9 {
+#include "iso8601_9.cc"
+}
+namespace v10 {
+#include "iso8601_10.cc"
+}
+namespace v11 {
+#include "iso8601_11.cc"
+}
+namespace v12 {
+#include "iso8601_12.cc"
+}
+namespace v13 {
+#include "iso8601_13.cc"
+}
+namespace v14 {
+#include "iso8601_14.cc"
+}
+namespace v15 {
+#include "iso8601_15.cc"
+}
+namespace v16 {
+#include "iso8601_16.cc"
+}
+#undef main
+
+using namespace std;
+
+// Makes the compiler assume that |p| is read, so that it can't drop the work
+// that went into it.
+template <class T>
+void escape(T* p) {
+  asm volatile("" : : "g"(p) : "memory");
+}
+
+struct Variant {
+  const char* name;
+  bool (*parse)(string_view);
+};
+
+#define VARIANT(n)                                   \
+  Variant {                                          \
+    "iso8601_" #n, [](string_view s) {               \
+      auto date = v##n::parse_js_ios_date(s);        \
+      escape(&date);                                 \
+      return date.has_value();                       \
+    }                                                \
+  }
+
+const Variant kVariants[] = {
+    VARIANT(0),  VARIANT(1),  VARIANT(2),  VARIANT(3),  VARIANT(4),
+    VARIANT(5),  VARIANT(6),  VARIANT(7),  VARIANT(8),  VARIANT(9),
+    VARIANT(10), VARIANT(11), VARIANT(12), VARIANT(13), VARIANT(14),
+    VARIANT(15), VARIANT(16),
+};
+
+// Instruction and branch miss counts of this thread, as one perf event group
+// so that both cover the same stretch of time.
+class PerfCounters {
+ public:
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  PerfCounters() {
+    instructions_ = open_counter(PERF_COUNT_HW_INSTRUCTIONS, -1);
+    if (instructions_ >= 0)
+      branch_misses_ = open_counter(PERF_COUNT_HW_BRANCH_MISSES, instructions_);
+  }
+  ~PerfCounters() {
+    if (branch_misses_ >= 0)
+      close(branch_misses_);
+    if (instructions_ >= 0)
+      close(instructions_);
+  }
+
+  bool ok() const { return branch_misses_ >= 0; }
+
+  void start() {
+    ioctl(instructions_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(instructions_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  void stop(uint64_t* instructions, uint64_t* branch_misses) {
+    ioctl(instructions_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(instructions_, instructions, 8) != 8 ||
+        read(branch_misses_, branch_misses, 8) != 8)
+      *instructions = *branch_misses = 0;
+  }
+
+ private:
+  static int open_counter(uint64_t config, int group_fd) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+  }
+
+  int instructions_ = -1;
+  int branch_misses_ = -1;
+};
+
+// Dates stored back to back in one string.
+struct Corpus {
+  string name;
+  string text;
+  vector<string_view> dates;
+};
+
+// Shapes 0 to 8: YYYY, YYYY-MM, YYYY-MM-DD, ...THH:MM, ...:SS, ....sss,
+// ...Z, ...+HH:MM, and +YYYYYY-MM-DDTHH:MM:SS.sssZ.
+string random_date(mt19937* rng, int shape) {
+  auto r = [&](int lo, int hi) {
+    return uniform_int_distribution<int>(lo, hi)(*rng);
+  };
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03d",
+           r(1970, 2038), r(1, 12), r(1, 28), r(0, 23), r(0, 59), r(0, 59),
+           r(0, 999));
+  string s = buf;
+  const size_t kLengths[] = {4, 7, 10, 16, 19, 23};
+  if (shape < 6)
+    return s.substr(0, kLengths[shape]);
+  if (shape == 6)
+    return s + "Z";
+  if (shape == 7) {
+    snprintf(buf, sizeof(buf), "%c%02d:%02d", r(0, 1) ? '+' : '-', r(0, 14),
+             r(0, 59));
+    return s + buf;
+  }
+  snprintf(buf, sizeof(buf), "+%06d", r(0, 275760));
+  return buf + s.substr(4) + "Z";
+}
+
+// One byte replaced by a random printable one, or the string cut short.
+string corrupt(mt19937* rng, string s) {
+  size_t pos = uniform_int_distribution<size_t>(0, s.size() - 1)(*rng);
+  if (uniform_int_distribution<int>(0, 3)(*rng) == 0)
+    s.resize(pos);
+  else
+    s[pos] = uniform_int_distribution<int>(' ', '~')(*rng);
+  return s;
+}
+
+Corpus make_corpus(const string& name, size_t count) {
+  mt19937 rng(8601);
+  vector<string> dates;
+  for (size_t i = 0; i < count; ++i) {
+    int shape = uniform_int_distribution<int>(0, 8)(rng);
+    if (name == "full")
+      dates.push_back(random_date(&rng, 6));
+    else if (name == "logs")
+      dates.push_back(i % 100 ? random_date(&rng, 6)
+                    : i % 200 ? random_date(&rng, shape)
+                              : corrupt(&rng, random_date(&rng, shape)));
+    else if (name == "mixed")
+      dates.push_back(random_date(&rng, shape));
+    else
+      dates.push_back(corrupt(&rng, random_date(&rng, shape)));
+  }
+
+  Corpus corpus{name};
+  size_t size = 0;
+  for (const string& date : dates)
+    size += date.size();
+  corpus.text.reserve(size);
+  for (const string& date : dates) {
+    corpus.dates.emplace_back(corpus.text.data() + corpus.text.size(),
+                              date.size());
+    corpus.text += date;
+  }
+  return corpus;
+}
+
+int main(int argc, char* argv[]) {
+  size_t count = 1000000;
+  int repetitions = 5;
+  for (; argc > 2 && argv[1][0] == '-'; argv += 2, argc -= 2) {
+    if (strcmp(argv[1], "-n") == 0) {
+      count = max(1, atoi(argv[2]));
+    } else if (strcmp(argv[1], "-r") == 0) {
+      repetitions = max(1, atoi(argv[2]));
+    } else {
+      break;
+    }
+  }
+  if (argc > 1 && argv[1][0] == '-') {
+    fprintf(stderr, "usage: iso8601_bench [-n dates] [-r repetitions] "
+                    "[full|logs|mixed|invalid...]\n");
+    return 1;
+  }
+  vector<string> names(argv + 1, argv + argc);
+  if (names.empty())
+    names = {"full", "logs", "mixed", "invalid"};
+
+  PerfCounters counters;
+  if (!counters.ok())
+    printf("perf_event_open() failed, no instruction or branch miss counts "
+           "(see /proc/sys/kernel/perf_event_paranoid)\n");
+
+  for (const string& name : names) {
+    Corpus corpus = make_corpus(name, count);
+    printf("\n%s: %zu dates, %.1f bytes each on average\n", name.c_str(),
+           corpus.dates.size(), double(corpus.text.size()) / count);
+    printf("%-12s %10s %14s %16s %10s\n", "variant", "ns/parse",
+           "instructions", "branch misses", "accepted");
+
+    for (const Variant& variant : kVariants) {
+      // The fastest of |repetitions| runs, and counters over all of them.
+      double best_ns = 1e300;
+      uint64_t instructions = 0, branch_misses = 0;
+      size_t accepted = 0;
+      for (int rep = 0; rep < repetitions; ++rep) {
+        accepted = 0;
+        if (counters.ok())
+          counters.start();
+        auto start_time = chrono::steady_clock::now();
+        for (string_view date : corpus.dates)
+          accepted += variant.parse(date);
+        auto end_time = chrono::steady_clock::now();
+        if (counters.ok()) {
+          uint64_t i, b;
+          counters.stop(&i, &b);
+          instructions += i;
+          branch_misses += b;
+        }
+        best_ns = min(best_ns, chrono::duration<double, nano>(
+                                   end_time - start_time).count());
+      }
+
+      double parses = double(repetitions) * count;
+      printf("%-12s %10.1f", variant.name, best_ns / count);
+      if (counters.ok())
+        printf(" %14.1f %16.3f", instructions / parses,
+               branch_misses / parses);
+      else
+        printf(" %14s %16s", "-", "-");
+      printf(" %10zu\n", accepted);
+    }
+  }
+}
@@ -0,0 +1,359 @@
+// c++ -std=c++17 -O2 iso8601_bulk.cc -o iso8601_bulk -pthread
+
+// Bulk parsing of newline-separated dates with the parsers in iso8601_16.cc
+// and iso8601_epoch.cc.
+//
+// parse_dates() splits a buffer, typically an mmap()ed file, into chunks that
+// end at line boundaries, and parses the chunks on a pool of threads into
+// struct-of-arrays DateColumns: epoch milliseconds and a validity bit per
+// line, and optionally the parsed fields.
+//
+//   iso8601_bulk                             runs self-checks
+//   iso8601_bulk -generate count file        writes count random dates
+//   iso8601_bulk [-j threads] [-fields] file parses file with 1, 2, 4, ...
+//                                            threads (or only with -j) and
+//                                            prints GB/s and lines/s
+#define ISO8601_EPOCH_NO_MAIN
+#include "iso8601_epoch.cc"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+struct DateColumns {
+  size_t size = 0;  // Number of lines.
+
+  vector<int64_t> epoch_ms;  // 0 for lines that didn't parse.
+  vector<uint64_t> valid;    // Bit i % 64 of valid[i / 64] is line i's.
+
+  // The JsIsoDate fields, -1 if unset.  Only filled if parse_dates() is
+  // asked for them.
+  struct Fields {
+    vector<int32_t> year;
+    vector<int8_t> month, day, hours, minutes, seconds;
+    vector<int16_t> milliseconds;
+    vector<char> timezone;
+    vector<int8_t> timezone_hours, timezone_minutes;
+  } fields;
+  bool has_fields = false;
+
+  bool is_valid(size_t i) const { return valid[i / 64] >> (i % 64) & 1; }
+
+  JsIsoDate date(size_t i) const {
+    const Fields& f = fields;
+    return JsIsoDate{f.year[i], f.month[i], f.day[i], f.hours[i],
+                     f.minutes[i], f.seconds[i], f.milliseconds[i],
+                     f.timezone[i], f.timezone_hours[i],
+                     f.timezone_minutes[i]};
+  }
+};
+
+// Calls f(i) for i in [0, count) on |num_threads| threads, which take the
+// next i as they become free.
+template <class F>
+void parallel_for(size_t count, int num_threads, F f) {
+  atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < count;)
+      f(i);
+  };
+  vector<thread> threads;
+  for (int i = 1; i < num_threads; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (thread& t : threads)
+    t.join();
+}
+
+// Parses every line of |buffer| on |num_threads| threads, or on one per core
+// if 0.  A final line without '\n' counts, an empty buffer has no lines.
+DateColumns parse_dates(string_view buffer, int num_threads, bool fields) {
+  if (num_threads <= 0)
+    num_threads = max(1u, thread::hardware_concurrency());
+
+  // A few chunks per thread, so that threads that finish early can help.
+  // Every chunk but the last ends after a '\n'.
+  size_t num_chunks = min<size_t>(buffer.size(), 8 * num_threads);
+  vector<size_t> starts = {0};
+  for (size_t i = 1; i < num_chunks; ++i) {
+    size_t pos = max(starts.back(), buffer.size() * i / num_chunks);
+    const void* nl = memchr(buffer.data() + pos, '\n', buffer.size() - pos);
+    if (!nl)
+      break;
+    size_t end = static_cast<const char*>(nl) - buffer.data() + 1;
+    if (end == buffer.size())
+      break;
+    if (end > starts.back())
+      starts.push_back(end);
+  }
+  if (!buffer.empty())
+    starts.push_back(buffer.size());
+  num_chunks = starts.size() - 1;
+
+  // First pass: lines per chunk, to know where each chunk's output goes.
+  vector<size_t> first_line(num_chunks + 1);
+  parallel_for(num_chunks, num_threads, [&](size_t c) {
+    const char* p = buffer.data() + starts[c];
+    const char* end = buffer.data() + starts[c + 1];
+    size_t lines = end[-1] != '\n';
+    while ((p = static_cast<const char*>(memchr(p, '\n', end - p)))) {
+      ++lines;
+      ++p;
+    }
+    first_line[c + 1] = lines;
+  });
+  for (size_t c = 0; c < num_chunks; ++c)
+    first_line[c + 1] += first_line[c];
+
+  DateColumns out;
+  out.size = first_line[num_chunks];
+  out.epoch_ms.resize(out.size);
+  out.valid.resize((out.size + 63) / 64);
+  out.has_fields = fields;
+  if (fields) {
+    DateColumns::Fields& f = out.fields;
+    f.year.resize(out.size);
+    f.month.resize(out.size);
+    f.day.resize(out.size);
+    f.hours.resize(out.size);
+    f.minutes.resize(out.size);
+    f.seconds.resize(out.size);
+    f.milliseconds.resize(out.size);
+    f.timezone.resize(out.size);
+    f.timezone_hours.resize(out.size);
+    f.timezone_minutes.resize(out.size);
+  }
+
+  // Second pass: parse.  Neighboring chunks can share a word of the validity
+  // bitmap, so bits are collected per word and or'ed in atomically.
+  parallel_for(num_chunks, num_threads, [&](size_t c) {
+    const char* p = buffer.data() + starts[c];
+    const char* end = buffer.data() + starts[c + 1];
+    size_t i = first_line[c];
+    uint64_t bits = 0;
+    auto flush = [&](size_t word) {
+      if (bits)
+        __atomic_fetch_or(&out.valid[word], bits, __ATOMIC_RELAXED);
+      bits = 0;
+    };
+    for (; p < end; ++i) {
+      const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+      const char* line_end = nl ? nl : end;
+      if (i % 64 == 0 && i != first_line[c])
+        flush(i / 64 - 1);
+      string_view line(p, line_end - p);
+      if (!fields) {
+        if (parse_epoch_ms(line, &out.epoch_ms[i]))
+          bits |= uint64_t(1) << (i % 64);
+        else
+          out.epoch_ms[i] = 0;
+      } else {
+        optional<JsIsoDate> date = parse_js_ios_date(line);
+        if (date) {
+          bits |= uint64_t(1) << (i % 64);
+          out.epoch_ms[i] = to_epoch_ms(*date);
+        }
+        JsIsoDate d = date ? *date : JsIsoDate{};
+        DateColumns::Fields& f = out.fields;
+        f.year[i] = d.year;
+        f.month[i] = d.month;
+        f.day[i] = d.day;
+        f.hours[i] = d.hours;
+        f.minutes[i] = d.minutes;
+        f.seconds[i] = d.seconds;
+        f.milliseconds[i] = d.milliseconds;
+        f.timezone[i] = d.timezone;
+        f.timezone_hours[i] = d.timezone_hours;
+        f.timezone_minutes[i] = d.timezone_minutes;
+      }
+      p = nl ? nl + 1 : end;
+    }
+    if (i != first_line[c])
+      flush((i - 1) / 64);
+  });
+  return out;
+}
+
+// A read-only mapping of a whole file.
+class MappedFile {
+ public:
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  explicit MappedFile(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      ok_ = true;
+      if (st.st_size > 0) {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+          ok_ = false;
+        } else {
+          data_ = static_cast<const char*>(p);
+          size_ = st.st_size;
+        }
+      }
+    }
+    close(fd);
+  }
+  ~MappedFile() {
+    if (data_)
+      munmap(const_cast<char*>(data_), size_);
+  }
+
+  bool ok() const { return ok_; }
+  string_view contents() const { return string_view(data_, size_); }
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  bool ok_ = false;
+};
+
+// Writes |count| random dates, almost all in the full-length UTC shape.
+bool generate(size_t count, const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f)
+    return false;
+  mt19937 rng(8601);
+  auto r = [&](int lo, int hi) {
+    return uniform_int_distribution<int>(lo, hi)(rng);
+  };
+  for (size_t i = 0; i < count; ++i) {
+    int shape = r(0, 199);
+    if (shape == 0)
+      fprintf(f, "%04d-%02d-%02d\n", r(1970, 2038), r(1, 12), r(1, 28));
+    else if (shape == 1)
+      fprintf(f, "%04d-%02d-%02dT%02d:%02d:%02d+%02d:%02d\n", r(1970, 2038),
+              r(1, 12), r(1, 28), r(0, 23), r(0, 59), r(0, 59), r(0, 14),
+              r(0, 59));
+    else
+      fprintf(f, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\n", r(1970, 2038),
+              r(1, 12), r(1, 28), r(0, 23), r(0, 59), r(0, 59), r(0, 999));
+  }
+  return fclose(f) == 0;
+}
+
+int self_check() {
+  if (to_epoch_ms(*parse_js_ios_date("1970-01-01T00:00:00.000Z")) != 0)
+    return 1;
+  if (to_epoch_ms(*parse_js_ios_date("2020-11-15T23:59:40.123Z")) != 1605484780123)
+    return 2;
+  if (to_epoch_ms(*parse_js_ios_date("2020-11-15T23:59:40.123+01:30")) != 1605484780123 - 5400000)
+    return 3;
+  if (to_epoch_ms(*parse_js_ios_date("2020-11-15T23:59:40.123-01:30")) != 1605484780123 + 5400000)
+    return 4;
+  if (to_epoch_ms(*parse_js_ios_date("2000-03")) != 951868800000)
+    return 5;
+  if (to_epoch_ms(*parse_js_ios_date("+275760-09-13T00:00:00.000Z")) != 8640000000000000)
+    return 6;
+  if (to_epoch_ms(*parse_js_ios_date("-000001-01-01T00:00:00.000Z")) != -62198755200000)
+    return 7;
+
+  DateColumns c = parse_dates("2020-11-15T23:59:40.123Z\nbogus\n2020\n\n1970-01-01T00:00:00.001Z", 4, true);
+  if (c.size != 5 || !c.is_valid(0) || c.is_valid(1) || !c.is_valid(2) ||
+      c.is_valid(3) || !c.is_valid(4) || c.epoch_ms[4] != 1 ||
+      c.date(2) != JsIsoDate{2020} || c.date(1) != JsIsoDate{})
+    return 8;
+  if (parse_dates("", 4, false).size != 0 || parse_dates("\n", 4, false).size != 1 ||
+      parse_dates("2020\n2021\n", 4, false).size != 2)
+    return 9;
+
+  // Every thread count gives the same columns as parsing line by line.
+  string buffer;
+  vector<string> lines;
+  for (int i = 0; i < 1000; ++i) {
+    char line[64];
+    const char* format = i % 3 ? "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ"
+                               : "%04d-%02d-%02dT%02d:%02d";
+    snprintf(line, sizeof(line), format, 1970 + i % 60, 1 + i % 12,
+             1 + i % 28, i % 24, i % 60, i % 61, i);
+    lines.push_back(i % 7 ? line : "x");
+    buffer += lines.back() + "\n";
+  }
+  for (int threads = 1; threads <= 9; ++threads) {
+    for (bool fields : {false, true}) {
+      DateColumns c = parse_dates(buffer, threads, fields);
+      if (c.size != lines.size())
+        return 10;
+      for (size_t i = 0; i < lines.size(); ++i) {
+        optional<JsIsoDate> d = parse_js_ios_date(lines[i]);
+        if (c.is_valid(i) != bool(d) ||
+            c.epoch_ms[i] != (d ? to_epoch_ms(*d) : 0) ||
+            (fields && c.date(i) != (d ? *d : JsIsoDate{})))
+          return 11;
+      }
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc == 1) {
+    int failure = self_check();
+    if (failure)
+      fprintf(stderr, "self-check %d failed\n", failure);
+    return failure;
+  }
+
+  if (argc == 4 && strcmp(argv[1], "-generate") == 0) {
+    if (!generate(strtoull(argv[2], nullptr, 10), argv[3])) {
+      fprintf(stderr, "could not write %s\n", argv[3]);
+      return 1;
+    }
+    return 0;
+  }
+
+  int num_threads = 0;
+  bool fields = false;
+  for (; argc > 2 && argv[1][0] == '-'; ++argv, --argc) {
+    if (strcmp(argv[1], "-fields") == 0) {
+      fields = true;
+    } else if (strcmp(argv[1], "-j") == 0 && argc > 3) {
+      num_threads = atoi(argv[2]);
+      ++argv;
+      --argc;
+    } else {
+      break;
+    }
+  }
+  if (argc != 2) {
+    fprintf(stderr, "usage: iso8601_bulk [-j threads] [-fields] file\n"
+                    "       iso8601_bulk -generate count file\n");
+    return 1;
+  }
+
+  MappedFile file(argv[1]);
+  if (!file.ok()) {
+    fprintf(stderr, "could not map %s\n", argv[1]);
+    return 1;
+  }
+  string_view buffer = file.contents();
+
+  // Fault the file in once, so that the first run doesn't pay for it.
+  parse_dates(buffer, num_threads, fields);
+
+  int max_threads = max(4u, thread::hardware_concurrency());
+  for (int threads = num_threads ? num_threads : 1;
+       threads <= (num_threads ? num_threads : max_threads); threads *= 2) {
+    auto start_time = chrono::steady_clock::now();
+    DateColumns c = parse_dates(buffer, threads, fields);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() -
+                                              start_time).count();
+    size_t valid = 0;
+    for (uint64_t word : c.valid)
+      valid += __builtin_popcountll(word);
+    printf("%d threads: %.2f GB/s, %.1fM lines/s (%zu of %zu lines valid)\n",
+           threads, buffer.size() / seconds / 1e9, c.size / seconds / 1e6,
+           valid, c.size);
+  }
+}
@@ -0,0 +1,305 @@
+// c++ -std=c++17 -O2 iso8601_epoch.cc -o iso8601_epoch && ./iso8601_epoch
+
+// Dates as milliseconds since 1970-01-01T00:00:00Z, for the parser in
+// iso8601_16.cc.
+//
+// to_epoch_ms() converts a parsed JsIsoDate.  parse_epoch_ms() goes straight
+// from text to milliseconds; for the full-length shapes it gets the fields
+// from the SWAR fast path and applies the offset in the same pass.
+// format_epoch_ms() is the reverse, and writes YYYY-MM-DDTHH:MM:SS.sssZ.
+//
+// Without arguments, runs self-checks.  With -bench, also times parsing,
+// formatting and round trips against the obvious versions.
+#define ISO8601_NO_MAIN
+#include "iso8601_16.cc"
+
+#include <stdio.h>
+#include <time.h>
+#include <chrono>
+#include <vector>
+
+// Days from 1970-01-01 to y-m-d in the proleptic Gregorian calendar, from
+// http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+// Days past the end of the month roll over into the next month.
+int64_t days_from_civil(int64_t y, int64_t m, int64_t d) {
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  int64_t yoe = y - era * 400;
+  int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// Same for years 0 to 9999.  Shifting those by 400 years keeps the year
+// positive, so the era is a plain division and there are no branches left.
+inline int64_t days_from_civil_0_9999(int y, int m, int d) {
+  y += 400 - (m <= 2);
+  int era = y / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return int64_t(era - 1) * 146097 + doe - 719468;
+}
+
+// Milliseconds since 1970-01-01T00:00:00Z.  Unset fields default like in
+// Date.parse(): month and day to 1, everything else to 0.  Dates without a
+// timezone are taken as UTC, where Date.parse() uses local time for the ones
+// with a time.
+int64_t to_epoch_ms(const JsIsoDate& d) {
+  int64_t days = days_from_civil(d.year, d.month == -1 ? 1 : d.month,
+                                 d.day == -1 ? 1 : d.day);
+  int64_t minutes = days * 24 * 60;
+  if (d.hours != -1)
+    minutes += d.hours * 60 + d.minutes;
+  if (d.timezone == '+')
+    minutes -= d.timezone_hours * 60 + d.timezone_minutes;
+  else if (d.timezone == '-')
+    minutes += d.timezone_hours * 60 + d.timezone_minutes;
+  int64_t ms = minutes * 60 * 1000;
+  if (d.seconds != -1)
+    ms += d.seconds * 1000;
+  if (d.milliseconds != -1)
+    ms += d.milliseconds;
+  return ms;
+}
+
+// Full-length fields plus an offset in minutes to subtract.
+inline int64_t full_date_ms(const JsIsoDate& d, int offset_minutes) {
+  int64_t days = days_from_civil_0_9999(d.year, d.month, d.day);
+  int64_t minutes = days * 1440 + d.hours * 60 + d.minutes - offset_minutes;
+  return minutes * 60000 + d.seconds * 1000 + d.milliseconds;
+}
+
+// Parses |s| like parse_js_ios_date() and stores the result of to_epoch_ms()
+// in |out|.  YYYY-MM-DDTHH:MM:SS.sssZ and YYYY-MM-DDTHH:MM:SS.sss+HH:MM
+// (or -HH:MM) never build a JsIsoDate in memory; other shapes go through the
+// recursive-descent parser.
+bool parse_epoch_ms(string_view s, int64_t* out) {
+  if (optional<JsIsoDate> d = parse_full_date_fast(s)) {
+    *out = full_date_ms(*d, 0);
+    return true;
+  }
+  if (s.size() == 29 && (s[23] == '+' || s[23] == '-') && s[26] == ':') {
+    // Put a 'Z' in place of the offset for the fast path.
+    char utc[24];
+    memcpy(utc, s.data(), 23);
+    utc[23] = 'Z';
+    auto digit = [&](int i) { return unsigned(s[i] - '0'); };
+    unsigned h = digit(24) * 10 + digit(25), m = digit(27) * 10 + digit(28);
+    optional<JsIsoDate> d = parse_full_date_fast(string_view(utc, 24));
+    if (d && digit(24) < 10 && digit(25) < 10 && digit(27) < 10 &&
+        digit(28) < 10 && h <= 24 && m <= 59) {
+      int offset = h * 60 + m;
+      *out = full_date_ms(*d, s[23] == '+' ? offset : -offset);
+      return true;
+    }
+  }
+  optional<JsIsoDate> d = parse_js_ios_date_slow(s);
+  if (!d)
+    return false;
+  *out = to_epoch_ms(*d);
+  return true;
+}
+
+const char kTwoDigits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// -62167219200000 is 0000-01-01T00:00:00.000Z, 253402300800000 is
+// 10000-01-01T00:00:00.000Z.
+const int64_t kMinFormattable = -62167219200000;
+const int64_t kMaxFormattable = 253402300800000 - 1;
+
+// Writes |ms| as YYYY-MM-DDTHH:MM:SS.sssZ to the 24 bytes at |out|.  Returns
+// false for years outside 0 to 9999, which would need +YYYYYY.
+bool format_epoch_ms(int64_t ms, char* out) {
+  if (ms < kMinFormattable || ms > kMaxFormattable)
+    return false;
+
+  // civil_from_days() from the page above, but counting days from
+  // -0400-03-01 instead of 0000-03-01, so that everything stays positive.
+  // -0400 is a leap year, so its March 1st is 60 days in.
+  uint64_t u = ms - kMinFormattable + 146097 * uint64_t(86400000);
+  uint32_t z = u / 86400000 - 60, ms_of_day = u % 86400000;
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  uint32_t d = doy - (153 * mp + 2) / 5 + 1;
+  uint32_t m = mp < 10 ? mp + 3 : mp - 9;
+  uint32_t y = yoe + era * 400 - 400 + (m <= 2);
+
+  uint32_t seconds = ms_of_day / 1000, millis = ms_of_day % 1000;
+  auto two = [&](int pos, uint32_t v) {
+    memcpy(out + pos, kTwoDigits + 2 * v, 2);
+  };
+  two(0, y / 100);
+  two(2, y % 100);
+  out[4] = '-';
+  two(5, m);
+  out[7] = '-';
+  two(8, d);
+  out[10] = 'T';
+  two(11, seconds / 3600);
+  out[13] = ':';
+  two(14, seconds / 60 % 60);
+  out[16] = ':';
+  two(17, seconds % 60);
+  out[19] = '.';
+  out[20] = '0' + millis / 100;
+  two(21, millis % 100);
+  out[23] = 'Z';
+  return true;
+}
+
+#ifndef ISO8601_EPOCH_NO_MAIN
+// The obvious formatter, for checking and timing against.
+string format_gmtime(int64_t ms) {
+  int64_t millis = (ms % 1000 + 1000) % 1000;
+  time_t t = (ms - millis) / 1000;
+  tm tm;
+  gmtime_r(&t, &tm);
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+           tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+           tm.tm_min, tm.tm_sec, int(millis));
+  return buf;
+}
+
+template <class F>
+double ns_per_call(size_t count, F f) {
+  auto start_time = chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i)
+    f(i);
+  return chrono::duration<double, nano>(chrono::steady_clock::now() -
+                                        start_time).count() / count;
+}
+
+// The benchmarks add their results into this, so that their work can't be
+// optimized away.
+volatile int64_t g_sink;
+
+int main(int argc, char* argv[]) {
+  auto check_parse = [](string_view s, int code) {
+    optional<JsIsoDate> d = parse_js_ios_date(s);
+    int64_t ms = 0;
+    if (parse_epoch_ms(s, &ms) != bool(d) || (d && ms != to_epoch_ms(*d)))
+      exit(code);
+  };
+
+  int64_t ms;
+  if (!parse_epoch_ms("1970-01-01T00:00:00.000Z", &ms) || ms != 0)
+    exit(1);
+  if (!parse_epoch_ms("2020-11-15T23:59:40.123Z", &ms) || ms != 1605484780123)
+    exit(2);
+  if (!parse_epoch_ms("2020-11-15T23:59:40.123+01:30", &ms) || ms != 1605484780123 - 5400000)
+    exit(3);
+  if (!parse_epoch_ms("2020-11-15T23:59:40.123-01:30", &ms) || ms != 1605484780123 + 5400000)
+    exit(4);
+  if (!parse_epoch_ms("2000-03", &ms) || ms != 951868800000)
+    exit(5);
+  if (!parse_epoch_ms("+275760-09-13T00:00:00.000Z", &ms) || ms != 8640000000000000)
+    exit(6);
+  if (!parse_epoch_ms("-000001-01-01T00:00:00.000Z", &ms) || ms != -62198755200000)
+    exit(7);
+  if (parse_epoch_ms("2020-11-15T23:59:40.123+1:30", &ms) ||
+      parse_epoch_ms("2020-11-15T23:59:40.123+01:60", &ms) ||
+      parse_epoch_ms("2020-11-15T23:59:40.123*01:30", &ms))
+    exit(8);
+
+  // The same answers as parse_js_ios_date() and to_epoch_ms(), for every
+  // byte value at every position of both full-length shapes, and for
+  // random dates from year 0 to 9999 with random offsets.
+  for (const char* base : {"2020-11-15T23:59:40.123Z",
+                           "2020-11-15T23:59:40.123+14:15",
+                           "0000-01-01T00:00:00.000-00:01"}) {
+    for (size_t i = 0; i < strlen(base); ++i) {
+      for (int c = 0; c < 256; ++c) {
+        string s = base;
+        s[i] = c;
+        check_parse(s, 9);
+      }
+    }
+  }
+  mt19937 rng(8601);
+  auto r = [&](int lo, int hi) {
+    return uniform_int_distribution<int>(lo, hi)(rng);
+  };
+  for (int i = 0; i < 1000000; ++i) {
+    char s[64];
+    snprintf(s, sizeof(s), "%04d-%02d-%02dT%02d:%02d:%02d.%03d%c%02d:%02d",
+             r(0, 9999), r(0, 13), r(0, 32), r(0, 25), r(0, 60), r(0, 60),
+             r(0, 999), "+-Z"[r(0, 2)], r(0, 25), r(0, 60));
+    if (s[23] == 'Z')
+      s[24] = '\0';
+    check_parse(s, 10);
+  }
+
+  // format_epoch_ms() agrees with gmtime(), and parses back to the same
+  // value.
+  char out[24];
+  if (format_epoch_ms(kMinFormattable - 1, out) ||
+      format_epoch_ms(kMaxFormattable + 1, out))
+    exit(11);
+  vector<int64_t> samples = {kMinFormattable, kMaxFormattable, 0, -1, 1,
+                             951782400000, 951868799999, -62135596800001};
+  for (int i = 0; i < 1000000; ++i)
+    samples.push_back(uniform_int_distribution<int64_t>(kMinFormattable,
+                                                        kMaxFormattable)(rng));
+  for (int64_t ms : samples) {
+    if (!format_epoch_ms(ms, out) || string(out, 24) != format_gmtime(ms))
+      exit(12);
+    int64_t back;
+    if (!parse_epoch_ms(string_view(out, 24), &back) || back != ms)
+      exit(13);
+  }
+
+  if (argc < 2 || strcmp(argv[1], "-bench") != 0)
+    return 0;
+
+  // Mostly full-length UTC dates, like real logs.
+  const size_t kCount = 2000000;
+  vector<string> dates;
+  vector<int64_t> values(kCount);
+  for (size_t i = 0; i < kCount; ++i) {
+    values[i] = uniform_int_distribution<int64_t>(0, 2147483647000)(rng);
+    format_epoch_ms(values[i], out);
+    dates.emplace_back(out, 24);
+    if (i % 100 == 0)
+      dates.back().replace(23, 1, "+05:30");
+  }
+  int64_t sum = 0;
+  printf("parse_js_ios_date + to_epoch_ms: %.1f ns\n",
+         ns_per_call(kCount, [&](size_t i) {
+           sum += to_epoch_ms(*parse_js_ios_date(dates[i]));
+         }));
+  printf("parse_epoch_ms:                  %.1f ns\n",
+         ns_per_call(kCount, [&](size_t i) {
+           int64_t ms;
+           parse_epoch_ms(dates[i], &ms);
+           sum += ms;
+         }));
+  printf("gmtime + snprintf:               %.1f ns\n",
+         ns_per_call(kCount, [&](size_t i) {
+           sum += format_gmtime(values[i])[9];
+         }));
+  printf("format_epoch_ms:                 %.1f ns\n",
+         ns_per_call(kCount, [&](size_t i) {
+           format_epoch_ms(values[i], out);
+           sum += out[9];
+         }));
+  printf("round trip:                      %.1f ns\n",
+         ns_per_call(kCount, [&](size_t i) {
+           int64_t ms;
+           parse_epoch_ms(dates[i], &ms);
+           format_epoch_ms(ms, out);
+           sum += out[9];
+         }));
+  g_sink = sum;
+  return 0;
+}
+#endif
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+r"""Generates large synthetic .rc inputs and times rc on them.
+
+Writes one file per benchmark to the -o directory, with one timing per line,
+for https://github.com/nico/ministat (like ../bench.py):
+
+    bench_rc.py -o before
+    # ...rebuild rc with some change...
+    bench_rc.py -o after
+    for f in before/*.txt; do ministat $f after/$(basename $f); done
+
+--timing runs each input once with /timing instead, to show where rc spends
+its time.
+"""
+
+import argparse, os, shutil, subprocess, sys, tempfile, time
+
+
+def stringtable(f, scale):
+  # String IDs are 16 bits, so spread large tables over several languages.
+  n = 100000 * scale
+  per_language = 50000
+  for i in range(n):
+    if i % per_language == 0:
+      if i:
+        f.write('END\n')
+      f.write('LANGUAGE %d, 1\nSTRINGTABLE\nBEGIN\n' % (9 + i // per_language))
+    f.write('  %d "String number %d, with some text"\n' % (i % per_language, i))
+  f.write('END\n')
+
+
+def dialog(f, scale):
+  # Control counts are 16 bits, so use several dialogs.
+  for d in range(scale):
+    f.write('%d DIALOGEX 0, 0, 600, 400\n' % (d + 1))
+    f.write('STYLE 0x80c80000\nCAPTION "Dialog %d"\nBEGIN\n' % d)
+    for i in range(5000):
+      x, y = 10 * (i % 50), 12 * (i // 50)
+      kind = i % 4
+      if kind == 0:
+        f.write('  LTEXT "Label %d", %d, %d, %d, 40, 10\n' % (i, i, x, y))
+      elif kind == 1:
+        f.write('  EDITTEXT %d, %d, %d, 40, 10\n' % (i, x, y))
+      elif kind == 2:
+        f.write('  PUSHBUTTON "Button %d", %d, %d, %d, 40, 10\n' % (i, i, x, y))
+      else:
+        f.write('  CONTROL "c%d", %d, "STATIC", 0, %d, %d, 40, 10\n' %
+                (i, i, x, y))
+    f.write('END\n')
+
+
+def menu(f, scale):
+  # rc doesn't support MENUEX yet, so this uses deeply nested MENU popups.
+  for m in range(20 * scale):
+    f.write('%d MENU\nBEGIN\n' % (m + 1))
+    depth = 100
+    for d in range(depth):
+      f.write('  ' * (d + 1) + 'POPUP "Level %d"\n' % d)
+      f.write('  ' * (d + 1) + 'BEGIN\n')
+      for i in range(5):
+        f.write('  ' * (d + 2) + 'MENUITEM "Item %d.%d", %d\n' %
+                (d, i, 100 * d + i))
+    for d in reversed(range(depth)):
+      f.write('  ' * (d + 1) + 'END\n')
+    f.write('END\n')
+
+
+def versioninfo(f, scale):
+  # Nesting is limited by the 16-bit length fields, so use many resources.
+  for v in range(50 * scale):
+    f.write('%d VERSIONINFO\nFILEVERSION 1,2,3,4\nBEGIN\n' % (v + 1))
+    depth = 40
+    for d in range(depth):
+      f.write('  ' * (d + 1) + 'BLOCK "block%d"\n' % d)
+      f.write('  ' * (d + 1) + 'BEGIN\n')
+      f.write('  ' * (d + 2) + 'VALUE "Key%d", "Value %d"\n' % (d, d))
+    for d in reversed(range(depth)):
+      f.write('  ' * (d + 1) + 'END\n')
+    f.write('END\n')
+
+
+def rcdata(f, scale):
+  for r in range(10 * scale):
+    f.write('%d RCDATA\nBEGIN\n' % (r + 1))
+    for i in range(2000):
+      f.write('  %d, %dL, "data %d",\n' % (i, i, i))
+    f.write('  0\nEND\n')
+
+
+BENCHMARKS = [stringtable, dialog, menu, versioninfo, rcdata]
+
+
+parser = argparse.ArgumentParser(
+             epilog=__doc__,
+             formatter_class=argparse.RawDescriptionHelpFormatter)
+parser.add_argument('-n', help='number of repetitions', default=5, type=int)
+parser.add_argument('--output', '-o', help='write timings to this directory')
+parser.add_argument('--rc', help='rc binary to time',
+                    default=os.path.join(os.path.dirname(__file__),
+                                         'rc.exe' if sys.platform == 'win32'
+                                         else 'rc'))
+parser.add_argument('--scale', help='input size multiplier', default=1,
+                    type=int)
+parser.add_argument('--timing', action='store_true',
+                    help='run each input once with /timing')
+parser.add_argument('benchmarks', nargs='*', help='benchmarks to run (default '
+                    'all: %s, batch)' % ', '.join(b.__name__
+                                                  for b in BENCHMARKS))
+args = parser.parse_args()
+
+rc = os.path.abspath(args.rc)
+tmpdir = tempfile.mkdtemp()
+if args.output and not os.path.isdir(args.output):
+  os.makedirs(args.output)
+
+# Each benchmark is a list of rc arguments.
+runs = []
+for bench in BENCHMARKS:
+  if args.benchmarks and bench.__name__ not in args.benchmarks:
+    continue
+  path = os.path.join(tmpdir, bench.__name__ + '.rc')
+  with open(path, 'w') as f:
+    bench(f, args.scale)
+  runs.append((bench.__name__,
+               ['/fo' + os.path.join(tmpdir, 'out.res'), path]))
+
+# Many small files in one process.
+if not args.benchmarks or 'batch' in args.benchmarks:
+  with open(os.path.join(tmpdir, 'jobs.txt'), 'w') as jobs:
+    for i in range(1000 * args.scale):
+      path = os.path.join(tmpdir, 'batch%d.rc' % i)
+      with open(path, 'w') as f:
+        f.write('STRINGTABLE\nBEGIN\n  1 "hello %d"\nEND\n' % i)
+        f.write('1 VERSIONINFO\nBEGIN\n  BLOCK "StringFileInfo"\n  BEGIN\n'
+                '    VALUE "FileVersion", "%d"\n  END\nEND\n' % i)
+      jobs.write('"%s" "%s"\n' % (path, path[:-3] + '.res'))
+  runs.append(('batch', ['/batch:' + os.path.join(tmpdir, 'jobs.txt')]))
+
+for name, rc_args in runs:
+  if args.timing:
+    print(name)
+    subprocess.check_call([rc, '/timing'] + rc_args)
+    continue
+  subprocess.check_call([rc] + rc_args)  # Warmup
+  times = []
+  for _ in range(args.n):
+    t = time.time()
+    subprocess.check_call([rc] + rc_args)
+    times.append(time.time() - t)
+  print('%-12s min %.4fs  median %.4fs' %
+        (name, min(times), sorted(times)[len(times) // 2]))
+  if args.output:
+    with open(os.path.join(args.output, name + '.txt'), 'w') as out:
+      for t in times:
+        print(t, file=out)
+
+shutil.rmtree(tmpdir)
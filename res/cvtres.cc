@@ -1,18 +1,25 @@
 /*
-clang++ -std=c++11 -o cvtres cvtres.cc
+clang++ -std=c++11 -o cvtres cvtres.cc -pthread
 ./cvtres foo.res
+./cvtres /out:foo.obj foo.res bar.res
 
-A reimplemenation of cvtres.exe.  Currently always writes to rsrc.obj.
+A reimplemenation of cvtres.exe.  Writes to rsrc.obj by default.
+Input files are parsed concurrently, and the output is assembled in memory
+and written with writev().  Large resource data isn't staged in memory, it's
+copied straight from the inputs with copy_file_range() on Linux.
+The .obj writer is in rsrc_obj.h, shared with rc.cc's direct .obj output.
 See also resdump.c and resobjdump.c in this folder for programs that can dump
 .res files and the .rsrc section of .obj files.
 */
-#include <experimental/string_view>
-#include <map>
-#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -23,8 +30,13 @@ See also resdump.c and resobjdump.c in this folder for programs that can dump
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "rsrc_obj.h"
+
+using rsrc::ResEntry;
+
 static void fatal(const char* msg, ...) {
   va_list args;
   va_start(args, msg);
@@ -33,618 +45,251 @@ static void fatal(const char* msg, ...) {
   exit(1);
 }
 
-static uint32_t read_little_long(unsigned char** d) {
-  uint32_t r = ((*d)[3] << 24) | ((*d)[2] << 16) | ((*d)[1] << 8) | (*d)[0];
-  *d += sizeof(uint32_t);
-  return r;
-}
-
-static uint16_t read_little_short(unsigned char** d) {
-  uint16_t r = ((*d)[1] << 8) | (*d)[0];
-  *d += sizeof(uint16_t);
-  return r;
-}
-
-struct ResEntry {
-  uint32_t data_size;
-  uint32_t header_size;  // Always 0x20 plus storage for type_str and name_str
-                         // if type or name aren't numeric.
-
-  bool type_is_id;  // determines which of the following two is valid.
-  uint16_t type_id;
-  std::vector<char16_t> type_str;
-
-  bool name_is_id;  // determines which of the following two is valid.
-  uint16_t name_id;
-  std::vector<char16_t> name_str;
-
-  uint32_t data_version;
-  uint16_t memory_flags;
-  uint16_t language_id;
-  uint32_t version;
-  uint32_t characteristics;
-
-  uint8_t* data;  // weak
-};
-
-struct ResEntries {
+// An mmap()ed input .res file, and the entries in it.
+struct InputFile {
+  const char* name;
+  int fd = -1;
+  uint8_t* data = nullptr;
+  size_t size = 0;
   std::vector<ResEntry> entries;
+  std::string error;  // Set if loading failed.
 };
 
-static ResEntry load_resource_entry(uint8_t* data, uint32_t* n_read) {
-  ResEntry entry;
-  entry.data_size = read_little_long(&data);
-  entry.header_size = read_little_long(&data);
-
-  // https://msdn.microsoft.com/en-us/library/windows/desktop/ms648027(v=vs.85).aspx
+static void load_res_file(InputFile* file) {
+  file->fd = open(file->name, O_RDONLY);
+  if (file->fd < 0) {
+    file->error = std::string("Unable to read '") + file->name + "'";
+    return;
+  }
 
-  // if type, name start with 0xffff then they're numeric IDs. Else they're
-  // inline zero-terminated utf-16le strings. After name, there might be one
-  // word of padding to align data_version.
-  uint8_t* string_start = data;
-  uint16_t type = read_little_short(&data);
-  entry.type_is_id = type == 0xffff;
-  if (entry.type_is_id) {
-    entry.type_id = read_little_short(&data);
-  } else {
-    while (type != 0) {
-      entry.type_str.push_back(type);
-      type = read_little_short(&data);
-    }
+  struct stat in_stat;
+  if (fstat(file->fd, &in_stat)) {
+    file->error = std::string("Failed to stat '") + file->name + "'";
+    return;
   }
-  uint16_t name = read_little_short(&data);
-  entry.name_is_id = name == 0xffff;
-  if (entry.name_is_id) {
-    entry.name_id = read_little_short(&data);
-  } else {
-    while (name != 0) {
-      entry.name_str.push_back(name);
-      name = read_little_short(&data);
-    }
+  file->size = in_stat.st_size;
+  if (file->size == 0) {
+    file->error = std::string("expected not-16-bit marker as first entry");
+    return;
   }
-  // Pad to dword boundary:
-  if ((data - string_start) & 2)
-    data += 2;
-  // Check that bigger headers are explained by string types and names.
-  if (entry.header_size != 0x20 + (data - string_start - 8))
-    fatal("unexpected header size\n");  // XXX error code
-
-  entry.data_version = read_little_long(&data);
-  entry.memory_flags = read_little_short(&data);
-  entry.language_id = read_little_short(&data);
-  entry.version = read_little_long(&data);
-  entry.characteristics = read_little_long(&data);
-
-  entry.data = data;
-
-  uint32_t total_size = entry.data_size + entry.header_size;
-  *n_read = total_size + ((4 - (total_size & 3)) & 3);  // DWORD-align.
-  return entry;
-}
-
-typedef struct {
-  uint16_t Machine;
-  uint16_t NumberOfSections;
-  uint32_t TimeDateStamp;
-  uint32_t PointerToSymbolTable;
-  uint32_t NumberOfSymbols;
-  uint16_t SizeOfOptionalHeader;
-  uint16_t Characteristics;
-} FileHeader;
-
-#pragma pack(push, 1)
-typedef struct {
-  char Name[8];
-  uint32_t Value;
-  int16_t SectionNumber;  // 1-based index, or a special value (0, -1, -2)
-  uint16_t Type;
-  uint8_t StorageClass;
-  uint8_t NumberOfAuxSymbols;
-} StandardSymbolRecord;
-_Static_assert(sizeof(StandardSymbolRecord) == 18, "");
 
-typedef struct {
-  uint32_t Length;
-  int16_t NumberOfRelocations;
-  int16_t NumberOfLinenumbers;
-  uint32_t CheckSum;
-  int16_t Number;
-  uint8_t Selection;
-  uint8_t Pad0;
-  uint8_t Pad1;
-  uint8_t Pad2;
-} SectionAuxSymbolRecord;
-_Static_assert(sizeof(SectionAuxSymbolRecord) == 18, "");
-#pragma pack(pop)
-
-typedef struct {
-  char Name[8];
-  uint32_t VirtualSize;
-  uint32_t VirtualAddress;
-  uint32_t SizeOfRawData;
-  uint32_t PointerToRawData;
-  uint32_t PointerToRelocations;
-  uint32_t PointerToLineNumbers;
-  uint16_t NumberOfRelocations;
-  uint16_t NumberOfLinenumbers;
-  uint32_t Characteristics;
-} SectionHeader;
-
-#pragma pack(push, 1)
-typedef struct {
-  uint32_t VirtualAddress;
-  uint32_t SymbolTableInd;  // zero-based
-  uint16_t Type;
-} Relocation;
-_Static_assert(sizeof(Relocation) == 10, "");
-#pragma pack(pop)
-
-typedef struct {
-  uint32_t Characteristics;
-  uint32_t TimeDateStamp;
-  uint16_t MajorVersion;
-  uint16_t MinorVersion;
-  uint16_t NumberOfNameEntries;
-  uint16_t NumberOfIdEntries;
-} ResourceDirectoryHeader;  // 16 bytes
-
-typedef struct {
-  uint32_t TypeNameLang;  // Either string address or id.
-  // High bit 0: Address of a Resource Data Entry (a leaf).
-  // High bit 1: Address of a Resource Directory Table.
-  uint32_t DataRVA;
-} ResourceDirectoryEntry;  // 8 bytes
-
-typedef struct {
-  uint32_t DataRVA;
-  uint32_t Size;
-  uint32_t Codepage;
-  uint32_t Reserved;
-} ResourceDataEntry;
-
-struct NodeKey {
-  bool is_id;  // determines which of the following two is valid.
-  uint16_t id;
-  const std::vector<char16_t>* str;
-
-  bool operator<(const NodeKey& rhs) const {
-    if (is_id != rhs.is_id)
-      return is_id < rhs.is_id;  // Names come before ids.
-    // If we come here, *this and rhs are either both numeric or both strings.
-    if (is_id)
-      return id < rhs.id;
-    return *str < *rhs.str;
+  file->data = (uint8_t*)mmap(/*addr=*/0, file->size, PROT_READ, MAP_SHARED,
+                              file->fd, /*offset=*/0);
+  if (file->data == MAP_FAILED) {
+    file->data = nullptr;
+    file->error = std::string("Failed to mmap: ") + strerror(errno);
+    return;
   }
-};
-
-enum Arch { kArchx86, kArchx64 };
-static void write_rsrc_obj(const char* out_name,
-                           const ResEntries& entries,
-                           Arch arch) {
-  // Want:
-  // COFF headers
-  // .rsrc$01 section with tree metadata (type->name->lang)
-  //   - relocations for all ResourceDataEntries (ResourceDirectoryEntry leaves)
-  // .rsrc$02 section with actual resource data
-  // symbol table that relocations and section names refer to
-
-  // Two phases:
-  // 1. Compute all file layout information at first
-  // 2. Write output in one pass
-
-  // Phase 1: Compute layout.
 
-  // Build type->name->lang resource tree.
-  std::vector<uint16_t> string_table;
-  std::map<std::experimental::u16string_view, uint32_t> strings;
-
-  std::map<NodeKey, std::map<NodeKey, std::map<uint16_t, const ResEntry*>>>
-      directory;
-  for (const auto& entry : entries.entries) {
-    NodeKey type_key{entry.type_is_id, entry.type_id, &entry.type_str};
-    NodeKey name_key{entry.name_is_id, entry.name_id, &entry.name_str};
-
-    auto& lang_map = directory[type_key][name_key];
-    auto lang_it = lang_map.insert(std::make_pair(entry.language_id, &entry));
-    if (!lang_it.second)
-      fatal("duplicate element\n");
-
-    // Also write type and name to the string table.
-    if (!entry.type_is_id) {
-      std::experimental::u16string_view s(entry.type_str.data(),
-                                          entry.type_str.size());
-      auto it = strings.insert(std::make_pair(s, 0));
-      if (it.second) {
-        // String wasn't in |strings| yet.  Add it to the string table, and
-        // update |it| to contain the right value.
-        off_t index = string_table.size() * sizeof(uint16_t);
-        string_table.push_back(entry.type_str.size());
-        string_table.insert(string_table.end(), entry.type_str.begin(),
-                            entry.type_str.end());
-        it.first->second = index;
-      }
+  const uint8_t* data = file->data;
+  const uint8_t* end = data + file->size;
+  bool is_first = true;
+  while (data < end) {
+    uint32_t n_read;
+    ResEntry entry;
+    if (const char* err = rsrc::load_resource_entry(data, end, &entry, &n_read)) {
+      file->error = std::string(file->name) + ": " + err;
+      return;
     }
-    if (!entry.name_is_id) {
-      std::experimental::u16string_view s(entry.name_str.data(),
-                                          entry.name_str.size());
-      auto it = strings.insert(std::make_pair(s, 0));
-      if (it.second) {
-        // String wasn't in |strings| yet.  Add it to the string table, and
-        // update |it| to contain the right value.
-        off_t index = string_table.size() * sizeof(uint16_t);
-        string_table.push_back(entry.name_str.size());
-        string_table.insert(string_table.end(), entry.name_str.begin(),
-                            entry.name_str.end());
-        it.first->second = index;
+    if (is_first) {
+      // Ignore not-16-bit marker.
+      is_first = false;
+      if (!entry.type_is_id || entry.type_id != 0 || !entry.name_is_id ||
+          entry.name_id != 0) {
+        file->error = "expected not-16-bit marker as first entry";
+        return;
+      }
+    } else {
+      if (const char* err = rsrc::check_resource_entry(entry)) {
+        file->error = err;
+        return;
       }
+      entry.fd = file->fd;
+      entry.data_offset = entry.data - file->data;
+      file->entries.push_back(entry);
     }
+    data += n_read;
   }
+}
 
-  // Do tree layout pass.
-  // The COFF spec says that the layout is:
-  // - ResourceDirectoryHeaders each followed by its ResourceDirectoryEntries
-  // - Strings. Each string is (len, chars).
-  // - ResourceDataEntries (aligned)
-  // - Actual resource data.
-  //
-  // cvtres.exe however writes data in this order:
-  // - ResourceDirectoryHeaders each followed by its ResourceDirectoryEntries
-  // - ResourceDataEntries (aligned)
-  // - Strings. Each string is (len, chars).
-  // - Relocations.
-  // - Actual resource data.
-  //
-  // Match cvtres.exe's order.
-  // For the tables, cvtres.exe writes all type headers, then all name headers,
-  // then all lang headers (instead of depth-first).
-  std::vector<uint32_t> offsets;
-  uint32_t offset = sizeof(ResourceDirectoryHeader) +
-                    directory.size() * sizeof(ResourceDirectoryEntry);
-  for (auto& type : directory) {
-    offsets.push_back(offset);
-    offset += sizeof(ResourceDirectoryHeader) +
-              type.second.size() * sizeof(ResourceDirectoryEntry);
+// Collects the output in memory and writes it with writev().  Large resource
+// data isn't buffered; it's copied from the input files in the kernel with
+// copy_file_range() where available, and else written from the input
+// mappings.
+class OutputWriter {
+ public:
+  // Smaller external data is cheaper to copy than to give its own syscall.
+  static const size_t kMinExternalSize = 64 << 10;
+
+  // For rsrc::write_rsrc_obj().  Only the data in |entries| that isn't
+  // copied from the inputs needs buffer space.
+  explicit OutputWriter(const std::vector<ResEntry>& entries) {
+    for (const ResEntry& entry : entries)
+      if (entry.data_size >= kMinExternalSize)
+        external_size_ += entry.data_size;
   }
-  for (auto& type : directory) {
-    for (auto& name : type.second) {
-      offsets.push_back(offset);
-      offset += sizeof(ResourceDirectoryHeader) +
-                name.second.size() * sizeof(ResourceDirectoryEntry);
-    }
+  void Reserve(uint64_t total_size) {
+    buf_.reserve(total_size - external_size_);
   }
-  uint32_t resource_data_entry_start = offset;
-  uint32_t num_resources = entries.entries.size();
-  uint32_t string_table_start =
-      resource_data_entry_start + num_resources * sizeof(ResourceDataEntry);
-  uint32_t relocations_start =
-      string_table_start + string_table.size() * sizeof(uint16_t);
-  // Padding after string table:
-  if (string_table.size() & 1)
-    relocations_start += 2;
-  uint32_t rsrc01_data_size = relocations_start;
-  uint32_t rsrc01_total_size =
-      rsrc01_data_size + num_resources * sizeof(Relocation);
-
-  // Compute offsets of all resource data in .rsrc$02.
-  std::vector<uint32_t> res_offsets;
-  uint32_t res_offset = 0;
-  for (const auto& entry : entries.entries) {
-    res_offsets.push_back(res_offset);
-    res_offset += entry.data_size;
-    res_offset = res_offset + ((8 - (res_offset & 7)) & 7);  // 8-byte-align
+  void WriteResourceData(const ResEntry& entry) {
+    WriteExternal(entry.data, entry.data_size, entry.fd, entry.data_offset);
   }
-  uint32_t rsrc02_size = res_offset;
-
-  // Phase 2: Write output.
 
-  // XXX write to temp, atomic-rename at end
-  FILE* out_file = fopen(out_name, "wb");
+  // Logical size of the output so far, including external data.
+  size_t size() const { return size_; }
 
-  uint32_t coff_header_size = sizeof(FileHeader) + 2*sizeof(SectionHeader);
-
-  FileHeader coff_header = {};
-  coff_header.Machine = arch == kArchx64 ? 0x8664 : 0x14c;
-  coff_header.NumberOfSections = 2;  // .rsrc$01, .rsrc$02
-  coff_header.TimeDateStamp = 0;  // FIXME: need flag, for inc linking with link
-  coff_header.PointerToSymbolTable =
-      coff_header_size + rsrc01_total_size + rsrc02_size;
-  // Symbols for section names have 1 aux entry each:
-  coff_header.NumberOfSymbols = 2*2 + num_resources;
-  coff_header.SizeOfOptionalHeader = 0;
-  coff_header.Characteristics = 0x100;  // XXX
-  fwrite(&coff_header, sizeof(coff_header), 1, out_file);
-
-  SectionHeader rsrc01_header;
-  memcpy(rsrc01_header.Name, ".rsrc$01", 8);
-  rsrc01_header.VirtualSize = 0;
-  rsrc01_header.VirtualAddress = 0;
-  rsrc01_header.SizeOfRawData = rsrc01_data_size;
-  rsrc01_header.PointerToRawData = coff_header_size;
-  rsrc01_header.PointerToRelocations =
-      rsrc01_header.PointerToRawData + relocations_start;
-  rsrc01_header.PointerToLineNumbers = 0;
-  rsrc01_header.NumberOfRelocations = num_resources;
-  rsrc01_header.NumberOfLinenumbers = 0;
-  rsrc01_header.Characteristics = 0xc0000040;  // read + write + initialized
-  fwrite(&rsrc01_header, sizeof(rsrc01_header), 1, out_file);
-
-  SectionHeader rsrc02_header;
-  memcpy(rsrc02_header.Name, ".rsrc$02", 8);
-  rsrc02_header.VirtualSize = 0;
-  rsrc02_header.VirtualAddress = 0;
-  rsrc02_header.SizeOfRawData = rsrc02_size;
-  rsrc02_header.PointerToRawData = coff_header_size + rsrc01_total_size;
-  rsrc02_header.PointerToRelocations = 0;
-  rsrc02_header.PointerToLineNumbers = 0;
-  rsrc02_header.NumberOfRelocations = 0;
-  rsrc02_header.NumberOfLinenumbers = 0;
-  rsrc02_header.Characteristics = 0xc0000040;  // read + write + initialized
-  fwrite(&rsrc02_header, sizeof(rsrc02_header), 1, out_file);
-
-  // Write .rsrc$01 section.
-  assert(ftello(out_file) == rsrc01_header.PointerToRawData);
-
-  size_t num_types = directory.size();
-  size_t num_named_types = 0;
-  for (const auto& types : directory) {
-    if (types.first.is_id)
-      break;
-    ++num_named_types;
+  void Write(const void* data, size_t size) {
+    buf_.insert(buf_.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+    size_ += size;
   }
 
-  ResourceDirectoryHeader type_dir = {};
-  type_dir.NumberOfNameEntries = num_named_types;
-  type_dir.NumberOfIdEntries= num_types - num_named_types;
-  fwrite(&type_dir, sizeof(type_dir), 1, out_file);
-  unsigned next_offset_index = 0;
-  for (auto& type : directory) {
-    ResourceDirectoryEntry entry;
-    entry.DataRVA = offsets[next_offset_index++] | 0x80000000;
-    if (!type.first.is_id) {
-      std::experimental::u16string_view s(type.first.str->data(),
-                                          type.first.str->size());
-      auto it = strings.find(s);
-      if (it == strings.end())
-        fatal("type str should have been inserted above!\n");
-      entry.TypeNameLang = string_table_start + it->second;
-      // cvtres.exe sets high bit of TypeNameLang for strings. not needed per
-      // coff spec and redundant with having a NumberOfIdEntries field, but
-      // match cvtres.exe for consistency.
-      entry.TypeNameLang |= 0x80000000;
-    } else {
-      entry.TypeNameLang = type.first.id;
+  // |data| is at |offset| in |fd|.  Both must stay valid until WriteTo()
+  // is called.
+  void WriteExternal(const uint8_t* data, size_t size, int fd,
+                     uint64_t offset) {
+    if (size < kMinExternalSize) {
+      Write(data, size);
+      return;
     }
-    fwrite(&entry, sizeof(entry), 1, out_file);
+    externals_.push_back(External{buf_.size(), data, size, fd, offset});
+    size_ += size;
   }
 
-  for (auto& type : directory) {
-    size_t num_names = type.second.size();
-    size_t num_named_names = 0;
-    for (const auto& names : type.second) {
-      if (names.first.is_id)
-        break;
-      ++num_named_names;
-    }
+  bool WriteTo(const char* path) const;
+
+ private:
+  struct External {
+    size_t buffer_pos;  // External data goes before this buffer offset.
+    const uint8_t* data;
+    size_t size;
+    int fd;
+    uint64_t offset;
+  };
+
+  static bool WriteAll(int fd, std::vector<iovec>* iov);
+  static bool CopyExternal(int fd, const External& e);
+  std::vector<uint8_t> buf_;
+  std::vector<External> externals_;
+  size_t size_ = 0;
+  uint64_t external_size_ = 0;
+};
 
-    ResourceDirectoryHeader name_dir = {};
-    name_dir.NumberOfNameEntries = num_named_names;
-    name_dir.NumberOfIdEntries = num_names - num_named_names;
-    fwrite(&name_dir, sizeof(name_dir), 1, out_file);
-    for (auto& name : type.second) {
-      ResourceDirectoryEntry entry;
-      entry.DataRVA = offsets[next_offset_index++] | 0x80000000;
-      if (!name.first.is_id) {
-        std::experimental::u16string_view s(name.first.str->data(),
-                                            name.first.str->size());
-        auto it = strings.find(s);
-        if (it == strings.end())
-          fatal("name str should have been inserted above!\n");
-        entry.TypeNameLang = string_table_start + it->second;
-        // cvtres.exe sets high bit of TypeNameLang for strings. not needed per
-        // coff spec and redundant with having a NumberOfIdEntries field, but
-        // match cvtres.exe for consistency.
-        entry.TypeNameLang |= 0x80000000;
-      } else {
-        entry.TypeNameLang = name.first.id;
-      }
-      fwrite(&entry, sizeof(entry), 1, out_file);
+bool OutputWriter::WriteTo(const char* path) const {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return false;
+  // Buffered data between external data goes out with one writev() each.
+  bool ok = true;
+  std::vector<iovec> iov;
+  size_t pos = 0;
+  for (const External& e : externals_) {
+    if (e.buffer_pos > pos) {
+      iov.assign(1, iovec{(void*)(buf_.data() + pos), e.buffer_pos - pos});
+      ok = ok && WriteAll(fd, &iov);
     }
+    ok = ok && CopyExternal(fd, e);
+    pos = e.buffer_pos;
   }
-
-  unsigned int data_index = 0;
-  for (auto& type : directory) {
-    for (auto& name : type.second) {
-      ResourceDirectoryHeader lang_dir = {};
-      lang_dir.NumberOfNameEntries = 0;
-      lang_dir.NumberOfIdEntries = name.second.size();
-      fwrite(&lang_dir, sizeof(lang_dir), 1, out_file);
-      for (auto& lang : name.second) {
-        ResourceDirectoryEntry entry;
-        entry.DataRVA = offset + data_index++ * sizeof(ResourceDataEntry);
-        entry.TypeNameLang = lang.first;
-        fwrite(&entry, sizeof(entry), 1, out_file);
-      }
-    }
+  if (buf_.size() > pos) {
+    iov.assign(1, iovec{(void*)(buf_.data() + pos), buf_.size() - pos});
+    ok = ok && WriteAll(fd, &iov);
   }
+  if (close(fd) != 0)
+    ok = false;
+  return ok;
+}
 
-  // Write resource data entries (the COFF spec recommends to put these after
-  // the string table, but cvtres.exe puts them before it).
-  std::unordered_map<const ResEntry*, unsigned> ordered_entries;
-  int entry_index = 0;
-  for (auto& type : directory) {
-    for (auto& name : type.second) {
-      for (auto& lang : name.second) {
-        ResourceDataEntry data_entry;
-        data_entry.DataRVA = 0;  // Fixed up by a relocation.
-        data_entry.Size = lang.second->data_size;
-        data_entry.Codepage = 0;  // XXX
-        data_entry.Reserved = 0;
-        fwrite(&data_entry, sizeof(data_entry), 1, out_file);
-
-        ordered_entries[lang.second] = entry_index++;
-      }
+bool OutputWriter::WriteAll(int fd, std::vector<iovec>* iov) {
+  // Usually a single writev(), but it's allowed to write less than asked
+  // for, and it takes at most IOV_MAX buffers.
+  size_t i = 0;
+  while (i < iov->size()) {
+    int n = (int)std::min<size_t>(iov->size() - i, IOV_MAX);
+    ssize_t written = writev(fd, &(*iov)[i], n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    while (i < iov->size() && (size_t)written >= (*iov)[i].iov_len)
+      written -= (*iov)[i++].iov_len;
+    if (written) {
+      (*iov)[i].iov_base = (char*)(*iov)[i].iov_base + written;
+      (*iov)[i].iov_len -= written;
     }
   }
+  return true;
+}
 
-  // Write string table after resource directory. (with padding)
-  assert(ftello(out_file) == coff_header_size + string_table_start);
-  fwrite(string_table.data(), string_table.size(), sizeof(uint16_t), out_file);
-  if (string_table.size() & 1)
-    fwrite("pa", 1, 2, out_file);
-
-  // Write relocations.
-  assert(ftello(out_file) == coff_header_size + relocations_start);
-  for (unsigned i = 0; i < entries.entries.size(); ++i) {
-    Relocation reloc;
-    reloc.VirtualAddress =
-        resource_data_entry_start +
-        ordered_entries[&entries.entries[i]] * sizeof(ResourceDataEntry);
-    reloc.SymbolTableInd = 8 + i;
-    const int kIMAGE_REL_AMD64_ADDR32NB = 3;
-    const int kIMAGE_REL_I386_DIR32NB = 7;
-    reloc.Type =
-        arch == kArchx64 ? kIMAGE_REL_AMD64_ADDR32NB : kIMAGE_REL_I386_DIR32NB;
-    fwrite(&reloc, sizeof(reloc), 1, out_file);
-  }
-
-  // Write .rsrc$02 section.
-  assert(ftello(out_file) == rsrc02_header.PointerToRawData);
-
-  // Actual resource data.
-  for (const auto& entry : entries.entries) {
-    fwrite(entry.data, 1, entry.data_size, out_file);
-    fwrite("padding", ((8 - (entry.data_size & 7)) & 7), 1, out_file);
-  }
-
-  // Write symbol table, followed by string table size.
-  assert(ftello(out_file) == coff_header.PointerToSymbolTable);
-
-  const int kIMAGE_SYM_CLASS_STATIC = 3;
-  StandardSymbolRecord rsrc01_symbol;
-  memcpy(rsrc01_symbol.Name, ".rsrc$01", 8);
-  rsrc01_symbol.Value = 0;
-  rsrc01_symbol.SectionNumber = 1;
-  rsrc01_symbol.Type = 0;
-  rsrc01_symbol.StorageClass = kIMAGE_SYM_CLASS_STATIC;
-  rsrc01_symbol.NumberOfAuxSymbols = 1;
-  fwrite(&rsrc01_symbol, sizeof(rsrc01_symbol), 1, out_file);
-
-  SectionAuxSymbolRecord rsrc01_aux;
-  rsrc01_aux.Length = rsrc01_data_size;
-  rsrc01_aux.NumberOfRelocations = entries.entries.size();
-  rsrc01_aux.NumberOfLinenumbers = 0;
-  rsrc01_aux.CheckSum = 0;
-  rsrc01_aux.Number = 0;
-  rsrc01_aux.Selection = 0;
-  rsrc01_aux.Pad0 = 0;
-  rsrc01_aux.Pad1 = 0;
-  rsrc01_aux.Pad2 = 0;
-  fwrite(&rsrc01_aux, sizeof(rsrc01_aux), 1, out_file);
-
-  StandardSymbolRecord rsrc02_symbol;
-  memcpy(rsrc02_symbol.Name, ".rsrc$02", 8);
-  rsrc02_symbol.Value = 0;
-  rsrc02_symbol.SectionNumber = 2;
-  rsrc02_symbol.Type = 0;
-  rsrc02_symbol.StorageClass = kIMAGE_SYM_CLASS_STATIC;
-  rsrc02_symbol.NumberOfAuxSymbols = 1;
-  fwrite(&rsrc02_symbol, sizeof(rsrc02_symbol), 1, out_file);
-
-  SectionAuxSymbolRecord rsrc02_aux;
-  rsrc02_aux.Length = rsrc02_size;
-  rsrc02_aux.NumberOfRelocations = 0;
-  rsrc02_aux.NumberOfLinenumbers = 0;
-  rsrc02_aux.CheckSum = 0;
-  rsrc02_aux.Number = 0;
-  rsrc02_aux.Selection = 0;
-  rsrc02_aux.CheckSum = 0;
-  rsrc02_aux.Pad0 = 0;
-  rsrc02_aux.Pad1 = 0;
-  rsrc02_aux.Pad2 = 0;
-  fwrite(&rsrc02_aux, sizeof(rsrc02_aux), 1, out_file);
-
-  for (uint32_t res_offset : res_offsets) {
-    if (res_offset > 0xffffff)
-      fatal("cannot handle resources this large yet\n");
-
-    char buf[9];
-    snprintf(buf, 9, "$R%06X", res_offset);
-    StandardSymbolRecord res_symbol;
-    memcpy(res_symbol.Name, buf, 8);
-    res_symbol.Value = res_offset;
-    res_symbol.SectionNumber = 2;
-    res_symbol.Type = 0;
-    res_symbol.StorageClass = kIMAGE_SYM_CLASS_STATIC;
-    res_symbol.NumberOfAuxSymbols = 0;
-    fwrite(&res_symbol, sizeof(res_symbol), 1, out_file);
+bool OutputWriter::CopyExternal(int fd, const External& e) {
+  size_t done = 0;
+#if defined(__linux__)
+  loff_t in_offset = e.offset;
+  while (done < e.size) {
+    ssize_t n = copy_file_range(e.fd, &in_offset, fd, nullptr, e.size - done,
+                                0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;  // E.g. EXDEV on older kernels: write the rest from the mapping.
+    done += n;
   }
-
-  // The length of the string table immediately follows the symbol table.
-  // According to the coff spec, the size of the string table includes the size
-  // field itself, so an empty string table has size 4.  However, cvtres.exe
-  // writes 0 here, not 4, so match that.
-  fwrite("\0\0\0", 1, 4, out_file);
-
-  fclose(out_file);
+#endif
+  std::vector<iovec> iov(1, iovec{(void*)(e.data + done), e.size - done});
+  return done == e.size || WriteAll(fd, &iov);
 }
 
 int main(int argc, char* argv[]) {
-  if (argc < 2)
-    fatal("Expected args >= 2, got %d\n", argc);
-
-  // Read inputs.
-  std::vector<int> files;
-  std::vector<uint8_t*> file_data;
-  std::vector<size_t> file_size;
-  ResEntries entries;
+  const char* out_name = "rsrc.obj";
+  std::vector<InputFile> files;
   for (int i = 1; i < argc; ++i) {
-    const char* in_name = argv[i];
-
-    int in_file = open(in_name, O_RDONLY);
-    if (!in_file)
-      fatal("Unable to read \'%s\'\n", in_name);
-
-    struct stat in_stat;
-    if (fstat(in_file, &in_stat))
-      fatal("Failed to stat \'%s\'\n", in_name);
-
-    uint8_t* data = (uint8_t*)mmap(/*addr=*/0, in_stat.st_size, PROT_READ,
-                                   MAP_SHARED, in_file,
-                                   /*offset=*/0);
-    if (data == MAP_FAILED)
-      fatal("Failed to mmap: %d (%s)\n", errno, strerror(errno));
-
-    files.push_back(in_file);
-    file_data.push_back(data);
-    file_size.push_back(in_stat.st_size);
-
-    uint8_t* end = data + in_stat.st_size;
-
-    bool is_first = true;
-    while (data < end) {
-      uint32_t n_read;
-      ResEntry entry = load_resource_entry(data, &n_read);
-      if (is_first) {
-        // Ignore not-16-bit marker.
-        is_first = false;
-        if (!entry.type_is_id || entry.type_id != 0 || !entry.name_is_id ||
-            entry.name_id != 0)
-          fatal("expected not-16-bit marker as first entry\n");
-      } else {
-        if (entry.type_is_id && entry.type_id == 0)
-          fatal("0 type\n");
-        if (entry.name_is_id && entry.name_id == 0)
-          fatal("0 name\n");
-        entries.entries.push_back(std::move(entry));
-      }
-      data += n_read;
+    if (strncasecmp(argv[i], "/out:", 5) == 0) {
+      out_name = argv[i] + 5;
+      continue;
     }
+    files.emplace_back();
+    files.back().name = argv[i];
   }
-
-  write_rsrc_obj("rsrc.obj", entries, kArchx64);
-
-  for (int i = 0; i < files.size(); ++i) {
-    munmap(file_data[i], file_size[i]);
-    close(files[i]);
+  if (files.empty())
+    fatal("Expected at least one input file\n");
+
+  // Read inputs, on several threads if there are several inputs.
+  std::atomic<size_t> next_file(0);
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next_file++) < files.size())
+      load_res_file(&files[i]);
+  };
+  size_t num_threads = std::min<size_t>(
+      std::max(1u, std::thread::hardware_concurrency()), files.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread& thread : threads)
+    thread.join();
+
+  // Concatenate entries in command-line order.
+  std::vector<ResEntry> entries;
+  size_t num_entries = 0;
+  for (const InputFile& file : files) {
+    if (!file.error.empty())
+      fatal("%s\n", file.error.c_str());
+    num_entries += file.entries.size();
+  }
+  entries.reserve(num_entries);
+  for (const InputFile& file : files)
+    entries.insert(entries.end(), file.entries.begin(), file.entries.end());
+
+  OutputWriter out(entries);
+  std::string err;
+  if (!rsrc::write_rsrc_obj(entries, rsrc::kArchx64, &out, &err))
+    fatal("%s\n", err.c_str());
+  if (!out.WriteTo(out_name))
+    fatal("Failed to write '%s': %s\n", out_name, strerror(errno));
+
+  for (const InputFile& file : files) {
+    munmap(file.data, file.size);
+    close(file.fd);
   }
 }
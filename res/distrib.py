@@ -26,7 +26,7 @@ common = [
 # Linux.
 linux_sysroot = crsrc + '/build/linux/debian_sid_amd64-sysroot'
 subprocess.check_call(
-    common + ['-o', 'rc-linux64', '-fuse-ld=lld',
+    common + ['-o', 'rc-linux64', '-fuse-ld=lld', '-pthread',
      '-target', 'x86_64-unknown-linux-gnu',
      '--sysroot', linux_sysroot,
     ])
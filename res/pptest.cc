@@ -1,5 +1,7 @@
 /*
 prototype that does something like `cc -E`; to be used in rc
+(rc.cc now has its own small preprocessor; this is kept for comparing against
+clang's.)
 
 POSIX:
 
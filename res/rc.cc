@@ -1,20 +1,21 @@
 /*
-  clang++ -std=c++14 -o rc rc.cc -Wall -Wno-c++11-narrowing
+  clang++ -std=c++14 -o rc rc.cc -Wall -Wno-c++11-narrowing -pthread
 or
   cl rc.cc /EHsc /wd4838 /nologo shlwapi.lib
+./rc foo.rc
 ./rc < foo.rc
+./rc /batch:jobs.txt
+./rc /fofoo.obj foo.rc
 
 A sketch of a reimplemenation of rc.exe, for research purposes.
-Doesn't do any preprocessing for now.
+Has a small built-in preprocessor (see "Preprocessor" below); `/DFOO=1`
+defines a macro.
 
 For files that this successfully processes, the goal is that the output is
 bit-for-bit equal to what Microsoft rc.exe produces.  It's ok if this program
 rejects some inputs that Microsoft rc.exe accepts.
 
-Missing for chromium:
-- preprocessor (but see pptest next to this; `pptest file | rc` kinda works)
-
-Also missing, but not yet for chromium:
+Missing, but not yet for chromium:
 - #pragma code_page()
 - FONT
 - MENUEX (including int expression parse/eval)
@@ -28,10 +29,43 @@ Also missing, but not yet for chromium:
   RCDATA, or STRINGTABLE (and custom elts?)
 - MUI, https://msdn.microsoft.com/en-us/library/windows/desktop/ee264325(v=vs.85).aspx
 
+COFF output:
+If the output name ends in .obj, this writes a COFF object file with a .rsrc
+section instead of a .res file, byte-for-byte what running cvtres on the .res
+file would write, without writing and reading back the .res file.  The .obj
+writer is shared with cvtres.cc, see rsrc_obj.h.
+
+Batch mode:
+`/batch:jobs.txt` compiles many .rc files in a single process. Each line of
+jobs.txt names an input .rc file and an output .res file, separated by
+whitespace (paths containing spaces can be put in double quotes); with
+`/batch:-` the job list is read from stdin. Jobs run concurrently on `/jN`
+threads (default: one per core), and each job runs on a single thread. For a
+single file, `/jN` limits the threads used to convert large string tables.
+Files referenced by the .rc files (icons,
+bitmaps, manifests, ...) are read once per process and shared by all jobs.
+
+Build system integration:
+`/depfile:foo.d` writes a Makefile-style (and ninja-compatible) depfile listing
+the input and every header and resource file it read; plain `/depfile` writes
+it next to the output, which is also how it works with `/batch:`.
+`/cache:dir` is an opt-in on-disk cache of .res files, keyed by a hash of the
+preprocessed input and the flags. An unchanged .rc file is satisfied by a
+copy from the cache without parsing it (see "Cache" below).
+
+Performance:
+`/timing` prints wall time and heap allocations per phase and bytes written
+per resource type to stderr. bench_rc.py generates large synthetic inputs and
+times rc on them, with output for ministat.  rc_test.cc checks the output for
+all test inputs in one process, and can write and check a generated corpus of
+thousands of inputs for validating changes to the serializer.
+
 Unicode handling:
 MS rc.exe allows either UTF-16LE input (FIXME: test non-BMP files) or codepage'd
 inputs.  This program either accepts UTF-16 or UTF-8 input.  UTF-16 is converted
-to UTF-8 at the start.  If the input wasn't UTF-16, this program will error
+to UTF-8 at the start; other inputs are tokenized straight out of the mmap()ed
+input file.  Validation and conversion use SSE4/AVX2 if available, see utf.h.
+If the input wasn't UTF-16, this program will error
 out on bytes > 127 in string literals so that real codepage'd inputs are
 rejected rather than miscompiled.
 
@@ -48,15 +82,22 @@ extern char *gets (char *__s) __attribute__ ((__deprecated__));
 
 #include <algorithm>
 #include <assert.h>
-#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <limits>
 #include <list>
-#include <locale>
 #include <limits.h>
-#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -64,10 +105,6 @@ extern char *gets (char *__s) __attribute__ ((__deprecated__));
 #define GCC_VERSION (__GNUC__ * 10000 \
                      + __GNUC_MINOR__ * 100 \
                      + __GNUC_PATCHLEVEL__)
-#if !(defined(__linux__) && GCC_VERSION < 50100)
-// No codecvt before libstdc++5.1, need to roll our own utf8<->utf16 routines.
-#include <codecvt>
-#endif
 
 #if defined(_MSC_VER)
 #include <direct.h>
@@ -78,9 +115,16 @@ extern char *gets (char *__s) __attribute__ ((__deprecated__));
 #include <windows.h>  // GetFullPathName
 #include <shlwapi.h>  // PathIsRelative
 #else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
+#include "rsrc_obj.h"
+#include "utf.h"
+
 #if __cplusplus >= 201703L
 #include <optional>
 #else
@@ -203,328 +247,7 @@ bool hexchar(int c, int* nibble) {
   return false;
 }
 
-typedef uint8_t UTF8;
-#if !defined(_MSC_VER) && !(defined(__linux__) && GCC_VERSION < 50100)
-bool isLegalUTF8String(const UTF8 *source, const UTF8 *sourceEnd) {
-  // Validate that the input if valid utf-8.
-  std::mbstate_t mbstate;
-  return std::codecvt_utf8<char32_t>().length(
-      mbstate, (char*)source, (char*)sourceEnd,
-      std::numeric_limits<size_t>::max())
-      == sourceEnd - source;
-}
-#else
-// codecvt_utf8::length() is broken with MSVC, and doesn't exist for gcc
-// older than 5.1.. Use code from the Unicode consortium there. License
-// below applies to contents of this #else block only.
-/*
- * Copyright 2001-2004 Unicode, Inc.
- *
- * Disclaimer
- *
- * This source code is provided as is by Unicode, Inc. No claims are
- * made as to fitness for any particular purpose. No warranties of any
- * kind are expressed or implied. The recipient agrees to determine
- * applicability of information provided. If this file has been
- * purchased on magnetic or optical media from Unicode, Inc., the
- * sole remedy for any claim will be exchange of defective media
- * within 90 days of receipt.
- *
- * Limitations on Rights to Redistribute This Code
- *
- * Unicode, Inc. hereby grants the right to freely use the information
- * supplied in this file in the creation of products supporting the
- * Unicode Standard, and to make copies of this file in any form
- * for internal or external distribution as long as this notice
- * remains attached.
- */
-static const char trailingBytesForUTF8[256] = {
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
-    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
-    2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 3,3,3,3,3,3,3,3,4,4,4,4,5,5,5,5
-};
-static bool isLegalUTF8(const UTF8 *source, int length) {
-  UTF8 a;
-  const UTF8 *srcptr = source+length;
-  switch (length) {
-    default: return false;
-      /* Everything else falls through when "true"... */
-    case 4: if ((a = (*--srcptr)) < 0x80 || a > 0xBF) return false;
-    case 3: if ((a = (*--srcptr)) < 0x80 || a > 0xBF) return false;
-    case 2: if ((a = (*--srcptr)) < 0x80 || a > 0xBF) return false;
-
-      switch (*source) {
-        /* no fall-through in this inner switch */
-        case 0xE0: if (a < 0xA0) return false; break;
-        case 0xED: if (a > 0x9F) return false; break;
-        case 0xF0: if (a < 0x90) return false; break;
-        case 0xF4: if (a > 0x8F) return false; break;
-        default:   if (a < 0x80) return false;
-      }
-
-    case 1: if (*source >= 0x80 && *source < 0xC2) return false;
-  }
-  if (*source > 0xF4) return false;
-  return true;
-}
-bool isLegalUTF8String(const UTF8 *source, const UTF8 *sourceEnd) {
-  while (source != sourceEnd) {
-    int length = trailingBytesForUTF8[*source] + 1;
-    if (length > sourceEnd - source || !isLegalUTF8(source, length))
-      return false;
-    source += length;
-  }
-  return true;
-}
-#endif
-
-#if defined(__linux__) && GCC_VERSION < 50100
-// No codecvt before libstdc++5.1, need to roll our own utf8<->utf16 routines.
-// Use code from the Unicode consortium there. License below applies to
-// contents of this #if block only.
-/*
- * Copyright 2001-2004 Unicode, Inc.
- *
- * Disclaimer
- *
- * This source code is provided as is by Unicode, Inc. No claims are
- * made as to fitness for any particular purpose. No warranties of any
- * kind are expressed or implied. The recipient agrees to determine
- * applicability of information provided. If this file has been
- * purchased on magnetic or optical media from Unicode, Inc., the
- * sole remedy for any claim will be exchange of defective media
- * within 90 days of receipt.
- *
- * Limitations on Rights to Redistribute This Code
- *
- * Unicode, Inc. hereby grants the right to freely use the information
- * supplied in this file in the creation of products supporting the
- * Unicode Standard, and to make copies of this file in any form
- * for internal or external distribution as long as this notice
- * remains attached.
- */
-typedef uint16_t UTF16;
-typedef uint32_t UTF32;
-
-#define UNI_REPLACEMENT_CHAR (UTF32)0x0000FFFD
-#define UNI_MAX_BMP (UTF32)0x0000FFFF
-#define UNI_MAX_UTF16 (UTF32)0x0010FFFF
-
-typedef enum {
-	conversionOK, 		/* conversion successful */
-	sourceExhausted,	/* partial character in source, but hit end */
-	targetExhausted,	/* insuff. room in target for conversion */
-	sourceIllegal		/* source sequence is illegal/malformed */
-} ConversionResult;
-
-typedef enum {
-	strictConversion = 0,
-	lenientConversion
-} ConversionFlags;
-
-ConversionResult ConvertUTF8toUTF16 (
-		const UTF8** sourceStart, const UTF8* sourceEnd,
-		UTF16** targetStart, UTF16* targetEnd, ConversionFlags flags);
-
-ConversionResult ConvertUTF16toUTF8 (
-		const UTF16** sourceStart, const UTF16* sourceEnd,
-		UTF8** targetStart, UTF8* targetEnd, ConversionFlags flags);
-
-static const int halfShift  = 10; /* used for shifting by 10 bits */
-
-static const UTF32 halfBase = 0x0010000UL;
-static const UTF32 halfMask = 0x3FFUL;
-
-#define UNI_SUR_HIGH_START  (UTF32)0xD800
-#define UNI_SUR_HIGH_END    (UTF32)0xDBFF
-#define UNI_SUR_LOW_START   (UTF32)0xDC00
-#define UNI_SUR_LOW_END     (UTF32)0xDFFF
-
-/* --------------------------------------------------------------------- */
-
-/*
- * Magic values subtracted from a buffer value during UTF8 conversion.
- * This table contains as many values as there might be trailing bytes
- * in a UTF-8 sequence.
- */
-static const UTF32 offsetsFromUTF8[6] = { 0x00000000UL, 0x00003080UL, 0x000E2080UL,
-		     0x03C82080UL, 0xFA082080UL, 0x82082080UL };
-
-/*
- * Once the bits are split out into bytes of UTF-8, this is a mask OR-ed
- * into the first byte, depending on how many bytes follow.  There are
- * as many entries in this table as there are UTF-8 sequence types.
- * (I.e., one byte sequence, two byte... etc.). Remember that sequencs
- * for *legal* UTF-8 will be 4 or fewer bytes total.
- */
-static const UTF8 firstByteMark[7] = { 0x00, 0x00, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC };
-
-/* The interface converts a whole buffer to avoid function-call overhead.
- * Constants have been gathered. Loops & conditionals have been removed as
- * much as possible for efficiency, in favor of drop-through switches.
- * (See "Note A" at the bottom of the file for equivalent code.)
- * If your compiler supports it, the "isLegalUTF8" call can be turned
- * into an inline function.
- */
-
-/* --------------------------------------------------------------------- */
-
-ConversionResult ConvertUTF16toUTF8 (
-	const UTF16** sourceStart, const UTF16* sourceEnd,
-	UTF8** targetStart, UTF8* targetEnd, ConversionFlags flags) {
-    ConversionResult result = conversionOK;
-    const UTF16* source = *sourceStart;
-    UTF8* target = *targetStart;
-    while (source < sourceEnd) {
-	UTF32 ch;
-	unsigned short bytesToWrite = 0;
-	const UTF32 byteMask = 0xBF;
-	const UTF32 byteMark = 0x80;
-	const UTF16* oldSource = source; /* In case we have to back up because of target overflow. */
-	ch = *source++;
-	/* If we have a surrogate pair, convert to UTF32 first. */
-	if (ch >= UNI_SUR_HIGH_START && ch <= UNI_SUR_HIGH_END) {
-	    /* If the 16 bits following the high surrogate are in the source buffer... */
-	    if (source < sourceEnd) {
-		UTF32 ch2 = *source;
-		/* If it's a low surrogate, convert to UTF32. */
-		if (ch2 >= UNI_SUR_LOW_START && ch2 <= UNI_SUR_LOW_END) {
-		    ch = ((ch - UNI_SUR_HIGH_START) << halfShift)
-			+ (ch2 - UNI_SUR_LOW_START) + halfBase;
-		    ++source;
-		} else if (flags == strictConversion) { /* it's an unpaired high surrogate */
-		    --source; /* return to the illegal value itself */
-		    result = sourceIllegal;
-		    break;
-		}
-	    } else { /* We don't have the 16 bits following the high surrogate. */
-		--source; /* return to the high surrogate */
-		result = sourceExhausted;
-		break;
-	    }
-	} else if (flags == strictConversion) {
-	    /* UTF-16 surrogate values are illegal in UTF-32 */
-	    if (ch >= UNI_SUR_LOW_START && ch <= UNI_SUR_LOW_END) {
-		--source; /* return to the illegal value itself */
-		result = sourceIllegal;
-		break;
-	    }
-	}
-	/* Figure out how many bytes the result will require */
-	if (ch < (UTF32)0x80) {	     bytesToWrite = 1;
-	} else if (ch < (UTF32)0x800) {     bytesToWrite = 2;
-	} else if (ch < (UTF32)0x10000) {   bytesToWrite = 3;
-	} else if (ch < (UTF32)0x110000) {  bytesToWrite = 4;
-	} else {			    bytesToWrite = 3;
-					    ch = UNI_REPLACEMENT_CHAR;
-	}
-
-	target += bytesToWrite;
-	if (target > targetEnd) {
-	    source = oldSource; /* Back up source pointer! */
-	    target -= bytesToWrite; result = targetExhausted; break;
-	}
-	switch (bytesToWrite) { /* note: everything falls through. */
-	    case 4: *--target = (UTF8)((ch | byteMark) & byteMask); ch >>= 6;
-	    case 3: *--target = (UTF8)((ch | byteMark) & byteMask); ch >>= 6;
-	    case 2: *--target = (UTF8)((ch | byteMark) & byteMask); ch >>= 6;
-	    case 1: *--target =  (UTF8)(ch | firstByteMark[bytesToWrite]);
-	}
-	target += bytesToWrite;
-    }
-    *sourceStart = source;
-    *targetStart = target;
-    return result;
-}
-
-/* --------------------------------------------------------------------- */
-
-ConversionResult ConvertUTF8toUTF16 (
-	const UTF8** sourceStart, const UTF8* sourceEnd,
-	UTF16** targetStart, UTF16* targetEnd, ConversionFlags flags) {
-    ConversionResult result = conversionOK;
-    const UTF8* source = *sourceStart;
-    UTF16* target = *targetStart;
-    while (source < sourceEnd) {
-	UTF32 ch = 0;
-	unsigned short extraBytesToRead = trailingBytesForUTF8[*source];
-	if (source + extraBytesToRead >= sourceEnd) {
-	    result = sourceExhausted; break;
-	}
-	/* Do this check whether lenient or strict */
-	if (! isLegalUTF8(source, extraBytesToRead+1)) {
-	    result = sourceIllegal;
-	    break;
-	}
-	/*
-	 * The cases all fall through. See "Note A" below.
-	 */
-	switch (extraBytesToRead) {
-	    case 5: ch += *source++; ch <<= 6; /* remember, illegal UTF-8 */
-	    case 4: ch += *source++; ch <<= 6; /* remember, illegal UTF-8 */
-	    case 3: ch += *source++; ch <<= 6;
-	    case 2: ch += *source++; ch <<= 6;
-	    case 1: ch += *source++; ch <<= 6;
-	    case 0: ch += *source++;
-	}
-	ch -= offsetsFromUTF8[extraBytesToRead];
-
-	if (target >= targetEnd) {
-	    source -= (extraBytesToRead+1); /* Back up source pointer! */
-	    result = targetExhausted; break;
-	}
-	if (ch <= UNI_MAX_BMP) { /* Target is a character <= 0xFFFF */
-	    /* UTF-16 surrogate values are illegal in UTF-32 */
-	    if (ch >= UNI_SUR_HIGH_START && ch <= UNI_SUR_LOW_END) {
-		if (flags == strictConversion) {
-		    source -= (extraBytesToRead+1); /* return to the illegal value itself */
-		    result = sourceIllegal;
-		    break;
-		} else {
-		    *target++ = UNI_REPLACEMENT_CHAR;
-		}
-	    } else {
-		*target++ = (UTF16)ch; /* normal case */
-	    }
-	} else if (ch > UNI_MAX_UTF16) {
-	    if (flags == strictConversion) {
-		result = sourceIllegal;
-		source -= (extraBytesToRead+1); /* return to the start */
-		break; /* Bail out; shouldn't continue */
-	    } else {
-		*target++ = UNI_REPLACEMENT_CHAR;
-	    }
-	} else {
-	    /* target is a character in range 0xFFFF - 0x10FFFF. */
-	    if (target + 1 >= targetEnd) {
-		source -= (extraBytesToRead+1); /* Back up source pointer! */
-		result = targetExhausted; break;
-	    }
-	    ch -= halfBase;
-	    *target++ = (UTF16)((ch >> halfShift) + UNI_SUR_HIGH_START);
-	    *target++ = (UTF16)((ch & halfMask) + UNI_SUR_LOW_START);
-	}
-    }
-    *sourceStart = source;
-    *targetStart = target;
-    return result;
-}
-
-#else
-#endif
-
-#if _MSC_VER == 1900 || _MSC_VER == 1911
-    // lol msvc: http://stackoverflow.com/questions/32055357/visual-studio-c-2015-stdcodecvt-with-char16-t-or-char32-t
-    using Char16 = int16_t;
-#else
-    using Char16 = char16_t;
-#endif
-typedef std::basic_string<Char16> C16string;
+typedef std::u16string C16string;
 
 //////////////////////////////////////////////////////////////////////////////
 // Lexer
@@ -699,11 +422,10 @@ std::vector<Token> Tokenizer::Run(std::string* err) {
       else if (IsEqualAsciiUppercase(token_value, "END"))
         type = Token::kEndBlock;
     }
-    // For now, skip all preprocessor directives.  Note that rc expects to be
-    // fed preprocessed input (e.g. via `clang-cl /P`, so only pragma lines
-    // and linemarkers should remain in the input.
-    // FIXME: Support linemarker directives for better diagnostics?
-    // FIXME: Also, probably do something with #pragma code_page(n).
+    // Skip preprocessor directives.  The Preprocessor leaves directives that
+    // don't change the output in place, and linemarkers were handled in
+    // AdvanceToEndOfToken() already.
+    // FIXME: Probably do something with #pragma code_page(n).
     if (type != Token::kLineComment && type != Token::kStarComment &&
         type != Token::kDirective)
       tokens_.push_back(Token(type, token_value, CurrentLocation()));
@@ -945,6 +667,210 @@ void Tokenizer::AdvanceToEndOfToken(Token::Type type) {
   }
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Arena
+
+// Bump allocator for AST nodes and interpreted string literals.  Nodes are
+// never freed one by one; everything in the arena goes away at once when it's
+// destroyed or Reset().  Destructors of objects created with New() run at
+// that point, so nodes can still own e.g. std::vectors.
+class Arena {
+ public:
+  Arena() {}
+  ~Arena() { RunDtors(); }
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void* Allocate(size_t size, size_t align);
+
+  template <class T, class... Args>
+  T* New(Args&&... args) {
+    T* t = new (Allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value)
+      dtors_.push_back({[](void* p) { static_cast<T*>(p)->~T(); }, t});
+    return t;
+  }
+
+  // Destroys all objects in the arena.  Its memory is kept for reuse (as a
+  // single block), so that /batch jobs after the first one on a thread
+  // usually don't need to allocate memory for their ASTs.
+  void Reset();
+
+ private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+  struct Dtor {
+    void (*destroy)(void*);
+    void* object;
+  };
+
+  void AddBlock(size_t size);
+  void RunDtors();
+
+  std::vector<Block> blocks_;
+  size_t used_ = 0;  // Bytes in all blocks before the current one.
+  char* cur_ = nullptr;
+  char* end_ = nullptr;
+  std::vector<Dtor> dtors_;
+};
+
+void* Arena::Allocate(size_t size, size_t align) {
+  uintptr_t p = ((uintptr_t)cur_ + align - 1) & ~(uintptr_t)(align - 1);
+  if (!cur_ || p + size > (uintptr_t)end_) {
+    AddBlock(size + align);
+    p = ((uintptr_t)cur_ + align - 1) & ~(uintptr_t)(align - 1);
+  }
+  cur_ = (char*)(p + size);
+  return (void*)p;
+}
+
+void Arena::AddBlock(size_t size) {
+  const size_t kMinBlockSize = 64 << 10;
+  if (!blocks_.empty())
+    used_ += blocks_.back().size;
+  size = std::max(size, kMinBlockSize);
+  blocks_.push_back(Block{std::unique_ptr<char[]>(new char[size]), size});
+  cur_ = blocks_.back().data.get();
+  end_ = cur_ + size;
+}
+
+void Arena::RunDtors() {
+  for (size_t i = dtors_.size(); i > 0; --i)
+    dtors_[i - 1].destroy(dtors_[i - 1].object);
+  dtors_.clear();
+}
+
+void Arena::Reset() {
+  RunDtors();
+
+  if (blocks_.empty())
+    return;
+  if (blocks_.size() > 1) {
+    // Replace all blocks with one that's large enough for everything.
+    size_t total = used_ + blocks_.back().size;
+    blocks_.clear();
+    used_ = 0;
+    AddBlock(total);
+    return;
+  }
+  cur_ = blocks_[0].data.get();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Timing
+
+// Number of operator new calls on this thread, for /timing.
+static thread_local uint64_t g_num_allocations = 0;
+
+// Not inlined, so that gcc's -Wmismatched-new-delete doesn't see the
+// malloc() and free() calls.
+#if defined(_MSC_VER)
+#define RC_NOINLINE __declspec(noinline)
+#else
+#define RC_NOINLINE __attribute__((noinline))
+#endif
+RC_NOINLINE void* operator new(size_t size) {
+  ++g_num_allocations;
+  if (void* p = malloc(size ? size : 1))
+    return p;
+#if defined(__cpp_exceptions) || defined(_CPPUNWIND)
+  throw std::bad_alloc();
+#else
+  abort();
+#endif
+}
+RC_NOINLINE void operator delete(void* p) noexcept { free(p); }
+RC_NOINLINE void operator delete(void* p, size_t) noexcept { free(p); }
+
+// /timing: wall time and heap allocations per compile phase, and bytes
+// written per resource type.  Phases are reported in the order they first
+// ran.  In /batch mode, the stats of all jobs are added up.
+class Timing {
+ public:
+  struct Phase {
+    const char* name;
+    uint64_t calls = 0;
+    double seconds = 0;
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+  };
+
+  // Measures one call of |phase| from construction to destruction.  |timing|
+  // can be null, in which case this does nothing.
+  class Scope {
+   public:
+    Scope(Timing* timing, const char* phase)
+        : timing_(timing), phase_(phase) {
+      if (timing_) {
+        start_ = std::chrono::steady_clock::now();
+        allocations_ = g_num_allocations;
+      }
+    }
+    ~Scope() {
+      if (!timing_)
+        return;
+      Phase* p = timing_->Get(phase_);
+      ++p->calls;
+      p->seconds += std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start_).count();
+      p->allocations += g_num_allocations - allocations_;
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    Timing* timing_;
+    const char* phase_;
+    std::chrono::steady_clock::time_point start_;
+    uint64_t allocations_ = 0;
+  };
+
+  Phase* Get(const char* name) {
+    for (Phase& p : phases_)
+      if (strcmp(p.name, name) == 0)
+        return &p;
+    phases_.emplace_back();
+    phases_.back().name = name;
+    return &phases_.back();
+  }
+
+  void Add(const Timing& other) {
+    for (const Phase& o : other.phases_) {
+      Phase* p = Get(o.name);
+      p->calls += o.calls;
+      p->seconds += o.seconds;
+      p->allocations += o.allocations;
+      p->bytes += o.bytes;
+    }
+  }
+
+  void Print(FILE* f) const {
+    fprintf(f, "%-24s %8s %10s %10s %12s\n",
+            "phase", "calls", "ms", "allocs", "bytes");
+    Phase total;
+    total.name = "total";
+    for (const Phase& p : phases_) {
+      PrintPhase(f, p);
+      total.seconds += p.seconds;
+      total.allocations += p.allocations;
+      total.bytes += p.bytes;
+    }
+    PrintPhase(f, total);
+  }
+
+ private:
+  static void PrintPhase(FILE* f, const Phase& p) {
+    fprintf(f, "%-24s %8llu %10.3f %10llu %12llu\n", p.name,
+            (unsigned long long)p.calls, p.seconds * 1000,
+            (unsigned long long)p.allocations, (unsigned long long)p.bytes);
+  }
+
+  std::vector<Phase> phases_;  // Few enough that linear search is fine.
+};
+
 //////////////////////////////////////////////////////////////////////////////
 // AST
 
@@ -986,6 +912,8 @@ class Visitor {
 // The uint16_t looks like (0xffff value) when serialized, the utf-16 string
 // is just a \0-terminated utf-16le string.  This class represents that concept.
 // (Also used in a few other places, e.g. DIALOG's CLASS, MENU, etc).
+class ResWriter;
+
 class IntOrStringName {
  public:
   static IntOrStringName MakeInt(uint16_t val) {
@@ -1018,9 +946,7 @@ class IntOrStringName {
 
   bool is_empty() const { return data_[0] == 0; }
   size_t serialized_size() const { return data_.size() * 2; }
-  bool write(FILE* f) const {
-    return fwrite(data_.data(), 2, data_.size(), f) == data_.size();
-  }
+  void write(ResWriter* w) const;
 
  private:
   IntOrStringName() {}
@@ -1051,9 +977,8 @@ class LanguageResource final : public Resource {
     uint8_t language;
     uint8_t sublanguage;
     uint16_t as_uint16() const { return language | sublanguage << 10; }
-    bool operator<(const Language& rhs) const {
-      return std::tie(language, sublanguage) <
-             std::tie(rhs.language, rhs.sublanguage);
+    bool operator==(const Language& rhs) const {
+      return language == rhs.language && sublanguage == rhs.sublanguage;
     }
   };
 
@@ -1126,13 +1051,11 @@ class MenuResource final : public Resource {
  public:
   struct EntryData {};
   struct Entry {
-    Entry(uint16_t style,
-          std::string_view name,
-          std::unique_ptr<EntryData> data)
-        : style(style), name(name), data(std::move(data)) {}
+    Entry(uint16_t style, std::string_view name, EntryData* data)
+        : style(style), name(name), data(data) {}
     uint16_t style;
     std::string_view name;
-    std::unique_ptr<EntryData> data;
+    EntryData* data;  // Owned by the arena.
   };
   struct ItemEntryData : public EntryData {
     explicit ItemEntryData(uint32_t id) : id(id) {}
@@ -1140,9 +1063,9 @@ class MenuResource final : public Resource {
   };
   struct SubmenuEntryData : public EntryData {
     SubmenuEntryData() {}
-    explicit SubmenuEntryData(std::vector<std::unique_ptr<Entry>> subentries)
+    explicit SubmenuEntryData(std::vector<Entry*> subentries)
         : subentries(std::move(subentries)) {}
-    std::vector<std::unique_ptr<Entry>> subentries;
+    std::vector<Entry*> subentries;
   };
 
   MenuResource(Location location, IntOrStringName name,
@@ -1196,18 +1119,6 @@ class DialogResource final : public Resource {
     IntOrStringName text;
 
     // There's another uint16_t field here that seems to be always 0.
-
-    uint16_t serialized_size(bool is_last, DialogKind kind) const {
-      uint16_t size = 2*4 + 5*2; // style, exstyle, x, y, w, h, id
-      size += clazz.serialized_size();
-      size += text.serialized_size();
-      size += 2;  // FIXME: Mystery 0 field after the control text.
-      if (kind == kDialogEx)
-        size += 4 + 2;  // help_id and 32-bit id.
-      if (!is_last && size % 4)
-        size += 2;  // pad to uint32_t
-      return size;
-    }
   };
 
   DialogResource(Location location,
@@ -1383,10 +1294,9 @@ class VersioninfoResource final : public Resource {
     Type type_;
   };
   struct Entry {
-    Entry(std::string_view key, std::unique_ptr<InfoData> data)
-        : key(key), data(std::move(data)) {}
+    Entry(std::string_view key, InfoData* data) : key(key), data(data) {}
     std::string_view key;
-    std::unique_ptr<InfoData> data;
+    InfoData* data;  // Owned by the arena.
   };
   struct ValueData : public InfoData {
     explicit ValueData(uint16_t value_size,
@@ -1411,9 +1321,9 @@ class VersioninfoResource final : public Resource {
   };
   struct BlockData : public InfoData {
     BlockData() : InfoData(kBlock) {}
-    explicit BlockData(std::vector<std::unique_ptr<Entry>> values)
+    explicit BlockData(std::vector<Entry*> values)
         : InfoData(kBlock), values(std::move(values)) {}
-    std::vector<std::unique_ptr<Entry>> values;
+    std::vector<Entry*> values;
   };
 
   VersioninfoResource(Location location, IntOrStringName name,
@@ -1483,7 +1393,7 @@ class UserDefinedResource final : public FileOrDataResource {
 
 class FileBlock {
  public:
-  std::vector<std::unique_ptr<Resource>> res_;
+  std::vector<Resource*> res_;  // Owned by the arena.
 };
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1498,32 +1408,21 @@ enum InternalEncoding { kEncodingUnknown, kEncodingUTF8 };
 
 bool ToUTF16(C16string* utf16, std::string_view in,
              InternalEncoding encoding, std::string* err_) {
-  if (encoding == kEncodingUTF8) {
-    // InternalEncoding is only set to kEncodingUTF8 when we know that all data
-    // is valid UTF-8, so this conversion here should never fail.
-#if defined(__linux__) && GCC_VERSION < 50100
-    std::vector<Char16> buffer(in.size());
-    const UTF8* src_start = (UTF8*)in.data();
-    UTF16* dst_start = (UTF16*)buffer.data();
-    ConversionResult r = ConvertUTF8toUTF16(
-        &src_start, (UTF8*)in.data() + in.size(),
-        &dst_start, (UTF16*)buffer.data() + buffer.size(),
-        strictConversion);
-    assert(r == conversionOK); (void)r;
-    *utf16 = C16string(buffer.data(), dst_start - (UTF16*)buffer.data());
-#else
-    std::wstring_convert<std::codecvt_utf8_utf16<Char16>, Char16> convert;
-    *utf16 = convert.from_bytes(AsString(in));
-#endif
-  } else {
-    for (size_t j = 0; j < in.size(); ++j) {
-      if (in[j] & 0x80) {
-        *err_ = "only 7-bit characters supported in non-unicode files";
-        return false;
-      }
-      utf16->push_back(in[j]);
+  const uint8_t* data = (const uint8_t*)in.data();
+  if (encoding != kEncodingUTF8) {
+    // Plain ASCII converts the same way as UTF-8.
+    if (std::any_of(in.begin(), in.end(), [](char c) { return c & 0x80; })) {
+      *err_ = "only 7-bit characters supported in non-unicode files";
+      return false;
     }
   }
+  // InternalEncoding is only set to kEncodingUTF8 when we know that all data
+  // is valid UTF-8, so this conversion here can't fail.
+  // UTF-16 never needs more code units than UTF-8 needs bytes.
+  size_t old_size = utf16->size();
+  utf16->resize(old_size + in.size());
+  size_t n = utf::UTF8ToUTF16(data, in.size(), (uint16_t*)&(*utf16)[old_size]);
+  utf16->resize(old_size + n);
   return true;
 }
 
@@ -1531,28 +1430,17 @@ bool ToUTF16(C16string* utf16, std::string_view in,
 // don't contain these, and in that case a string_view not including the
 // start and end quotes can represent the string contents efficiently.
 // If there _are_ escape characters, the string_view needs to refer to memory
-// containing an actual <tab> character instead of '\' 't'.  This class
-// stores those interpreted strings.
-class StringStorage {
- public:
-  std::string_view StringContents(std::string_view s);
-
- private:
-  // FIXME: Just std::vector<std::string> might be fine too, but at least
-  // with MSVC, vector seems to copy instead of moving strings when it grows,
-  // which is bad since the string_views vended by this class refer to fixed
-  // memory locations.
-  std::vector<std::unique_ptr<std::string>> storage_;
-};
-
-std::string_view StringStorage::StringContents(std::string_view s) {
+// containing an actual <tab> character instead of '\' 't'.  Those interpreted
+// strings are stored in |arena|.
+std::string_view StringContents(std::string_view s, Arena* arena) {
   // The literal includes quotes, strip them.
   size_t start_skip_count = ascii_toupper(s[0]) == 'L' ? 2 : 1;
   s = s.substr(start_skip_count, s.size() - (start_skip_count + 1));
   if (s.find('"') == s.npos && s.find('\\') == s.npos)
     return s;
-  std::unique_ptr<std::string> stored(new std::string);
-  stored->reserve(s.size());
+  // Interpreting escapes never makes a string longer.
+  char* stored = (char*)arena->Allocate(s.size(), 1);
+  size_t size = 0;
   // There are two phases:
   // 1. Collapse "" to "
   // 2. Process \ escapes
@@ -1560,7 +1448,7 @@ std::string_view StringStorage::StringContents(std::string_view s) {
   for (size_t i = 0; i < s.size(); ++i) {
     char c = s[i];
     if (c != '\\' || i + 1 == s.size()) {
-      stored->push_back(c);
+      stored[size++] = c;
       if (c == '"') {  // "" -> "
         assert(s[i + 1] == '"');
         ++i;
@@ -1582,7 +1470,7 @@ std::string_view StringStorage::StringContents(std::string_view s) {
       }
       // FIXME: In L"" strings, \x takes four nibbles instead of two.
       if (i + 1 < s.size() || c)  // \0 is only added if not at end of string.
-        stored->push_back(c);
+        stored[size++] = c;
       continue;
     }
     if (c >= '0' && c <= '7') {
@@ -1594,7 +1482,7 @@ std::string_view StringStorage::StringContents(std::string_view s) {
       }
       // FIXME: L"" strings?
       if (i + 1 < s.size() || c)  // \0 is only added if not at end of string.
-        stored->push_back(c);
+        stored[size++] = c;
       continue;
     }
     switch (c) {
@@ -1605,12 +1493,11 @@ std::string_view StringStorage::StringContents(std::string_view s) {
       case '0': c = '\0'; break;
       case '\\': c = '\\'; break;
       case '"': c = '"'; assert(s[i + 1] == '"'); ++i; break;
-      default: stored->push_back('\\');
+      default: stored[size++] = '\\';
     }
-    stored->push_back(c);
+    stored[size++] = c;
   }
-  storage_.push_back(std::move(stored));
-  return *storage_.back();
+  return std::string_view(stored, size);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1618,14 +1505,14 @@ std::string_view StringStorage::StringContents(std::string_view s) {
 
 class Parser {
  public:
-  static std::unique_ptr<FileBlock> Parse(std::vector<Token> tokens,
-                                          InternalEncoding encoding,
-                                          StringStorage* string_storage,
-                                          std::string* err);
+  // The returned AST is allocated in |arena|.
+  static FileBlock* Parse(std::vector<Token> tokens,
+                          InternalEncoding encoding,
+                          Arena* arena,
+                          std::string* err);
 
  private:
-  Parser(std::vector<Token> tokens, InternalEncoding encoding,
-         StringStorage* string_storage);
+  Parser(std::vector<Token> tokens, InternalEncoding encoding, Arena* arena);
 
   // Parses an expression matching
   //    expr ::= unary_expr {binary_op unary_expr}
@@ -1651,22 +1538,22 @@ class Parser {
                             bool* is_text);
   bool ParseRawData(std::vector<uint8_t>* data);
 
-  std::unique_ptr<LanguageResource> ParseLanguage();
+  LanguageResource* ParseLanguage();
   void MaybeParseMenuOptions(uint16_t* style);
-  std::unique_ptr<MenuResource::SubmenuEntryData> ParseMenuBlock();
-  std::unique_ptr<MenuResource> ParseMenu(IntOrStringName name);
+  MenuResource::SubmenuEntryData* ParseMenuBlock();
+  MenuResource* ParseMenu(IntOrStringName name);
   bool ParseDialogControl(DialogResource::Control* control,
                           DialogResource::DialogKind dialog_kind);
-  std::unique_ptr<DialogResource> ParseDialog(
+  DialogResource* ParseDialog(
       IntOrStringName name,
       DialogResource::DialogKind dialog_kind);
-  std::unique_ptr<StringtableResource> ParseStringtable();
+  StringtableResource* ParseStringtable();
   bool ParseAccelerator(AcceleratorsResource::Accelerator* accelerator);
-  std::unique_ptr<AcceleratorsResource> ParseAccelerators(IntOrStringName name);
-  std::unique_ptr<VersioninfoResource::BlockData> ParseVersioninfoBlock();
-  std::unique_ptr<VersioninfoResource> ParseVersioninfo(IntOrStringName name);
-  std::unique_ptr<Resource> ParseResource();
-  std::unique_ptr<FileBlock> ParseFile(std::string* err);
+  AcceleratorsResource* ParseAccelerators(IntOrStringName name);
+  VersioninfoResource::BlockData* ParseVersioninfoBlock();
+  VersioninfoResource* ParseVersioninfo(IntOrStringName name);
+  Resource* ParseResource();
+  FileBlock* ParseFile(std::string* err);
 
   // If |error_message| is non-nullptr, sets err_ if expected token isn't found.
   bool Is(Token::Type type, const char* error_message = nullptr);
@@ -1691,23 +1578,23 @@ class Parser {
   std::vector<Token> tokens_;
   std::string err_;
   InternalEncoding encoding_;
-  StringStorage* string_storage_;
+  Arena* arena_;
   size_t cur_;
 };
 
 // static
-std::unique_ptr<FileBlock> Parser::Parse(std::vector<Token> tokens,
-                                         InternalEncoding encoding,
-                                         StringStorage* string_storage,
-                                         std::string* err) {
-  Parser p(std::move(tokens), encoding, string_storage);
+FileBlock* Parser::Parse(std::vector<Token> tokens,
+                         InternalEncoding encoding,
+                         Arena* arena,
+                         std::string* err) {
+  Parser p(std::move(tokens), encoding, arena);
   return p.ParseFile(err);
 }
 
 Parser::Parser(std::vector<Token> tokens, InternalEncoding encoding,
-               StringStorage* string_storage)
-    : tokens_(std::move(tokens)), encoding_(encoding),
-      string_storage_(string_storage), cur_(0) {}
+               Arena* arena)
+    : tokens_(std::move(tokens)), encoding_(encoding), arena_(arena),
+      cur_(0) {}
 
 bool Parser::Is(Token::Type type, const char* error_message) {
   if (at_end())
@@ -1782,7 +1669,7 @@ bool Parser::EvalIntExpressionPrimary(uint32_t* out, bool* is_32) {
 
 std::string_view Parser::StringContents(const Token& tok) {
   assert(tok.type() == Token::kString);
-  return string_storage_->StringContents(tok.value_);
+  return ::StringContents(tok.value_, arena_);
 }
 
 static bool EndsVersioninfoData(const Token& t) {
@@ -1907,16 +1794,16 @@ bool Parser::ParseRawData(std::vector<uint8_t>* data) {
   return Match(Token::kEndBlock, "expected END or }");
 }
 
-std::unique_ptr<LanguageResource> Parser::ParseLanguage() {
+LanguageResource* Parser::ParseLanguage() {
   Location location = cur_or_last_token().location_;
   if (!Is(Token::kInt, "expected int"))
-    return std::unique_ptr<LanguageResource>();
+    return nullptr;
   uint8_t language = Consume().IntValue();
   if (!Match(Token::kComma, "expected comma") ||
       !Is(Token::kInt, "expected int"))
-    return std::unique_ptr<LanguageResource>();
+    return nullptr;
   uint8_t sub_language = Consume().IntValue();
-  return std::make_unique<LanguageResource>(location, language, sub_language);
+  return arena_->New<LanguageResource>(location, language, sub_language);
 }
 
 void Parser::MaybeParseMenuOptions(uint16_t* style) {
@@ -1943,19 +1830,19 @@ void Parser::MaybeParseMenuOptions(uint16_t* style) {
   }
 }
 
-std::unique_ptr<MenuResource::SubmenuEntryData> Parser::ParseMenuBlock() {
+MenuResource::SubmenuEntryData* Parser::ParseMenuBlock() {
   if (!Match(Token::kBeginBlock, "expected BEGIN or {"))
-    return std::unique_ptr<MenuResource::SubmenuEntryData>();
+    return nullptr;
 
-  std::unique_ptr<MenuResource::SubmenuEntryData> entries(
-      new MenuResource::SubmenuEntryData);
+  MenuResource::SubmenuEntryData* entries =
+      arena_->New<MenuResource::SubmenuEntryData>();
   while (!at_end() && cur_token().type() != Token::kEndBlock) {
     if (!Is(Token::kIdentifier) ||
         (!IsEqualAsciiUppercase(cur_token().value_, "MENUITEM") &&
          !IsEqualAsciiUppercase(cur_token().value_, "POPUP"))) {
       SetError("expected MENUITEM or POPUP, got " +
                AsString(cur_or_last_token().value_));
-      return std::unique_ptr<MenuResource::SubmenuEntryData>();
+      return nullptr;
     }
     bool is_item = IsEqualAsciiUppercase(cur_token().value_ , "MENUITEM");
     Consume();  // Eat MENUITEM or POPUP.
@@ -1964,61 +1851,59 @@ std::unique_ptr<MenuResource::SubmenuEntryData> Parser::ParseMenuBlock() {
     // MENUEX in the future, make sure to not accept MENUITEM SEPARATOR in
     // MENUEX blocks.
     std::string_view name_val;
-    std::unique_ptr<MenuResource::EntryData> entry_data;
+    MenuResource::EntryData* entry_data = nullptr;
     bool is_separator = false;
     if (is_item && Is(Token::kIdentifier) &&
         IsEqualAsciiUppercase(cur_token().value_, "SEPARATOR")) {
       Consume();
       is_separator = true;
-      entry_data.reset(new MenuResource::ItemEntryData(0));
+      entry_data = arena_->New<MenuResource::ItemEntryData>(0);
     } else if (Is(Token::kString, "expected string")) {
       name_val = StringContents(Consume());
     } else {
-      return std::unique_ptr<MenuResource::SubmenuEntryData>();
+      return nullptr;
     }
 
     uint16_t style = 0;
     if (is_item && !is_separator) {
       if (!Match(Token::kComma, "expected comma"))
-        return std::unique_ptr<MenuResource::SubmenuEntryData>();
+        return nullptr;
       if (!Is(Token::kInt, "expected int"))
-        return std::unique_ptr<MenuResource::SubmenuEntryData>();
+        return nullptr;
       uint16_t id_num = Consume().IntValue();
 
       MaybeParseMenuOptions(&style);
-      entry_data.reset(new MenuResource::ItemEntryData(id_num));
+      entry_data = arena_->New<MenuResource::ItemEntryData>(id_num);
     }
     if (!is_item) {
       MaybeParseMenuOptions(&style);
       style |= kMenuPOPUP;
 
-      std::unique_ptr<MenuResource::SubmenuEntryData> subentries =
-          ParseMenuBlock();
-      if (!entries)
-        return std::unique_ptr<MenuResource::SubmenuEntryData>();
-      entry_data = std::move(subentries);
+      MenuResource::SubmenuEntryData* subentries = ParseMenuBlock();
+      if (!subentries)
+        return nullptr;
+      entry_data = subentries;
     }
 
-    entries->subentries.push_back(std::unique_ptr<MenuResource::Entry>(
-        new MenuResource::Entry(style, name_val, std::move(entry_data))));
+    entries->subentries.push_back(
+        arena_->New<MenuResource::Entry>(style, name_val, entry_data));
   }
   if (!Match(Token::kEndBlock, "expected END or }"))
-    return std::unique_ptr<MenuResource::SubmenuEntryData>();
+    return nullptr;
   if (entries->subentries.empty()) {
     SetError("empty menus are not allowed");
-    return std::unique_ptr<MenuResource::SubmenuEntryData>();
+    return nullptr;
   }
   return entries;
 }
 
 
-std::unique_ptr<MenuResource> Parser::ParseMenu(IntOrStringName name) {
+MenuResource* Parser::ParseMenu(IntOrStringName name) {
   Location location = cur_or_last_token().location_;
-  std::unique_ptr<MenuResource::SubmenuEntryData> entries = ParseMenuBlock();
+  MenuResource::SubmenuEntryData* entries = ParseMenuBlock();
   if (!entries)
-    return std::unique_ptr<MenuResource>();
-  return std::make_unique<MenuResource>(
-      location, name, std::move(*entries.get()));
+    return nullptr;
+  return arena_->New<MenuResource>(location, name, std::move(*entries));
 }
 
 static void ClassAndStyleForControl(std::string_view type,
@@ -2220,7 +2105,7 @@ bool Parser::ParseDialogControl(DialogResource::Control* control,
   return true;
 }
 
-std::unique_ptr<DialogResource> Parser::ParseDialog(
+DialogResource* Parser::ParseDialog(
     IntOrStringName name,
     DialogResource::DialogKind dialog_kind) {
   Location location = cur_or_last_token().location_;
@@ -2230,7 +2115,7 @@ std::unique_ptr<DialogResource> Parser::ParseDialog(
     if (i > 0)
       Match(Token::kComma);  // Eat optional commas.
     if (!Is(Token::kInt, "expected int"))
-      return std::unique_ptr<DialogResource>();
+      return nullptr;
     rect[i] = Consume().IntValue();
   }
 
@@ -2238,7 +2123,7 @@ std::unique_ptr<DialogResource> Parser::ParseDialog(
   uint32_t help_id = 0;
   if (dialog_kind == DialogResource::kDialogEx && Match(Token::kComma)) {
     if (!Is(Token::kInt, "expected int"))
-      return std::unique_ptr<DialogResource>();
+      return nullptr;
     help_id = Consume().IntValue();
   }
 
@@ -2250,25 +2135,25 @@ std::unique_ptr<DialogResource> Parser::ParseDialog(
   std::optional<uint32_t> style;
   while (!at_end() && cur_token().type() != Token::kBeginBlock) {
     if (!Is(Token::kIdentifier, "expected identifier, BEGIN or {"))
-      return std::unique_ptr<DialogResource>();
+      return nullptr;
     const Token& tok = Consume();
     if (IsEqualAsciiUppercase(tok.value_, "CAPTION")) {
       if (!Is(Token::kString, "expected string"))
-        return std::unique_ptr<DialogResource>();
+        return nullptr;
       caption_val = StringContents(Consume());
     }
     else if (IsEqualAsciiUppercase(tok.value_, "CLASS")) {
       if (!Is(Token::kString) && !Is(Token::kInt)) {
         SetError("expected string or int, got " +
                  AsString(cur_or_last_token().value_));
-        return std::unique_ptr<DialogResource>();
+        return nullptr;
       }
       const Token& clazz_tok = Consume();
       if (clazz_tok.type() == Token::kString) {
         std::string_view clazz_val = StringContents(clazz_tok);
         C16string clazz_val_utf16;
         if (!ToUTF16(&clazz_val_utf16, clazz_val, encoding_, &err_))
-          return std::unique_ptr<DialogResource>();
+          return nullptr;
         clazz = IntOrStringName::MakeStringUTF16(clazz_val_utf16);
       } else {
         uint16_t clazz_val = clazz_tok.IntValue();
@@ -2277,17 +2162,17 @@ std::unique_ptr<DialogResource> Parser::ParseDialog(
     }
     else if (IsEqualAsciiUppercase(tok.value_, "EXSTYLE")) {
       if (!EvalIntExpression(&exstyle))
-        return std::unique_ptr<DialogResource>();
+        return nullptr;
     }
     else if (IsEqualAsciiUppercase(tok.value_, "FONT")) {
       DialogResource::FontInfo info;
       if (!Is(Token::kInt, "expected int"))
-        return std::unique_ptr<DialogResource>();
+        return nullptr;
       info.size = Consume().IntValue();
       if (!Match(Token::kComma, "expected comma"))
-        return std::unique_ptr<DialogResource>();
+        return nullptr;
       if (!Is(Token::kString, "expected string"))
-        return std::unique_ptr<DialogResource>();
+        return nullptr;
       info.name = StringContents(Consume());
 
       // DIALOGEX can have optional font weight, italic, encoding flags.
@@ -2295,7 +2180,7 @@ std::unique_ptr<DialogResource> Parser::ParseDialog(
         uint16_t vals[3] = {0, 0, 1};
         for (int i = 0; i < 3 && Match(Token::kComma); ++i) {
           if (!Is(Token::kInt, "expected int"))
-            return std::unique_ptr<DialogResource>();
+            return nullptr;
           vals[i] = Consume().IntValue();
         }
         info.weight = vals[0];
@@ -2309,14 +2194,14 @@ std::unique_ptr<DialogResource> Parser::ParseDialog(
       if (!Is(Token::kString) && !Is(Token::kInt)) {
         err_ = "expected string or int, got " +
                AsString(cur_or_last_token().value_);
-        return std::unique_ptr<DialogResource>();
+        return nullptr;
       }
       const Token& menu_tok = Consume();
       if (menu_tok.type() == Token::kString) {
         // Do NOT strip the quotes here, rc.exe includes them too.
         C16string menu_utf16;
         if (!ToUTF16(&menu_utf16, menu_tok.value_, encoding_, &err_))
-          return std::unique_ptr<DialogResource>();
+          return nullptr;
         menu = IntOrStringName::MakeStringUTF16(menu_utf16);
       } else {
         uint16_t menu_val = menu_tok.IntValue();
@@ -2326,55 +2211,55 @@ std::unique_ptr<DialogResource> Parser::ParseDialog(
     else if (IsEqualAsciiUppercase(tok.value_, "STYLE")) {
       uint32_t style_val;
       if (!EvalIntExpression(&style_val))
-        return std::unique_ptr<DialogResource>();
+        return nullptr;
       style = style_val;
     } else {
       SetError("unknown DIALOG attribute " + AsString(tok.value_));
-      return std::unique_ptr<DialogResource>();
+      return nullptr;
     }
   }
 
   // Parse resources block.
   if (!Match(Token::kBeginBlock, "expected BEGIN of {"))
-    return std::unique_ptr<DialogResource>();
+    return nullptr;
   std::vector<DialogResource::Control> controls;
   while (!at_end() && cur_token().type() != Token::kEndBlock) {
     DialogResource::Control control;
     if (!ParseDialogControl(&control, dialog_kind))
-      return std::unique_ptr<DialogResource>();
+      return nullptr;
     controls.push_back(control);
   }
   if (!Match(Token::kEndBlock, "exptected END or }"))
-    return std::unique_ptr<DialogResource>();
+    return nullptr;
 
-  return std::make_unique<DialogResource>(
+  return arena_->New<DialogResource>(
       location,
       name, dialog_kind, rect[0], rect[1], rect[2], rect[3], help_id,
       caption_val, std::move(clazz), exstyle, std::move(font), std::move(menu),
       style, std::move(controls));
 }
 
-std::unique_ptr<StringtableResource> Parser::ParseStringtable() {
+StringtableResource* Parser::ParseStringtable() {
   Location location = cur_or_last_token().location_;
   if (!Match(Token::kBeginBlock, "expected BEGIN or {"))
-    return std::unique_ptr<StringtableResource>();
+    return nullptr;
   std::vector<StringtableResource::Entry> entries;
   while (!at_end() && cur_token().type() != Token::kEndBlock) {
     Location string_location = cur_or_last_token().location_;
     if (!Is(Token::kInt, "expected int"))
-      return std::unique_ptr<StringtableResource>();
+      return nullptr;
     uint16_t key_num = Consume().IntValue();
     Match(Token::kComma);  // Eat optional comma between key and value.
 
     if (!Is(Token::kString, "expected string"))
-      return std::unique_ptr<StringtableResource>();
+      return nullptr;
     std::string_view str_val = StringContents(Consume());
     entries.push_back(
         StringtableResource::Entry{key_num, string_location, str_val});
   }
   if (!Match(Token::kEndBlock, "expected END or }"))
-    return std::unique_ptr<StringtableResource>();
-  return std::make_unique<StringtableResource>(
+    return nullptr;
+  return arena_->New<StringtableResource>(
       location, entries.data(), entries.size());
 }
 
@@ -2453,72 +2338,71 @@ bool Parser::ParseAccelerator(AcceleratorsResource::Accelerator* accelerator) {
   return true;
 }
 
-std::unique_ptr<AcceleratorsResource> Parser::ParseAccelerators(
+AcceleratorsResource* Parser::ParseAccelerators(
     IntOrStringName name) {
   Location location = cur_or_last_token().location_;
   if (!Match(Token::kBeginBlock, "expected BEGIN or {"))
-    return std::unique_ptr<AcceleratorsResource>();
+    return nullptr;
 
   std::vector<AcceleratorsResource::Accelerator> entries;
   while (!at_end() && cur_token().type() != Token::kEndBlock) {
     AcceleratorsResource::Accelerator accelerator;
     if (!ParseAccelerator(&accelerator))
-      return std::unique_ptr<AcceleratorsResource>();
+      return nullptr;
     entries.push_back(accelerator);
   }
   if (!Match(Token::kEndBlock, "expected END or }"))
-    return std::unique_ptr<AcceleratorsResource>();
-  return std::make_unique<AcceleratorsResource>(
+    return nullptr;
+  return arena_->New<AcceleratorsResource>(
       location, name, std::move(entries));
 }
 
-std::unique_ptr<VersioninfoResource::BlockData>
+VersioninfoResource::BlockData*
 Parser::ParseVersioninfoBlock() {
   if (!Match(Token::kBeginBlock, "expected BEGIN or {"))
-    return std::unique_ptr<VersioninfoResource::BlockData>();
+    return nullptr;
 
-  std::unique_ptr<VersioninfoResource::BlockData> block(
-      new VersioninfoResource::BlockData);
+  VersioninfoResource::BlockData* block =
+      arena_->New<VersioninfoResource::BlockData>();
   while (!at_end() && cur_token().type() != Token::kEndBlock) {
     if (!Is(Token::kIdentifier) ||
         (!IsEqualAsciiUppercase(cur_token().value_, "BLOCK") &&
          !IsEqualAsciiUppercase(cur_token().value_, "VALUE"))) {
       SetError("expected BLOCK or VALUE, got " +
                AsString(cur_or_last_token().value_));
-      return std::unique_ptr<VersioninfoResource::BlockData>();
+      return nullptr;
     }
     bool is_value = IsEqualAsciiUppercase(cur_token().value_, "VALUE");
     Consume();
     if (!Is(Token::kString, "expected string"))
-      return std::unique_ptr<VersioninfoResource::BlockData>();
+      return nullptr;
     std::string_view name_val = StringContents(Consume());
 
-    std::unique_ptr<VersioninfoResource::InfoData> info_data;
+    VersioninfoResource::InfoData* info_data;
     if (is_value) {
       std::vector<uint8_t> val;
       uint16_t value_size = 0;
       bool is_text = true;
       if (!ParseVersioninfoData(&val, &value_size, &is_text))
-        return std::unique_ptr<VersioninfoResource::BlockData>();
-      info_data.reset(new VersioninfoResource::ValueData(value_size, is_text,
-                                                         std::move(val)));
+        return nullptr;
+      info_data = arena_->New<VersioninfoResource::ValueData>(
+          value_size, is_text, std::move(val));
     } else {
-      std::unique_ptr<VersioninfoResource::BlockData> block =
-          ParseVersioninfoBlock();
+      VersioninfoResource::BlockData* block = ParseVersioninfoBlock();
       if (!block)
-        return std::unique_ptr<VersioninfoResource::BlockData>();
-      info_data = std::move(block);
+        return nullptr;
+      info_data = block;
     }
 
-    block->values.push_back(std::unique_ptr<VersioninfoResource::Entry>(
-        new VersioninfoResource::Entry(name_val, std::move(info_data))));
+    block->values.push_back(
+        arena_->New<VersioninfoResource::Entry>(name_val, info_data));
   }
   if (!Match(Token::kEndBlock, "expected END or }"))
-    return std::unique_ptr<VersioninfoResource::BlockData>();
+    return nullptr;
   return block;
 }
 
-std::unique_ptr<VersioninfoResource> Parser::ParseVersioninfo(
+VersioninfoResource* Parser::ParseVersioninfo(
     IntOrStringName name) {
   Location location = cur_or_last_token().location_;
   // Parse fixed info.
@@ -2532,17 +2416,17 @@ std::unique_ptr<VersioninfoResource> Parser::ParseVersioninfo(
   }, 10, &CaseInsensitiveHash, IsEqualAsciiUppercase};
   while (!at_end() && cur_token().type() != Token::kBeginBlock) {
     if (!Is(Token::kIdentifier, "expected identifier, BEGIN or {"))
-      return std::unique_ptr<VersioninfoResource>();
+      return nullptr;
     const Token& name = Consume();
     uint32_t val_num;
     if (!EvalIntExpression(&val_num))
-      return std::unique_ptr<VersioninfoResource>();
+      return nullptr;
     if (IsEqualAsciiUppercase(name.value_, "FILEVERSION") ||
         IsEqualAsciiUppercase(name.value_, "PRODUCTVERSION")) {
       uint32_t val_nums[4] = { val_num };
       for (int i = 0; i < 3 && Match(Token::kComma); ++i)
         if (!EvalIntExpression(&val_nums[i + 1]))
-          return std::unique_ptr<VersioninfoResource>();
+          return nullptr;
       if (IsEqualAsciiUppercase(name.value_, "FILEVERSION")) {
         fixed_info.fileversion_high = (val_nums[0] << 16) | val_nums[1];
         fixed_info.fileversion_low = (val_nums[2] << 16) | val_nums[3];
@@ -2554,22 +2438,21 @@ std::unique_ptr<VersioninfoResource> Parser::ParseVersioninfo(
       auto it = fields.find(name.value_);
       if (it == fields.end()) {
         SetError("unknown field " + AsString(name.value_));
-        return std::unique_ptr<VersioninfoResource>();
+        return nullptr;
       }
       *it->second = val_num;
     }
   }
 
   // Parse block info.
-  std::unique_ptr<VersioninfoResource::BlockData> block =
-      ParseVersioninfoBlock();
+  VersioninfoResource::BlockData* block = ParseVersioninfoBlock();
   if (!block)
-    return std::unique_ptr<VersioninfoResource>();
-  return std::make_unique<VersioninfoResource>(location, name, fixed_info,
-                                               std::move(*block.get()));
+    return nullptr;
+  return arena_->New<VersioninfoResource>(location, name, fixed_info,
+                                          std::move(*block));
 }
 
-std::unique_ptr<Resource> Parser::ParseResource() {
+Resource* Parser::ParseResource() {
   Location location = cur_or_last_token().location_;
   // FIXME: `"hi ho" {}` is parsed by Microsoft rc as a user-defined resource
   // with id `"hi` and type `ho"` -- so their tokenizer is context-dependent.
@@ -2580,7 +2463,7 @@ std::unique_ptr<Resource> Parser::ParseResource() {
 
   if (at_end()) {
     SetError("expected resource name");
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
 
   // Normally, name first.
@@ -2600,7 +2483,7 @@ std::unique_ptr<Resource> Parser::ParseResource() {
       id.type() != Token::kIdentifier) {
     SetError("expected int, string, or identifier, got " +
              AsString(cur_or_last_token().value_));
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
   uint16_t id_int = 0;
   if (id.type() == Token::kInt) {
@@ -2611,7 +2494,7 @@ std::unique_ptr<Resource> Parser::ParseResource() {
   // FIXME: "", \a, L"" handling?
   if (!id_int &&
       !ToUTF16(&id_utf16, id.value_, encoding_, &err_))  // Do NOT strip quotes
-    return std::unique_ptr<Resource>();
+    return nullptr;
   // FIXME: consider warning on non-int IDs, that seems to be unintentional
   // quite often.
   IntOrStringName name =
@@ -2622,7 +2505,7 @@ std::unique_ptr<Resource> Parser::ParseResource() {
   const Token& type = Consume();
   if (at_end()) {
     SetError("expected resource type");
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
 
   // FIXME: skip Common Resource Attributes if needed:
@@ -2643,7 +2526,7 @@ std::unique_ptr<Resource> Parser::ParseResource() {
   if (type.type_ == Token::kIdentifier &&
       IsEqualAsciiUppercase(type.value_, "MENUEX")) {
     SetError("MENUEX not implemented yet");  // FIXME
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
   if (type.type_ == Token::kIdentifier &&
       IsEqualAsciiUppercase(type.value_, "DIALOG"))
@@ -2657,7 +2540,7 @@ std::unique_ptr<Resource> Parser::ParseResource() {
   if (type.type_ == Token::kIdentifier &&
       IsEqualAsciiUppercase(type.value_, "MESSAGETABLE")) {
     SetError("MESSAGETABLE not implemented yet");  // FIXME
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
   if (type.type_ == Token::kIdentifier &&
       IsEqualAsciiUppercase(type.value_, "VERSIONINFO"))
@@ -2666,28 +2549,28 @@ std::unique_ptr<Resource> Parser::ParseResource() {
   // Unsupported types.
   if (IsEqualAsciiUppercase(type.value_, "FONTDIR")) {
     SetError("FONTDIR not implemented yet");  // FIXME
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
   if (IsEqualAsciiUppercase(type.value_, "FONT")) {
     SetError("FONT not implemented yet");  // FIXME
     // If this gets implemented: rc requires numeric names for FONTs.
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
   if (IsEqualAsciiUppercase(type.value_, "PLUGPLAY")) {
     SetError("PLUGPLAY not implemented");
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
   if (IsEqualAsciiUppercase(type.value_, "VXD")) {
     SetError("VXD not implemented");
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
   if (IsEqualAsciiUppercase(type.value_, "ANICURSOR")) {
     SetError("ANICURSOR not implemented yet");  // FIXME
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
   if (IsEqualAsciiUppercase(type.value_, "ANIICON")) {
     SetError("ANIICON not implemented yet");  // FIXME
-    return std::unique_ptr<Resource>();
+    return nullptr;
   }
 
   // Types always taking a string parameter.
@@ -2697,18 +2580,18 @@ std::unique_ptr<Resource> Parser::ParseResource() {
                       IsEqualAsciiUppercase(type.value_, "DLGINCLUDE");
   if (needs_string) {
     if (!Is(Token::kString, "expected string"))
-      return std::unique_ptr<DialogResource>();
+      return nullptr;
     const Token& data = Consume();
     std::string_view str_val = StringContents(data);
 
     if (IsEqualAsciiUppercase(type.value_, "CURSOR"))
-      return std::make_unique<CursorResource>(location, name, str_val);
+      return arena_->New<CursorResource>(location, name, str_val);
     if (IsEqualAsciiUppercase(type.value_, "BITMAP"))
-      return std::make_unique<BitmapResource>(location, name, str_val);
+      return arena_->New<BitmapResource>(location, name, str_val);
     if (IsEqualAsciiUppercase(type.value_, "ICON"))
-      return std::make_unique<IconResource>(location, name, str_val);
+      return arena_->New<IconResource>(location, name, str_val);
     if (IsEqualAsciiUppercase(type.value_, "DLGINCLUDE"))
-      return std::make_unique<DlgincludeResource>(location, name, str_val);
+      return arena_->New<DlgincludeResource>(location, name, str_val);
   }
 
   // The remaining types can either take a string filename or a BEGIN END
@@ -2717,13 +2600,13 @@ std::unique_ptr<Resource> Parser::ParseResource() {
   if (data.type_ == Token::kBeginBlock) {
     std::vector<uint8_t> raw_data;
     if (!ParseRawData(&raw_data))
-      return std::unique_ptr<Resource>();
+      return nullptr;
 
     if (IsEqualAsciiUppercase(type.value_, "RCDATA"))
-      return std::make_unique<RcdataResource>(
+      return arena_->New<RcdataResource>(
           location, name, std::move(raw_data));
     if (IsEqualAsciiUppercase(type.value_, "HTML"))
-      return std::make_unique<HtmlResource>(
+      return arena_->New<HtmlResource>(
           location, name, std::move(raw_data));
 
     // Not a known resource type, so it's a User-Defined Resource.
@@ -2734,22 +2617,22 @@ std::unique_ptr<Resource> Parser::ParseResource() {
       // FIXME: "", \a, L"" handling?
       if (type.type() != Token::kInt &&
           !ToUTF16(&type_utf16, type.value_, encoding_, &err_))
-        return std::unique_ptr<Resource>();
+        return nullptr;
       IntOrStringName type_name =
           type.type() == Token::kInt
              ? IntOrStringName::MakeInt(type.IntValue())
              : IntOrStringName::MakeUpperStringUTF16(type_utf16);
-      return std::make_unique<UserDefinedResource>(location, type_name, name,
-                                                   std::move(raw_data));
+      return arena_->New<UserDefinedResource>(location, type_name, name,
+                                              std::move(raw_data));
     }
   }
 
   if (type.type_ == Token::kIdentifier && data.type_ == Token::kString) {
     std::string_view str_val = StringContents(data);
     if (IsEqualAsciiUppercase(type.value_, "RCDATA"))
-      return std::make_unique<RcdataResource>(location, name, str_val);
+      return arena_->New<RcdataResource>(location, name, str_val);
     if (IsEqualAsciiUppercase(type.value_, "HTML"))
-      return std::make_unique<HtmlResource>(location, name, str_val);
+      return arena_->New<HtmlResource>(location, name, str_val);
   }
 
   // Not a known resource type, so it's a custom User-Defined Resource.
@@ -2764,35 +2647,35 @@ std::unique_ptr<Resource> Parser::ParseResource() {
     // FIXME: "", \a, L"" handling?
     if (type_int == 0 &&
         !ToUTF16(&type_utf16, type.value_, encoding_, &err_))
-      return std::unique_ptr<Resource>();
+      return nullptr;
 
     std::string_view str_val = StringContents(data);
     IntOrStringName type_name = type_int != 0
                                     ? IntOrStringName::MakeInt(type_int)
                                     : IntOrStringName::MakeUpperStringUTF16(
                                           type_utf16);
-    return std::make_unique<UserDefinedResource>(
+    return arena_->New<UserDefinedResource>(
         location, type_name, name, str_val);
   }
 
   SetError("unknown resource, type " + AsString(type.value_));
-  return std::unique_ptr<Resource>();
+  return nullptr;
 }
 
-std::unique_ptr<FileBlock> Parser::ParseFile(std::string* err) {
-  std::unique_ptr<FileBlock> file(new FileBlock);
+FileBlock* Parser::ParseFile(std::string* err) {
+  FileBlock* file = arena_->New<FileBlock>();
   for (;;) {
     if (at_end())
       break;
 
-    std::unique_ptr<Resource> res = ParseResource();
+    Resource* res = ParseResource();
     if (!res)
       break;
-    file->res_.push_back(std::move(res));
+    file->res_.push_back(res);
   }
   if (has_error()) {
     *err = err_;
-    return std::unique_ptr<FileBlock>();
+    return nullptr;
   }
   return file;
 }
@@ -2826,42 +2709,395 @@ enum {
   kRT_MANIFEST = 24,
 };
 
-static void write_little_long(FILE* f, uint32_t l) {
+// Builds a .res file in memory, so that size fields in resource headers can
+// be patched after the resource data has been written, and so that the
+// output can be written with a single writev() call.  Large payloads from
+// input files (bitmaps, icons, manifests, ...) aren't copied into the buffer;
+// the output refers to the (mmap()ed) input file contents instead.
+class ResWriter {
+ public:
+  // Logical size of the output so far, including external payloads.
+  size_t size() const { return size_; }
+  // Offset of the next byte written to the buffer, for Patch*().
+  size_t buffer_pos() const { return buf_.size(); }
+
+  void Write(const void* data, size_t size) {
+    buf_.append((const char*)data, size);
+    size_ += size;
+  }
+  void WriteByte(uint8_t b) {
+    buf_.push_back(b);
+    ++size_;
+  }
+  // |data| must stay valid until WriteTo() is called.
+  void WriteExternal(const uint8_t* data, size_t size);
+
+  void Reserve(size_t buffer_size) { buf_.reserve(buffer_size); }
+  const uint8_t* buffer() const { return (const uint8_t*)buf_.data(); }
+  // Number of bytes written with WriteExternal() and not in the buffer.
+  size_t external_size() const { return size_ - buf_.size(); }
+
+  // Writes the |size| bytes at logical offset |pos| to |dst|.  The range
+  // must not start or end within external data, which stays external.
+  void CopyTo(size_t pos, size_t size, ResWriter* dst) const;
+
+  void PatchLittleShort(size_t buffer_pos, uint16_t l) {
+    buf_[buffer_pos] = l & 0xff;
+    buf_[buffer_pos + 1] = l >> 8;
+  }
+  void PatchLittleLong(size_t buffer_pos, uint32_t l) {
+    PatchLittleShort(buffer_pos, l & 0xffff);
+    PatchLittleShort(buffer_pos + 2, l >> 16);
+  }
+
+  // Pads the output with \0 bytes to the next multiple of 4.
+  void PadToDword() { Write("\0\0\0", (4 - (size_ & 3)) & 3); }
+
+  bool WriteTo(const std::string& path, std::string* err) const;
+  // The whole output, including external data, in one string.
+  std::string ToString() const;
+
+ private:
+  struct External {
+    size_t buffer_pos;  // External data goes before this buffer offset.
+    size_t pos;  // Logical offset of the data.
+    const uint8_t* data;
+    size_t size;
+  };
+  std::string buf_;
+  std::vector<External> externals_;
+  size_t size_ = 0;
+};
+
+void ResWriter::WriteExternal(const uint8_t* data, size_t size) {
+  // Small payloads are cheaper to copy than to give their own iovec.
+  const size_t kMinExternalSize = 4096;
+  if (size < kMinExternalSize) {
+    Write(data, size);
+    return;
+  }
+  externals_.push_back(External{buf_.size(), size_, data, size});
+  size_ += size;
+}
+
+void ResWriter::CopyTo(size_t pos, size_t size, ResWriter* dst) const {
+  auto it = std::lower_bound(
+      externals_.begin(), externals_.end(), pos,
+      [](const External& e, size_t pos) { return e.pos < pos; });
+  // Map |pos| to a buffer offset by subtracting the external data before it.
+  size_t buffer_pos = pos;
+  if (it != externals_.begin())
+    buffer_pos -= std::prev(it)->pos + std::prev(it)->size -
+                  std::prev(it)->buffer_pos;
+  size_t end = pos + size;
+  for (; it != externals_.end() && it->pos < end; ++it) {
+    dst->Write(buf_.data() + buffer_pos, it->buffer_pos - buffer_pos);
+    dst->WriteExternal(it->data, it->size);
+    buffer_pos = it->buffer_pos;
+    pos = it->pos + it->size;
+  }
+  dst->Write(buf_.data() + buffer_pos, end - pos);
+}
+
+std::string ResWriter::ToString() const {
+  std::string s;
+  s.reserve(size_);
+  size_t pos = 0;
+  for (const External& e : externals_) {
+    s.append(buf_, pos, e.buffer_pos - pos);
+    s.append((const char*)e.data, e.size);
+    pos = e.buffer_pos;
+  }
+  s.append(buf_, pos, std::string::npos);
+  return s;
+}
+
+bool ResWriter::WriteTo(const std::string& path, std::string* err) const {
+#if defined(_MSC_VER)
+  FILE* f = fopen(path.c_str(), "wb");
+  if (!f) {
+    *err = Location{ path, 0, 0}.Error("failed to open file");
+    return false;
+  }
+  size_t pos = 0;
+  for (const External& e : externals_) {
+    fwrite(buf_.data() + pos, 1, e.buffer_pos - pos, f);
+    fwrite(e.data, 1, e.size, f);
+    pos = e.buffer_pos;
+  }
+  fwrite(buf_.data() + pos, 1, buf_.size() - pos, f);
+  bool ok = !ferror(f);
+  if (fclose(f) != 0)
+    ok = false;
+#else
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    *err = Location{ path, 0, 0}.Error("failed to open file");
+    return false;
+  }
+  std::vector<iovec> iov;
+  iov.reserve(2 * externals_.size() + 1);
+  size_t pos = 0;
+  for (const External& e : externals_) {
+    if (e.buffer_pos > pos)
+      iov.push_back(iovec{(void*)(buf_.data() + pos), e.buffer_pos - pos});
+    iov.push_back(iovec{(void*)e.data, e.size});
+    pos = e.buffer_pos;
+  }
+  if (buf_.size() > pos)
+    iov.push_back(iovec{(void*)(buf_.data() + pos), buf_.size() - pos});
+
+  // Usually a single writev(), but it's allowed to write less than asked
+  // for, and it takes at most IOV_MAX buffers.
+  bool ok = true;
+  size_t i = 0;
+  while (ok && i < iov.size()) {
+    int n = (int)std::min<size_t>(iov.size() - i, IOV_MAX);
+    ssize_t written = writev(fd, &iov[i], n);
+    if (written < 0) {
+      ok = errno == EINTR;
+      continue;
+    }
+    while (i < iov.size() && (size_t)written >= iov[i].iov_len)
+      written -= iov[i++].iov_len;
+    if (written) {
+      iov[i].iov_base = (char*)iov[i].iov_base + written;
+      iov[i].iov_len -= written;
+    }
+  }
+  if (close(fd) != 0)
+    ok = false;
+#endif
+  if (!ok)
+    *err = Location{ path, 0, 0}.Error("failed to write file");
+  return ok;
+}
+
+static void write_little_long(ResWriter* w, uint32_t l) {
   uint8_t bytes[] = { l & 0xff, (l >> 8) & 0xff, (l >> 16) & 0xff, l >> 24 };
-  fwrite(bytes, 1, sizeof(bytes), f);
+  w->Write(bytes, sizeof(bytes));
 }
 
-static void write_little_short(FILE* f, uint16_t l) {
+static void write_little_short(ResWriter* w, uint16_t l) {
   uint8_t bytes[] = { l & 0xff, (l >> 8) };
-  fwrite(bytes, 1, sizeof(bytes), f);
+  w->Write(bytes, sizeof(bytes));
+}
+
+void IntOrStringName::write(ResWriter* w) const {
+  w->Write(data_.data(), data_.size() * 2);
+}
+
+static uint16_t read_little_short(const uint8_t* d) {
+  return d[0] | (d[1] << 8);
+}
+
+static uint32_t read_little_long(const uint8_t* d) {
+  return d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+}
+
+// Read-only contents of a file.  Regular files are mmap()ed, everything else
+// (stdin, pipes) is read into memory.
+class MappedFile {
+ public:
+  MappedFile() {}
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // On failure, returns false with errno set.
+  bool Open(const std::string& path);
+  bool Read(FILE* f);
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+  std::string_view view() const {
+    return std::string_view((const char*)data_, size_);
+  }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  std::string buffer_;  // Backing store if not mapped.
+};
+
+MappedFile::~MappedFile() {
+  if (!mapped_)
+    return;
+#if defined(_MSC_VER)
+  UnmapViewOfFile(data_);
+#else
+  munmap((void*)data_, size_);
+#endif
+}
+
+bool MappedFile::Open(const std::string& path) {
+#if defined(_MSC_VER)
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    DWORD error = GetLastError();
+    errno = error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND
+                ? ENOENT : EACCES;
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || GetFileType(file) != FILE_TYPE_DISK) {
+    CloseHandle(file);
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+      return false;
+    bool ok = Read(f);
+    fclose(f);
+    return ok;
+  }
+  size_ = (size_t)size.QuadPart;
+  if (size_ > 0) {
+    HANDLE mapping =
+        CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+      data_ = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+    }
+    if (!data_) {
+      CloseHandle(file);
+      errno = EIO;
+      return false;
+    }
+    mapped_ = true;
+  }
+  CloseHandle(file);
+  return true;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* data = mmap(/*addr=*/0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      close(fd);
+      data_ = (const uint8_t*)data;
+      size_ = st.st_size;
+      mapped_ = true;
+      return true;
+    }
+  }
+  // Empty, not a regular file, or mmap() failed: read instead.
+  FILE* f = fdopen(fd, "rb");
+  if (!f) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return false;
+  }
+  bool ok = Read(f);
+  int error = errno;
+  fclose(f);
+  errno = error;
+  return ok;
+#endif
+}
+
+bool MappedFile::Read(FILE* f) {
+  char buf[64 << 10];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+    buffer_.append(buf, len);
+  if (ferror(f)) {
+    if (!errno)
+      errno = EIO;
+    return false;
+  }
+  data_ = (const uint8_t*)buffer_.data();
+  size_ = buffer_.size();
+  return true;
 }
 
-static uint16_t read_little_short(FILE* f) {
-  uint16_t r = fgetc(f);  // XXX error handling
-  r |= fgetc(f) << 8;
-  return r;
+// Caches files referenced by .rc files (icons, bitmaps, manifests, ...), keyed
+// by the path passed to fopen().  In /batch mode, all jobs share one cache, so
+// a file included by many .rc files is read only once.  Failed lookups are
+// cached too, since every include directory is probed for every file.
+class FileCache {
+ public:
+  // Returns nullptr and sets |error| to an errno value if |path| can't be
+  // read.  Thread-safe.  Returned pointers stay valid for the lifetime of the
+  // cache.
+  const MappedFile* Get(const std::string& path, int* error);
+
+ private:
+  struct Entry {
+    std::once_flag once;
+    int error = 0;
+    MappedFile file;
+  };
+  static void Load(const std::string& path, Entry* entry);
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<Entry>> entries_;
+};
+
+const MappedFile* FileCache::Get(const std::string& path, int* error) {
+  Entry* entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Entry>& slot = entries_[path];
+    if (!slot)
+      slot.reset(new Entry);
+    entry = slot.get();
+  }
+  // Read outside of mutex_ so that other jobs can look up other files
+  // meanwhile.
+  std::call_once(entry->once, Load, path, entry);
+  if (entry->error) {
+    *error = entry->error;
+    return nullptr;
+  }
+  return &entry->file;
 }
 
-static uint32_t read_little_long(FILE* f) {
-  uint32_t r = fgetc(f);  // XXX error handling
-  r |= fgetc(f) << 8;
-  r |= fgetc(f) << 16;
-  r |= fgetc(f) << 24;
-  return r;
+// static
+void FileCache::Load(const std::string& path, Entry* entry) {
+  if (!entry->file.Open(path))
+    entry->error = errno ? errno : EIO;
 }
 
+// Records the files that a compile reads, for /showIncludes and /depfile.
+struct Dependencies {
+  // Records that |path| was read, and adds a note if |show_includes| is set.
+  void Add(const std::string& path);
+
+  // Like Add(), but also remembers the name that was looked up, so that the
+  // /cache: manifest can check that it still resolves to the same file.
+  void AddResource(const char* name, const std::string& path) {
+    resources.emplace_back(name, path);
+    Add(path);
+  }
+
+  bool show_includes = false;
+  std::string notes;  // /showIncludes output.
+  std::vector<std::string> files;  // Paths as found in the include path.
+  std::vector<std::pair<std::string, std::string>> resources;
+
+ private:
+  std::unordered_set<std::string> seen_;
+};
+
 // The format of .res files is documented at
 // https://msdn.microsoft.com/en-us/library/windows/desktop/ms648007(v=vs.85).aspx
 class SerializationVisitor : public Visitor {
  public:
   // FIXME: rc.exe gets the default language from the system while this
   // hardcodes US English. Neither seems like a great default.
+  // Files read while writing resources are recorded in |deps|.
   SerializationVisitor(
-      FILE* f, const std::vector<std::string>& include_dirs,
-      bool show_includes, InternalEncoding encoding, std::string* err)
-      : out_(f),
+      ResWriter* out, const std::vector<std::string>& include_dirs,
+      FileCache* file_cache, Dependencies* deps, InternalEncoding encoding,
+      std::string* err)
+      : out_(out),
         include_dirs_(include_dirs),
-        show_includes_(show_includes),
+        file_cache_(file_cache),
+        deps_(deps),
         err_(err),
         next_icon_id_(1),
         cur_language_{9, 1},
@@ -2873,6 +3109,14 @@ class SerializationVisitor : public Visitor {
       IntOrStringName name,
       uint16_t memory_flags = 0x1030,
       std::optional<uint16_t> language = std::optional<uint16_t>());
+  // Writes a resource header with a placeholder data size, which is filled in
+  // by the matching EndResource() call.
+  void BeginResource(
+      IntOrStringName type,
+      IntOrStringName name,
+      uint16_t memory_flags = 0x1030,
+      std::optional<uint16_t> language = std::optional<uint16_t>());
+  void EndResource();
   bool WriteFileOrDataResource(
       IntOrStringName type, const FileOrDataResource* r);
 
@@ -2890,17 +3134,30 @@ class SerializationVisitor : public Visitor {
   bool VisitHtmlResource(const HtmlResource* r) override;
   bool VisitUserDefinedResource(const UserDefinedResource* r) override;
 
-  bool WriteStringtables();
+  // Converts the string bundles on up to |num_threads| threads, 0 meaning
+  // one per core.
+  bool WriteStringtables(unsigned num_threads);
+
+  // Where each resource written by BeginResource() is in the output.
+  struct ResourcePos {
+    size_t header_pos;  // Buffer offset of the resource header.
+    size_t data_start;  // Logical offset of the resource data.
+  };
+  const std::vector<ResourcePos>& resources() const { return resources_; }
 
  private:
-  FILE* OpenFile(const char* path);
+  const MappedFile* OpenFile(const char* path);
 
   enum GroupType { kIcon = 1, kCursor = 2 };
   bool WriteIconOrCursorGroup(const FileResource* r, GroupType type);
 
-  FILE* out_;
+  ResWriter* out_;
+  size_t resource_header_pos_;  // Buffer offset of current resource header.
+  size_t resource_data_start_;  // Logical offset of current resource data.
+  std::vector<ResourcePos> resources_;
   const std::vector<std::string>& include_dirs_;
-  bool show_includes_;
+  FileCache* file_cache_;
+  Dependencies* deps_;
   std::string* err_;
   int next_icon_id_;
   LanguageResource::Language cur_language_;
@@ -2915,27 +3172,28 @@ class SerializationVisitor : public Visitor {
     BundleKey key;
     const std::string_view* strings[16];
   };
-  bool EmitOneStringBundle(const StringBundle& bundle);
-  std::list<StringBundle> string_bundles_;
-  std::map<BundleKey, std::list<StringBundle>::iterator> bundle_index;
-};
-
-struct FClose {
-  FClose(FILE* f) : f_(f) {}
-  ~FClose() { if (f_) fclose(f_); }
-  FILE* f_;
+  // Converts |bundle| to its resource data in |data|.  Doesn't touch the
+  // output, so this can run for several bundles in parallel.
+  bool ConvertStringBundle(const StringBundle& bundle,
+                           std::string* data,
+                           std::string* err) const;
+  StringBundle* GetStringBundle(BundleKey key);
+
+  // Bundles in the order rc.exe emits them, which is the order in which
+  // their first string appears in the input.
+  std::vector<StringBundle> string_bundles_;
+  // For each language that has strings, maps bundle number (id / 16) to
+  // 1 + the bundle's index in string_bundles_, or to 0 if the bundle
+  // doesn't exist yet.  There are only 4096 bundles per language, so this is
+  // a flat array instead of a map.
+  struct LanguageBundles {
+    LanguageResource::Language language;
+    std::unique_ptr<uint32_t[]> bundle_index;
+  };
+  std::vector<LanguageBundles> language_bundles_;
+  LanguageBundles* cur_language_bundles_ = nullptr;
 };
 
-void copy(FILE* to, FILE* from, size_t n) {
-  char buf[64 << 10];
-  size_t len;
-  while ((len = fread(buf, 1, std::min(sizeof(buf), n), from)) > 0) {
-    fwrite(buf, 1, len, to);
-    n -= len;
-  }
-  // XXX if (ferror(from) || ferror(to))...
-}
-
 std::string Join(const std::string dir, const char* path) {
   if (dir.empty())
     return path;
@@ -2952,40 +3210,52 @@ std::string Join(const std::string dir, const char* path) {
   return dir + "/" + path;
 }
 
-FILE* SerializationVisitor::OpenFile(const char* path) {
-  FILE* f = NULL;
-  std::string path_storage;
-  for (const std::string& dir : include_dirs_) {
-    path_storage = Join(dir, path);
+// Looks for |path| in |include_dirs|, in order, and sets |found_path| to the
+// first match.  Returns nullptr if |path| isn't found.
+const MappedFile* FindFile(const std::vector<std::string>& include_dirs,
+                           const char* path,
+                           FileCache* file_cache,
+                           std::string* found_path) {
+  for (const std::string& dir : include_dirs) {
+    *found_path = Join(dir, path);
 #if !defined(_WIN32)
     // .rc files often use \ as path separator, so fix that up on non-Windows.
-    std::replace(path_storage.begin(), path_storage.end(), '\\', '/');
+    std::replace(found_path->begin(), found_path->end(), '\\', '/');
 #endif
-    FILE* nf = fopen(path_storage.c_str(), "rb");
-    if (nf) {
-      f = nf;
-      path = path_storage.c_str();
-      break;
-    }
+    int error;
+    if (const MappedFile* f = file_cache->Get(*found_path, &error))
+      return f;
     // rc.exe only keeps searching if the file doesn't exist; if it exists
     // but is e.g. not readable, it fails. Match that.
-    if (errno != ENOENT)
+    if (error != ENOENT)
       break;
   }
-  if (!f) {
-    *err_ = Location{path}.Error("failed to open file");
-    return NULL;
-  }
-  if (show_includes_) {
+  return nullptr;
+}
+
+void Dependencies::Add(const std::string& path) {
+  if (seen_.insert(path).second)
+    files.push_back(path);
+  if (!show_includes)
+    return;
 #if !defined(_WIN32)
-    char full_path[PATH_MAX];
-    realpath(path, full_path);
+  char full_path[PATH_MAX];
+  realpath(path.c_str(), full_path);
 #else
-    char full_path[_MAX_PATH];
-    GetFullPathName(path, sizeof(full_path), full_path, NULL);
+  char full_path[_MAX_PATH];
+  GetFullPathName(path.c_str(), sizeof(full_path), full_path, NULL);
 #endif
-    printf("Note: including file: %s\n", full_path);
+  notes += std::string("Note: including file: ") + full_path + "\n";
+}
+
+const MappedFile* SerializationVisitor::OpenFile(const char* path) {
+  std::string found_path;
+  const MappedFile* f = FindFile(include_dirs_, path, file_cache_, &found_path);
+  if (!f) {
+    *err_ = Location{path}.Error("failed to open file");
+    return NULL;
   }
+  deps_->AddResource(path, found_path);
   return f;
 }
 
@@ -3017,30 +3287,41 @@ void SerializationVisitor::WriteResHeader(
   write_little_long(out_, 0);              // characteristics
 }
 
+void SerializationVisitor::BeginResource(
+    IntOrStringName type,
+    IntOrStringName name,
+    uint16_t memory_flags,
+    std::optional<uint16_t> language) {
+  resource_header_pos_ = out_->buffer_pos();
+  WriteResHeader(0, type, name, memory_flags, language);
+  resource_data_start_ = out_->size();
+  resources_.push_back(ResourcePos{resource_header_pos_, resource_data_start_});
+}
+
+void SerializationVisitor::EndResource() {
+  out_->PatchLittleLong(resource_header_pos_,
+                        out_->size() - resource_data_start_);
+  out_->PadToDword();  // DWORD-align.
+}
+
 bool SerializationVisitor::WriteFileOrDataResource(
     IntOrStringName type, const FileOrDataResource* r) {
   size_t size;
-  FILE* f = NULL;
+  const uint8_t* data;
   if (r->type() == FileOrDataResource::kFile) {
-    f = OpenFile(AsString(r->path()).c_str());
+    const MappedFile* f = OpenFile(AsString(r->path()).c_str());
     if (!f)
       return false;
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
+    size = f->size();
+    data = f->data();
   } else {
     size = r->data().size();
+    data = r->data().data();
   }
-  FClose closer(f);
 
-  WriteResHeader(size, type, r->name(), 0x30);
-
-  if (r->type() == FileOrDataResource::kFile) {
-    fseek(f, 0, SEEK_SET);
-    copy(out_, f, size);
-  } else
-    fwrite(r->data().data(), 1, size, out_);
-  uint8_t padding = ((4 - (size & 3)) & 3);  // DWORD-align.
-  fwrite("\0\0", 1, padding, out_);
+  BeginResource(type, r->name(), 0x30);
+  out_->WriteExternal(data, size);
+  EndResource();
 
   return true;
 }
@@ -3052,10 +3333,11 @@ bool SerializationVisitor::WriteIconOrCursorGroup(const FileResource* r,
   //kRT_GROUP_ICON.
   // .ico format: https://msdn.microsoft.com/en-us/library/ms997538.aspx
 
-  FILE* f = OpenFile(AsString(r->path()).c_str());
+  const MappedFile* f = OpenFile(AsString(r->path()).c_str());
   if (!f)
     return false;
-  FClose closer(f);
+  const uint8_t* data = f->data();
+  size_t file_size = f->size();
 
   struct IconDir {
     uint16_t reserved;  // must be 0
@@ -3063,18 +3345,22 @@ bool SerializationVisitor::WriteIconOrCursorGroup(const FileResource* r,
     uint16_t count;
   } dir;
 
-  dir.reserved = read_little_short(f);
+  if (file_size < 6) {
+    *err_ = r->location().Error("truncated file " + AsString(r->path()));
+    return false;
+  }
+  dir.reserved = read_little_short(data);
   if (dir.reserved != 0) {
     *err_ = r->location().Error("reserved not 0 in" + AsString(r->path()));
     return false;
   }
-  dir.type = read_little_short(f);
+  dir.type = read_little_short(data + 2);
   // rc.exe allows both 1 and 2 here for both ICON and CURSOR.
   if (dir.type != type) {
     *err_ = r->location().Error("unexpected type in " + AsString(r->path()));
     return false;
   }
-  dir.count = read_little_short(f);
+  dir.count = read_little_short(data + 4);
 
   // Read entries.
   struct IconEntry {
@@ -3090,49 +3376,54 @@ bool SerializationVisitor::WriteIconOrCursorGroup(const FileResource* r,
     uint32_t data_offset;  // used when reading
     uint16_t id;           // used when writing
   };
+  if (file_size < 6 + dir.count * 16u) {
+    *err_ = r->location().Error("truncated file " + AsString(r->path()));
+    return false;
+  }
   std::vector<IconEntry> entries(dir.count);
+  const uint8_t* entry_data = data + 6;
   for (IconEntry& entry : entries) {
-    entry.width = fgetc(f);
-    entry.height = fgetc(f);
-    entry.num_colors = fgetc(f);
-    entry.reserved = fgetc(f);
-    entry.num_planes = read_little_short(f);
-    entry.bpp = read_little_short(f);
-    entry.data_size = read_little_long(f);
-    entry.data_offset = read_little_long(f);
+    entry.width = entry_data[0];
+    entry.height = entry_data[1];
+    entry.num_colors = entry_data[2];
+    entry.reserved = entry_data[3];
+    entry.num_planes = read_little_short(entry_data + 4);
+    entry.bpp = read_little_short(entry_data + 6);
+    entry.data_size = read_little_long(entry_data + 8);
+    entry.data_offset = read_little_long(entry_data + 12);
+    entry_data += 16;
+
+    if (entry.data_offset > file_size ||
+        entry.data_size > file_size - entry.data_offset) {
+      *err_ = r->location().Error("truncated file " + AsString(r->path()));
+      return false;
+    }
   }
 
   // For each entry, write a kRT_ICON resource.
   for (IconEntry& entry : entries) {
-    // Cursors are prepended by their hotspot.
-    WriteResHeader(
-        entry.data_size + (type == kCursor ? 4 : 0),
+    BeginResource(
         IntOrStringName::MakeInt(type == kIcon ? kRT_ICON : kRT_CURSOR),
         IntOrStringName::MakeInt(next_icon_id_), 0x1010);
 
+    // Cursors are prepended by their hotspot.
     if (type == kCursor) {
       write_little_short(out_, entry.num_planes);  // hotspot_x
       write_little_short(out_, entry.bpp);         // hotspot_y
     }
 
-    fseek(f, entry.data_offset, SEEK_SET);
-    copy(out_, f, entry.data_size);
+    out_->WriteExternal(data + entry.data_offset, entry.data_size);
     if (type == kCursor)
       entry.data_size += 4;
 
     entry.id = next_icon_id_++;
-
-    uint8_t padding = (4 - (entry.data_size & 3)) & 3;  // DWORD-align.
-    fwrite("\0\0", 1, padding, out_);
+    EndResource();
   }
 
-  // Write final kRT_GROUP_ICON resource.
-  uint16_t group_size = 6 + dir.count * 14;   // 1 IconDir + n IconEntry
-  uint8_t group_padding = ((4 - (group_size & 3)) & 3);  // DWORD-align.
-  WriteResHeader(group_size,
-                 IntOrStringName::MakeInt(type == kIcon ? kRT_GROUP_ICON
-                                                        : kRT_GROUP_CURSOR),
-                 r->name());
+  // Write final kRT_GROUP_ICON resource, 1 IconDir + n IconEntry.
+  BeginResource(IntOrStringName::MakeInt(type == kIcon ? kRT_GROUP_ICON
+                                                       : kRT_GROUP_CURSOR),
+                r->name());
 
   write_little_short(out_, dir.reserved);
   write_little_short(out_, dir.type);
@@ -3144,15 +3435,14 @@ bool SerializationVisitor::WriteIconOrCursorGroup(const FileResource* r,
     // (if present) there too.  So always do this.
     uint16_t num_planes;
     uint16_t bpp;
-    fseek(f, entry.data_offset, SEEK_SET);
-    uint32_t bitmapinfoheader_size = read_little_long(f);
-    if (bitmapinfoheader_size == 0x28) {
+    const uint8_t* bitmap = data + entry.data_offset;
+    size_t bitmap_size = file_size - entry.data_offset;
+    if (bitmap_size >= 16 && read_little_long(bitmap) == 0x28) {
       // foo_new.ico just contains raw png data at the data offset, without
       // BITMAPINFOHEADER.  The 0x28 check prevents reading that.
-      (void)read_little_long(f);  // width
-      (void)read_little_long(f);  // height
-      num_planes = read_little_short(f);
-      bpp = read_little_short(f);
+      // Skip size, width, height.
+      num_planes = read_little_short(bitmap + 12);
+      bpp = read_little_short(bitmap + 14);
     } else {
       // A PNG .ico file.
       // https://blogs.msdn.microsoft.com/oldnewthing/20101022-00/?p=12473
@@ -3162,10 +3452,10 @@ bool SerializationVisitor::WriteIconOrCursorGroup(const FileResource* r,
     }
 
     if (type == kIcon) {
-      fputc(entry.width, out_);
-      fputc(entry.height, out_);
-      fputc(entry.num_colors, out_);
-      fputc(entry.reserved, out_);
+      out_->WriteByte(entry.width);
+      out_->WriteByte(entry.height);
+      out_->WriteByte(entry.num_colors);
+      out_->WriteByte(entry.reserved);
       write_little_short(out_, num_planes);
       write_little_short(out_, bpp);
     } else {
@@ -3182,8 +3472,7 @@ bool SerializationVisitor::WriteIconOrCursorGroup(const FileResource* r,
     write_little_long(out_, entry.data_size);
     write_little_short(out_, entry.id);
   }
-  //fwrite(":)", 1, group_padding, out_);
-  fwrite("\0\0", 1, group_padding, out_);
+  EndResource();
 
   return true;
 }
@@ -3198,25 +3487,21 @@ bool SerializationVisitor::VisitCursorResource(const CursorResource* r) {
 }
 
 bool SerializationVisitor::VisitBitmapResource(const BitmapResource* r) {
-  FILE* f = OpenFile(AsString(r->path()).c_str());
+  const MappedFile* f = OpenFile(AsString(r->path()).c_str());
   if (!f)
     return false;
-  FClose closer(f);
-  fseek(f, 0, SEEK_END);
-  size_t size = ftell(f);
   // https://support.microsoft.com/en-us/kb/67883
   // "NOTE: The BITMAPFILEHEADER structure is NOT present in the packed DIB;
   //  however, it is present in a DIB read from disk."
   const int kBitmapFileHeaderSize = 14;
-  size -= kBitmapFileHeaderSize;
-
-  WriteResHeader(size, IntOrStringName::MakeInt(kRT_BITMAP), r->name(), 0x30);
-
-  fseek(f, kBitmapFileHeaderSize, SEEK_SET);
-  copy(out_, f, size);
-
-  uint8_t padding = ((4 - (size & 3)) & 3);  // DWORD-align.
-  fwrite("\0\0", 1, padding, out_);
+  if (f->size() < kBitmapFileHeaderSize) {
+    *err_ = r->location().Error("truncated file " + AsString(r->path()));
+    return false;
+  }
+  BeginResource(IntOrStringName::MakeInt(kRT_BITMAP), r->name(), 0x30);
+  out_->WriteExternal(f->data() + kBitmapFileHeaderSize,
+                      f->size() - kBitmapFileHeaderSize);
+  EndResource();
 
   return true;
 }
@@ -3225,31 +3510,7 @@ bool SerializationVisitor::VisitIconResource(const IconResource* r) {
   return WriteIconOrCursorGroup(r, kIcon);
 }
 
-bool CountMenu(const MenuResource::SubmenuEntryData& submenu,
-               InternalEncoding encoding,
-               std::string* err,
-               size_t* num_submenus,
-               size_t* num_items,
-               size_t* total_string_length) {
-  for (const auto& item : submenu.subentries) {
-    C16string name_utf16;
-    if (!ToUTF16(&name_utf16, item->name, encoding, err))
-      return false;
-    *total_string_length += name_utf16.size() + 1;
-    if (item->style & kMenuPOPUP) {
-      ++*num_submenus;
-      if (!CountMenu(static_cast<MenuResource::SubmenuEntryData&>(*item->data),
-                     encoding, err, num_submenus, num_items,
-                     total_string_length))
-        return false;
-    } else {
-      ++*num_items;
-    }
-  }
-  return true;
-}
-
-bool WriteMenu(FILE* out, InternalEncoding encoding, std::string* err,
+bool WriteMenu(ResWriter* out, InternalEncoding encoding, std::string* err,
                const MenuResource::SubmenuEntryData& submenu) {
   for (const auto& item : submenu.subentries) {
     uint16_t style = item->style;
@@ -3276,14 +3537,7 @@ bool WriteMenu(FILE* out, InternalEncoding encoding, std::string* err,
 }
 
 bool SerializationVisitor::VisitMenuResource(const MenuResource* r) {
-  size_t num_submenus = 0, num_items = 0, total_string_length = 0;
-  if (!CountMenu(r->entries_, encoding_, err_,
-                 &num_submenus, &num_items, &total_string_length))
-    return false;
-
-  size_t size = 4 + (num_submenus + 2*num_items + total_string_length) * 2;
-
-  WriteResHeader(size, IntOrStringName::MakeInt(kRT_MENU), r->name());
+  BeginResource(IntOrStringName::MakeInt(kRT_MENU), r->name());
 
   // After header, 4 bytes, always 0 as far as I can tell.
   // Maybe style and name of toplevel menu.
@@ -3306,40 +3560,20 @@ bool SerializationVisitor::VisitMenuResource(const MenuResource* r) {
   // have chosen!)
   if (!WriteMenu(out_, encoding_, err_, r->entries_))
     return false;
-  if (size % 4) // Pad to dword.
-    write_little_short(out_, 0);
+  EndResource();
   return true;
 }
 
 bool SerializationVisitor::VisitDialogResource(const DialogResource* r) {
-  size_t fixed_size = r->kind == DialogResource::kDialogEx ? 0x1a : 0x12;
-  fixed_size += r->clazz.serialized_size();
-
   C16string caption_utf16;
   if (!ToUTF16(&caption_utf16, r->caption, encoding_, err_))
     return false;
-  fixed_size += (caption_utf16.size() + 1) * 2;
 
   C16string fontname_utf16;
-  if (r->font) {
-    fixed_size += 2;  // 1 uint16_t font size.
-    if (r->kind == DialogResource::kDialogEx)
-      fixed_size += 4;  // uint16_t font weight, 2 uint8_t italic, charset
-
-    if (!ToUTF16(&fontname_utf16, r->font->name, encoding_, err_))
-      return false;
-    fixed_size += 2 * (fontname_utf16.size() + 1);
-  }
-  fixed_size += r->menu.serialized_size();
-
-  size_t size = fixed_size;
-  if (r->controls.size() && fixed_size % 4)
-    size += 2;  // pad to uint32_t after header.
-
-  for (const auto& c : r->controls)
-    size += c.serialized_size(&c == &r->controls.back(), r->kind);
+  if (r->font && !ToUTF16(&fontname_utf16, r->font->name, encoding_, err_))
+    return false;
 
-  WriteResHeader(size, IntOrStringName::MakeInt(kRT_DIALOG), r->name());
+  BeginResource(IntOrStringName::MakeInt(kRT_DIALOG), r->name());
 
   // DIALOGEX seems to have a pretty different layout :-/
   struct DialogData {
@@ -3428,18 +3662,18 @@ bool SerializationVisitor::VisitDialogResource(const DialogResource* r) {
     write_little_short(out_, r->font->size);
     if (r->kind == DialogResource::kDialogEx) {
       write_little_short(out_, r->font->weight);
-      fputc(r->font->italic, out_);
-      fputc(r->font->charset, out_);
+      out_->WriteByte(r->font->italic);
+      out_->WriteByte(r->font->charset);
     }
     for (size_t j = 0; j < fontname_utf16.size(); ++j)
       write_little_short(out_, fontname_utf16[j]);
     write_little_short(out_, 0);
   }
 
-  if (fixed_size % 4) {
-    // Pad to dword after header.
-    write_little_short(out_, 0);
-  }
+  // Pad to dword after header.  If there are no controls, this padding isn't
+  // part of the resource's size.
+  if (!r->controls.empty())
+    out_->PadToDword();
 
   // Write dialog controls.
   for (const auto& c : r->controls) {
@@ -3468,12 +3702,12 @@ bool SerializationVisitor::VisitDialogResource(const DialogResource* r) {
     // ends on a uint32_t boundary.
     write_little_short(out_, 0);
 
-    // In DIALOGEX, the bigger id shifts everything by 2 bytes.
-    if ((c.clazz.serialized_size() + c.text.serialized_size()) % 4 !=
-        2*int(r->kind == DialogResource::kDialogEx))
-      write_little_short(out_, 0);  // pad, but see FIXME above
+    // Padding after the last control isn't part of the resource's size.
+    if (&c != &r->controls.back())
+      out_->PadToDword();  // pad, but see FIXME above
   }
 
+  EndResource();
   return true;
 }
 
@@ -3483,15 +3717,7 @@ bool SerializationVisitor::VisitStringtableResource(
   // input file.
   for (auto& str : *r) {
     BundleKey key{str.id & ~0xF, cur_language_};
-    auto it = bundle_index.find(key);
-    StringBundle* bundle;
-    if (it == bundle_index.end()) {
-      string_bundles_.push_back(StringBundle(key));
-      bundle_index[key] = std::prev(string_bundles_.end());
-      bundle = &string_bundles_.back();
-    } else {
-      bundle = &*it->second;
-    }
+    StringBundle* bundle = GetStringBundle(key);
     if (bundle->strings[str.id - key.first]) {
       *err_ = str.location.Error(
           "duplicate string table key " + std::to_string(str.id));
@@ -3504,9 +3730,7 @@ bool SerializationVisitor::VisitStringtableResource(
 
 bool SerializationVisitor::VisitAcceleratorsResource(
     const AcceleratorsResource* r) {
-  size_t size = r->accelerators().size() * 8;
-  WriteResHeader(size, IntOrStringName::MakeInt(kRT_ACCELERATOR), r->name(),
-                 0x30);
+  BeginResource(IntOrStringName::MakeInt(kRT_ACCELERATOR), r->name(), 0x30);
   for (const auto& accelerator : r->accelerators()) {
     uint16_t flags = accelerator.flags;
     if (&accelerator == &r->accelerators().back())
@@ -3516,6 +3740,7 @@ bool SerializationVisitor::VisitAcceleratorsResource(
     write_little_short(out_, accelerator.id);
     write_little_short(out_, accelerator.pad);
   }
+  EndResource();
   return true;
 }
 
@@ -3523,50 +3748,19 @@ bool SerializationVisitor::VisitRcdataResource(const RcdataResource* r) {
   return WriteFileOrDataResource(IntOrStringName::MakeInt(kRT_RCDATA), r);
 }
 
-bool CountBlock(
-    const VersioninfoResource::BlockData& block,
-    InternalEncoding encoding,
-    std::string* err,
-    uint16_t* total_size,
-    std::unordered_map<VersioninfoResource::Entry*, uint16_t>* sizes) {
+bool WriteBlock(ResWriter* out,
+                InternalEncoding encoding,
+                std::string* err,
+                const VersioninfoResource::BlockData& block) {
   for (const auto& value : block.values) {
-    C16string key_utf16;
-    if (!ToUTF16(&key_utf16, value->key, encoding, err))
-      return false;
-    uint16_t size =
-        3 * sizeof(uint16_t) + sizeof(char16_t) * (key_utf16.size() + 1);
-    if (size % 4)
-      size += 2;  // Pad to 4 bytes after name.
-    if (value->data->type_ == VersioninfoResource::InfoData::kValue) {
-      size += static_cast<VersioninfoResource::ValueData&>(*value->data)
-                  .value.size();
-    } else {
-      // Children are already padded to 4 bytes.
-      if (!CountBlock(
-              static_cast<VersioninfoResource::BlockData&>(*value->data),
-              encoding, err, &size, sizes))
-        return false;
-    }
-    (*sizes)[value.get()] = size;
-
-    // The padding after the object isn't include in that object's size.
-    // Padding after the last object isn't included in the block's size.
-    if (size % 4 && &value != &block.values.back())
-      size += 2;  // Pad to 4 bytes after value too.
-    *total_size += size;
-  }
-  return true;
-}
+    // The padding after an object isn't included in that object's size, and
+    // padding after the last object isn't included in the block's size.  So
+    // pad before each object instead of after it.
+    if (&value != &block.values.front())
+      out->PadToDword();
 
-bool WriteBlock(
-    FILE* out,
-    InternalEncoding encoding,
-    std::string* err,
-    const VersioninfoResource::BlockData& block,
-    const std::unordered_map<VersioninfoResource::Entry*, uint16_t> sizes) {
-  for (const auto& value : block.values) {
     uint16_t value_size = 0;
-    const std::vector<uint8_t>* data;
+    const std::vector<uint8_t>* data = nullptr;
     bool is_text = true;
     if (value->data->type_ == VersioninfoResource::InfoData::kValue) {
       const VersioninfoResource::ValueData& value_data =
@@ -3577,12 +3771,13 @@ bool WriteBlock(
     }
 
     // Every block / value there seems to start with a 3-uint16_t header:
-    // - uint16_t total_size (including header)
+    // - uint16_t total_size (including header, patched below)
     // - value_size (in char16_ts, only for VALUE, 0 for BLOCKs, including \0)
     // - uint16_t is 1 for text values and blocks, 0 for int values
     // Followed by node data, followed by optional padding to uint32_t boundary
-    uint16_t size = sizes.find(value.get())->second;
-    write_little_short(out, size);
+    size_t start = out->size();
+    size_t size_pos = out->buffer_pos();
+    write_little_short(out, 0);
     write_little_short(out, value_size);
     write_little_short(out, is_text ? 1 : 0);
 
@@ -3592,39 +3787,30 @@ bool WriteBlock(
     for (size_t j = 0; j < key_utf16.size(); ++j)
       write_little_short(out, key_utf16[j]);
     write_little_short(out, 0);  // \0-terminate.
-    if (value->key.size() % 2)
-      write_little_short(out, 0);  // padding to dword after 3 uint16_t and key
+    out->PadToDword();  // padding to dword after 3 uint16_t and key
 
     if (value->data->type_ == VersioninfoResource::InfoData::kValue) {
-      fwrite(data->data(), 1, data->size(), out);
-      if (data->size() % 4)
-        write_little_short(out, 0);  // pad to dword after value
+      out->Write(data->data(), data->size());
     } else {
       if (!WriteBlock(
                out, encoding, err,
-               static_cast<VersioninfoResource::BlockData&>(*value->data),
-               sizes))
+               static_cast<VersioninfoResource::BlockData&>(*value->data)))
         return false;
     }
+    out->PatchLittleShort(size_pos, out->size() - start);
   }
   return true;
 }
 
 bool SerializationVisitor::VisitVersioninfoResource(
     const VersioninfoResource* r) {
-  std::unordered_map<VersioninfoResource::Entry*, uint16_t> sizes;
-  uint16_t block_size = 0;
-  if (!CountBlock(r->block_, encoding_, err_, &block_size, &sizes))
-    return false;
-
-  const size_t kFixedInfoSize = 0x5c;
-  size_t size = kFixedInfoSize + block_size;
-  WriteResHeader(size, IntOrStringName::MakeInt(kRT_VERSION), r->name(), 0x30);
+  BeginResource(IntOrStringName::MakeInt(kRT_VERSION), r->name(), 0x30);
 
   // The fixed info block seems to always start with the same fixed bytes:
-  write_little_short(out_, size);
+  size_t size_pos = out_->buffer_pos();
+  write_little_short(out_, 0);  // Total size, patched below.
   write_little_long(out_, 52);
-  fwrite(u"VS_VERSION_INFO", 2, 16, out_);
+  out_->Write(u"VS_VERSION_INFO", 2 * 16);
   write_little_short(out_, 0);
   write_little_long(out_, 0xfeef04bd);
   write_little_short(out_, 0);
@@ -3645,19 +3831,21 @@ bool SerializationVisitor::VisitVersioninfoResource(
   write_little_long(out_, 0);
 
   // Write variable block.
-  return WriteBlock(out_, encoding_, err_, r->block_, sizes);
+  if (!WriteBlock(out_, encoding_, err_, r->block_))
+    return false;
+  out_->PatchLittleShort(size_pos, out_->size() - resource_data_start_);
+  EndResource();
+  return true;
 }
 
 bool SerializationVisitor::VisitDlgincludeResource(
     const DlgincludeResource* r) {
-  size_t size = r->data().size() + 1; // include trailing \0
-  WriteResHeader(size, IntOrStringName::MakeInt(kRT_DLGINCLUDE), r->name());
+  BeginResource(IntOrStringName::MakeInt(kRT_DLGINCLUDE), r->name());
   // data() is a string_view and might not be \0-terminated, so write \0
   // separately.
-  fwrite(r->data().data(), 1, r->data().size(), out_);
-  fputc('\0', out_);
-  uint8_t padding = ((4 - (size & 3)) & 3);  // DWORD-align.
-  fwrite("\0\0", 1, padding, out_);
+  out_->Write(r->data().data(), r->data().size());
+  out_->WriteByte('\0');
+  EndResource();
   return true;
 }
 
@@ -3670,43 +3858,56 @@ bool SerializationVisitor::VisitUserDefinedResource(
   return WriteFileOrDataResource(r->type(), r);
 }
 
-bool SerializationVisitor::EmitOneStringBundle(const StringBundle& bundle) {
+SerializationVisitor::StringBundle* SerializationVisitor::GetStringBundle(
+    BundleKey key) {
+  // LANGUAGE statements are rare, so the current language's index is cached
+  // and other languages are found by linear search.
+  if (!cur_language_bundles_ || !(cur_language_bundles_->language ==
+                                  key.second)) {
+    cur_language_bundles_ = nullptr;
+    for (LanguageBundles& l : language_bundles_)
+      if (l.language == key.second)
+        cur_language_bundles_ = &l;
+    if (!cur_language_bundles_) {
+      language_bundles_.push_back(LanguageBundles{
+          key.second, std::unique_ptr<uint32_t[]>(new uint32_t[4096]())});
+      cur_language_bundles_ = &language_bundles_.back();
+    }
+  }
+  uint32_t& index = cur_language_bundles_->bundle_index[key.first / 16];
+  if (!index) {
+    string_bundles_.push_back(StringBundle(key));
+    index = (uint32_t)string_bundles_.size();
+  }
+  return &string_bundles_[index - 1];
+}
+
+bool SerializationVisitor::ConvertStringBundle(const StringBundle& bundle,
+                                               std::string* data,
+                                               std::string* err) const {
   // Each string is written as uint16_t length, followed by string data without
   // a trailing \0.
   // FIXME: rc.exe /n null-terminates strings in string table, have option
   // for that.
-
-  C16string utf16[16];
+  C16string utf16;
   for (int i = 0; i < 16; ++i) {
+    size_t length_pos = utf16.size();
+    utf16.push_back(0);
     if (!bundle.strings[i])
       continue;
-    if (!ToUTF16(&utf16[i], *bundle.strings[i], encoding_, err_))
+    if (!ToUTF16(&utf16, *bundle.strings[i], encoding_, err))
       return false;
+    utf16[length_pos] = (char16_t)(utf16.size() - length_pos - 1);
   }
-
-  size_t size = 0;
-  for (int i = 0; i < 16; ++i)
-    size += 2 * (1 + (bundle.strings[i] ? utf16[i].size() : 0));
-
-  WriteResHeader(size, IntOrStringName::MakeInt(kRT_STRING),
-                 IntOrStringName::MakeInt((bundle.key.first / 16) + 1), 0x1030,
-                 bundle.key.second.as_uint16());
-  for (int i = 0; i < 16; ++i) {
-    if (!bundle.strings[i]) {
-      fwrite("\0", 1, 2, out_);
-      continue;
-    }
-    write_little_short(out_, utf16[i].size());
-    for (size_t j = 0; j < utf16[i].size(); ++j)
-      write_little_short(out_, utf16[i][j]);
+  data->resize(2 * utf16.size());
+  for (size_t i = 0; i < utf16.size(); ++i) {
+    (*data)[2 * i] = (char)(utf16[i] & 0xff);
+    (*data)[2 * i + 1] = (char)(utf16[i] >> 8);
   }
-  uint8_t padding = ((4 - (size & 3)) & 3);  // DWORD-align.
-  fwrite("\0\0", 1, padding, out_);
-
   return true;
 }
 
-bool SerializationVisitor::WriteStringtables() {
+bool SerializationVisitor::WriteStringtables(unsigned num_threads) {
   // https://blogs.msdn.microsoft.com/oldnewthing/20040130-00/?p=40813
   // "The strings listed in the *.rc file are grouped together in bundles of
   //  sixteen. So the first bundle contains strings 0 through 15, the second
@@ -3718,165 +3919,2185 @@ bool SerializationVisitor::WriteStringtables() {
   //  there would be one bundle (number 2), which consists of string 16,
   //  fourteen null strings, then string 31."
 
-  for (const StringBundle& bundle : string_bundles_)
-    if (!EmitOneStringBundle(bundle))
+  // Converting strings to UTF-16 is most of the work, and independent per
+  // bundle, so it's done on several threads for large tables.  Writing the
+  // converted bundles is cheap and has to happen in order.
+  size_t n = string_bundles_.size();
+  std::vector<std::string> data(n);
+  std::vector<std::string> errs(n);
+  std::vector<char> ok(n);
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    const size_t kBundlesPerTask = 64;
+    size_t begin;
+    while ((begin = next.fetch_add(kBundlesPerTask)) < n) {
+      size_t end = std::min(begin + kBundlesPerTask, n);
+      for (size_t i = begin; i < end; ++i)
+        ok[i] = ConvertStringBundle(string_bundles_[i], &data[i], &errs[i]);
+    }
+  };
+  // The helper threads' allocations are added to this thread's count, so
+  // that /timing sees them.
+  std::atomic<uint64_t> helper_allocations(0);
+  auto helper = [&]() {
+    worker();
+    helper_allocations += g_num_allocations;
+  };
+  const size_t kMinBundlesPerThread = 1024;
+  if (num_threads == 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  num_threads = std::min<size_t>(num_threads, n / kMinBundlesPerThread);
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i)
+    threads.emplace_back(helper);
+  worker();
+  for (std::thread& thread : threads)
+    thread.join();
+  g_num_allocations += helper_allocations;
+
+  for (size_t i = 0; i < n; ++i) {
+    if (!ok[i]) {
+      *err_ = errs[i];
       return false;
+    }
+    const StringBundle& bundle = string_bundles_[i];
+    BeginResource(IntOrStringName::MakeInt(kRT_STRING),
+                  IntOrStringName::MakeInt((bundle.key.first / 16) + 1),
+                  0x1030, bundle.key.second.as_uint16());
+    out_->Write(data[i].data(), data[i].size());
+    EndResource();
+  }
   string_bundles_.clear();
+  language_bundles_.clear();
+  cur_language_bundles_ = nullptr;
 
   return true;
 }
 
+// Forwards to another Visitor, and records time, allocations, and output
+// bytes per resource type in a Timing.
+class TimingVisitor : public Visitor {
+ public:
+  TimingVisitor(Visitor* v, const ResWriter* out, Timing* timing)
+      : v_(v), out_(out), timing_(timing) {}
+
+#define TIMED_VISIT(Type)                                        \
+  bool Visit##Type(const Type* r) override {                     \
+    size_t size = out_->size();                                  \
+    Timing::Scope scope(timing_, "Visit" #Type);                 \
+    bool ok = v_->Visit##Type(r);                                \
+    timing_->Get("Visit" #Type)->bytes += out_->size() - size;   \
+    return ok;                                                   \
+  }
+  TIMED_VISIT(LanguageResource)
+  TIMED_VISIT(CursorResource)
+  TIMED_VISIT(BitmapResource)
+  TIMED_VISIT(IconResource)
+  TIMED_VISIT(MenuResource)
+  TIMED_VISIT(DialogResource)
+  TIMED_VISIT(StringtableResource)
+  TIMED_VISIT(AcceleratorsResource)
+  TIMED_VISIT(RcdataResource)
+  TIMED_VISIT(VersioninfoResource)
+  TIMED_VISIT(DlgincludeResource)
+  TIMED_VISIT(HtmlResource)
+  TIMED_VISIT(UserDefinedResource)
+#undef TIMED_VISIT
+
+ private:
+  Visitor* v_;
+  const ResWriter* out_;
+  Timing* timing_;
+};
+
+// True if |path| ends in .obj, which means WriteRes() writes a COFF file.
+static bool IsObjPath(const std::string& path) {
+  return path.size() >= 4 &&
+         IsEqualAsciiUppercase(std::string_view(path).substr(path.size() - 4),
+                               ".OBJ");
+}
+
+// The writer for rsrc::write_rsrc_obj(), with resource data copied from the
+// serialized .res file in |res|.
+class RsrcObjWriter {
+ public:
+  RsrcObjWriter(const ResWriter& res, ResWriter* obj) : res_(res), obj_(obj) {}
+
+  // All external .res data is resource data, and stays external.
+  void Reserve(uint64_t total_size) {
+    obj_->Reserve(total_size - res_.external_size());
+  }
+  void Write(const void* data, size_t size) { obj_->Write(data, size); }
+  void WriteResourceData(const rsrc::ResEntry& entry) {
+    res_.CopyTo(entry.data_offset, entry.data_size, obj_);
+  }
+  size_t size() const { return obj_->size(); }
+
+ private:
+  const ResWriter& res_;
+  ResWriter* obj_;
+};
+
+// Writes the |resources| in the serialized .res file |res| to |obj| as a
+// COFF file with a .rsrc section.  On error, returns false and sets |err| to
+// a description of the problem.
+static bool WriteRsrcObj(
+    const ResWriter& res,
+    const std::vector<SerializationVisitor::ResourcePos>& resources,
+    ResWriter* obj,
+    std::string* err) {
+  // The headers are always in the buffer, only resource data can be external.
+  std::vector<rsrc::ResEntry> entries(resources.size());
+  const uint8_t* end = res.buffer() + res.buffer_pos();
+  for (size_t i = 0; i < resources.size(); ++i) {
+    rsrc::ResEntry* entry = &entries[i];
+    const char* entry_err = rsrc::load_resource_header(
+        res.buffer() + resources[i].header_pos, end, entry);
+    if (!entry_err)
+      entry_err = rsrc::check_resource_entry(*entry);
+    if (entry_err) {
+      *err = entry_err;
+      return false;
+    }
+    entry->data = nullptr;
+    entry->data_offset = resources[i].data_start;
+  }
+  RsrcObjWriter writer(res, obj);
+  return rsrc::write_rsrc_obj(entries, rsrc::kArchx64, &writer, err);
+}
+
+// Serializes |file| to |result|, as a .res file or, if |out| ends in .obj,
+// as a COFF file.  If |timing| is non-null, per-resource-type stats are added
+// to it.  Uses up to |num_threads| threads, 0 meaning one per core.
 bool WriteRes(const FileBlock& file,
               const std::string& out,
               const std::vector<std::string>& include_dirs,
-              bool show_includes,
+              FileCache* file_cache,
+              Dependencies* deps,
               InternalEncoding encoding,
+              Timing* timing,
+              unsigned num_threads,
+              ResWriter* result,
               std::string* err) {
-  FILE* f = fopen(out.c_str(), "wb");
-  if (!f) {
-    *err = Location{ out, 0, 0}.Error("failed to open file");
-    return false;
-  }
-  FClose closer(f);
-
+  bool obj = IsObjPath(out);
+  ResWriter res;
+  ResWriter& writer = obj ? res : *result;
   SerializationVisitor serializer(
-      f, include_dirs, show_includes, encoding, err);
+      &writer, include_dirs, file_cache, deps, encoding, err);
+  TimingVisitor timing_visitor(&serializer, &writer, timing);
+  Visitor* visitor = timing ? (Visitor*)&timing_visitor : &serializer;
 
   // First write the "this is not the ancient 16-bit format" header.
   serializer.WriteResHeader(0, IntOrStringName::MakeInt(0),
                             IntOrStringName::MakeInt(0), 0, 0);
 
   for (size_t i = 0; i < file.res_.size(); ++i) {
-    const Resource* res = file.res_[i].get();
-    if (!res->Visit(&serializer))
+    const Resource* res = file.res_[i];
+    if (!res->Visit(visitor))
       return false;
   }
-  return serializer.WriteStringtables();
-}
-
-//////////////////////////////////////////////////////////////////////////////
-// Driver
-
-int main(int argc, char* argv[]) {
-#if defined(_MSC_VER)
-  _setmode(_fileno(stdin), _O_BINARY);
-#endif
-
-  std::string output = "out.res";
-  std::vector<std::string> includes;
-  // MS rc.exe's search order for includes:
-  // 1. next to the input .rc
-  // 2. cwd
-  // 3. in all /I args (relative to cwd), in order
-  // 4. in directories in %INCLUDE% (FIXME: not implemented; also a bit silly),
-  //    if /x isn't passed (/x makes MS rc not look in %INCLUDE%)
-  includes.push_back("");
-  std::string cd;
 
-  bool show_includes = false;
-  bool input_is_utf8 = false;
-  while (argc > 1 && (argv[1][0] == '/' || argv[1][0] == '-')) {
-    if (strncmp(argv[1], "/I", 2) == 0 || strncmp(argv[1], "-I", 2) == 0) {
-      // /I flags are relative to original cwd, not to where input .rc is.
-      includes.push_back(argv[1] + 2);
-    } else if (strncmp(argv[1], "/fo", 3) == 0) {
-      output = std::string(argv[1] + 3);
-    } else if (strncmp(argv[1], "/cd", 3) == 0) {
-      cd = std::string(argv[1] + 3);
-    } else if (strcmp(argv[1], "/showIncludes") == 0) {
-      show_includes = true;
-    } else if (strcmp(argv[1], "/utf-8") == 0) {
-      // rc.exe doesn't support utf-8, so require an explicit flag for that.
-      input_is_utf8 = true;
-    } else if (strcmp(argv[1], "--") == 0) {
-      --argc;
-      ++argv;
-      break;
-    } else {
-      fprintf(stderr, "rc: unrecognized option `%s'\n", argv[1]);
-      return 1;
+  {
+    // String tables are collected while visiting and written at the end.
+    size_t size = writer.size();
+    Timing::Scope scope(timing, "WriteStringtables");
+    if (!serializer.WriteStringtables(num_threads))
+      return false;
+    if (timing)
+      timing->Get("WriteStringtables")->bytes += writer.size() - size;
+  }
+  if (obj) {
+    Timing::Scope scope(timing, "WriteRsrcObj");
+    std::string obj_err;
+    if (!WriteRsrcObj(writer, serializer.resources(), result, &obj_err)) {
+      *err = Location{out, 0, 0}.Error(obj_err);
+      return false;
     }
-    --argc;
-    ++argv;
   }
+  return true;
+}
 
-  // Put directory input .rc is in at front of search path.
-  if (!cd.empty())
-    includes.insert(includes.begin(), cd);
-
-  std::istreambuf_iterator<char> begin(std::cin), end;
-  std::string s(begin, end);
-
-  InternalEncoding encoding = kEncodingUnknown;
+//////////////////////////////////////////////////////////////////////////////
+// Preprocessor
+
+// rc.exe runs its input through a C preprocessor.  This is a small one that
+// supports #include, #define / #undef (object-like and function-like macros,
+// including # and ##), #if / #ifdef / #ifndef / #elif / #else / #endif,
+// #error, and #pragma once.  Like rc.exe, it only looks at directives in .h
+// and .c files and ignores everything else in them, so that headers shared
+// with C code can be included.  Differences from a real C preprocessor:
+// - the arguments of a function-like macro must be on a single line
+// - no __FILE__, __LINE__, __COUNTER__ etc
+//
+// The output is text for the Tokenizer, with linemarkers (`# 12 "foo.rc"`)
+// where the current file changes.  Directives that don't affect the output
+// are left in place, since the Tokenizer skips them.  So an .rc file that
+// only includes headers and doesn't use any macros is passed on as-is,
+// without making a copy.
+
+// Validates |input|, or converts it to UTF-8 if it is UTF-16LE.  |source| is
+// set to |input| itself if no conversion is needed, else to the converted
+// text in |storage|.  On error, returns false and sets |err| to a description
+// of the problem.
+static bool DecodeInput(std::string_view input,
+                        bool input_is_utf8,
+                        std::string* storage,
+                        std::string_view* source,
+                        InternalEncoding* encoding,
+                        const char** err) {
+  *encoding = kEncodingUnknown;
+  *source = input;
 
   if (input_is_utf8) {
     // Validate that the input if valid utf-8.
-    if (!isLegalUTF8String((UTF8*)s.data(), (UTF8*)s.data() + s.size())) {
-      fprintf(stderr, "rc: input is not valid utf-8\n");
-      return 1;
+    if (!utf::IsValidUTF8((const uint8_t*)input.data(), input.size())) {
+      *err = "input is not valid utf-8";
+      return false;
     }
-    encoding = kEncodingUTF8;
+    *encoding = kEncodingUTF8;
   }
   // Convert from UTF-16LE to UTF-8 if input is UTF-16LE.
   // Checking for a 0 byte is a hack: valid .rc files can start with a
   // character that needs both bytes of a UFT-16 unit.
   // Microsoft cl.exe silently produces a .res file with nothing but the
   // 32-bit header when handed UTF-16BE input (with or without BOM).
-  else if (s.size() >= 2 &&
-      ((uint8_t(s[0]) == 0xff && uint8_t(s[1]) == 0xfe) || s[1] == '\0')) {
-    // Make sure s.data() ends in two \0 bytes, i.e. one \0 Char16.
-    s += std::string("\0", 1);
-#if defined(__linux__) && GCC_VERSION < 50100
-    std::vector<uint8_t> buffer(s.size() * 6);
-    const UTF16* src_start = (UTF16*)s.data();
-    const UTF16* src_end = src_start + s.size()/2;
-    UTF8* dst_start = (UTF8*)buffer.data();
-    ConversionResult r = ConvertUTF16toUTF8(
-        &src_start, src_end,
-        &dst_start, (UTF8*)buffer.data() + buffer.size(),
-        strictConversion);
-    if (r != conversionOK) {
-      fprintf(stderr, "rc: tried to decode input as UTF-16LE and failed\n");
-      return 1;
-    }
-    s = std::string((char*)buffer.data(), dst_start - (UTF8*)buffer.data());
-#else
-    // wstring_convert throws on error, or returns a fixed string handed to
-    // its ctor if present. Pass an invalid UTF-8 string as error string,
-    // then we can be sure if we get that back it must have been returned as
-    // error string.
-    std::wstring_convert<
-        std::codecvt_utf8_utf16<Char16, 0x10ffff, std::little_endian>,
-        Char16>
-        convert("\x80");
-    s = convert.to_bytes(reinterpret_cast<const Char16*>(s.data()));
-    if (s == "\x80") {
-      fprintf(stderr, "rc: tried to decode input as UTF-16LE and failed\n");
-      return 1;
+  else if (input.size() >= 2 &&
+      ((uint8_t(input[0]) == 0xff && uint8_t(input[1]) == 0xfe) ||
+       input[1] == '\0')) {
+    // A BOM is converted to a UTF-8 BOM, which the tokenizer skips.
+    if (!utf::UTF16LEToUTF8((const uint8_t*)input.data(), input.size(),
+                            storage)) {
+      *err = "tried to decode input as UTF-16LE and failed";
+      return false;
     }
-#endif
-    encoding = kEncodingUTF8;
+    *source = *storage;
+    *encoding = kEncodingUTF8;
     // FIXME:
     // Tests for:
     // - utf-16le with non-BMP
     // - utf-16 with invalid bytes in the middle
   }
+  return true;
+}
 
-  std::string err;
-  std::vector<Token> tokens = Tokenizer::Tokenize("<stdin>", s, &err);
-  if (tokens.empty() && !err.empty()) {
-    fprintf(stderr, "%s\n", err.c_str());
-    return 1;
+// Returns the directory part of |path|, or "" if there is none.
+static std::string DirName(const std::string& path) {
+  size_t slash = path.find_last_of("/\\");
+  return slash == std::string::npos ? "" : path.substr(0, slash);
+}
+
+// Macros that are currently being expanded, to prevent infinite recursion.
+struct PPHideSet {
+  std::string_view name;
+  const PPHideSet* next;
+};
+
+struct PPToken {
+  enum Kind { kIdent, kNumber, kString, kChar, kPunct, kSpace };
+  Kind kind;
+  std::string_view text;
+  const PPHideSet* hide;
+};
+
+static bool IsPPIdentFirstChar(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool IsPPIdentChar(char c) {
+  return IsPPIdentFirstChar(c) || (c >= '0' && c <= '9');
+}
+
+// Splits |s| into preprocessing tokens and appends them to |out|, or only
+// tracks comment state if |out| is nullptr.  In .rc text (|rc_text|), ""
+// escapes a quote in a string and \ has no special meaning; in directives,
+// strings use C escapes and '...' is a character literal.  Comments become
+// kSpace tokens.  |in_comment| tracks /* */ comments spanning several lines.
+static void LexPP(std::string_view s,
+                  bool rc_text,
+                  bool* in_comment,
+                  std::vector<PPToken>* out) {
+  static const char* const kPuncts[] = {
+    "...", "##", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+  };
+  size_t i = 0, n = s.size();
+  while (i < n) {
+    size_t begin = i;
+    PPToken::Kind kind = PPToken::kPunct;
+    char c = s[i];
+    if (*in_comment || (c == '/' && i + 1 < n && s[i + 1] == '*')) {
+      if (!*in_comment)
+        i += 2;
+      *in_comment = true;
+      while (i < n && *in_comment) {
+        if (s[i] == '*' && i + 1 < n && s[i + 1] == '/') {
+          *in_comment = false;
+          ++i;
+        }
+        ++i;
+      }
+      kind = PPToken::kSpace;
+    } else if (c == '/' && i + 1 < n && s[i + 1] == '/') {
+      i = n;
+      kind = PPToken::kSpace;
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f') {
+      while (i < n && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' ||
+                       s[i] == '\v' || s[i] == '\f'))
+        ++i;
+      kind = PPToken::kSpace;
+    } else if (c == '"' || (!rc_text && c == '\'') ||
+               ((c == 'L' || c == 'l') && i + 1 < n && s[i + 1] == '"')) {
+      if (c != '"' && c != '\'')
+        ++i;
+      char quote = s[i++];
+      while (i < n) {
+        if (s[i] == quote) {
+          // In .rc files, "" is an escaped quote.
+          if (rc_text && i + 1 < n && s[i + 1] == quote) {
+            i += 2;
+            continue;
+          }
+          ++i;
+          break;
+        }
+        if (!rc_text && s[i] == '\\' && i + 1 < n)
+          ++i;
+        ++i;
+      }
+      kind = quote == '"' ? PPToken::kString : PPToken::kChar;
+    } else if ((c >= '0' && c <= '9') ||
+               (c == '.' && i + 1 < n && s[i + 1] >= '0' && s[i + 1] <= '9')) {
+      while (i < n && (IsPPIdentChar(s[i]) || s[i] == '.' ||
+                       ((s[i] == '+' || s[i] == '-') &&
+                        (ascii_toupper(s[i - 1]) == 'E' ||
+                         ascii_toupper(s[i - 1]) == 'P'))))
+        ++i;
+      kind = PPToken::kNumber;
+    } else if (IsPPIdentFirstChar(c)) {
+      while (i < n && IsPPIdentChar(s[i]))
+        ++i;
+      kind = PPToken::kIdent;
+    } else if ((uint8_t)c >= 0x80) {
+      // Keep multi-byte characters together.
+      while (i < n && (uint8_t)s[i] >= 0x80)
+        ++i;
+    } else {
+      ++i;
+      for (const char* p : kPuncts) {
+        size_t len = strlen(p);
+        if (s.substr(begin, len) == std::string_view(p, len)) {
+          i = begin + len;
+          break;
+        }
+      }
+    }
+    if (out)
+      out->push_back(PPToken{kind, s.substr(begin, i - begin), nullptr});
   }
-  StringStorage string_storage;
-  std::unique_ptr<FileBlock> file =
-      Parser::Parse(std::move(tokens), encoding, &string_storage, &err);
-  if (!file) {
-    fprintf(stderr, "%s\n", err.c_str());
-    return 1;
+}
+
+// Returns if |lhs| and |rhs| would lex differently when written out next to
+// each other, e.g. a macro expanding to 10 followed by 0.  Tokens that are
+// next to each other in the input never do, so only tokens from macro
+// expansions (which have a hide set) need checking.
+static bool WouldMerge(const PPToken& lhs, const PPToken& rhs) {
+  if ((!lhs.hide && !rhs.hide) || lhs.kind == PPToken::kSpace ||
+      rhs.kind == PPToken::kSpace)
+    return false;
+  std::string text = AsString(lhs.text) + AsString(rhs.text);
+  std::vector<PPToken> tokens;
+  bool in_comment = false;
+  LexPP(text, /*rc_text=*/true, &in_comment, &tokens);
+  return tokens.size() != 2 || tokens[0].text.size() != lhs.text.size();
+}
+
+// Returns the index of the first token at or after |i| that isn't kSpace.
+static size_t SkipPPSpace(const std::vector<PPToken>& tokens, size_t i) {
+  while (i < tokens.size() && tokens[i].kind == PPToken::kSpace)
+    ++i;
+  return i;
+}
+
+// An input file, split into lines.  The main .rc file is only used once, but
+// included files are parsed once and then kept in the HeaderCache.
+struct PPFile {
+  struct Line {
+    // For directives, the text after the #, with continuation lines joined.
+    // Else, the whole line without the trailing \n.
+    std::string_view text;
+    size_t offset;  // Offset of the start of the line in the file.
+    uint32_t line;  // 1-based line number.
+    uint32_t num_lines;  // Number of physical lines, for continued lines.
+    bool is_directive;
+    bool in_comment;  // If the line starts in a /* */ comment.
+  };
+
+  void Init(std::string_view contents, bool h_or_c);
+
+  std::string_view text;
+  bool is_h_or_c = false;
+  // If |text| is valid UTF-8.  Only computed for included files.
+  bool is_valid_utf8 = false;
+  bool pragma_once = false;
+  // If everything in the file is inside `#ifndef FOO ... #endif` and the
+  // first directive in there is `#define FOO`, this is FOO.
+  std::string_view guard;
+  // For .h and .c files, only contains directives.
+  std::vector<Line> lines;
+
+  std::string storage;  // Backing store if the file needed decoding.
+  std::list<std::string> joined_lines;  // Backing store for continued lines.
+};
+
+// Returns the name of the directive in |tokens| (the tokens after the #), and
+// sets |rest| to the index of the token after the name.
+static std::string_view DirectiveName(const std::vector<PPToken>& tokens,
+                                      size_t* rest) {
+  size_t i = SkipPPSpace(tokens, 0);
+  if (i == tokens.size())
+    return std::string_view();
+  *rest = i + 1;
+  return tokens[i].text;
+}
+
+void PPFile::Init(std::string_view contents, bool h_or_c) {
+  text = contents;
+  is_h_or_c = h_or_c;
+
+  size_t pos = 0;
+  if (text.size() >= 3 && uint8_t(text[0]) == 0xef &&
+      uint8_t(text[1]) == 0xbb && uint8_t(text[2]) == 0xbf) {
+    pos = 3;  // The Tokenizer skips the BOM, so leave it in place.
+  }
+  uint32_t line_number = 1;
+  bool in_comment = false;
+  while (pos < text.size()) {
+    Line line;
+    line.offset = pos;
+    line.line = line_number;
+    line.num_lines = 1;
+    line.in_comment = in_comment;
+
+    size_t end = pos;
+    while (end < text.size() && text[end] != '\n')
+      ++end;
+    line.text = text.substr(pos, end - pos);
+    pos = end + 1;
+
+    size_t hash = 0;
+    while (hash < line.text.size() &&
+           (line.text[hash] == ' ' || line.text[hash] == '\t'))
+      ++hash;
+    line.is_directive =
+        !in_comment && hash < line.text.size() && line.text[hash] == '#';
+    if (line.is_directive)
+      line.text = line.text.substr(hash + 1);
+
+    // Join lines ending in \, also if whitespace follows it (compilers accept
+    // that with a warning).  In .h and .c files, lines are joined before
+    // directives are recognized, like in C, so that e.g. a // comment ending
+    // in \ hides a #define on the next line.  In .rc files, only directives
+    // are joined.
+    if (line.is_directive || is_h_or_c) {
+      auto continues = [](std::string_view l) {
+        size_t size = l.size();
+        while (size && (l[size - 1] == ' ' || l[size - 1] == '\t' ||
+                        l[size - 1] == '\r'))
+          --size;
+        return size && l[size - 1] == '\\' ? size : 0;
+      };
+      if (size_t size = continues(line.text)) {
+        joined_lines.push_back(std::string(line.text.data(), size - 1));
+        std::string& joined = joined_lines.back();
+        while (pos < text.size()) {
+          end = pos;
+          while (end < text.size() && text[end] != '\n')
+            ++end;
+          std::string_view next = text.substr(pos, end - pos);
+          pos = end + 1;
+          ++line.num_lines;
+          size = continues(next);
+          if (!size) {
+            joined.append(next.data(), next.size());
+            break;
+          }
+          joined.append(next.data(), size - 1);
+        }
+        line.text = joined;
+      }
+    }
+    line_number += line.num_lines;
+    LexPP(line.text, !line.is_directive, &in_comment, nullptr);
+    if (line.is_directive || !is_h_or_c)
+      lines.push_back(line);
+  }
+
+  // Look for #pragma once and an include guard: The first directive must be
+  // `#ifndef FOO` or `#if !defined(FOO)`, and everything else must be
+  // inside it.
+  std::vector<PPToken> tokens;
+  int depth = 0;
+  bool seen_top_level = false;
+  bool maybe_guarded = true;
+  std::string_view guard_name;
+  for (const Line& line : lines) {
+    if (!line.is_directive && (!maybe_guarded || depth > 0))
+      continue;
+    tokens.clear();
+    bool comment = line.in_comment;
+    LexPP(line.text, !line.is_directive, &comment, &tokens);
+    if (!line.is_directive) {
+      if (SkipPPSpace(tokens, 0) != tokens.size())
+        maybe_guarded = false;  // Text outside of the guard.
+      continue;
+    }
+
+    size_t rest = 0;
+    std::string_view name = DirectiveName(tokens, &rest);
+    size_t i = SkipPPSpace(tokens, rest);
+    if (name == "pragma" && i < tokens.size() && tokens[i].text == "once")
+      pragma_once = true;
+
+    if (depth == 0 && maybe_guarded) {
+      if (seen_top_level) {
+        maybe_guarded = false;  // Directive after the guard's #endif.
+      } else if (name == "ifndef" && i < tokens.size() &&
+                 tokens[i].kind == PPToken::kIdent) {
+        guard_name = tokens[i].text;
+        i = SkipPPSpace(tokens, i + 1);
+      } else if (name == "if" && i < tokens.size() && tokens[i].text == "!") {
+        i = SkipPPSpace(tokens, i + 1);
+        if (i < tokens.size() && tokens[i].text == "defined") {
+          i = SkipPPSpace(tokens, i + 1);
+          bool paren = i < tokens.size() && tokens[i].text == "(";
+          if (paren)
+            i = SkipPPSpace(tokens, i + 1);
+          if (i < tokens.size() && tokens[i].kind == PPToken::kIdent)
+            guard_name = tokens[i].text;
+          i = SkipPPSpace(tokens, i + 1);
+          if (paren) {
+            if (i < tokens.size() && tokens[i].text == ")")
+              i = SkipPPSpace(tokens, i + 1);
+            else
+              guard_name = std::string_view();
+          }
+        }
+      }
+      if (guard_name.empty() || i < tokens.size())
+        maybe_guarded = false;
+      seen_top_level = true;
+    }
+    if (name == "if" || name == "ifdef" || name == "ifndef") {
+      ++depth;
+    } else if (name == "endif") {
+      --depth;
+    } else if (depth == 1 && (name == "else" || name == "elif")) {
+      maybe_guarded = false;  // Not everything is skipped if FOO is defined.
+    }
+  }
+  if (maybe_guarded && depth == 0)
+    guard = guard_name;
+}
+
+// Caches included files, parsed into lines, keyed by path.  In /batch mode,
+// all jobs share one cache, so headers included by many .rc files (and
+// headers included many times) are only split into lines once.
+class HeaderCache {
+ public:
+  // Returns nullptr and sets |err| if |file| can't be decoded.  Thread-safe.
+  // Returned pointers stay valid for the lifetime of the cache.
+  const PPFile* Get(const std::string& path,
+                    const MappedFile* file,
+                    const char** err);
+
+ private:
+  struct Entry {
+    std::once_flag once;
+    const char* err = nullptr;
+    PPFile file;
+  };
+  static void Load(const std::string& path, const MappedFile* file,
+                   Entry* entry);
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<Entry>> entries_;
+};
+
+const PPFile* HeaderCache::Get(const std::string& path,
+                               const MappedFile* file,
+                               const char** err) {
+  Entry* entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<Entry>& slot = entries_[path];
+    if (!slot)
+      slot.reset(new Entry);
+    entry = slot.get();
+  }
+  std::call_once(entry->once, Load, path, file, entry);
+  if (entry->err) {
+    *err = entry->err;
+    return nullptr;
+  }
+  return &entry->file;
+}
+
+// static
+void HeaderCache::Load(const std::string& path,
+                       const MappedFile* file,
+                       Entry* entry) {
+  std::string_view source;
+  InternalEncoding encoding;
+  if (!DecodeInput(file->view(), /*input_is_utf8=*/false,
+                   &entry->file.storage, &source, &encoding, &entry->err))
+    return;
+  entry->file.is_valid_utf8 =
+      encoding == kEncodingUTF8 ||
+      utf::IsValidUTF8((const uint8_t*)source.data(), source.size());
+
+  // FIXME: docs only say .c and .h; but check what rc does for .hh, .hpp,
+  // .cc, .cxx etc
+  size_t dot = path.find_last_of("./\\");
+  bool is_h_or_c = dot != std::string::npos && path[dot] == '.' &&
+                   (IsEqualAsciiUppercase(path.substr(dot), ".h") ||
+                    IsEqualAsciiUppercase(path.substr(dot), ".c"));
+  entry->file.Init(source, is_h_or_c);
+}
+
+class Preprocessor {
+ public:
+  // Included files are recorded in |deps|.
+  Preprocessor(const std::vector<std::string>& include_dirs,
+               FileCache* file_cache,
+               HeaderCache* header_cache,
+               InternalEncoding encoding,
+               Dependencies* deps,
+               std::string* err)
+      : include_dirs_(include_dirs),
+        file_cache_(file_cache),
+        header_cache_(header_cache),
+        encoding_(encoding),
+        deps_(deps),
+        err_(err) {}
+
+  // Defines a macro from a /D flag, `NAME` or `NAME=value`.
+  bool Define(std::string_view define);
+
+  // Preprocesses the .rc file |source| named |name|.  On success, |output|
+  // points either to |source| or to memory owned by this object.
+  bool Run(std::string_view name,
+           std::string_view source,
+           std::string_view* output);
+
+ private:
+  struct Macro {
+    bool function_like = false;
+    bool variadic = false;  // If the last parameter is `...`.
+    std::vector<std::string_view> params;
+    std::vector<PPToken> body;
+  };
+
+  struct Conditional {
+    bool parent_active;
+    bool taken;  // If a branch of this conditional was active.
+    bool seen_else;
+    Location location;
+  };
+
+  bool Process(const PPFile& file, const std::string& path, int depth);
+  bool Directive(const PPFile& file,
+                 const std::string& path,
+                 const PPFile::Line& line,
+                 int depth);
+  bool Include(const std::string& path,
+               const PPFile::Line& line,
+               const std::vector<PPToken>& tokens,
+               size_t arg,
+               int depth,
+               bool* emitted);
+  bool DefineMacro(const std::vector<PPToken>& tokens, size_t i,
+                   const Location& loc);
+  bool EvalCondition(const std::vector<PPToken>& tokens, size_t i,
+                     const Location& loc, bool* value);
+  bool Expand(const std::vector<PPToken>& in, const Location& loc,
+              std::vector<PPToken>* out);
+  bool Substitute(const Macro& macro,
+                  const PPToken& name,
+                  const std::vector<std::vector<PPToken>>& args,
+                  const Location& loc,
+                  std::vector<PPToken>* stack);
+  PPToken Stringify(const std::vector<PPToken>& arg);
+  PPToken Paste(const PPToken& lhs, const PPToken& rhs);
+
+  bool EmitText(const PPFile::Line& line, const Location& loc);
+  void EmitBlankLines(const PPFile& file, const PPFile::Line& line);
+  void EmitLinemarker(uint32_t line, const std::string& path);
+  // Stops passing the input through as-is, from |offset| in the main file on.
+  void BreakIdentity(size_t offset);
+
+  std::string_view Own(std::string s) {
+    strings_.push_back(std::move(s));
+    return strings_.back();
+  }
+  bool Error(const Location& loc, const std::string& message) {
+    *err_ = loc.Error(message);
+    return false;
+  }
+
+  const std::vector<std::string>& include_dirs_;
+  FileCache* file_cache_;
+  HeaderCache* header_cache_;
+  InternalEncoding encoding_;
+  Dependencies* deps_;
+  std::string* err_;
+
+  std::unordered_map<std::string_view, Macro> macros_;
+  std::vector<Conditional> conditionals_;
+  bool active_ = true;  // False in the skipped part of an #if.
+  std::unordered_set<const PPFile*> included_once_;
+
+  std::string_view main_text_;
+  bool identity_ = true;  // If the output so far is equal to the input.
+  std::string out_;
+  std::vector<PPToken> line_tokens_;  // Reused by EmitText() for every line.
+
+  std::list<std::string> strings_;  // Backing store for generated tokens.
+  std::list<PPHideSet> hide_sets_;
+};
+
+bool Preprocessor::Define(std::string_view define) {
+  std::string text = AsString(define);
+  size_t eq = text.find('=');
+  if (eq == std::string::npos)
+    text += " 1";
+  else
+    text[eq] = ' ';
+  std::vector<PPToken> tokens;
+  bool in_comment = false;
+  LexPP(Own(text), /*rc_text=*/false, &in_comment, &tokens);
+  return DefineMacro(tokens, 0, Location{"<command line>", 0, 0});
+}
+
+bool Preprocessor::Run(std::string_view name,
+                       std::string_view source,
+                       std::string_view* output) {
+  // Like rc.exe.
+  for (const char* define : {"RC_INVOKED", "_WIN32"})
+    Define(define);
+
+  PPFile file;
+  file.Init(source, /*h_or_c=*/false);
+  main_text_ = source;
+  if (!Process(file, AsString(name), 0))
+    return false;
+  *output = identity_ ? source : std::string_view(out_);
+  return true;
+}
+
+bool Preprocessor::Process(const PPFile& file,
+                           const std::string& path,
+                           int depth) {
+  size_t conditionals_begin = conditionals_.size();
+  for (const PPFile::Line& line : file.lines) {
+    if (line.is_directive) {
+      if (!Directive(file, path, line, depth))
+        return false;
+    } else if (!active_) {
+      EmitBlankLines(file, line);
+    } else if (!file.is_h_or_c) {
+      Location loc{path, line.line, 0};
+      if (encoding_ == kEncodingUTF8 && !file.is_valid_utf8 && depth > 0 &&
+          !utf::IsValidUTF8((const uint8_t*)line.text.data(),
+                            line.text.size()))
+        return Error(loc, "included file is not valid utf-8");
+      if (!EmitText(line, loc))
+        return false;
+    }
+  }
+  if (conditionals_.size() != conditionals_begin)
+    return Error(conditionals_.back().location, "unterminated conditional");
+  return true;
+}
+
+void Preprocessor::BreakIdentity(size_t offset) {
+  if (!identity_)
+    return;
+  identity_ = false;
+  out_.assign(main_text_.data(), offset);
+}
+
+void Preprocessor::EmitBlankLines(const PPFile& file,
+                                  const PPFile::Line& line) {
+  if (file.is_h_or_c)
+    return;
+  BreakIdentity(line.offset);
+  out_.append(line.num_lines, '\n');
+}
+
+void Preprocessor::EmitLinemarker(uint32_t line, const std::string& path) {
+  out_ += "# " + std::to_string(line) + " \"" + path + "\"\n";
+}
+
+bool Preprocessor::EmitText(const PPFile::Line& line, const Location& loc) {
+  std::vector<PPToken>& tokens = line_tokens_;
+  tokens.clear();
+  bool in_comment = line.in_comment;
+  LexPP(line.text, /*rc_text=*/true, &in_comment, &tokens);
+  bool uses_macros = false;
+  for (const PPToken& token : tokens) {
+    if (token.kind == PPToken::kIdent && macros_.count(token.text)) {
+      uses_macros = true;
+      break;
+    }
+  }
+  if (!uses_macros) {
+    if (!identity_) {
+      out_.append(line.text.data(), line.text.size());
+      out_ += '\n';
+    }
+    return true;
+  }
+
+  BreakIdentity(line.offset);
+  std::vector<PPToken> expanded;
+  if (!Expand(tokens, loc, &expanded))
+    return false;
+  for (size_t i = 0; i < expanded.size(); ++i) {
+    if (i > 0 && WouldMerge(expanded[i - 1], expanded[i]))
+      out_ += ' ';
+    out_.append(expanded[i].text.data(), expanded[i].text.size());
+  }
+  out_ += '\n';
+  return true;
+}
+
+bool Preprocessor::Directive(const PPFile& file,
+                             const std::string& path,
+                             const PPFile::Line& line,
+                             int depth) {
+  Location loc{path, line.line, 0};
+  std::vector<PPToken> tokens;
+  bool in_comment = line.in_comment;
+  LexPP(line.text, /*rc_text=*/false, &in_comment, &tokens);
+  size_t rest = 0;
+  std::string_view name = DirectiveName(tokens, &rest);
+
+  // Directives that don't change the output can stay in place, since the
+  // Tokenizer skips them.  That doesn't work for directives that span
+  // several lines.
+  bool pass_through = line.num_lines == 1 && !in_comment;
+
+  if (name == "if" || name == "ifdef" || name == "ifndef") {
+    Conditional c = { active_, true, false, loc };
+    if (active_) {
+      bool value;
+      if (name == "if") {
+        if (!EvalCondition(tokens, rest, loc, &value))
+          return false;
+      } else {
+        size_t i = SkipPPSpace(tokens, rest);
+        if (i == tokens.size() || tokens[i].kind != PPToken::kIdent)
+          return Error(loc, "expected macro name");
+        value = (macros_.count(tokens[i].text) != 0) == (name == "ifdef");
+      }
+      c.taken = value;
+      active_ = value;
+    }
+    conditionals_.push_back(c);
+  } else if (name == "elif" || name == "else" || name == "endif") {
+    if (conditionals_.empty())
+      return Error(loc, "#" + AsString(name) + " without #if");
+    Conditional& c = conditionals_.back();
+    if (name == "endif") {
+      active_ = c.parent_active;
+      conditionals_.pop_back();
+    } else {
+      if (c.seen_else)
+        return Error(loc, "#" + AsString(name) + " after #else");
+      bool value = !c.taken;
+      if (name == "else")
+        c.seen_else = true;
+      else if (value && !EvalCondition(tokens, rest, loc, &value))
+        return false;
+      active_ = value;
+      c.taken = c.taken || value;
+    }
+  } else if (!active_) {
+    // Skipped.
+  } else if (name.empty() || tokens[rest - 1].kind == PPToken::kNumber) {
+    // Null directive, or a linemarker from a previous preprocessing step.
+  } else if (name == "define") {
+    if (encoding_ == kEncodingUTF8 && !file.is_valid_utf8 && depth > 0 &&
+        !utf::IsValidUTF8((const uint8_t*)line.text.data(), line.text.size()))
+      return Error(loc, "included file is not valid utf-8");
+    if (!DefineMacro(tokens, rest, loc))
+      return false;
+  } else if (name == "undef") {
+    size_t i = SkipPPSpace(tokens, rest);
+    if (i == tokens.size() || tokens[i].kind != PPToken::kIdent)
+      return Error(loc, "expected macro name");
+    macros_.erase(tokens[i].text);
+  } else if (name == "include") {
+    bool emitted;
+    if (!Include(path, line, tokens, rest, depth, &emitted))
+      return false;
+    if (emitted) {
+      // Included .rc files are emitted inline and need linemarkers.
+      if (!file.is_h_or_c)
+        EmitLinemarker(line.line + line.num_lines, path);
+      return true;
+    }
+  } else if (name == "error") {
+    std::string message;
+    for (size_t i = SkipPPSpace(tokens, rest); i < tokens.size(); ++i)
+      message += AsString(tokens[i].text);
+    return Error(loc, "#error " + message);
+  } else if (name == "pragma") {
+    // #pragma once is handled in PPFile::Init().  Other pragmas (e.g.
+    // code_page) are for the Tokenizer.
+  } else if (name == "line") {
+    // The Tokenizer understands `# 12 "foo.rc"`, but not `#line 12 "foo.rc"`.
+    if (!file.is_h_or_c) {
+      BreakIdentity(line.offset);
+      out_ += '#';
+      for (size_t i = rest; i < tokens.size(); ++i)
+        out_.append(tokens[i].text.data(), tokens[i].text.size());
+      out_.append(line.num_lines, '\n');
+    }
+    return true;
+  } else {
+    return Error(loc, "invalid preprocessor directive #" + AsString(name));
+  }
+
+  if (file.is_h_or_c)
+    return true;
+  if (pass_through) {
+    if (!identity_) {
+      // Copy the directive from the start of its line.
+      const char* begin = file.text.data() + line.offset;
+      out_.append(begin, line.text.data() + line.text.size() - begin);
+      out_ += '\n';
+    }
+  } else {
+    EmitBlankLines(file, line);
+  }
+  return true;
+}
+
+bool Preprocessor::Include(const std::string& path,
+                           const PPFile::Line& line,
+                           const std::vector<PPToken>& tokens,
+                           size_t arg,
+                           int depth,
+                           bool* emitted) {
+  Location loc{path, line.line, 0};
+  *emitted = false;
+
+  // `#include "foo.h"`, `#include <foo.h>`, or a macro expanding to either.
+  std::vector<PPToken> arg_tokens(tokens.begin() + arg, tokens.end());
+  arg = SkipPPSpace(arg_tokens, 0);
+  if (arg < arg_tokens.size() && arg_tokens[arg].kind == PPToken::kIdent) {
+    std::vector<PPToken> expanded;
+    if (!Expand(arg_tokens, loc, &expanded))
+      return false;
+    arg_tokens.swap(expanded);
+    arg = SkipPPSpace(arg_tokens, 0);
+  }
+  std::string name;
+  bool quoted = false;
+  if (arg < arg_tokens.size() && arg_tokens[arg].kind == PPToken::kString &&
+      arg_tokens[arg].text[0] == '"') {
+    std::string_view text = arg_tokens[arg].text;
+    name = AsString(text.substr(1, text.size() - 2));
+    quoted = true;
+  } else if (arg < arg_tokens.size() && arg_tokens[arg].text == "<") {
+    size_t i = arg + 1;
+    for (; i < arg_tokens.size() && arg_tokens[i].text != ">"; ++i)
+      name += AsString(arg_tokens[i].text);
+    if (i == arg_tokens.size())
+      name.clear();
+  }
+  if (name.empty())
+    return Error(loc, "expected \"FILENAME\" or <FILENAME>");
+
+  if (depth >= 200)
+    return Error(loc, "#include nested too deeply");
+
+  // Quoted includes are first looked for next to the including file.
+  std::vector<std::string> dirs;
+  if (quoted && depth > 0)
+    dirs.push_back(DirName(path));
+  dirs.insert(dirs.end(), include_dirs_.begin(), include_dirs_.end());
+  std::string found_path;
+  const MappedFile* f =
+      FindFile(dirs, name.c_str(), file_cache_, &found_path);
+  if (!f)
+    return Error(loc, "failed to open file '" + name + "'");
+  const char* decode_err;
+  const PPFile* included = header_cache_->Get(found_path, f, &decode_err);
+  if (!included)
+    return Error(Location{found_path, 0, 0}, decode_err);
+
+  // Skip files that were included before and can't have an effect.
+  if (included_once_.count(included) ||
+      (!included->guard.empty() && macros_.count(included->guard)))
+    return true;
+  if (included->pragma_once)
+    included_once_.insert(included);
+  deps_->Add(found_path);
+
+  if (!included->is_h_or_c) {
+    BreakIdentity(line.offset);
+    EmitLinemarker(1, found_path);
+    *emitted = true;
+  }
+  return Process(*included, found_path, depth + 1);
+}
+
+bool Preprocessor::DefineMacro(const std::vector<PPToken>& tokens,
+                               size_t i,
+                               const Location& loc) {
+  i = SkipPPSpace(tokens, i);
+  if (i == tokens.size() || tokens[i].kind != PPToken::kIdent)
+    return Error(loc, "expected macro name");
+  std::string_view name = tokens[i++].text;
+  Macro macro;
+
+  // `#define F(x)` is a function-like macro, `#define F (x)` isn't.
+  if (i < tokens.size() && tokens[i].text == "(") {
+    macro.function_like = true;
+    for (i = SkipPPSpace(tokens, i + 1);; i = SkipPPSpace(tokens, i + 1)) {
+      if (i < tokens.size() && tokens[i].text == ")" && macro.params.empty())
+        break;
+      if (i < tokens.size() && tokens[i].text == "...") {
+        macro.variadic = true;
+        macro.params.push_back("__VA_ARGS__");
+      } else if (i < tokens.size() && tokens[i].kind == PPToken::kIdent) {
+        macro.params.push_back(tokens[i].text);
+      } else {
+        return Error(loc, "invalid macro parameter list");
+      }
+      i = SkipPPSpace(tokens, i + 1);
+      if (i < tokens.size() && tokens[i].text == ")")
+        break;
+      if (macro.variadic || i == tokens.size() || tokens[i].text != ",")
+        return Error(loc, "invalid macro parameter list");
+    }
+    ++i;
+  }
+
+  // Collapse whitespace, and drop it at the ends and around ##.
+  for (i = SkipPPSpace(tokens, i); i < tokens.size(); ++i) {
+    if (tokens[i].kind == PPToken::kSpace) {
+      size_t next = SkipPPSpace(tokens, i);
+      if (next < tokens.size() && tokens[next].text != "##" &&
+          macro.body.back().text != "##")
+        macro.body.push_back(PPToken{PPToken::kSpace, " ", nullptr});
+      i = next - 1;
+      continue;
+    }
+    macro.body.push_back(tokens[i]);
+  }
+  if (!macro.body.empty() &&
+      (macro.body.front().text == "##" || macro.body.back().text == "##"))
+    return Error(loc, "'##' cannot appear at either end of a macro");
+  macros_[name] = std::move(macro);
+  return true;
+}
+
+// Evaluates the expression in an #if.
+class PPExpression {
+ public:
+  PPExpression(const std::vector<PPToken>& tokens) : tokens_(tokens) {}
+
+  // Returns false and sets |err| on error.
+  bool Eval(int64_t* value, std::string* err) {
+    *value = Conditional(true);
+    if (err_.empty() && pos_ != tokens_.size())
+      err_ = "unexpected '" + AsString(tokens_[pos_].text) + "' in #if";
+    *err = err_;
+    return err_.empty();
+  }
+
+ private:
+  bool Next(const char* op) {
+    if (pos_ < tokens_.size() && tokens_[pos_].kind == PPToken::kPunct &&
+        tokens_[pos_].text == op) {
+      ++pos_;
+      return true;
+    }
+    return false;
+  }
+
+  int64_t Conditional(bool eval) {
+    int64_t cond = Binary(1, eval);
+    if (!Next("?"))
+      return cond;
+    int64_t a = Conditional(eval && cond);
+    if (!Next(":") && err_.empty())
+      err_ = "expected ':' in #if";
+    int64_t b = Conditional(eval && !cond);
+    return cond ? a : b;
+  }
+
+  static int Precedence(std::string_view op) {
+    static const struct { const char* op; int precedence; } kOps[] = {
+      {"||", 1}, {"&&", 2}, {"|", 3}, {"^", 4}, {"&", 5}, {"==", 6},
+      {"!=", 6}, {"<", 7}, {">", 7}, {"<=", 7}, {">=", 7}, {"<<", 8},
+      {">>", 8}, {"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10},
+    };
+    for (const auto& o : kOps)
+      if (op == o.op)
+        return o.precedence;
+    return 0;
+  }
+
+  int64_t Binary(int min_precedence, bool eval) {
+    int64_t lhs = Unary(eval);
+    for (;;) {
+      if (pos_ >= tokens_.size() || tokens_[pos_].kind != PPToken::kPunct)
+        return lhs;
+      std::string_view op = tokens_[pos_].text;
+      int precedence = Precedence(op);
+      if (precedence < min_precedence || precedence == 0)
+        return lhs;
+      ++pos_;
+      bool eval_rhs = eval && !(op == "&&" && !lhs) && !(op == "||" && lhs);
+      int64_t rhs = Binary(precedence + 1, eval_rhs);
+      uint64_t l = (uint64_t)lhs, r = (uint64_t)rhs;
+      if (op == "||") lhs = lhs || rhs;
+      else if (op == "&&") lhs = lhs && rhs;
+      else if (op == "|") lhs = lhs | rhs;
+      else if (op == "^") lhs = lhs ^ rhs;
+      else if (op == "&") lhs = lhs & rhs;
+      else if (op == "==") lhs = lhs == rhs;
+      else if (op == "!=") lhs = lhs != rhs;
+      else if (op == "<") lhs = lhs < rhs;
+      else if (op == ">") lhs = lhs > rhs;
+      else if (op == "<=") lhs = lhs <= rhs;
+      else if (op == ">=") lhs = lhs >= rhs;
+      else if (op == "<<") lhs = (int64_t)(l << (r & 63));
+      else if (op == ">>") lhs = lhs >> (r & 63);
+      else if (op == "+") lhs = (int64_t)(l + r);
+      else if (op == "-") lhs = (int64_t)(l - r);
+      else if (op == "*") lhs = (int64_t)(l * r);
+      else if (rhs == 0 || (lhs == INT64_MIN && rhs == -1)) {
+        if (eval && err_.empty())
+          err_ = "division by zero in #if";
+        lhs = 0;
+      } else if (op == "/") lhs = lhs / rhs;
+      else lhs = lhs % rhs;
+    }
+  }
+
+  int64_t Unary(bool eval) {
+    if (Next("+"))
+      return Unary(eval);
+    if (Next("-"))
+      return (int64_t)(0 - (uint64_t)Unary(eval));
+    if (Next("!"))
+      return !Unary(eval);
+    if (Next("~"))
+      return ~Unary(eval);
+    if (Next("(")) {
+      int64_t value = Conditional(eval);
+      if (!Next(")") && err_.empty())
+        err_ = "expected ')' in #if";
+      return value;
+    }
+    if (pos_ >= tokens_.size()) {
+      if (err_.empty())
+        err_ = "expected value in #if";
+      return 0;
+    }
+    const PPToken& token = tokens_[pos_++];
+    if (token.kind == PPToken::kIdent)
+      return 0;  // Undefined macros are 0.
+    if (token.kind == PPToken::kChar && token.text.size() >= 3) {
+      if (token.text[1] != '\\')
+        return (uint8_t)token.text[1];
+      switch (token.text[2]) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case '0': return 0;
+        default: return (uint8_t)token.text[2];
+      }
+    }
+    if (token.kind == PPToken::kNumber) {
+      std::string digits = AsString(token.text);
+      while (!digits.empty() && (ascii_toupper(digits.back()) == 'L' ||
+                                 ascii_toupper(digits.back()) == 'U'))
+        digits.pop_back();
+      char* end;
+      errno = 0;
+      uint64_t value = strtoull(digits.c_str(), &end, 0);
+      if (!digits.empty() && *end == '\0' && errno == 0)
+        return (int64_t)value;
+    }
+    if (err_.empty())
+      err_ = "invalid token '" + AsString(token.text) + "' in #if";
+    return 0;
+  }
+
+  const std::vector<PPToken>& tokens_;
+  size_t pos_ = 0;
+  std::string err_;
+};
+
+bool Preprocessor::EvalCondition(const std::vector<PPToken>& tokens,
+                                 size_t i,
+                                 const Location& loc,
+                                 bool* value) {
+  // Replace `defined FOO` and `defined(FOO)` before expanding macros.
+  std::vector<PPToken> replaced;
+  for (; i < tokens.size(); ++i) {
+    if (tokens[i].text != "defined") {
+      replaced.push_back(tokens[i]);
+      continue;
+    }
+    size_t j = SkipPPSpace(tokens, i + 1);
+    bool paren = j < tokens.size() && tokens[j].text == "(";
+    if (paren)
+      j = SkipPPSpace(tokens, j + 1);
+    if (j == tokens.size() || tokens[j].kind != PPToken::kIdent)
+      return Error(loc, "expected macro name after 'defined'");
+    bool defined = macros_.count(tokens[j].text) != 0;
+    if (paren) {
+      j = SkipPPSpace(tokens, j + 1);
+      if (j == tokens.size() || tokens[j].text != ")")
+        return Error(loc, "expected ')' after 'defined'");
+    }
+    replaced.push_back(PPToken{PPToken::kNumber, defined ? "1" : "0", nullptr});
+    i = j;
+  }
+
+  std::vector<PPToken> expanded;
+  if (!Expand(replaced, loc, &expanded))
+    return false;
+  expanded.erase(std::remove_if(expanded.begin(), expanded.end(),
+                                [](const PPToken& t) {
+                                  return t.kind == PPToken::kSpace;
+                                }),
+                 expanded.end());
+  int64_t result;
+  std::string err;
+  if (!PPExpression(expanded).Eval(&result, &err))
+    return Error(loc, err);
+  *value = result != 0;
+  return true;
+}
+
+static bool InHideSet(const PPHideSet* hide, std::string_view name) {
+  for (; hide; hide = hide->next)
+    if (hide->name == name)
+      return true;
+  return false;
+}
+
+bool Preprocessor::Expand(const std::vector<PPToken>& in,
+                          const Location& loc,
+                          std::vector<PPToken>* out) {
+  // Tokens still to be scanned, in reverse order.  Macro expansions are
+  // pushed back onto this, so that they're rescanned together with the rest
+  // of the input.
+  std::vector<PPToken> stack(in.rbegin(), in.rend());
+  while (!stack.empty()) {
+    PPToken token = stack.back();
+    stack.pop_back();
+    std::unordered_map<std::string_view, Macro>::const_iterator it;
+    if (token.kind != PPToken::kIdent ||
+        (it = macros_.find(token.text)) == macros_.end() ||
+        InHideSet(token.hide, token.text)) {
+      out->push_back(token);
+      continue;
+    }
+    const Macro& macro = it->second;
+    std::vector<std::vector<PPToken>> args;
+    if (macro.function_like) {
+      // Only an invocation if followed by (.
+      size_t paren = stack.size();
+      while (paren > 0 && stack[paren - 1].kind == PPToken::kSpace)
+        --paren;
+      if (paren == 0 || stack[paren - 1].text != "(") {
+        out->push_back(token);
+        continue;
+      }
+      stack.resize(paren - 1);
+
+      args.emplace_back();
+      int depth = 0;
+      for (;;) {
+        if (stack.empty()) {
+          return Error(loc, "unterminated argument list invoking macro '" +
+                                AsString(token.text) + "'");
+        }
+        PPToken t = stack.back();
+        stack.pop_back();
+        if (t.kind == PPToken::kPunct) {
+          if (t.text == "(") {
+            ++depth;
+          } else if (t.text == ")" && depth-- == 0) {
+            break;
+          } else if (t.text == "," && depth == 0 &&
+                     !(macro.variadic && args.size() == macro.params.size())) {
+            args.emplace_back();
+            continue;
+          }
+        }
+        args.back().push_back(t);
+      }
+      if (macro.params.empty() && args.size() == 1 &&
+          SkipPPSpace(args[0], 0) == args[0].size())
+        args.clear();  // F() for a macro without parameters.
+      if (macro.variadic && args.size() + 1 == macro.params.size())
+        args.emplace_back();
+      if (args.size() != macro.params.size()) {
+        return Error(loc, "macro '" + AsString(token.text) + "' takes " +
+                              std::to_string(macro.params.size()) +
+                              " arguments");
+      }
+    }
+    if (!Substitute(macro, token, args, loc, &stack))
+      return false;
+  }
+  return true;
+}
+
+bool Preprocessor::Substitute(const Macro& macro,
+                              const PPToken& name,
+                              const std::vector<std::vector<PPToken>>& args,
+                              const Location& loc,
+                              std::vector<PPToken>* stack) {
+  auto param_index = [&macro](const PPToken& t) {
+    if (t.kind == PPToken::kIdent) {
+      for (size_t i = 0; i < macro.params.size(); ++i)
+        if (macro.params[i] == t.text)
+          return (int)i;
+    }
+    return -1;
+  };
+  auto trimmed = [](const std::vector<PPToken>& arg) {
+    size_t begin = SkipPPSpace(arg, 0), end = arg.size();
+    while (end > begin && arg[end - 1].kind == PPToken::kSpace)
+      --end;
+    return std::vector<PPToken>(arg.begin() + begin, arg.begin() + end);
+  };
+
+  std::vector<PPToken> result;
+  const std::vector<PPToken>& body = macro.body;
+  for (size_t i = 0; i < body.size(); ++i) {
+    int param = param_index(body[i]);
+    if (macro.function_like && body[i].text == "#" && i + 1 < body.size() &&
+        param_index(body[i + 1]) >= 0) {
+      result.push_back(Stringify(args[param_index(body[++i])]));
+    } else if (body[i].text == "##" && i + 1 < body.size()) {
+      int rhs_param = param_index(body[++i]);
+      std::vector<PPToken> rhs =
+          rhs_param >= 0 ? trimmed(args[rhs_param])
+                         : std::vector<PPToken>(1, body[i]);
+      if (rhs.empty())
+        continue;
+      if (result.empty()) {
+        result = rhs;
+      } else {
+        result.back() = Paste(result.back(), rhs[0]);
+        result.insert(result.end(), rhs.begin() + 1, rhs.end());
+      }
+    } else if (param >= 0) {
+      // Arguments are fully expanded first, unless they're operands of ##.
+      if (i + 1 < body.size() && body[i + 1].text == "##") {
+        std::vector<PPToken> arg = trimmed(args[param]);
+        result.insert(result.end(), arg.begin(), arg.end());
+      } else if (!Expand(args[param], loc, &result)) {
+        return false;
+      }
+    } else {
+      result.push_back(body[i]);
+    }
+  }
+
+  // Mark all tokens from this expansion as coming from |macro|, and push
+  // them to be rescanned.
+  hide_sets_.push_back(PPHideSet{name.text, name.hide});
+  const PPHideSet* hide = &hide_sets_.back();
+  for (size_t i = result.size(); i-- > 0;) {
+    PPToken t = result[i];
+    if (!t.hide || t.hide == name.hide) {
+      t.hide = hide;
+    } else if (!InHideSet(t.hide, name.text)) {
+      hide_sets_.push_back(PPHideSet{name.text, t.hide});
+      t.hide = &hide_sets_.back();
+    }
+    stack->push_back(t);
+  }
+  return true;
+}
+
+PPToken Preprocessor::Stringify(const std::vector<PPToken>& arg) {
+  std::string s = "\"";
+  for (size_t i = SkipPPSpace(arg, 0); i < arg.size(); ++i) {
+    if (arg[i].kind == PPToken::kSpace) {
+      if (SkipPPSpace(arg, i) < arg.size())
+        s += ' ';
+      i = SkipPPSpace(arg, i) - 1;
+    } else if (arg[i].kind == PPToken::kString ||
+               arg[i].kind == PPToken::kChar) {
+      for (char c : arg[i].text) {
+        if (c == '"' || c == '\\')
+          s += '\\';
+        s += c;
+      }
+    } else {
+      s.append(arg[i].text.data(), arg[i].text.size());
+    }
+  }
+  s += '"';
+  return PPToken{PPToken::kString, Own(s), nullptr};
+}
+
+PPToken Preprocessor::Paste(const PPToken& lhs, const PPToken& rhs) {
+  std::string_view text =
+      Own(AsString(lhs.text) + AsString(rhs.text));
+  PPToken::Kind kind = PPToken::kPunct;
+  if (lhs.kind == PPToken::kIdent &&
+      std::all_of(text.begin(), text.end(), IsPPIdentChar))
+    kind = PPToken::kIdent;
+  else if (lhs.kind == PPToken::kNumber)
+    kind = PPToken::kNumber;
+  return PPToken{kind, text, lhs.hide};
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Cache
+
+// With /cache:dir, every .res file that's written is also stored in dir,
+// keyed by a hash of everything that goes into it: the preprocessed source
+// (which covers the .rc file, the headers it includes, and /D flags), the
+// include path, the cwd, and the rc binary itself.  Files read while writing
+// resources (icons, RCDATA files, ...) are only known after parsing, so they
+// are listed with a hash of their contents in a manifest next to the cached
+// .res.  If all of them still resolve to the same, unchanged files, the
+// cached .res is copied to the output and the .rc file isn't parsed at all.
+//
+// The cached file is copied instead of hard-linked: ResWriter::WriteTo()
+// truncates and rewrites an existing output in place, so the next non-cached
+// write to that output would clobber the cache entry through the link.
+
+struct Hash128 {
+  uint64_t h1, h2;
+
+  std::string Hex() const {
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)h1,
+             (unsigned long long)h2);
+    return buf;
+  }
+};
+
+static inline uint64_t Rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t FMix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// MurmurHash3_x64_128.  Not cryptographic, but a cache key only has to
+// distinguish different versions of the same inputs.
+static Hash128 MurmurHash3(const void* key, size_t len, uint64_t seed = 0) {
+  const uint8_t* data = (const uint8_t*)key;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = seed, h2 = seed;
+
+  size_t nblocks = len / 16;
+  for (size_t i = 0; i < nblocks; ++i) {
+    uint64_t k1, k2;
+    memcpy(&k1, data + 16 * i, 8);  // Assumes a little-endian host.
+    memcpy(&k2, data + 16 * i + 8, 8);
+    k1 *= c1; k1 = Rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = Rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = Rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = Rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  const uint8_t* tail = data + nblocks * 16;
+  uint64_t k1 = 0, k2 = 0;
+  switch (len & 15) {
+    case 15: k2 ^= (uint64_t)tail[14] << 48;
+    case 14: k2 ^= (uint64_t)tail[13] << 40;
+    case 13: k2 ^= (uint64_t)tail[12] << 32;
+    case 12: k2 ^= (uint64_t)tail[11] << 24;
+    case 11: k2 ^= (uint64_t)tail[10] << 16;
+    case 10: k2 ^= (uint64_t)tail[9] << 8;
+    case 9: k2 ^= (uint64_t)tail[8];
+      k2 *= c2; k2 = Rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    case 8: k1 ^= (uint64_t)tail[7] << 56;
+    case 7: k1 ^= (uint64_t)tail[6] << 48;
+    case 6: k1 ^= (uint64_t)tail[5] << 40;
+    case 5: k1 ^= (uint64_t)tail[4] << 32;
+    case 4: k1 ^= (uint64_t)tail[3] << 24;
+    case 3: k1 ^= (uint64_t)tail[2] << 16;
+    case 2: k1 ^= (uint64_t)tail[1] << 8;
+    case 1: k1 ^= (uint64_t)tail[0];
+      k1 *= c1; k1 = Rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= len; h2 ^= len;
+  h1 += h2; h2 += h1;
+  h1 = FMix64(h1); h2 = FMix64(h2);
+  h1 += h2; h2 += h1;
+  return Hash128{h1, h2};
+}
+
+class ResCache {
+ public:
+  explicit ResCache(const std::string& dir);
+
+  // Returns the cache key for compiling |preprocessed| with |include_dirs|
+  // to a .res file, or to an .obj file if |obj| is set.
+  std::string Key(std::string_view preprocessed,
+                  InternalEncoding encoding,
+                  const std::vector<std::string>& include_dirs,
+                  bool obj) const;
+
+  // If there's an entry for |key| and the files its manifest lists are
+  // unchanged, copies the cached .res to |output|, records the files in
+  // |deps|, and returns true.
+  bool Fetch(const std::string& key,
+             const std::string& output,
+             const std::vector<std::string>& include_dirs,
+             FileCache* file_cache,
+             Dependencies* deps) const;
+
+  // Stores the just-written |output| as the entry for |key|.  The cache is
+  // best-effort, so failures are ignored.
+  void Store(const std::string& key,
+             const std::string& output,
+             const Dependencies& deps,
+             FileCache* file_cache);
+
+ private:
+  // Writes |w| to |path| via a temporary file, so that concurrent rc
+  // processes never see a partially written entry.
+  bool WriteAtomically(const ResWriter& w, const std::string& path);
+
+  std::string dir_;
+  std::string cwd_;
+  std::atomic<unsigned> next_temp_{0};
+};
+
+static const char kCacheManifestHeader[] = "rc cache manifest 1\n";
+
+ResCache::ResCache(const std::string& dir) : dir_(dir) {
+  char buf[4096];
+#if defined(_MSC_VER)
+  if (_getcwd(buf, sizeof(buf)))
+#else
+  if (getcwd(buf, sizeof(buf)))
+#endif
+    cwd_ = buf;
+}
+
+std::string ResCache::Key(std::string_view preprocessed,
+                          InternalEncoding encoding,
+                          const std::vector<std::string>& include_dirs,
+                          bool obj) const {
+  // Use the build time as a stand-in for the rc version, so that a new rc
+  // never reuses entries written by an older one.
+  std::string material = kCacheManifestHeader;
+  material += __DATE__ " " __TIME__ "\n";
+  material += cwd_ + '\n';
+  material += encoding == kEncodingUTF8 ? "utf-8\n" : "default\n";
+  material += obj ? "obj\n" : "res\n";
+  for (const std::string& dir : include_dirs)
+    material += "I" + dir + '\n';
+  Hash128 h = MurmurHash3(preprocessed.data(), preprocessed.size());
+  material.append((const char*)&h, sizeof(h));
+  return MurmurHash3(material.data(), material.size()).Hex();
+}
+
+bool ResCache::Fetch(const std::string& key,
+                     const std::string& output,
+                     const std::vector<std::string>& include_dirs,
+                     FileCache* file_cache,
+                     Dependencies* deps) const {
+  MappedFile manifest;
+  if (!manifest.Open(dir_ + "/" + key + ".manifest"))
+    return false;
+  std::string_view m = manifest.view();
+  size_t header_size = sizeof(kCacheManifestHeader) - 1;
+  if (m.substr(0, header_size) != kCacheManifestHeader)
+    return false;
+
+  // Each line is "hash\tname\tpath\n": |name| must still resolve to |path|,
+  // and its contents must still have |hash|.
+  std::vector<std::pair<std::string, std::string>> resources;
+  for (size_t pos = header_size; pos < m.size();) {
+    size_t tab1 = pos, tab2, eol;
+    while (tab1 < m.size() && m[tab1] != '\t')
+      ++tab1;
+    for (tab2 = tab1 + 1; tab2 < m.size() && m[tab2] != '\t'; ++tab2) {}
+    for (eol = tab2 + 1; eol < m.size() && m[eol] != '\n'; ++eol) {}
+    if (eol >= m.size())
+      return false;
+    std::string hash = AsString(m.substr(pos, tab1 - pos));
+    std::string name = AsString(m.substr(tab1 + 1, tab2 - tab1 - 1));
+    std::string path = AsString(m.substr(tab2 + 1, eol - tab2 - 1));
+    std::string found_path;
+    const MappedFile* f =
+        FindFile(include_dirs, name.c_str(), file_cache, &found_path);
+    if (!f || found_path != path ||
+        MurmurHash3(f->data(), f->size()).Hex() != hash)
+      return false;
+    resources.emplace_back(std::move(name), std::move(path));
+    pos = eol + 1;
+  }
+
+  MappedFile res;
+  if (!res.Open(dir_ + "/" + key + ".res"))
+    return false;
+  ResWriter w;
+  w.WriteExternal(res.data(), res.size());
+  std::string err;
+  if (!w.WriteTo(output, &err))
+    return false;
+  for (const auto& r : resources)
+    deps->AddResource(r.first.c_str(), r.second);
+  return true;
+}
+
+void ResCache::Store(const std::string& key,
+                     const std::string& output,
+                     const Dependencies& deps,
+                     FileCache* file_cache) {
+  std::string manifest = kCacheManifestHeader;
+  for (const auto& r : deps.resources) {
+    const std::string& name = r.first;
+    const std::string& path = r.second;
+    if (name.find_first_of("\t\n") != std::string::npos ||
+        path.find_first_of("\t\n") != std::string::npos)
+      return;
+    int error;
+    const MappedFile* f = file_cache->Get(path, &error);
+    if (!f)
+      return;
+    manifest += MurmurHash3(f->data(), f->size()).Hex() + '\t' + name + '\t' +
+                path + '\n';
+  }
+
+  MappedFile res;
+  if (!res.Open(output))
+    return;
+#if defined(_MSC_VER)
+  _mkdir(dir_.c_str());
+#else
+  mkdir(dir_.c_str(), 0777);
+#endif
+  // The manifest goes last, since Fetch() only looks at the .res if there's
+  // a manifest.
+  ResWriter res_writer;
+  res_writer.WriteExternal(res.data(), res.size());
+  if (!WriteAtomically(res_writer, dir_ + "/" + key + ".res"))
+    return;
+  ResWriter manifest_writer;
+  manifest_writer.Write(manifest.data(), manifest.size());
+  WriteAtomically(manifest_writer, dir_ + "/" + key + ".manifest");
+}
+
+bool ResCache::WriteAtomically(const ResWriter& w, const std::string& path) {
+#if defined(_MSC_VER)
+  unsigned long pid = GetCurrentProcessId();
+#else
+  unsigned long pid = getpid();
+#endif
+  std::string temp = path + ".tmp" + std::to_string(pid) + "." +
+                     std::to_string(next_temp_++);
+  std::string err;
+  if (!w.WriteTo(temp, &err)) {
+    remove(temp.c_str());
+    return false;
+  }
+#if defined(_MSC_VER)
+  bool ok = MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+  bool ok = rename(temp.c_str(), path.c_str()) == 0;
+#endif
+  if (!ok)
+    remove(temp.c_str());
+  return ok;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Driver
+
+struct Options {
+  // Include search path, not including the directory of the input .rc file.
+  std::vector<std::string> includes;
+  std::vector<std::string> defines;  // From /D flags.
+  bool show_includes = false;
+  bool input_is_utf8 = false;
+  // If set, a depfile is written next to each output, at |depfile_path| if
+  // that's set and else at the output path with ".d" appended.
+  bool write_depfile = false;
+  std::string depfile_path;
+  ResCache* cache = nullptr;  // From /cache:.
+  bool timing = false;
+};
+
+// Compiles the already-decoded .rc source |s| to the .res file |output|.
+// Tokens point into |s|, so it must stay alive until this returns.  The AST
+// is built in |arena|, which is Reset() before this returns.  If |cache| is
+// non-null, the .res is taken from it if possible, and added to it otherwise.
+// If |result| is non-null, the output is stored there instead of written to
+// |output|, whose name then only picks the format; |cache| must be null then.
+// Uses up to |num_threads| threads, 0 meaning one per core.
+static bool CompileRc(std::string_view input_name,
+                      std::string_view s,
+                      InternalEncoding encoding,
+                      const std::string& output,
+                      const std::vector<std::string>& include_dirs,
+                      const std::vector<std::string>& defines,
+                      FileCache* file_cache,
+                      HeaderCache* header_cache,
+                      ResCache* cache,
+                      Arena* arena,
+                      Dependencies* deps,
+                      Timing* timing,
+                      unsigned num_threads,
+                      ResWriter* result,
+                      std::string* err) {
+  assert(!(cache && result));
+  Preprocessor preprocessor(include_dirs, file_cache, header_cache, encoding,
+                            deps, err);
+  std::string_view preprocessed;
+  {
+    Timing::Scope scope(timing, "preprocess");
+    for (const std::string& define : defines)
+      if (!preprocessor.Define(define))
+        return false;
+    if (!preprocessor.Run(input_name, s, &preprocessed))
+      return false;
+  }
+
+  std::string cache_key;
+  if (cache) {
+    Timing::Scope scope(timing, "cache lookup");
+    cache_key =
+        cache->Key(preprocessed, encoding, include_dirs, IsObjPath(output));
+    if (cache->Fetch(cache_key, output, include_dirs, file_cache, deps))
+      return true;
+  }
+
+  std::vector<Token> tokens;
+  {
+    Timing::Scope scope(timing, "Tokenizer::Run");
+    tokens = Tokenizer::Tokenize(input_name, preprocessed, err);
+  }
+  if (tokens.empty() && !err->empty())
+    return false;
+  FileBlock* file;
+  {
+    Timing::Scope scope(timing, "Parser::ParseFile");
+    file = Parser::Parse(std::move(tokens), encoding, arena, err);
+  }
+  ResWriter storage;
+  ResWriter* writer = result ? result : &storage;
+  bool ok = file && WriteRes(*file, output, include_dirs, file_cache, deps,
+                             encoding, timing, num_threads, writer, err);
+  arena->Reset();
+  if (ok && !result) {
+    Timing::Scope scope(timing, "WriteTo");
+    ok = writer->WriteTo(output, err);
+  }
+  if (ok && cache) {
+    Timing::Scope scope(timing, "cache store");
+    cache->Store(cache_key, output, *deps, file_cache);
+  }
+  return ok;
+}
+
+// rc_test.cc includes this file to call CompileRc() in-process, and has its
+// own main().
+#if !defined(RC_NO_MAIN)
+
+// Appends |path| to |out|, escaped for Makefile syntax (which ninja
+// understands too).
+static void AppendDepfilePath(const std::string& path, std::string* out) {
+  for (char c : path) {
+    if (c == ' ' || c == '#')
+      *out += '\\';
+    else if (c == '$')
+      *out += '$';
+    *out += c;
+  }
+}
+
+// Writes a depfile saying that |output| depends on |input| and on all files
+// in |deps|.
+static bool WriteDepfile(const std::string& path,
+                         const std::string& output,
+                         const std::string& input,
+                         const Dependencies& deps,
+                         std::string* err) {
+  std::string contents;
+  AppendDepfilePath(output, &contents);
+  contents += ':';
+  if (input != "<stdin>") {
+    contents += ' ';
+    AppendDepfilePath(input, &contents);
+  }
+  for (const std::string& file : deps.files) {
+    contents += " \\\n  ";
+    AppendDepfilePath(file, &contents);
+  }
+  contents += '\n';
+
+  FILE* f = fopen(path.c_str(), "wb");
+  if (!f) {
+    *err = Location{path, 0, 0}.Error("failed to open file");
+    return false;
+  }
+  fwrite(contents.data(), 1, contents.size(), f);
+  bool ok = !ferror(f);
+  if (fclose(f) != 0 || !ok) {
+    *err = Location{path, 0, 0}.Error("failed to write file");
+    return false;
+  }
+  return true;
+}
+
+struct BatchJob {
+  std::string input;
+  std::string output;
+
+  // Filled in by RunBatchJob().
+  bool ok = false;
+  Dependencies deps;
+  Timing timing;
+  std::string err;
+};
+
+// Parses a /batch job list.  Each non-empty line that doesn't start with '#'
+// has an input and an output path, optionally in double quotes.
+static bool ParseBatchJobs(std::string_view list,
+                           std::vector<BatchJob>* jobs,
+                           std::string* err) {
+  size_t pos = 0;
+  for (int line = 1; pos < list.size(); ++line) {
+    size_t eol = pos;
+    while (eol < list.size() && list[eol] != '\n')
+      ++eol;
+    std::vector<std::string> fields;
+    size_t i = pos;
+    while (i < eol) {
+      char c = list[i];
+      if (c == ' ' || c == '\t' || c == '\r') {
+        ++i;
+        continue;
+      }
+      if (c == '#' && fields.empty())
+        break;
+      size_t start, end;
+      if (c == '"') {
+        start = i + 1;
+        end = start;
+        while (end < eol && list[end] != '"')
+          ++end;
+        if (end == eol) {
+          *err = Location{"<batch>", (uint32_t)line, 0}.Error(
+              "unterminated quoted path");
+          return false;
+        }
+        i = end + 1;
+      } else {
+        start = i;
+        while (i < eol && list[i] != ' ' && list[i] != '\t' && list[i] != '\r')
+          ++i;
+        end = i;
+      }
+      fields.push_back(AsString(list.substr(start, end - start)));
+    }
+    if (!fields.empty()) {
+      if (fields.size() != 2) {
+        *err = Location{"<batch>", (uint32_t)line, 0}.Error(
+            "expected input and output path");
+        return false;
+      }
+      jobs->emplace_back();
+      jobs->back().input = fields[0];
+      jobs->back().output = fields[1];
+    }
+    pos = eol + 1;
+  }
+  return true;
+}
+
+static void RunBatchJob(BatchJob* job,
+                        const Options& options,
+                        FileCache* file_cache,
+                        HeaderCache* header_cache,
+                        Arena* arena) {
+  Timing* timing = options.timing ? &job->timing : nullptr;
+  MappedFile input;
+  std::string storage;
+  std::string_view s;
+  InternalEncoding encoding;
+  const char* decode_err;
+  {
+    Timing::Scope scope(timing, "read input");
+    if (!input.Open(job->input)) {
+      job->err = Location{job->input, 0, 0}.Error("failed to open file");
+      return;
+    }
+  }
+  {
+    Timing::Scope scope(timing, "decode");
+    if (!DecodeInput(input.view(), options.input_is_utf8, &storage, &s,
+                     &encoding, &decode_err)) {
+      job->err = Location{job->input, 0, 0}.Error(decode_err);
+      return;
+    }
+  }
+
+  // Like for a single file, look next to the input .rc first.
+  std::vector<std::string> include_dirs = options.includes;
+  std::string dir = DirName(job->input);
+  if (!dir.empty())
+    include_dirs.insert(include_dirs.begin(), dir);
+
+  job->deps.show_includes = options.show_includes;
+  job->ok = CompileRc(job->input, s, encoding, job->output, include_dirs,
+                      options.defines, file_cache, header_cache, options.cache,
+                      arena, &job->deps, timing, /*num_threads=*/1,
+                      /*result=*/nullptr, &job->err);
+  if (job->ok && options.write_depfile) {
+    job->ok = WriteDepfile(job->output + ".d", job->output, job->input,
+                           job->deps, &job->err);
+  }
+}
+
+static int RunBatch(const std::string& list_path,
+                    unsigned num_threads,
+                    const Options& options) {
+  MappedFile list;
+  if (!(list_path == "-" ? list.Read(stdin) : list.Open(list_path))) {
+    fprintf(stderr, "%s\n",
+            Location{list_path, 0, 0}.Error("failed to open file").c_str());
+    return 1;
+  }
+
+  std::vector<BatchJob> jobs;
+  std::string err;
+  if (!ParseBatchJobs(list.view(), &jobs, &err)) {
+    fprintf(stderr, "%s\n", err.c_str());
+    return 1;
+  }
+
+  FileCache file_cache;
+  HeaderCache header_cache;
+  std::atomic<size_t> next_job(0);
+  auto worker = [&]() {
+    Arena arena;  // Reused for all jobs on this thread.
+    size_t i;
+    while ((i = next_job++) < jobs.size())
+      RunBatchJob(&jobs[i], options, &file_cache, &header_cache, &arena);
+  };
+  if (num_threads == 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  num_threads = std::min<size_t>(num_threads, jobs.size());
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread& thread : threads)
+    thread.join();
+
+  // Print diagnostics in job order, so that output is deterministic.
+  int result = 0;
+  Timing timing;
+  for (const BatchJob& job : jobs) {
+    fputs(job.deps.notes.c_str(), stdout);
+    if (!job.ok) {
+      fprintf(stderr, "%s\n", job.err.c_str());
+      result = 1;
+    }
+    timing.Add(job.timing);
+  }
+  if (options.timing) {
+    // Times are summed over all threads, so they can exceed the wall time.
+    fprintf(stderr, "%zu jobs on %u threads\n", jobs.size(), num_threads);
+    timing.Print(stderr);
+  }
+  return result;
+}
+
+#if !defined(_WIN32)
+// Absolute input paths start with '/' like options do, and can start with an
+// option's name too (/data/app.rc isn't /d ata/app.rc).  An argument is the
+// input if it names something that exists and isn't a directory, or if it's
+// the last argument and its directory exists, so that a missing input is
+// reported instead of silently turning into an option.
+static bool IsAbsoluteInputPath(const char* arg, bool is_last) {
+  struct stat st;
+  if (stat(arg, &st) == 0)
+    return !S_ISDIR(st.st_mode);
+  if (!is_last)
+    return false;
+  std::string dir = DirName(arg);
+  return !dir.empty() && stat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+#endif
+
+int main(int argc, char* argv[]) {
+#if defined(_MSC_VER)
+  _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+  std::string output = "out.res";
+  Options options;
+  // MS rc.exe's search order for includes:
+  // 1. next to the input .rc
+  // 2. cwd
+  // 3. in all /I args (relative to cwd), in order
+  // 4. in directories in %INCLUDE% (FIXME: not implemented; also a bit silly),
+  //    if /x isn't passed (/x makes MS rc not look in %INCLUDE%)
+  options.includes.push_back("");
+  std::string cd;
+  std::string batch;
+  std::string cache_dir;
+  unsigned num_threads = 0;
+
+  while (argc > 1 && (argv[1][0] == '/' || argv[1][0] == '-')) {
+#if !defined(_WIN32)
+    // Checked before the options, which match by prefix.
+    if (argv[1][0] == '/' && IsAbsoluteInputPath(argv[1], argc == 2))
+      break;
+#endif
+    if (strncmp(argv[1], "/I", 2) == 0 || strncmp(argv[1], "-I", 2) == 0) {
+      // /I flags are relative to original cwd, not to where input .rc is.
+      options.includes.push_back(argv[1] + 2);
+    } else if (strcmp(argv[1], "/depfile") == 0) {
+      // Checked before /d, which defines macros.
+      options.write_depfile = true;
+    } else if (strncmp(argv[1], "/depfile:", 9) == 0) {
+      options.write_depfile = true;
+      options.depfile_path = argv[1] + 9;
+    } else if (strncmp(argv[1], "/D", 2) == 0 ||
+               strncmp(argv[1], "-D", 2) == 0 ||
+               strncmp(argv[1], "/d", 2) == 0) {
+      options.defines.push_back(argv[1] + 2);
+    } else if (strncmp(argv[1], "/fo", 3) == 0) {
+      output = std::string(argv[1] + 3);
+    } else if (strncmp(argv[1], "/cd", 3) == 0) {
+      cd = std::string(argv[1] + 3);
+    } else if (strcmp(argv[1], "/showIncludes") == 0) {
+      options.show_includes = true;
+    } else if (strncmp(argv[1], "/cache:", 7) == 0) {
+      cache_dir = argv[1] + 7;
+    } else if (strcmp(argv[1], "/utf-8") == 0) {
+      // rc.exe doesn't support utf-8, so require an explicit flag for that.
+      options.input_is_utf8 = true;
+    } else if (strcmp(argv[1], "/timing") == 0) {
+      options.timing = true;
+    } else if (strncmp(argv[1], "/batch:", 7) == 0) {
+      batch = std::string(argv[1] + 7);
+    } else if (strncmp(argv[1], "/j", 2) == 0) {
+      num_threads = atoi(argv[1] + 2);
+    } else if (strcmp(argv[1], "--") == 0) {
+      --argc;
+      ++argv;
+      break;
+    } else {
+      fprintf(stderr, "rc: unrecognized option `%s'\n", argv[1]);
+      return 1;
+    }
+    --argc;
+    ++argv;
+  }
+
+  std::unique_ptr<ResCache> cache;
+  if (!cache_dir.empty()) {
+    cache.reset(new ResCache(cache_dir));
+    options.cache = cache.get();
+  }
+
+  if (!batch.empty()) {
+    if (!options.depfile_path.empty()) {
+      fprintf(stderr, "rc: use /depfile instead of /depfile: with /batch:\n");
+      return 1;
+    }
+    return RunBatch(batch, num_threads, options);
+  }
+
+  Timing timing_storage;
+  Timing* timing = options.timing ? &timing_storage : nullptr;
+
+  // Read the input .rc file if one is passed, else stdin.
+  std::string input_name = "<stdin>";
+  MappedFile input;
+  {
+    Timing::Scope scope(timing, "read input");
+    if (argc > 1) {
+      input_name = argv[1];
+      if (!input.Open(input_name)) {
+        fprintf(stderr, "%s\n", Location{input_name, 0, 0}
+                                    .Error("failed to open file")
+                                    .c_str());
+        return 1;
+      }
+      if (cd.empty())
+        cd = DirName(input_name);
+    } else if (!input.Read(stdin)) {
+      fprintf(stderr, "rc: failed to read stdin\n");
+      return 1;
+    }
+  }
+
+  // Put directory input .rc is in at front of search path.
+  std::vector<std::string> includes = options.includes;
+  if (!cd.empty())
+    includes.insert(includes.begin(), cd);
+
+  std::string storage;
+  std::string_view s;
+  InternalEncoding encoding;
+  const char* decode_err;
+  {
+    Timing::Scope scope(timing, "decode");
+    if (!DecodeInput(input.view(), options.input_is_utf8, &storage, &s,
+                     &encoding, &decode_err)) {
+      fprintf(stderr, "rc: %s\n", decode_err);
+      return 1;
+    }
+  }
+
+  FileCache file_cache;
+  HeaderCache header_cache;
+  Arena arena;
+  Dependencies deps;
+  deps.show_includes = options.show_includes;
+  std::string err;
+  bool ok = CompileRc(input_name, s, encoding, output, includes,
+                      options.defines, &file_cache, &header_cache,
+                      options.cache, &arena, &deps, timing, num_threads,
+                      /*result=*/nullptr, &err);
+  fputs(deps.notes.c_str(), stdout);
+  if (ok && options.write_depfile) {
+    std::string depfile = options.depfile_path.empty()
+                              ? output + ".d" : options.depfile_path;
+    ok = WriteDepfile(depfile, output, input_name, deps, &err);
   }
-  if (!WriteRes(*file.get(), output, includes, show_includes, encoding, &err)) {
+  if (timing)
+    timing->Print(stderr);
+  if (!ok) {
     fprintf(stderr, "%s\n", err.c_str());
     return 1;
   }
 }
+#endif  // !defined(RC_NO_MAIN)
@@ -0,0 +1,621 @@
+/*
+Checks rc's output against reference .res files, in-process.
+
+  clang++ -std=c++14 -O2 -o rc_test rc_test.cc -Wall -Wno-c++11-narrowing -pthread
+or
+  cl rc_test.cc /O2 /EHsc /wd4838 /nologo shlwapi.lib
+
+./rc_test                  checks the .rc/.res pairs in test/
+./rc_test /j4 dir1 dir2    checks the .rc/.res pairs in dir1 and dir2
+./rc_test /gen:5000 dir    writes 5000 generated .rc files to dir, and the
+                           .res files this build of rc writes for them
+
+Each .rc file that has a .res file next to it is compiled with CompileRc()
+from rc.cc (which is included below), on /jN threads (default: one per core),
+and the result is compared with the .res file.  On a mismatch, this prints
+the first resource that differs and which header field or data offset
+differs, rather than just that the files are different.
+
+The generated corpus is for checking that a change to the serializer doesn't
+change its output: write a corpus with /gen: before the change, then check
+it after.  The inputs are random mixes of all resource types that don't
+need external files.
+*/
+#define RC_NO_MAIN
+#include "rc.cc"
+
+#include <random>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+// Returns the names of the files in |dir|, sorted.
+static bool ListDir(const std::string& dir, std::vector<std::string>* names) {
+#if defined(_WIN32)
+  WIN32_FIND_DATAA data;
+  HANDLE h = FindFirstFileA((dir + "\\*").c_str(), &data);
+  if (h == INVALID_HANDLE_VALUE)
+    return false;
+  do {
+    names->push_back(data.cFileName);
+  } while (FindNextFileA(h, &data));
+  FindClose(h);
+#else
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return false;
+  while (struct dirent* entry = readdir(d))
+    names->push_back(entry->d_name);
+  closedir(d);
+#endif
+  std::sort(names->begin(), names->end());
+  return true;
+}
+
+static bool EndsWith(const std::string& s, const char* suffix) {
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Runs |f(i, arena)| for all i in [0, n) on |num_threads| threads, with one
+// Arena per thread.
+template <class F>
+static void ParallelFor(size_t n, unsigned num_threads, F f) {
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    Arena arena;
+    size_t i;
+    while ((i = next++) < n)
+      f(i, &arena);
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < std::min<size_t>(num_threads, n); ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Structural .res diff
+
+// Like resdump.c.
+static const char* TypeName(uint16_t type) {
+  switch (type) {
+    case 0: return "not 16-bit resource marker";
+    case 1: return "RT_CURSOR";
+    case 2: return "RT_BITMAP";
+    case 3: return "RT_ICON";
+    case 4: return "RT_MENU";
+    case 5: return "RT_DIALOG";
+    case 6: return "RT_STRING";
+    case 7: return "RT_FONTDIR";
+    case 8: return "RT_FONT";
+    case 9: return "RT_ACCELERATOR";
+    case 10: return "RT_RCDATA";
+    case 11: return "RT_MESSAGETABLE";
+    case 12: return "RT_GROUP_CURSOR";
+    case 14: return "RT_GROUP_ICON";
+    case 16: return "RT_VERSION";
+    case 17: return "RT_DLGINCLUDE";
+    case 19: return "RT_PLUGPLAY";
+    case 20: return "RT_VXD";
+    case 21: return "RT_ANICURSOR";
+    case 22: return "RT_ANIICON";
+    case 23: return "RT_HTML";
+    case 24: return "RT_MANIFEST";
+    default: return nullptr;
+  }
+}
+
+static std::string Hex(uint32_t n) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "0x%" PRIx32, n);
+  return buf;
+}
+
+// Formats a type or name like resdump.c's dump_id().
+static std::string IdOrString(bool is_id, uint16_t id,
+                              const rsrc::U16String& str, bool is_type) {
+  if (is_id) {
+    const char* name = is_type ? TypeName(id) : nullptr;
+    return name ? Hex(id) + " (" + name + ")" : Hex(id);
+  }
+  std::string s = "\"";
+  for (size_t i = 0; i < str.size; ++i)
+    s += str[i] < 128 ? (char)str[i] : '?';
+  return s + '"';
+}
+
+static std::string Describe(size_t index, const rsrc::ResEntry& e) {
+  return "resource " + std::to_string(index) + " (type " +
+         IdOrString(e.type_is_id, e.type_id, e.type_str, true) + ", name " +
+         IdOrString(e.name_is_id, e.name_id, e.name_str, false) +
+         ", language " + Hex(e.language_id) + ")";
+}
+
+// Splits the .res file |data| into its entries, including the leading
+// not-16-bit marker.  On error, returns a description of the problem.
+static const char* ParseRes(std::string_view data,
+                            std::vector<rsrc::ResEntry>* entries) {
+  const uint8_t* p = (const uint8_t*)data.data();
+  const uint8_t* end = p + data.size();
+  while (p < end) {
+    rsrc::ResEntry entry;
+    uint32_t n_read;
+    if (const char* err = rsrc::load_resource_entry(p, end, &entry, &n_read))
+      return err;
+    entries->push_back(entry);
+    p += n_read;
+  }
+  return nullptr;
+}
+
+// Compares the .res files |expected| and |actual|.  Returns an empty string
+// if they're identical, else a description of the first difference.
+static std::string DiffRes(std::string_view expected, std::string_view actual) {
+  if (expected == actual)
+    return std::string();
+
+  std::vector<rsrc::ResEntry> want, got;
+  if (const char* err = ParseRes(expected, &want))
+    return std::string("reference .res: ") + err;
+  if (const char* err = ParseRes(actual, &got))
+    return std::string("output: ") + err;
+
+  for (size_t i = 0; i < std::min(want.size(), got.size()); ++i) {
+    const rsrc::ResEntry& w = want[i];
+    const rsrc::ResEntry& g = got[i];
+    auto field = [&](const char* name, const std::string& want_value,
+                     const std::string& got_value) {
+      return Describe(i, w) + ": " + name + ": expected " + want_value +
+             ", got " + got_value;
+    };
+    if (rsrc::compare_type(w, g) != 0) {
+      return field("type", IdOrString(w.type_is_id, w.type_id, w.type_str, 1),
+                   IdOrString(g.type_is_id, g.type_id, g.type_str, 1));
+    }
+    if (rsrc::compare_name(w, g) != 0) {
+      return field("name", IdOrString(w.name_is_id, w.name_id, w.name_str, 0),
+                   IdOrString(g.name_is_id, g.name_id, g.name_str, 0));
+    }
+#define CHECK_FIELD(f) \
+    if (w.f != g.f) \
+      return field(#f, Hex(w.f), Hex(g.f));
+    CHECK_FIELD(language_id)
+    CHECK_FIELD(data_version)
+    CHECK_FIELD(memory_flags)
+    CHECK_FIELD(version)
+    CHECK_FIELD(characteristics)
+#undef CHECK_FIELD
+
+    uint32_t n = std::min(w.data_size, g.data_size);
+    uint32_t j = 0;
+    while (j < n && w.data[j] == g.data[j])
+      ++j;
+    std::string first_diff;
+    if (j < n) {
+      first_diff = "data at offset " + Hex(j) + ": expected " +
+                   Hex(w.data[j]) + ", got " + Hex(g.data[j]);
+    }
+    if (w.data_size != g.data_size) {
+      std::string s = field("data_size", Hex(w.data_size), Hex(g.data_size));
+      return first_diff.empty() ? s : s + "; " + first_diff;
+    }
+    if (!first_diff.empty())
+      return Describe(i, w) + ": " + first_diff;
+  }
+  if (want.size() != got.size()) {
+    return "expected " + std::to_string(want.size()) + " resources, got " +
+           std::to_string(got.size());
+  }
+
+  // Equal entries, so the difference is in padding.
+  size_t i = 0;
+  while (i < std::min(expected.size(), actual.size()) &&
+         expected[i] == actual[i])
+    ++i;
+  return "padding at file offset " + Hex(i);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Test runner
+
+struct Test {
+  std::string rc;
+  std::string res;
+
+  // Filled in by RunTest().
+  bool ok = false;
+  std::string err;
+};
+
+// Appends the .rc files in |dir| that have a .res file next to them.
+static bool FindTests(const std::string& dir, std::vector<Test>* tests) {
+  std::vector<std::string> names;
+  if (!ListDir(dir, &names))
+    return false;
+  for (const std::string& name : names) {
+    // Needs /I flags and a special cwd, see test_rc.py.
+    if (!EndsWith(name, ".rc") || name == "dirsearch.rc")
+      continue;
+    std::string res = name.substr(0, name.size() - 3) + ".res";
+    if (!std::binary_search(names.begin(), names.end(), res))
+      continue;
+    tests->emplace_back();
+    tests->back().rc = dir + "/" + name;
+    tests->back().res = dir + "/" + res;
+  }
+  return true;
+}
+
+// Compiles |rc| like `rc rc` would.  If |output| is non-null, the result is
+// stored there, else it's written to |res|.
+static bool Compile(const std::string& rc,
+                    const std::string& res,
+                    FileCache* file_cache,
+                    HeaderCache* header_cache,
+                    Arena* arena,
+                    ResWriter* output,
+                    std::string* err) {
+  MappedFile input;
+  if (!input.Open(rc)) {
+    *err = Location{rc, 0, 0}.Error("failed to open file");
+    return false;
+  }
+  std::string storage;
+  std::string_view s;
+  InternalEncoding encoding;
+  const char* decode_err;
+  if (!DecodeInput(input.view(), /*input_is_utf8=*/false, &storage, &s,
+                   &encoding, &decode_err)) {
+    *err = Location{rc, 0, 0}.Error(decode_err);
+    return false;
+  }
+  // Like main(): next to the input first, then cwd.
+  std::vector<std::string> include_dirs = {DirName(rc), ""};
+  Dependencies deps;
+  return CompileRc(rc, s, encoding, res, include_dirs, {}, file_cache,
+                   header_cache, /*cache=*/nullptr, arena, &deps,
+                   /*timing=*/nullptr, /*num_threads=*/1, output, err);
+}
+
+static void RunTest(Test* test,
+                    FileCache* file_cache,
+                    HeaderCache* header_cache,
+                    Arena* arena) {
+  MappedFile expected;
+  if (!expected.Open(test->res)) {
+    test->err = Location{test->res, 0, 0}.Error("failed to open file");
+    return;
+  }
+  ResWriter output;
+  if (!Compile(test->rc, test->res, file_cache, header_cache, arena, &output,
+               &test->err))
+    return;
+  test->err = DiffRes(expected.view(), output.ToString());
+  test->ok = test->err.empty();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Corpus generator
+
+// Writes random .rc files that use all resource types that don't need
+// external files.
+class Generator {
+ public:
+  explicit Generator(uint32_t seed) : rng_(seed) {}
+
+  std::string Generate();
+
+ private:
+  int Rand(int n) { return std::uniform_int_distribution<int>(0, n - 1)(rng_); }
+
+  void Name();
+  void String();
+  void Data();
+
+  void Stringtable();
+  void Rcdata();
+  void Menu(int depth);
+  void Dialog();
+  void Accelerators();
+  void Versioninfo();
+
+  std::mt19937 rng_;
+  std::string out_;
+  int next_name_ = 1;
+  int next_string_id_ = 0;
+};
+
+std::string Generator::Generate() {
+  out_.clear();
+  for (int n = 1 + Rand(20); n > 0; --n) {
+    switch (Rand(8)) {
+      case 0: Stringtable(); break;
+      case 1: Rcdata(); break;
+      case 2:
+        Name();
+        out_ += " MENU\nBEGIN\n";
+        Menu(0);
+        out_ += "END\n";
+        break;
+      case 3: Dialog(); break;
+      case 4: Accelerators(); break;
+      case 5: Versioninfo(); break;
+      case 6:
+        out_ += "LANGUAGE " + std::to_string(1 + Rand(30)) + ", " +
+                std::to_string(Rand(4)) + "\n";
+        break;
+      case 7:
+        Name();
+        out_ += Rand(2) ? " CUSTOM" : " 300";
+        out_ += " {";
+        for (int i = Rand(10); i > 0; --i) {
+          out_ += ' ';
+          Data();
+        }
+        out_ += " }\n";
+        break;
+    }
+  }
+  return out_;
+}
+
+void Generator::Name() {
+  if (Rand(4) == 0)
+    out_ += "NAME";
+  out_ += std::to_string(next_name_++);
+}
+
+void Generator::String() {
+  static const char kChars[] =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .,:;&-";
+  if (Rand(4) == 0)
+    out_ += 'L';
+  out_ += '"';
+  for (int n = Rand(30); n > 0; --n) {
+    switch (Rand(20)) {
+      case 0: out_ += "\"\""; break;
+      case 1: out_ += "\\t"; break;
+      case 2: out_ += "\\\\"; break;
+      default: out_ += kChars[Rand(sizeof(kChars) - 1)]; break;
+    }
+  }
+  out_ += '"';
+}
+
+void Generator::Data() {
+  switch (Rand(4)) {
+    case 0: String(); break;
+    case 1: out_ += std::to_string(Rand(70000)); break;
+    case 2: out_ += std::to_string(Rand(70000)) + "L"; break;
+    case 3: out_ += Hex(Rand(0x10000)); break;
+  }
+}
+
+void Generator::Stringtable() {
+  out_ += "STRINGTABLE\nBEGIN\n";
+  for (int n = 1 + Rand(20); n > 0 && next_string_id_ < 65000; --n) {
+    next_string_id_ += 1 + Rand(40);
+    out_ += "  " + std::to_string(next_string_id_) + ", ";
+    String();
+    out_ += '\n';
+  }
+  out_ += "END\n";
+}
+
+void Generator::Rcdata() {
+  Name();
+  out_ += " RCDATA\nBEGIN\n";
+  for (int n = Rand(20); n > 0; --n) {
+    out_ += "  ";
+    Data();
+    out_ += ",\n";
+  }
+  out_ += "  0\nEND\n";
+}
+
+void Generator::Menu(int depth) {
+  static const char* const kOptions[] = {
+      "CHECKED", "GRAYED", "HELP", "INACTIVE", "MENUBARBREAK", "MENUBREAK"};
+  for (int n = 1 + Rand(6); n > 0; --n) {
+    out_ += std::string(2 * depth + 2, ' ');
+    int kind = Rand(depth < 3 ? 4 : 3);
+    if (kind == 0) {
+      out_ += "MENUITEM SEPARATOR\n";
+      continue;
+    }
+    out_ += kind == 3 ? "POPUP " : "MENUITEM ";
+    String();
+    if (kind != 3)
+      out_ += ", " + std::to_string(Rand(1000));
+    if (Rand(3) == 0)
+      out_ += std::string(", ") + kOptions[Rand(6)];
+    out_ += '\n';
+    if (kind == 3) {
+      out_ += std::string(2 * depth + 2, ' ') + "BEGIN\n";
+      Menu(depth + 1);
+      out_ += std::string(2 * depth + 2, ' ') + "END\n";
+    }
+  }
+}
+
+void Generator::Dialog() {
+  static const char* const kControls[] = {
+      "LTEXT", "RTEXT", "CTEXT", "PUSHBUTTON", "DEFPUSHBUTTON", "GROUPBOX",
+      "AUTOCHECKBOX", "RADIOBUTTON"};
+  Name();
+  out_ += Rand(2) ? " DIALOGEX" : " DIALOG";
+  out_ += " 0, 0, " + std::to_string(Rand(500)) + ", " +
+          std::to_string(Rand(500)) + "\n";
+  if (Rand(2))
+    out_ += "STYLE " + Hex((uint32_t)Rand(0x10000) << 16) + "\n";
+  if (Rand(2)) {
+    out_ += "CAPTION ";
+    String();
+    out_ += '\n';
+  }
+  out_ += "BEGIN\n";
+  for (int n = Rand(15); n > 0; --n) {
+    std::string rect = std::to_string(Rand(400)) + ", " +
+                       std::to_string(Rand(400)) + ", " +
+                       std::to_string(Rand(100)) + ", " +
+                       std::to_string(Rand(30));
+    std::string id = std::to_string(Rand(1000));
+    switch (Rand(3)) {
+      case 0:
+        out_ += std::string("  ") + kControls[Rand(8)] + ' ';
+        String();
+        out_ += ", " + id + ", " + rect + '\n';
+        break;
+      case 1:
+        out_ += std::string("  ") + (Rand(2) ? "EDITTEXT " : "LISTBOX ") +
+                id + ", " + rect + '\n';
+        break;
+      case 2:
+        out_ += "  CONTROL ";
+        String();
+        out_ += ", " + id + ", \"BUTTON\", " + Hex(Rand(0x10000)) + ", " +
+                rect + '\n';
+        break;
+    }
+  }
+  out_ += "END\n";
+}
+
+void Generator::Accelerators() {
+  Name();
+  out_ += " ACCELERATORS\nBEGIN\n";
+  for (int n = 1 + Rand(10); n > 0; --n) {
+    std::string id = std::to_string(Rand(1000));
+    switch (Rand(3)) {
+      case 0:
+        out_ += std::string("  \"") + (char)('a' + Rand(26)) + "\", " + id +
+                '\n';
+        break;
+      case 1:
+        out_ += std::string("  \"^") + (char)('A' + Rand(26)) + "\", " + id +
+                '\n';
+        break;
+      case 2:
+        out_ += "  " + std::to_string('A' + Rand(26)) + ", " + id +
+                ", VIRTKEY";
+        if (Rand(2))
+          out_ += ", CONTROL";
+        if (Rand(2))
+          out_ += ", SHIFT";
+        if (Rand(2))
+          out_ += ", ALT";
+        out_ += '\n';
+        break;
+    }
+  }
+  out_ += "END\n";
+}
+
+void Generator::Versioninfo() {
+  Name();
+  out_ += " VERSIONINFO\n";
+  out_ += "FILEVERSION " + std::to_string(Rand(10)) + "," +
+          std::to_string(Rand(10)) + "," + std::to_string(Rand(100)) + "," +
+          std::to_string(Rand(1000)) + "\n";
+  out_ += "BEGIN\n  BLOCK \"StringFileInfo\"\n  BEGIN\n";
+  out_ += "    BLOCK \"040904b0\"\n    BEGIN\n";
+  for (int n = Rand(6); n > 0; --n) {
+    out_ += "      VALUE ";
+    String();
+    out_ += ", ";
+    String();
+    out_ += '\n';
+  }
+  out_ += "    END\n  END\n";
+  out_ += "  BLOCK \"VarFileInfo\"\n  BEGIN\n";
+  out_ += "    VALUE \"Translation\", 0x409, 1200\n  END\nEND\n";
+}
+
+// Writes |count| generated .rc files to |dir|, and the .res files this build
+// produces for them.
+static int Generate(const std::string& dir, int count, unsigned num_threads) {
+  FileCache file_cache;
+  HeaderCache header_cache;
+  std::vector<std::string> errors(count);
+  ParallelFor(count, num_threads, [&](size_t i, Arena* arena) {
+    char name[32];
+    snprintf(name, sizeof(name), "/gen%05zu", i);
+    std::string rc = dir + name + ".rc";
+    std::string source = Generator(i).Generate();
+    ResWriter writer;
+    writer.Write(source.data(), source.size());
+    if (writer.WriteTo(rc, &errors[i]))
+      Compile(rc, dir + name + ".res", &file_cache, &header_cache, arena,
+              /*output=*/nullptr, &errors[i]);
+  });
+  int result = 0;
+  for (const std::string& err : errors) {
+    if (!err.empty()) {
+      fprintf(stderr, "%s\n", err.c_str());
+      result = 1;
+    }
+  }
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+  int gen_count = 0;
+  while (argc > 1 && argv[1][0] == '/') {
+    if (strncmp(argv[1], "/j", 2) == 0) {
+      num_threads = std::max(1, atoi(argv[1] + 2));
+    } else if (strncmp(argv[1], "/gen:", 5) == 0) {
+      gen_count = atoi(argv[1] + 5);
+    } else {
+      break;  // An absolute path.
+    }
+    --argc;
+    ++argv;
+  }
+
+  if (gen_count) {
+    if (argc != 2) {
+      fprintf(stderr, "rc_test: /gen: needs one output directory\n");
+      return 1;
+    }
+    return Generate(argv[1], gen_count, num_threads);
+  }
+
+  std::vector<std::string> dirs(argv + 1, argv + argc);
+  if (dirs.empty())
+    dirs.push_back("test");
+  std::vector<Test> tests;
+  for (const std::string& dir : dirs) {
+    if (!FindTests(dir, &tests)) {
+      fprintf(stderr, "%s\n",
+              Location{dir, 0, 0}.Error("failed to list directory").c_str());
+      return 1;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  FileCache file_cache;
+  HeaderCache header_cache;
+  ParallelFor(tests.size(), num_threads, [&](size_t i, Arena* arena) {
+    RunTest(&tests[i], &file_cache, &header_cache, arena);
+  });
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  size_t failed = 0;
+  for (const Test& test : tests) {
+    if (!test.ok) {
+      printf("FAIL %s: %s\n", test.rc.c_str(), test.err.c_str());
+      ++failed;
+    }
+  }
+  printf("%zu passed, %zu failed in %.2fs on %u threads\n",
+         tests.size() - failed, failed, elapsed.count(), num_threads);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,769 @@
+// The entries of a .res file, and writing them to a COFF .obj file with a
+// .rsrc section the way cvtres.exe does.
+//
+// Shared by cvtres.cc, which reads the entries from .res files, and rc.cc,
+// which collects them while serializing and can write an .obj directly
+// without going through a .res file first.  Both produce the same bytes.
+#ifndef RC_RSRC_OBJ_H_
+#define RC_RSRC_OBJ_H_
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace rsrc {
+
+inline uint32_t read_little_long(const uint8_t** d) {
+  uint32_t r = ((*d)[3] << 24) | ((*d)[2] << 16) | ((*d)[1] << 8) | (*d)[0];
+  *d += sizeof(uint32_t);
+  return r;
+}
+
+inline uint16_t read_little_short(const uint8_t** d) {
+  uint16_t r = ((*d)[1] << 8) | (*d)[0];
+  *d += sizeof(uint16_t);
+  return r;
+}
+
+// A UTF-16LE string inside a .res buffer.  rc.cc's buffers don't keep
+// strings 2-byte aligned, so this reads code units a byte at a time.
+struct U16String {
+  const uint8_t* data = nullptr;
+  size_t size = 0;  // In code units.
+
+  uint16_t operator[](size_t i) const {
+    return data[2 * i] | (data[2 * i + 1] << 8);
+  }
+  // Like std::u16string_view::compare().
+  int compare(const U16String& rhs) const {
+    size_t n = std::min(size, rhs.size);
+    for (size_t i = 0; i < n; ++i) {
+      uint16_t a = (*this)[i], b = rhs[i];
+      if (a != b)
+        return a < b ? -1 : 1;
+    }
+    return size < rhs.size ? -1 : size > rhs.size;
+  }
+  bool operator!=(const U16String& rhs) const { return compare(rhs) != 0; }
+};
+
+struct ResEntry {
+  uint32_t data_size;
+  uint32_t header_size;  // Always 0x20 plus storage for type_str and name_str
+                         // if type or name aren't numeric.
+
+  // Strings point into the buffer the header was read from.
+  bool type_is_id;  // determines which of the following two is valid.
+  uint16_t type_id;
+  U16String type_str;
+
+  bool name_is_id;  // determines which of the following two is valid.
+  uint16_t name_id;
+  U16String name_str;
+
+  uint32_t data_version;
+  uint16_t memory_flags;
+  uint16_t language_id;
+  uint32_t version;
+  uint32_t characteristics;
+
+  // Where the resource data is.  What these mean is up to the writer passed
+  // to write_rsrc_obj(): cvtres uses |data| and the input file and offset
+  // for copy_file_range(), rc only the offset in the .res it serialized.
+  const uint8_t* data;  // weak
+  int fd;
+  uint64_t data_offset;
+};
+
+// Reads a type or name field at |*data|.
+inline bool load_id_or_string(const uint8_t** data,
+                              const uint8_t* end,
+                              bool* is_id,
+                              uint16_t* id,
+                              U16String* str) {
+  if (end - *data < 4)
+    return false;
+  uint16_t c = read_little_short(data);
+  *is_id = c == 0xffff;
+  if (*is_id) {
+    *id = read_little_short(data);
+    return true;
+  }
+  const uint8_t* start = *data - 2;
+  while (c != 0) {
+    if (end - *data < 2)
+      return false;
+    c = read_little_short(data);
+  }
+  str->data = start;
+  str->size = (*data - start) / 2 - 1;
+  return true;
+}
+
+// Parses the resource header at |data|, and sets |entry->data| to the first
+// byte after it.  On error, returns a description of the problem.
+inline const char* load_resource_header(const uint8_t* data,
+                                        const uint8_t* end,
+                                        ResEntry* entry) {
+  if (end - data < 0x20)
+    return "truncated resource header";
+  entry->data_size = read_little_long(&data);
+  entry->header_size = read_little_long(&data);
+
+  // https://msdn.microsoft.com/en-us/library/windows/desktop/ms648027(v=vs.85).aspx
+
+  // if type, name start with 0xffff then they're numeric IDs. Else they're
+  // inline zero-terminated utf-16le strings. After name, there might be one
+  // word of padding to align data_version.
+  const uint8_t* string_start = data;
+  if (!load_id_or_string(&data, end, &entry->type_is_id, &entry->type_id,
+                         &entry->type_str) ||
+      !load_id_or_string(&data, end, &entry->name_is_id, &entry->name_id,
+                         &entry->name_str))
+    return "truncated resource header";
+  // Pad to dword boundary:
+  if ((data - string_start) & 2)
+    data += 2;
+  // Check that bigger headers are explained by string types and names.
+  if (entry->header_size != 0x20 + (data - string_start - 8))
+    return "unexpected header size";  // XXX error code
+  if (end - data < 16)
+    return "truncated resource header";
+
+  entry->data_version = read_little_long(&data);
+  entry->memory_flags = read_little_short(&data);
+  entry->language_id = read_little_short(&data);
+  entry->version = read_little_long(&data);
+  entry->characteristics = read_little_long(&data);
+
+  entry->data = data;
+  entry->fd = -1;
+  entry->data_offset = 0;
+  return nullptr;
+}
+
+// Parses the resource entry at |data|, header and data.  On error, returns a
+// description of the problem.
+inline const char* load_resource_entry(const uint8_t* data,
+                                       const uint8_t* end,
+                                       ResEntry* entry,
+                                       uint32_t* n_read) {
+  if (const char* err = load_resource_header(data, end, entry))
+    return err;
+  if ((uint64_t)(end - entry->data) < entry->data_size)
+    return "truncated resource data";
+
+  uint64_t total_size = (uint64_t)entry->data_size + entry->header_size;
+  total_size += (4 - (total_size & 3)) & 3;  // DWORD-align.
+  *n_read = (uint32_t)std::min<uint64_t>(total_size, end - data);
+  return nullptr;
+}
+
+// Checks an entry after the not-16-bit marker that starts each .res file.
+inline const char* check_resource_entry(const ResEntry& entry) {
+  if (entry.type_is_id && entry.type_id == 0)
+    return "0 type";
+  if (entry.name_is_id && entry.name_id == 0)
+    return "0 name";
+  return nullptr;
+}
+
+typedef struct {
+  uint16_t Machine;
+  uint16_t NumberOfSections;
+  uint32_t TimeDateStamp;
+  uint32_t PointerToSymbolTable;
+  uint32_t NumberOfSymbols;
+  uint16_t SizeOfOptionalHeader;
+  uint16_t Characteristics;
+} FileHeader;
+
+#pragma pack(push, 1)
+typedef struct {
+  char Name[8];
+  uint32_t Value;
+  int16_t SectionNumber;  // 1-based index, or a special value (0, -1, -2)
+  uint16_t Type;
+  uint8_t StorageClass;
+  uint8_t NumberOfAuxSymbols;
+} StandardSymbolRecord;
+static_assert(sizeof(StandardSymbolRecord) == 18, "");
+
+typedef struct {
+  uint32_t Length;
+  int16_t NumberOfRelocations;
+  int16_t NumberOfLinenumbers;
+  uint32_t CheckSum;
+  int16_t Number;
+  uint8_t Selection;
+  uint8_t Pad0;
+  uint8_t Pad1;
+  uint8_t Pad2;
+} SectionAuxSymbolRecord;
+static_assert(sizeof(SectionAuxSymbolRecord) == 18, "");
+#pragma pack(pop)
+
+typedef struct {
+  char Name[8];
+  uint32_t VirtualSize;
+  uint32_t VirtualAddress;
+  uint32_t SizeOfRawData;
+  uint32_t PointerToRawData;
+  uint32_t PointerToRelocations;
+  uint32_t PointerToLineNumbers;
+  uint16_t NumberOfRelocations;
+  uint16_t NumberOfLinenumbers;
+  uint32_t Characteristics;
+} SectionHeader;
+
+#pragma pack(push, 1)
+typedef struct {
+  uint32_t VirtualAddress;
+  uint32_t SymbolTableInd;  // zero-based
+  uint16_t Type;
+} Relocation;
+static_assert(sizeof(Relocation) == 10, "");
+#pragma pack(pop)
+
+typedef struct {
+  uint32_t Characteristics;
+  uint32_t TimeDateStamp;
+  uint16_t MajorVersion;
+  uint16_t MinorVersion;
+  uint16_t NumberOfNameEntries;
+  uint16_t NumberOfIdEntries;
+} ResourceDirectoryHeader;  // 16 bytes
+
+typedef struct {
+  uint32_t TypeNameLang;  // Either string address or id.
+  // High bit 0: Address of a Resource Data Entry (a leaf).
+  // High bit 1: Address of a Resource Directory Table.
+  uint32_t DataRVA;
+} ResourceDirectoryEntry;  // 8 bytes
+
+typedef struct {
+  uint32_t DataRVA;
+  uint32_t Size;
+  uint32_t Codepage;
+  uint32_t Reserved;
+} ResourceDataEntry;
+
+// Orders types and names like cvtres.exe: strings before ids, strings in
+// char16_t order, ids numerically.
+inline int compare_id_or_string(bool a_is_id,
+                                uint16_t a_id,
+                                const U16String& a_str,
+                                bool b_is_id,
+                                uint16_t b_id,
+                                const U16String& b_str) {
+  if (a_is_id != b_is_id)
+    return a_is_id ? 1 : -1;  // Names come before ids.
+  if (a_is_id)
+    return a_id < b_id ? -1 : a_id > b_id;
+  return a_str.compare(b_str);
+}
+
+inline int compare_type(const ResEntry& a, const ResEntry& b) {
+  return compare_id_or_string(a.type_is_id, a.type_id, a.type_str,
+                              b.type_is_id, b.type_id, b.type_str);
+}
+
+inline int compare_name(const ResEntry& a, const ResEntry& b) {
+  return compare_id_or_string(a.name_is_id, a.name_id, a.name_str,
+                              b.name_is_id, b.name_id, b.name_str);
+}
+
+// The type->name->lang tree, as one array of entries sorted by
+// (type, name, lang).  Each directory is a contiguous run in that array.
+struct ResourceTree {
+  std::vector<uint32_t> order;  // Entry indices, in tree order.
+  std::vector<uint32_t> type_starts;  // Index in |order| of each type's run.
+  std::vector<uint32_t> name_starts;  // Same for each (type, name) run.
+  std::vector<uint32_t> names_per_type;  // Number of name runs per type.
+};
+
+// Returns false if two entries have the same type, name, and language.
+inline bool build_resource_tree(const std::vector<ResEntry>& entries,
+                                ResourceTree* tree) {
+  tree->order.resize(entries.size());
+  for (uint32_t i = 0; i < entries.size(); ++i)
+    tree->order[i] = i;
+  std::sort(tree->order.begin(), tree->order.end(),
+            [&entries](uint32_t a, uint32_t b) {
+    const ResEntry& ea = entries[a];
+    const ResEntry& eb = entries[b];
+    if (int c = compare_type(ea, eb))
+      return c < 0;
+    if (int c = compare_name(ea, eb))
+      return c < 0;
+    return ea.language_id < eb.language_id;
+  });
+
+  // Find run boundaries in one pass.
+  for (uint32_t i = 0; i < tree->order.size(); ++i) {
+    const ResEntry& e = entries[tree->order[i]];
+    const ResEntry* prev = i ? &entries[tree->order[i - 1]] : nullptr;
+    bool new_type = !prev || compare_type(*prev, e) != 0;
+    bool new_name = new_type || compare_name(*prev, e) != 0;
+    if (!new_name && prev->language_id == e.language_id)
+      return false;
+    if (new_type) {
+      tree->type_starts.push_back(i);
+      tree->names_per_type.push_back(0);
+    }
+    if (new_name) {
+      tree->name_starts.push_back(i);
+      ++tree->names_per_type.back();
+    }
+  }
+  tree->type_starts.push_back(tree->order.size());
+  tree->name_starts.push_back(tree->order.size());
+  return true;
+}
+
+// The (len, chars) string table for string types and names, and the offset
+// of each entry's type and name string in it.  Like cvtres.exe, strings are
+// laid out in order of first use and deduplicated.
+struct ResourceStrings {
+  std::vector<uint16_t> table;
+  std::vector<uint32_t> type_offsets;  // Indexed by entry index.
+  std::vector<uint32_t> name_offsets;
+};
+
+inline void build_resource_strings(const std::vector<ResEntry>& entries,
+                                   ResourceStrings* strings) {
+  // Each use of a string, identified by 2 * entry index (+ 1 for names).
+  struct Use {
+    U16String str;
+    uint32_t use;
+  };
+  std::vector<Use> uses;
+  for (uint32_t i = 0; i < entries.size(); ++i) {
+    if (!entries[i].type_is_id)
+      uses.push_back(Use{entries[i].type_str, 2 * i});
+    if (!entries[i].name_is_id)
+      uses.push_back(Use{entries[i].name_str, 2 * i + 1});
+  }
+
+  // Sorting puts equal strings next to each other, first use first.
+  std::sort(uses.begin(), uses.end(), [](const Use& a, const Use& b) {
+    if (int c = a.str.compare(b.str))
+      return c < 0;
+    return a.use < b.use;
+  });
+
+  // The first use of each string determines its position in the table.
+  std::vector<uint32_t> first_use(uses.size());  // Index into |uses|.
+  std::vector<uint32_t> firsts;
+  for (uint32_t i = 0; i < uses.size(); ++i) {
+    bool is_first = i == 0 || uses[i - 1].str != uses[i].str;
+    first_use[i] = is_first ? i : first_use[i - 1];
+    if (is_first)
+      firsts.push_back(i);
+  }
+  std::sort(firsts.begin(), firsts.end(), [&uses](uint32_t a, uint32_t b) {
+    return uses[a].use < uses[b].use;
+  });
+
+  std::vector<uint32_t> offset_of_first(uses.size());
+  for (uint32_t i : firsts) {
+    offset_of_first[i] = strings->table.size() * sizeof(uint16_t);
+    strings->table.push_back(uses[i].str.size);
+    for (size_t j = 0; j < uses[i].str.size; ++j)
+      strings->table.push_back(uses[i].str[j]);
+  }
+
+  strings->type_offsets.resize(entries.size());
+  strings->name_offsets.resize(entries.size());
+  for (uint32_t i = 0; i < uses.size(); ++i) {
+    uint32_t entry = uses[i].use / 2;
+    uint32_t offset = offset_of_first[first_use[i]];
+    if (uses[i].use & 1)
+      strings->name_offsets[entry] = offset;
+    else
+      strings->type_offsets[entry] = offset;
+  }
+}
+
+enum Arch { kArchx86, kArchx64 };
+
+// Writes a COFF file with the resources in |entries| to |out|.  On error,
+// returns false and sets |err|.  |Writer| needs these methods:
+//
+//   void Reserve(uint64_t total_size);  // Called once, before any writes.
+//   void Write(const void* data, size_t size);
+//   void WriteResourceData(const ResEntry& entry);
+//   size_t size() const;  // Bytes written so far.
+template <class Writer>
+bool write_rsrc_obj(const std::vector<ResEntry>& res,
+                    Arch arch,
+                    Writer* out,
+                    std::string* err) {
+  // Want:
+  // COFF headers
+  // .rsrc$01 section with tree metadata (type->name->lang)
+  //   - relocations for all ResourceDataEntries (ResourceDirectoryEntry leaves)
+  // .rsrc$02 section with actual resource data
+  // symbol table that relocations and section names refer to
+
+  // Two phases:
+  // 1. Compute all file layout information at first
+  // 2. Write output in one pass
+
+  // Phase 1: Compute layout.
+
+  // Build type->name->lang resource tree.
+  ResourceTree tree;
+  if (!build_resource_tree(res, &tree)) {
+    *err = "duplicate element";
+    return false;
+  }
+  ResourceStrings strings;
+  build_resource_strings(res, &strings);
+  const std::vector<uint16_t>& string_table = strings.table;
+  size_t num_types = tree.type_starts.size() - 1;
+  size_t num_names = tree.name_starts.size() - 1;
+
+  // Do tree layout pass.
+  // The COFF spec says that the layout is:
+  // - ResourceDirectoryHeaders each followed by its ResourceDirectoryEntries
+  // - Strings. Each string is (len, chars).
+  // - ResourceDataEntries (aligned)
+  // - Actual resource data.
+  //
+  // cvtres.exe however writes data in this order:
+  // - ResourceDirectoryHeaders each followed by its ResourceDirectoryEntries
+  // - ResourceDataEntries (aligned)
+  // - Strings. Each string is (len, chars).
+  // - Relocations.
+  // - Actual resource data.
+  //
+  // Match cvtres.exe's order.
+  // For the tables, cvtres.exe writes all type headers, then all name headers,
+  // then all lang headers (instead of depth-first).
+  std::vector<uint32_t> offsets;
+  offsets.reserve(num_types + num_names);
+  uint32_t offset = sizeof(ResourceDirectoryHeader) +
+                    num_types * sizeof(ResourceDirectoryEntry);
+  for (size_t t = 0; t < num_types; ++t) {
+    offsets.push_back(offset);
+    offset += sizeof(ResourceDirectoryHeader) +
+              tree.names_per_type[t] * sizeof(ResourceDirectoryEntry);
+  }
+  for (size_t n = 0; n < num_names; ++n) {
+    offsets.push_back(offset);
+    offset += sizeof(ResourceDirectoryHeader) +
+              (tree.name_starts[n + 1] - tree.name_starts[n]) *
+                  sizeof(ResourceDirectoryEntry);
+  }
+  uint32_t resource_data_entry_start = offset;
+  uint32_t num_resources = res.size();
+  uint32_t string_table_start =
+      resource_data_entry_start + num_resources * sizeof(ResourceDataEntry);
+  uint32_t relocations_start =
+      string_table_start + string_table.size() * sizeof(uint16_t);
+  // Padding after string table:
+  if (string_table.size() & 1)
+    relocations_start += 2;
+  uint32_t rsrc01_data_size = relocations_start;
+  // The section header's relocation count is 16 bits.  If there are more
+  // relocations, IMAGE_SCN_LNK_NRELOC_OVFL is set, and the real count is in
+  // the VirtualAddress field of an extra first relocation.
+  bool reloc_overflow = num_resources >= 0xffff;
+  uint32_t num_relocations = num_resources + reloc_overflow;
+  uint32_t rsrc01_total_size =
+      rsrc01_data_size + num_relocations * sizeof(Relocation);
+
+  // Compute offsets of all resource data in .rsrc$02.  The symbol for each
+  // is called $R followed by the offset in hex.  Up to 0xffffff that fits
+  // in the 8 bytes of the symbol record; longer names go to the COFF string
+  // table.
+  std::vector<uint32_t> res_offsets;
+  res_offsets.reserve(res.size());
+  uint64_t res_offset = 0;
+  uint32_t coff_strings_size = 0;
+  for (const auto& entry : res) {
+    if (res_offset > 0xffffff)
+      coff_strings_size += snprintf(nullptr, 0, "$R%" PRIX64, res_offset) + 1;
+    res_offsets.push_back(res_offset);
+    res_offset += entry.data_size;
+    res_offset = res_offset + ((8 - (res_offset & 7)) & 7);  // 8-byte-align
+  }
+  uint64_t rsrc02_size = res_offset;
+
+  // Phase 2: Write output.
+
+  uint32_t coff_header_size = sizeof(FileHeader) + 2*sizeof(SectionHeader);
+  uint32_t num_symbols = 2*2 + num_resources;
+  uint64_t symbol_table_start =
+      (uint64_t)coff_header_size + rsrc01_total_size + rsrc02_size;
+  uint64_t total_size =
+      symbol_table_start + num_symbols * sizeof(StandardSymbolRecord) + 4 +
+      coff_strings_size;
+  // Offsets in COFF files are 32 bits.
+  if (total_size > UINT32_MAX) {
+    *err = "resources too large for a COFF file";
+    return false;
+  }
+  out->Reserve(total_size);
+
+  FileHeader coff_header = {};
+  coff_header.Machine = arch == kArchx64 ? 0x8664 : 0x14c;
+  coff_header.NumberOfSections = 2;  // .rsrc$01, .rsrc$02
+  coff_header.TimeDateStamp = 0;  // FIXME: need flag, for inc linking with link
+  coff_header.PointerToSymbolTable = symbol_table_start;
+  // Symbols for section names have 1 aux entry each:
+  coff_header.NumberOfSymbols = num_symbols;
+  coff_header.SizeOfOptionalHeader = 0;
+  coff_header.Characteristics = 0x100;  // XXX
+  out->Write(&coff_header, sizeof(coff_header));
+
+  SectionHeader rsrc01_header;
+  memcpy(rsrc01_header.Name, ".rsrc$01", 8);
+  rsrc01_header.VirtualSize = 0;
+  rsrc01_header.VirtualAddress = 0;
+  rsrc01_header.SizeOfRawData = rsrc01_data_size;
+  rsrc01_header.PointerToRawData = coff_header_size;
+  rsrc01_header.PointerToRelocations =
+      rsrc01_header.PointerToRawData + relocations_start;
+  rsrc01_header.PointerToLineNumbers = 0;
+  rsrc01_header.NumberOfRelocations =
+      reloc_overflow ? 0xffff : num_relocations;
+  rsrc01_header.NumberOfLinenumbers = 0;
+  rsrc01_header.Characteristics = 0xc0000040;  // read + write + initialized
+  const uint32_t kIMAGE_SCN_LNK_NRELOC_OVFL = 0x01000000;
+  if (reloc_overflow)
+    rsrc01_header.Characteristics |= kIMAGE_SCN_LNK_NRELOC_OVFL;
+  out->Write(&rsrc01_header, sizeof(rsrc01_header));
+
+  SectionHeader rsrc02_header;
+  memcpy(rsrc02_header.Name, ".rsrc$02", 8);
+  rsrc02_header.VirtualSize = 0;
+  rsrc02_header.VirtualAddress = 0;
+  rsrc02_header.SizeOfRawData = rsrc02_size;
+  rsrc02_header.PointerToRawData = coff_header_size + rsrc01_total_size;
+  rsrc02_header.PointerToRelocations = 0;
+  rsrc02_header.PointerToLineNumbers = 0;
+  rsrc02_header.NumberOfRelocations = 0;
+  rsrc02_header.NumberOfLinenumbers = 0;
+  rsrc02_header.Characteristics = 0xc0000040;  // read + write + initialized
+  out->Write(&rsrc02_header, sizeof(rsrc02_header));
+
+  // Write .rsrc$01 section.
+  assert(out->size() == rsrc01_header.PointerToRawData);
+
+  // Strings sort before ids, so named entries come first in each run.
+  size_t num_named_types = 0;
+  while (num_named_types < num_types &&
+         !res[tree.order[tree.type_starts[num_named_types]]].type_is_id)
+    ++num_named_types;
+
+  ResourceDirectoryHeader type_dir = {};
+  type_dir.NumberOfNameEntries = num_named_types;
+  type_dir.NumberOfIdEntries= num_types - num_named_types;
+  out->Write(&type_dir, sizeof(type_dir));
+  unsigned next_offset_index = 0;
+  for (size_t t = 0; t < num_types; ++t) {
+    uint32_t i = tree.order[tree.type_starts[t]];
+    ResourceDirectoryEntry entry;
+    entry.DataRVA = offsets[next_offset_index++] | 0x80000000;
+    if (!res[i].type_is_id) {
+      entry.TypeNameLang = string_table_start + strings.type_offsets[i];
+      // cvtres.exe sets high bit of TypeNameLang for strings. not needed per
+      // coff spec and redundant with having a NumberOfIdEntries field, but
+      // match cvtres.exe for consistency.
+      entry.TypeNameLang |= 0x80000000;
+    } else {
+      entry.TypeNameLang = res[i].type_id;
+    }
+    out->Write(&entry, sizeof(entry));
+  }
+
+  size_t name_index = 0;
+  for (size_t t = 0; t < num_types; ++t) {
+    size_t first_name = name_index;
+    size_t end_name = first_name + tree.names_per_type[t];
+    size_t num_named_names = 0;
+    while (first_name + num_named_names < end_name &&
+           !res[tree.order[tree.name_starts[first_name + num_named_names]]]
+                .name_is_id)
+      ++num_named_names;
+
+    ResourceDirectoryHeader name_dir = {};
+    name_dir.NumberOfNameEntries = num_named_names;
+    name_dir.NumberOfIdEntries = tree.names_per_type[t] - num_named_names;
+    out->Write(&name_dir, sizeof(name_dir));
+    for (; name_index < end_name; ++name_index) {
+      uint32_t i = tree.order[tree.name_starts[name_index]];
+      ResourceDirectoryEntry entry;
+      entry.DataRVA = offsets[next_offset_index++] | 0x80000000;
+      if (!res[i].name_is_id) {
+        entry.TypeNameLang = string_table_start + strings.name_offsets[i];
+        // cvtres.exe sets high bit of TypeNameLang for strings. not needed per
+        // coff spec and redundant with having a NumberOfIdEntries field, but
+        // match cvtres.exe for consistency.
+        entry.TypeNameLang |= 0x80000000;
+      } else {
+        entry.TypeNameLang = res[i].name_id;
+      }
+      out->Write(&entry, sizeof(entry));
+    }
+  }
+
+  for (size_t n = 0; n < num_names; ++n) {
+    ResourceDirectoryHeader lang_dir = {};
+    lang_dir.NumberOfNameEntries = 0;
+    lang_dir.NumberOfIdEntries = tree.name_starts[n + 1] - tree.name_starts[n];
+    out->Write(&lang_dir, sizeof(lang_dir));
+    for (uint32_t k = tree.name_starts[n]; k < tree.name_starts[n + 1]; ++k) {
+      ResourceDirectoryEntry entry;
+      entry.DataRVA = offset + k * sizeof(ResourceDataEntry);
+      entry.TypeNameLang = res[tree.order[k]].language_id;
+      out->Write(&entry, sizeof(entry));
+    }
+  }
+
+  // Write resource data entries (the COFF spec recommends to put these after
+  // the string table, but cvtres.exe puts them before it).
+  std::vector<uint32_t> tree_index(res.size());  // Inverse of tree.order.
+  for (uint32_t k = 0; k < tree.order.size(); ++k) {
+    ResourceDataEntry data_entry;
+    data_entry.DataRVA = 0;  // Fixed up by a relocation.
+    data_entry.Size = res[tree.order[k]].data_size;
+    data_entry.Codepage = 0;  // XXX
+    data_entry.Reserved = 0;
+    out->Write(&data_entry, sizeof(data_entry));
+
+    tree_index[tree.order[k]] = k;
+  }
+
+  // Write string table after resource directory. (with padding)
+  assert(out->size() == coff_header_size + string_table_start);
+  out->Write(string_table.data(), string_table.size() * sizeof(uint16_t));
+  if (string_table.size() & 1)
+    out->Write("pa", 2);
+
+  // Write relocations.
+  assert(out->size() == coff_header_size + relocations_start);
+  if (reloc_overflow) {
+    Relocation count = {};
+    count.VirtualAddress = num_relocations;  // Includes this one.
+    out->Write(&count, sizeof(count));
+  }
+  for (unsigned i = 0; i < res.size(); ++i) {
+    Relocation reloc;
+    reloc.VirtualAddress =
+        resource_data_entry_start + tree_index[i] * sizeof(ResourceDataEntry);
+    reloc.SymbolTableInd = 8 + i;
+    const int kIMAGE_REL_AMD64_ADDR32NB = 3;
+    const int kIMAGE_REL_I386_DIR32NB = 7;
+    reloc.Type =
+        arch == kArchx64 ? kIMAGE_REL_AMD64_ADDR32NB : kIMAGE_REL_I386_DIR32NB;
+    out->Write(&reloc, sizeof(reloc));
+  }
+
+  // Write .rsrc$02 section.
+  assert(out->size() == rsrc02_header.PointerToRawData);
+
+  // Actual resource data.
+  for (const auto& entry : res) {
+    out->WriteResourceData(entry);
+    out->Write("padding", (8 - (entry.data_size & 7)) & 7);
+  }
+
+  // Write symbol table, followed by string table size.
+  assert(out->size() == coff_header.PointerToSymbolTable);
+
+  const int kIMAGE_SYM_CLASS_STATIC = 3;
+  StandardSymbolRecord rsrc01_symbol;
+  memcpy(rsrc01_symbol.Name, ".rsrc$01", 8);
+  rsrc01_symbol.Value = 0;
+  rsrc01_symbol.SectionNumber = 1;
+  rsrc01_symbol.Type = 0;
+  rsrc01_symbol.StorageClass = kIMAGE_SYM_CLASS_STATIC;
+  rsrc01_symbol.NumberOfAuxSymbols = 1;
+  out->Write(&rsrc01_symbol, sizeof(rsrc01_symbol));
+
+  SectionAuxSymbolRecord rsrc01_aux;
+  rsrc01_aux.Length = rsrc01_data_size;
+  rsrc01_aux.NumberOfRelocations = std::min(num_relocations, 0xffffu);
+  rsrc01_aux.NumberOfLinenumbers = 0;
+  rsrc01_aux.CheckSum = 0;
+  rsrc01_aux.Number = 0;
+  rsrc01_aux.Selection = 0;
+  rsrc01_aux.Pad0 = 0;
+  rsrc01_aux.Pad1 = 0;
+  rsrc01_aux.Pad2 = 0;
+  out->Write(&rsrc01_aux, sizeof(rsrc01_aux));
+
+  StandardSymbolRecord rsrc02_symbol;
+  memcpy(rsrc02_symbol.Name, ".rsrc$02", 8);
+  rsrc02_symbol.Value = 0;
+  rsrc02_symbol.SectionNumber = 2;
+  rsrc02_symbol.Type = 0;
+  rsrc02_symbol.StorageClass = kIMAGE_SYM_CLASS_STATIC;
+  rsrc02_symbol.NumberOfAuxSymbols = 1;
+  out->Write(&rsrc02_symbol, sizeof(rsrc02_symbol));
+
+  SectionAuxSymbolRecord rsrc02_aux;
+  rsrc02_aux.Length = rsrc02_size;
+  rsrc02_aux.NumberOfRelocations = 0;
+  rsrc02_aux.NumberOfLinenumbers = 0;
+  rsrc02_aux.CheckSum = 0;
+  rsrc02_aux.Number = 0;
+  rsrc02_aux.Selection = 0;
+  rsrc02_aux.CheckSum = 0;
+  rsrc02_aux.Pad0 = 0;
+  rsrc02_aux.Pad1 = 0;
+  rsrc02_aux.Pad2 = 0;
+  out->Write(&rsrc02_aux, sizeof(rsrc02_aux));
+
+  std::string coff_strings;
+  coff_strings.reserve(coff_strings_size);
+  for (uint32_t res_offset : res_offsets) {
+    StandardSymbolRecord res_symbol;
+    if (res_offset <= 0xffffff) {
+      char buf[9];
+      snprintf(buf, 9, "$R%06X", res_offset);
+      memcpy(res_symbol.Name, buf, 8);
+    } else {
+      // A long name: 4 zero bytes, then the name's offset in the string
+      // table.  Offsets include the table's 4-byte size field.
+      uint32_t name_offset = 4 + coff_strings.size();
+      memset(res_symbol.Name, 0, 4);
+      memcpy(res_symbol.Name + 4, &name_offset, 4);
+      char buf[16];
+      snprintf(buf, sizeof(buf), "$R%X", res_offset);
+      coff_strings.append(buf, strlen(buf) + 1);
+    }
+    res_symbol.Value = res_offset;
+    res_symbol.SectionNumber = 2;
+    res_symbol.Type = 0;
+    res_symbol.StorageClass = kIMAGE_SYM_CLASS_STATIC;
+    res_symbol.NumberOfAuxSymbols = 0;
+    out->Write(&res_symbol, sizeof(res_symbol));
+  }
+
+  // The length of the string table immediately follows the symbol table.
+  // According to the coff spec, the size of the string table includes the size
+  // field itself, so an empty string table has size 4.  However, cvtres.exe
+  // writes 0 here, not 4, so match that.
+  assert(coff_strings.size() == coff_strings_size);
+  uint32_t coff_strings_field = coff_strings.empty() ? 0 : 4 + coff_strings_size;
+  out->Write(&coff_strings_field, sizeof(coff_strings_field));
+  out->Write(coff_strings.data(), coff_strings.size());
+
+  assert(out->size() == total_size);
+  return true;
+}
+
+}  // namespace rsrc
+
+#endif  // RC_RSRC_OBJ_H_
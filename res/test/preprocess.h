@@ -0,0 +1,33 @@
+#ifndef PREPROCESS_H_
+#define PREPROCESS_H_
+
+// rc ignores everything but preprocessor directives in .h files.
+int some_c_declaration(void);
+struct S { int i; };
+
+#define IDS_HELLO 1
+#define IDS_WORLD 2
+#define IDS_BASE 20
+#define IDS_PASTED 21
+#define IDC_CONTROL IDS_HELLO + IDS_BASE
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define CAT(a, b) a##b
+#define VERSION 3
+#define IDR_DATA 100
+#define MULTI_LINE \
+    0x10
+#define IDS_B 101
+// Whitespace after the \ still continues the line.
+#define SPACE_CONTINUED 0x20 + \  
+    0x02
+// A comment ending in \ continues onto the next line, which is then not a \
+#define IDS_HIDDEN 1
+
+#if VERSION >= 3 && defined(RC_INVOKED) && !defined NOT_DEFINED
+#define GREETING XSTR(VERSION)
+#else
+#define GREETING "wrong"
+#endif
+
+#endif  // PREPROCESS_H_
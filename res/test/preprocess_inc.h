@@ -0,0 +1 @@
+#define INC_VALUE 3
@@ -0,0 +1,2 @@
+#pragma once
+#define ONCE_VALUE 2
@@ -3,9 +3,30 @@ import filecmp, subprocess, sys
 if sys.platform == 'win32':
   cmd = 'cl rc.cc /EHsc /wd4838 /nologo shlwapi.lib'
 else:
-  cmd = 'clang++ -std=c++14 -o rc rc.cc -Wall -Wno-c++11-narrowing'.split()
+  cmd = 'clang++ -std=c++14 -o rc rc.cc -Wall -Wno-c++11-narrowing -pthread'.split()
 subprocess.check_call(cmd)
 
+# Check SIMD utf-8/utf-16 routines against their scalar versions.
+print('utf')
+if sys.platform == 'win32':
+  subprocess.check_call('cl utf_test.cc /EHsc /O2 /nologo'.split())
+  subprocess.check_call('utf_test.exe')
+else:
+  subprocess.check_call('clang++ -std=c++14 -O2 -o utf_test utf_test.cc'.split())
+  subprocess.check_call('./utf_test')
+
+# Compile all .rc/.res pairs in test/ in one process, with a structural diff
+# on mismatches.
+print('rc_test')
+if sys.platform == 'win32':
+  subprocess.check_call(
+      'cl rc_test.cc /O2 /EHsc /wd4838 /nologo shlwapi.lib'.split())
+  subprocess.check_call('rc_test.exe')
+else:
+  subprocess.check_call('clang++ -std=c++14 -O2 -o rc_test rc_test.cc -Wall '
+                        '-Wno-c++11-narrowing -pthread'.split())
+  subprocess.check_call('./rc_test')
+
 # General tests.
 tests = [
 'language',
@@ -34,6 +55,7 @@ tests = [
 'unicode_utf16le_bom_menu',
 'unicode_utf16le_bom_stringtable',
 'unicode_utf16le_bom_versioninfo',
+'preprocess',
 ]
 
 RC = 'rc.exe' if sys.platform == 'win32' else './rc'
@@ -42,8 +64,89 @@ for test in tests:
   subprocess.check_call(RC, stdin=open('test/%s.rc' % test))
   assert filecmp.cmp('out.res', 'test/%s.res' % test)
 
-# Directory search order tests.
+# Input passed as path instead of on stdin.
+for test in tests:
+  print('path ' + test)
+  subprocess.check_call([RC, 'test/%s.rc' % test])
+  assert filecmp.cmp('out.res', 'test/%s.res' % test)
+
+# Absolute input paths that start like options (/d, /D, /I, /fo, /cd, /j).
+if sys.platform != 'win32':
+  print('abs input path')
+  with open('test/menu.rc', 'rb') as f:
+    subprocess.check_call([RC, '/dev/fd/%d' % f.fileno()],
+                          stdin=subprocess.DEVNULL, pass_fds=[f.fileno()])
+  assert filecmp.cmp('out.res', 'test/menu.res')
+  assert subprocess.call([RC, '/dev/does_not_exist.rc'],
+                         stdin=subprocess.DEVNULL) != 0
+
+# Batch mode: all general tests in one process.
 import os, tempfile
+print('batch')
+BATCHDIR = tempfile.mkdtemp()
+with open(os.path.join(BATCHDIR, 'jobs.txt'), 'w') as f:
+  for test in tests:
+    f.write('test/%s.rc "%s"\n' % (test, os.path.join(BATCHDIR, test + '.res')))
+subprocess.check_call([RC, '/batch:' + os.path.join(BATCHDIR, 'jobs.txt')])
+for test in tests:
+  assert filecmp.cmp(os.path.join(BATCHDIR, test + '.res'),
+                     'test/%s.res' % test)
+
+# /depfile lists the input, included headers and .rc files, and resource files.
+print('depfile')
+DEPFILE = os.path.join(BATCHDIR, 'out.d')
+subprocess.check_call([RC, '/depfile:' + DEPFILE, 'test/preprocess.rc'])
+with open(DEPFILE) as f:
+  assert f.read() == ('out.res: test/preprocess.rc \\\n'
+                      '  test/preprocess.h \\\n'
+                      '  test/preprocess_once.h \\\n'
+                      '  test/preprocess_inc.rc \\\n'
+                      '  test/preprocess_inc.h\n')
+subprocess.check_call([RC, '/depfile', 'test/bitmap.rc'])
+with open('out.res.d') as f:
+  assert f.read().split()[:4] == ['out.res:', 'test/bitmap.rc', '\\',
+                                  'test/bitmap_4.bmp']
+os.remove('out.res.d')
+
+# /timing prints stats to stderr and doesn't change the output.
+print('timing')
+timing = subprocess.check_output([RC, '/timing', 'test/dialog_controls.rc'],
+                                 stderr=subprocess.STDOUT)
+assert b'Parser::ParseFile' in timing and b'VisitDialogResource' in timing
+assert filecmp.cmp('out.res', 'test/dialog_controls.res')
+
+# /cache: reuses the .res from a previous run, but not if a resource file
+# changed.
+print('cache')
+CACHEDIR = os.path.join(BATCHDIR, 'cache')
+CACHERC = os.path.join(BATCHDIR, 'cache.rc')
+CACHEFILE = os.path.join(BATCHDIR, 'cache.txt')
+with open(CACHERC, 'w') as f:
+  f.write('1 RCDATA "cache.txt"\n')
+for contents in [b'old', b'old', b'new']:
+  with open(CACHEFILE, 'wb') as f:
+    f.write(contents)
+  subprocess.check_call([RC, '/cache:' + CACHEDIR, CACHERC])
+  with open('out.res', 'rb') as f:
+    assert f.read().endswith(contents + b'\0')
+  entries = os.listdir(CACHEDIR)
+  assert len(entries) == 2 and not any('.tmp' in e for e in entries)
+
+# /fofoo.obj writes the same .obj file as running cvtres on the .res file.
+if sys.platform != 'win32':
+  print('obj')
+  subprocess.check_call(
+      'clang++ -std=c++11 -o cvtres cvtres.cc -pthread'.split())
+  OBJ = os.path.join(BATCHDIR, 'out.obj')
+  for test in ['bitmap', 'cursor', 'menu', 'stringnames', 'stringtable',
+               'stringtable_by_language', 'versioninfo']:
+    subprocess.check_call([RC, 'test/%s.rc' % test])
+    subprocess.check_call(['./cvtres', 'out.res'])
+    subprocess.check_call([RC, '/fo' + OBJ, 'test/%s.rc' % test])
+    assert filecmp.cmp(OBJ, 'rsrc.obj')
+  os.remove('rsrc.obj')
+
+# Directory search order tests.
 RCDIR = os.path.abspath(os.path.dirname(__file__))
 TESTDIR = os.path.join(RCDIR, 'test')
 os.chdir(tempfile.gettempdir())
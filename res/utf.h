@@ -0,0 +1,520 @@
+// UTF-8 validation and UTF-8 <-> UTF-16 conversion for rc.cc.
+//
+// Each function has a portable scalar implementation.  On x86, there are also
+// SSE4 and AVX2 implementations, picked at runtime based on what the CPU
+// supports.  The scalar versions are the reference; utf_test.cc checks that
+// all implementations agree.
+//
+// UTF-8 validation uses the lookup table algorithm from
+// "Validating UTF-8 In Less Than One Instruction Per Byte" (Keiser, Lemire),
+// https://arxiv.org/abs/2010.03090
+// The converters only vectorize ASCII runs, which is what almost all .rc
+// files consist of, and fall back to scalar code for everything else.
+#ifndef RC_UTF_H_
+#define RC_UTF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#define UTF_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define UTF_TARGET(x)
+#else
+#define UTF_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+namespace utf {
+
+//////////////////////////////////////////////////////////////////////////////
+// Scalar implementations.
+
+// Returns if [data, data + size) is valid UTF-8: No overlong encodings, no
+// surrogates, nothing above U+10FFFF, no truncated sequences.
+inline bool IsValidUTF8Scalar(const uint8_t* data, size_t size) {
+  size_t i = 0;
+  while (i < size) {
+    uint8_t c = data[i];
+    if (c < 0x80) {
+      ++i;
+      continue;
+    }
+    size_t n;
+    uint8_t lo = 0x80, hi = 0xbf;  // Valid range of the second byte.
+    if (c >= 0xc2 && c <= 0xdf) {
+      n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      n = 3;
+      if (c == 0xe0)
+        lo = 0xa0;  // Overlong.
+      else if (c == 0xed)
+        hi = 0x9f;  // Surrogates.
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 4;
+      if (c == 0xf0)
+        lo = 0x90;  // Overlong.
+      else if (c == 0xf4)
+        hi = 0x8f;  // > U+10FFFF.
+    } else {
+      return false;
+    }
+    if (size - i < n || data[i + 1] < lo || data[i + 1] > hi)
+      return false;
+    for (size_t j = 2; j < n; ++j)
+      if ((data[i + j] & 0xc0) != 0x80)
+        return false;
+    i += n;
+  }
+  return true;
+}
+
+// Decodes the code point at data[*i] (which must be valid UTF-8), writes it
+// as one or two UTF-16 units to out[*o], and advances |i| and |o|.
+inline void UTF8ToUTF16Step(const uint8_t* data, size_t* i,
+                            uint16_t* out, size_t* o) {
+  uint32_t c = data[*i];
+  if (c < 0x80) {
+    *i += 1;
+  } else if (c < 0xe0) {
+    c = ((c & 0x1f) << 6) | (data[*i + 1] & 0x3f);
+    *i += 2;
+  } else if (c < 0xf0) {
+    c = ((c & 0x0f) << 12) | ((data[*i + 1] & 0x3f) << 6) |
+        (data[*i + 2] & 0x3f);
+    *i += 3;
+  } else {
+    c = ((c & 0x07) << 18) | ((data[*i + 1] & 0x3f) << 12) |
+        ((data[*i + 2] & 0x3f) << 6) | (data[*i + 3] & 0x3f);
+    *i += 4;
+  }
+  if (c < 0x10000) {
+    out[(*o)++] = c;
+  } else {
+    c -= 0x10000;
+    out[(*o)++] = 0xd800 + (c >> 10);
+    out[(*o)++] = 0xdc00 + (c & 0x3ff);
+  }
+}
+
+// Converts valid UTF-8 to UTF-16.  |out| must have room for |size| units.
+// Returns the number of units written.
+inline size_t UTF8ToUTF16Scalar(const uint8_t* data, size_t size,
+                                uint16_t* out) {
+  size_t i = 0, o = 0;
+  while (i < size)
+    UTF8ToUTF16Step(data, &i, out, &o);
+  return o;
+}
+
+// Incremental UTF-16LE to UTF-8 conversion, see UTF16LEToUTF8() below.
+struct UTF16Decoder {
+  uint32_t high_surrogate = 0;
+  bool ok = true;
+
+  // Appends the UTF-8 encoding of |unit| to |o| and returns the new end.
+  char* Step(uint32_t unit, char* o) {
+    uint32_t c = unit;
+    if (high_surrogate) {
+      if (c < 0xdc00 || c > 0xdfff) {
+        ok = false;
+        return o;
+      }
+      c = 0x10000 + ((high_surrogate - 0xd800) << 10) + (c - 0xdc00);
+      high_surrogate = 0;
+    } else if (c >= 0xd800 && c <= 0xdbff) {
+      high_surrogate = c;
+      return o;
+    } else if (c >= 0xdc00 && c <= 0xdfff) {
+      ok = false;
+      return o;
+    }
+
+    if (c < 0x80) {
+      *o++ = c;
+    } else if (c < 0x800) {
+      *o++ = 0xc0 | (c >> 6);
+      *o++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+      *o++ = 0xe0 | (c >> 12);
+      *o++ = 0x80 | ((c >> 6) & 0x3f);
+      *o++ = 0x80 | (c & 0x3f);
+    } else {
+      *o++ = 0xf0 | (c >> 18);
+      *o++ = 0x80 | ((c >> 12) & 0x3f);
+      *o++ = 0x80 | ((c >> 6) & 0x3f);
+      *o++ = 0x80 | (c & 0x3f);
+    }
+    return o;
+  }
+};
+
+// Processes UTF-16LE input in chunks of this many units.
+const size_t kUTF16ChunkUnits = 4096;
+
+// Converts up to kUTF16ChunkUnits units starting at unit |*i| to UTF-8 in
+// |buf|, which must have room for 3 bytes per unit.  Stops early at a \0
+// unit and sets |*num_units| to its index.  Returns the end of the output.
+inline char* UTF16LEToUTF8ChunkScalar(const uint8_t* data, size_t size,
+                                      size_t* i, size_t* num_units,
+                                      UTF16Decoder* decoder, char* buf) {
+  size_t end = *i + kUTF16ChunkUnits < *num_units ? *i + kUTF16ChunkUnits
+                                                  : *num_units;
+  char* o = buf;
+  for (; *i < end && decoder->ok; ++*i) {
+    uint32_t unit = data[2 * *i];
+    if (2 * *i + 1 < size)
+      unit |= data[2 * *i + 1] << 8;
+    if (unit == 0) {
+      *num_units = *i;
+      break;
+    }
+    o = decoder->Step(unit, o);
+  }
+  return o;
+}
+
+#if UTF_X86
+//////////////////////////////////////////////////////////////////////////////
+// SSE4 and AVX2 implementations.
+
+// Lookup tables for the validation algorithm.  Each table maps a nibble to
+// the set of errors that are possible for it; a byte pair is invalid iff
+// the intersection of the three lookups is non-empty.
+enum : uint8_t {
+  kTooShort = 1 << 0,      // 11______ 0_______, 11______ 11______
+  kTooLong = 1 << 1,       // 0_______ 10______
+  kOverlong3 = 1 << 2,     // 11100000 100_____
+  kTooLarge = 1 << 3,      // 11110100 1001____ and up
+  kSurrogate = 1 << 4,     // 11101101 101_____
+  kOverlong2 = 1 << 5,     // 1100000_ 10______
+  kTooLarge1000 = 1 << 6,  // 11110101 1000____ and up
+  kOverlong4 = 1 << 6,     // 11110000 1000____
+  kTwoConts = 1 << 7,      // 10______ 10______
+  kCarry = kTooShort | kTooLong | kTwoConts,
+};
+
+#define UTF_BYTE_1_HIGH                                                      \
+  kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,      \
+      kTooLong, kTwoConts, kTwoConts, kTwoConts, kTwoConts,                  \
+      kTooShort | kOverlong2, kTooShort,                                     \
+      kTooShort | kOverlong3 | kSurrogate,                                   \
+      kTooShort | kTooLarge | kTooLarge1000 | kOverlong4
+#define UTF_BYTE_1_LOW                                                       \
+  kCarry | kOverlong3 | kOverlong2 | kOverlong4, kCarry | kOverlong2,        \
+      kCarry, kCarry, kCarry | kTooLarge, kCarry | kTooLarge | kTooLarge1000, \
+      kCarry | kTooLarge | kTooLarge1000, kCarry | kTooLarge | kTooLarge1000, \
+      kCarry | kTooLarge | kTooLarge1000, kCarry | kTooLarge | kTooLarge1000, \
+      kCarry | kTooLarge | kTooLarge1000, kCarry | kTooLarge | kTooLarge1000, \
+      kCarry | kTooLarge | kTooLarge1000,                                    \
+      kCarry | kTooLarge | kTooLarge1000 | kSurrogate,                       \
+      kCarry | kTooLarge | kTooLarge1000, kCarry | kTooLarge | kTooLarge1000
+#define UTF_BYTE_2_HIGH                                                      \
+  kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,          \
+      kTooShort, kTooShort,                                                  \
+      kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 |       \
+          kOverlong4,                                                        \
+      kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,            \
+      kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,            \
+      kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,            \
+      kTooShort, kTooShort, kTooShort, kTooShort
+
+UTF_TARGET("sse4.1")
+inline bool IsValidUTF8SSE4(const uint8_t* data, size_t size) {
+  const __m128i byte_1_high = _mm_setr_epi8(UTF_BYTE_1_HIGH);
+  const __m128i byte_1_low = _mm_setr_epi8(UTF_BYTE_1_LOW);
+  const __m128i byte_2_high = _mm_setr_epi8(UTF_BYTE_2_HIGH);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  // Bytes in the last 3 positions that start a sequence that doesn't fit.
+  const __m128i max_complete =
+      _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                    0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+
+  __m128i error = _mm_setzero_si128();
+  __m128i prev = _mm_setzero_si128();
+  __m128i prev_incomplete = _mm_setzero_si128();
+  uint8_t tail[16];
+  for (size_t i = 0; i < size; i += 16) {
+    __m128i input;
+    if (size - i >= 16) {
+      input = _mm_loadu_si128((const __m128i*)(data + i));
+    } else {
+      // Pad with \0, which is ASCII and ends incomplete sequences.
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, data + i, size - i);
+      input = _mm_loadu_si128((const __m128i*)tail);
+    }
+
+    if (_mm_movemask_epi8(input) == 0) {
+      // ASCII: Only need to check the end of the previous block.
+      error = _mm_or_si128(error, prev_incomplete);
+      prev_incomplete = _mm_setzero_si128();
+      prev = input;
+      continue;
+    }
+
+    __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+    __m128i special_cases = _mm_and_si128(
+        _mm_and_si128(
+            _mm_shuffle_epi8(byte_1_high,
+                             _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+            _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(byte_2_high,
+                         _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+    // Third and fourth bytes of 3 and 4 byte sequences must be
+    // continuations.  (Second bytes are handled by the tables.)
+    __m128i prev2 = _mm_alignr_epi8(input, prev, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev, 13);
+    __m128i must_be_cont = _mm_or_si128(
+        _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+        _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80)));
+    must_be_cont = _mm_and_si128(must_be_cont, _mm_set1_epi8((char)0x80));
+    error = _mm_or_si128(error, _mm_xor_si128(must_be_cont, special_cases));
+
+    prev_incomplete = _mm_subs_epu8(input, max_complete);
+    prev = input;
+  }
+  error = _mm_or_si128(error, prev_incomplete);
+  return _mm_testz_si128(error, error);
+}
+
+UTF_TARGET("avx2")
+inline bool IsValidUTF8AVX2(const uint8_t* data, size_t size) {
+  const __m256i byte_1_high =
+      _mm256_setr_epi8(UTF_BYTE_1_HIGH, UTF_BYTE_1_HIGH);
+  const __m256i byte_1_low = _mm256_setr_epi8(UTF_BYTE_1_LOW, UTF_BYTE_1_LOW);
+  const __m256i byte_2_high =
+      _mm256_setr_epi8(UTF_BYTE_2_HIGH, UTF_BYTE_2_HIGH);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i max_complete = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0xf0 - 1, 0xe0 - 1,
+      0xc0 - 1);
+
+  __m256i error = _mm256_setzero_si256();
+  __m256i prev = _mm256_setzero_si256();
+  __m256i prev_incomplete = _mm256_setzero_si256();
+  uint8_t tail[32];
+  for (size_t i = 0; i < size; i += 32) {
+    __m256i input;
+    if (size - i >= 32) {
+      input = _mm256_loadu_si256((const __m256i*)(data + i));
+    } else {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, data + i, size - i);
+      input = _mm256_loadu_si256((const __m256i*)tail);
+    }
+
+    if (_mm256_movemask_epi8(input) == 0) {
+      error = _mm256_or_si256(error, prev_incomplete);
+      prev_incomplete = _mm256_setzero_si256();
+      prev = input;
+      continue;
+    }
+
+    // alignr works within 128-bit lanes, so first make a vector of the
+    // previous block's high lane and this block's low lane.
+    __m256i shifted = _mm256_permute2x128_si256(prev, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i special_cases = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(
+                byte_1_high,
+                _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(
+            byte_2_high,
+            _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+    __m256i must_be_cont = _mm256_or_si256(
+        _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+        _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80)));
+    must_be_cont =
+        _mm256_and_si256(must_be_cont, _mm256_set1_epi8((char)0x80));
+    error = _mm256_or_si256(error,
+                            _mm256_xor_si256(must_be_cont, special_cases));
+
+    prev_incomplete = _mm256_subs_epu8(input, max_complete);
+    prev = input;
+  }
+  error = _mm256_or_si256(error, prev_incomplete);
+  return _mm256_testz_si256(error, error);
+}
+
+#undef UTF_BYTE_1_HIGH
+#undef UTF_BYTE_1_LOW
+#undef UTF_BYTE_2_HIGH
+
+UTF_TARGET("sse4.1")
+inline size_t UTF8ToUTF16SSE4(const uint8_t* data, size_t size,
+                              uint16_t* out) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0, o = 0;
+  while (i < size) {
+    if (size - i >= 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+      if (_mm_movemask_epi8(v) == 0) {
+        _mm_storeu_si128((__m128i*)(out + o), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i*)(out + o + 8), _mm_unpackhi_epi8(v, zero));
+        i += 16;
+        o += 16;
+        continue;
+      }
+    }
+    UTF8ToUTF16Step(data, &i, out, &o);
+  }
+  return o;
+}
+
+UTF_TARGET("avx2")
+inline size_t UTF8ToUTF16AVX2(const uint8_t* data, size_t size,
+                              uint16_t* out) {
+  size_t i = 0, o = 0;
+  while (i < size) {
+    if (size - i >= 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+      if (_mm_movemask_epi8(v) == 0) {
+        _mm256_storeu_si256((__m256i*)(out + o), _mm256_cvtepu8_epi16(v));
+        i += 16;
+        o += 16;
+        continue;
+      }
+    }
+    UTF8ToUTF16Step(data, &i, out, &o);
+  }
+  return o;
+}
+
+// Like UTF16LEToUTF8ChunkScalar, but handles runs of 8 ASCII units at once.
+UTF_TARGET("sse4.1")
+inline char* UTF16LEToUTF8ChunkSSE4(const uint8_t* data, size_t size,
+                                    size_t* i, size_t* num_units,
+                                    UTF16Decoder* decoder, char* buf) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i non_ascii = _mm_set1_epi16((short)0xff80);
+  size_t end = *i + kUTF16ChunkUnits < *num_units ? *i + kUTF16ChunkUnits
+                                                  : *num_units;
+  char* o = buf;
+  while (*i < end && decoder->ok) {
+    // 8 full units available, and no pending high surrogate that the next
+    // unit would need to pair with.
+    if (end - *i >= 8 && 2 * *i + 16 <= size && !decoder->high_surrogate) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(data + 2 * *i));
+      __m128i bad = _mm_or_si128(
+          _mm_cmpeq_epi16(v, zero),
+          _mm_xor_si128(_mm_cmpeq_epi16(_mm_and_si128(v, non_ascii), zero),
+                        _mm_set1_epi16(-1)));
+      if (_mm_testz_si128(bad, bad)) {
+        _mm_storel_epi64((__m128i*)o, _mm_packus_epi16(v, v));
+        o += 8;
+        *i += 8;
+        continue;
+      }
+    }
+    uint32_t unit = data[2 * *i];
+    if (2 * *i + 1 < size)
+      unit |= data[2 * *i + 1] << 8;
+    if (unit == 0) {
+      *num_units = *i;
+      break;
+    }
+    o = decoder->Step(unit, o);
+    ++*i;
+  }
+  return o;
+}
+
+// 0: scalar, 1: SSE4, 2: AVX2.
+inline int CpuLevel() {
+  static const int level = [] {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool sse4 = (info[2] & (1 << 19)) != 0 && (info[2] & (1 << 9)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0 && (info[2] & (1 << 27)) != 0 &&
+               (_xgetbv(0) & 6) == 6;
+    bool avx2 = false;
+    if (avx && max_leaf >= 7) {
+      __cpuidex(info, 7, 0);
+      avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    bool sse4 = __builtin_cpu_supports("sse4.1") &&
+                __builtin_cpu_supports("ssse3");
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return avx2 ? 2 : sse4 ? 1 : 0;
+  }();
+  return level;
+}
+#endif  // UTF_X86
+
+//////////////////////////////////////////////////////////////////////////////
+// Dispatchers.
+
+inline bool IsValidUTF8(const uint8_t* data, size_t size) {
+#if UTF_X86
+  switch (CpuLevel()) {
+    case 2: return IsValidUTF8AVX2(data, size);
+    case 1: return IsValidUTF8SSE4(data, size);
+  }
+#endif
+  return IsValidUTF8Scalar(data, size);
+}
+
+// Converts valid UTF-8 to UTF-16.  |out| must have room for |size| units.
+// Returns the number of units written.
+inline size_t UTF8ToUTF16(const uint8_t* data, size_t size, uint16_t* out) {
+#if UTF_X86
+  switch (CpuLevel()) {
+    case 2: return UTF8ToUTF16AVX2(data, size, out);
+    case 1: return UTF8ToUTF16SSE4(data, size, out);
+  }
+#endif
+  return UTF8ToUTF16Scalar(data, size, out);
+}
+
+// Appends UTF-16LE |data| converted to UTF-8 to |out|, up to the first \0
+// code unit.  An odd trailing byte is treated as a code unit with high byte
+// 0.  Works on fixed-size chunks, so that no aligned UTF-16 copy of the whole
+// input is needed.  Returns false on unpaired surrogates.
+// |level| is for testing; -1 means "best available".
+inline bool UTF16LEToUTF8(const uint8_t* data, size_t size, std::string* out,
+                          int level = -1) {
+#if UTF_X86
+  if (level < 0)
+    level = CpuLevel();
+#endif
+  size_t num_units = (size + 1) / 2;
+  out->reserve(out->size() + num_units);
+
+  char buf[3 * kUTF16ChunkUnits];  // At most 3 UTF-8 bytes per UTF-16 unit.
+  UTF16Decoder decoder;
+  for (size_t i = 0; i < num_units && decoder.ok;) {
+    char* o;
+#if UTF_X86
+    if (level > 0)
+      o = UTF16LEToUTF8ChunkSSE4(data, size, &i, &num_units, &decoder, buf);
+    else
+#endif
+      o = UTF16LEToUTF8ChunkScalar(data, size, &i, &num_units, &decoder, buf);
+    out->append(buf, o - buf);
+  }
+  return decoder.ok && decoder.high_surrogate == 0;
+}
+
+}  // namespace utf
+
+#endif  // RC_UTF_H_
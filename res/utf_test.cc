@@ -0,0 +1,549 @@
+/*
+Differential test for utf.h: Checks that all implementations agree with the
+Unicode, Inc. ConvertUTF code that rc.cc used before, and that the scalar
+validator agrees with a naive decode-and-reencode check.
+
+clang++ -std=c++14 -O2 -o utf_test utf_test.cc && ./utf_test
+*/
+#include "utf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+// The scalar code that rc.cc used before utf.h, kept verbatim as the
+// reference that utf.h's implementations are checked against, so that a
+// misreading of the spec shared by them doesn't go unnoticed.
+namespace unicode_inc {
+typedef uint8_t UTF8;
+/*
+ * Copyright 2001-2004 Unicode, Inc.
+ *
+ * Disclaimer
+ *
+ * This source code is provided as is by Unicode, Inc. No claims are
+ * made as to fitness for any particular purpose. No warranties of any
+ * kind are expressed or implied. The recipient agrees to determine
+ * applicability of information provided. If this file has been
+ * purchased on magnetic or optical media from Unicode, Inc., the
+ * sole remedy for any claim will be exchange of defective media
+ * within 90 days of receipt.
+ *
+ * Limitations on Rights to Redistribute This Code
+ *
+ * Unicode, Inc. hereby grants the right to freely use the information
+ * supplied in this file in the creation of products supporting the
+ * Unicode Standard, and to make copies of this file in any form
+ * for internal or external distribution as long as this notice
+ * remains attached.
+ */
+static const char trailingBytesForUTF8[256] = {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+    2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 3,3,3,3,3,3,3,3,4,4,4,4,5,5,5,5
+};
+static bool isLegalUTF8(const UTF8 *source, int length) {
+  UTF8 a;
+  const UTF8 *srcptr = source+length;
+  switch (length) {
+    default: return false;
+      /* Everything else falls through when "true"... */
+    case 4: if ((a = (*--srcptr)) < 0x80 || a > 0xBF) return false;
+    case 3: if ((a = (*--srcptr)) < 0x80 || a > 0xBF) return false;
+    case 2: if ((a = (*--srcptr)) < 0x80 || a > 0xBF) return false;
+
+      switch (*source) {
+        /* no fall-through in this inner switch */
+        case 0xE0: if (a < 0xA0) return false; break;
+        case 0xED: if (a > 0x9F) return false; break;
+        case 0xF0: if (a < 0x90) return false; break;
+        case 0xF4: if (a > 0x8F) return false; break;
+        default:   if (a < 0x80) return false;
+      }
+
+    case 1: if (*source >= 0x80 && *source < 0xC2) return false;
+  }
+  if (*source > 0xF4) return false;
+  return true;
+}
+bool isLegalUTF8String(const UTF8 *source, const UTF8 *sourceEnd) {
+  while (source != sourceEnd) {
+    int length = trailingBytesForUTF8[*source] + 1;
+    if (length > sourceEnd - source || !isLegalUTF8(source, length))
+      return false;
+    source += length;
+  }
+  return true;
+}
+
+typedef uint16_t UTF16;
+typedef uint32_t UTF32;
+
+#define UNI_REPLACEMENT_CHAR (UTF32)0x0000FFFD
+#define UNI_MAX_BMP (UTF32)0x0000FFFF
+#define UNI_MAX_UTF16 (UTF32)0x0010FFFF
+
+typedef enum {
+	conversionOK, 		/* conversion successful */
+	sourceExhausted,	/* partial character in source, but hit end */
+	targetExhausted,	/* insuff. room in target for conversion */
+	sourceIllegal		/* source sequence is illegal/malformed */
+} ConversionResult;
+
+typedef enum {
+	strictConversion = 0,
+	lenientConversion
+} ConversionFlags;
+
+ConversionResult ConvertUTF8toUTF16 (
+		const UTF8** sourceStart, const UTF8* sourceEnd,
+		UTF16** targetStart, UTF16* targetEnd, ConversionFlags flags);
+
+ConversionResult ConvertUTF16toUTF8 (
+		const UTF16** sourceStart, const UTF16* sourceEnd,
+		UTF8** targetStart, UTF8* targetEnd, ConversionFlags flags);
+
+static const int halfShift  = 10; /* used for shifting by 10 bits */
+
+static const UTF32 halfBase = 0x0010000UL;
+static const UTF32 halfMask = 0x3FFUL;
+
+#define UNI_SUR_HIGH_START  (UTF32)0xD800
+#define UNI_SUR_HIGH_END    (UTF32)0xDBFF
+#define UNI_SUR_LOW_START   (UTF32)0xDC00
+#define UNI_SUR_LOW_END     (UTF32)0xDFFF
+
+/* --------------------------------------------------------------------- */
+
+/*
+ * Magic values subtracted from a buffer value during UTF8 conversion.
+ * This table contains as many values as there might be trailing bytes
+ * in a UTF-8 sequence.
+ */
+static const UTF32 offsetsFromUTF8[6] = { 0x00000000UL, 0x00003080UL, 0x000E2080UL,
+		     0x03C82080UL, 0xFA082080UL, 0x82082080UL };
+
+/*
+ * Once the bits are split out into bytes of UTF-8, this is a mask OR-ed
+ * into the first byte, depending on how many bytes follow.  There are
+ * as many entries in this table as there are UTF-8 sequence types.
+ * (I.e., one byte sequence, two byte... etc.). Remember that sequencs
+ * for *legal* UTF-8 will be 4 or fewer bytes total.
+ */
+static const UTF8 firstByteMark[7] = { 0x00, 0x00, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC };
+
+/* The interface converts a whole buffer to avoid function-call overhead.
+ * Constants have been gathered. Loops & conditionals have been removed as
+ * much as possible for efficiency, in favor of drop-through switches.
+ * (See "Note A" at the bottom of the file for equivalent code.)
+ * If your compiler supports it, the "isLegalUTF8" call can be turned
+ * into an inline function.
+ */
+
+/* --------------------------------------------------------------------- */
+
+ConversionResult ConvertUTF16toUTF8 (
+	const UTF16** sourceStart, const UTF16* sourceEnd,
+	UTF8** targetStart, UTF8* targetEnd, ConversionFlags flags) {
+    ConversionResult result = conversionOK;
+    const UTF16* source = *sourceStart;
+    UTF8* target = *targetStart;
+    while (source < sourceEnd) {
+	UTF32 ch;
+	unsigned short bytesToWrite = 0;
+	const UTF32 byteMask = 0xBF;
+	const UTF32 byteMark = 0x80;
+	const UTF16* oldSource = source; /* In case we have to back up because of target overflow. */
+	ch = *source++;
+	/* If we have a surrogate pair, convert to UTF32 first. */
+	if (ch >= UNI_SUR_HIGH_START && ch <= UNI_SUR_HIGH_END) {
+	    /* If the 16 bits following the high surrogate are in the source buffer... */
+	    if (source < sourceEnd) {
+		UTF32 ch2 = *source;
+		/* If it's a low surrogate, convert to UTF32. */
+		if (ch2 >= UNI_SUR_LOW_START && ch2 <= UNI_SUR_LOW_END) {
+		    ch = ((ch - UNI_SUR_HIGH_START) << halfShift)
+			+ (ch2 - UNI_SUR_LOW_START) + halfBase;
+		    ++source;
+		} else if (flags == strictConversion) { /* it's an unpaired high surrogate */
+		    --source; /* return to the illegal value itself */
+		    result = sourceIllegal;
+		    break;
+		}
+	    } else { /* We don't have the 16 bits following the high surrogate. */
+		--source; /* return to the high surrogate */
+		result = sourceExhausted;
+		break;
+	    }
+	} else if (flags == strictConversion) {
+	    /* UTF-16 surrogate values are illegal in UTF-32 */
+	    if (ch >= UNI_SUR_LOW_START && ch <= UNI_SUR_LOW_END) {
+		--source; /* return to the illegal value itself */
+		result = sourceIllegal;
+		break;
+	    }
+	}
+	/* Figure out how many bytes the result will require */
+	if (ch < (UTF32)0x80) {	     bytesToWrite = 1;
+	} else if (ch < (UTF32)0x800) {     bytesToWrite = 2;
+	} else if (ch < (UTF32)0x10000) {   bytesToWrite = 3;
+	} else if (ch < (UTF32)0x110000) {  bytesToWrite = 4;
+	} else {			    bytesToWrite = 3;
+					    ch = UNI_REPLACEMENT_CHAR;
+	}
+
+	target += bytesToWrite;
+	if (target > targetEnd) {
+	    source = oldSource; /* Back up source pointer! */
+	    target -= bytesToWrite; result = targetExhausted; break;
+	}
+	switch (bytesToWrite) { /* note: everything falls through. */
+	    case 4: *--target = (UTF8)((ch | byteMark) & byteMask); ch >>= 6;
+	    case 3: *--target = (UTF8)((ch | byteMark) & byteMask); ch >>= 6;
+	    case 2: *--target = (UTF8)((ch | byteMark) & byteMask); ch >>= 6;
+	    case 1: *--target =  (UTF8)(ch | firstByteMark[bytesToWrite]);
+	}
+	target += bytesToWrite;
+    }
+    *sourceStart = source;
+    *targetStart = target;
+    return result;
+}
+
+/* --------------------------------------------------------------------- */
+
+ConversionResult ConvertUTF8toUTF16 (
+	const UTF8** sourceStart, const UTF8* sourceEnd,
+	UTF16** targetStart, UTF16* targetEnd, ConversionFlags flags) {
+    ConversionResult result = conversionOK;
+    const UTF8* source = *sourceStart;
+    UTF16* target = *targetStart;
+    while (source < sourceEnd) {
+	UTF32 ch = 0;
+	unsigned short extraBytesToRead = trailingBytesForUTF8[*source];
+	if (source + extraBytesToRead >= sourceEnd) {
+	    result = sourceExhausted; break;
+	}
+	/* Do this check whether lenient or strict */
+	if (! isLegalUTF8(source, extraBytesToRead+1)) {
+	    result = sourceIllegal;
+	    break;
+	}
+	/*
+	 * The cases all fall through. See "Note A" below.
+	 */
+	switch (extraBytesToRead) {
+	    case 5: ch += *source++; ch <<= 6; /* remember, illegal UTF-8 */
+	    case 4: ch += *source++; ch <<= 6; /* remember, illegal UTF-8 */
+	    case 3: ch += *source++; ch <<= 6;
+	    case 2: ch += *source++; ch <<= 6;
+	    case 1: ch += *source++; ch <<= 6;
+	    case 0: ch += *source++;
+	}
+	ch -= offsetsFromUTF8[extraBytesToRead];
+
+	if (target >= targetEnd) {
+	    source -= (extraBytesToRead+1); /* Back up source pointer! */
+	    result = targetExhausted; break;
+	}
+	if (ch <= UNI_MAX_BMP) { /* Target is a character <= 0xFFFF */
+	    /* UTF-16 surrogate values are illegal in UTF-32 */
+	    if (ch >= UNI_SUR_HIGH_START && ch <= UNI_SUR_LOW_END) {
+		if (flags == strictConversion) {
+		    source -= (extraBytesToRead+1); /* return to the illegal value itself */
+		    result = sourceIllegal;
+		    break;
+		} else {
+		    *target++ = UNI_REPLACEMENT_CHAR;
+		}
+	    } else {
+		*target++ = (UTF16)ch; /* normal case */
+	    }
+	} else if (ch > UNI_MAX_UTF16) {
+	    if (flags == strictConversion) {
+		result = sourceIllegal;
+		source -= (extraBytesToRead+1); /* return to the start */
+		break; /* Bail out; shouldn't continue */
+	    } else {
+		*target++ = UNI_REPLACEMENT_CHAR;
+	    }
+	} else {
+	    /* target is a character in range 0xFFFF - 0x10FFFF. */
+	    if (target + 1 >= targetEnd) {
+		source -= (extraBytesToRead+1); /* Back up source pointer! */
+		result = targetExhausted; break;
+	    }
+	    ch -= halfBase;
+	    *target++ = (UTF16)((ch >> halfShift) + UNI_SUR_HIGH_START);
+	    *target++ = (UTF16)((ch & halfMask) + UNI_SUR_LOW_START);
+	}
+    }
+    *sourceStart = source;
+    *targetStart = target;
+    return result;
+}
+}  // namespace unicode_inc
+
+static int g_failures = 0;
+
+static void Fail(const char* what, const std::vector<uint8_t>& in) {
+  if (++g_failures > 20)
+    return;
+  fprintf(stderr, "FAIL %s:", what);
+  for (uint8_t c : in)
+    fprintf(stderr, " %02x", c);
+  fprintf(stderr, "\n");
+}
+
+// Independent reference: decode greedily, then check the code point is in
+// range and re-encodes to the same bytes.
+static bool NaiveIsValidUTF8(const std::vector<uint8_t>& in) {
+  for (size_t i = 0; i < in.size();) {
+    uint8_t c = in[i];
+    size_t n = c < 0x80   ? 1
+             : c < 0xc0 ? 0
+             : c < 0xe0 ? 2
+             : c < 0xf0 ? 3
+             : c < 0xf8 ? 4
+                        : 0;
+    if (n == 0 || i + n > in.size())
+      return false;
+    uint32_t cp = n == 1 ? c : c & (0x7f >> n);
+    for (size_t j = 1; j < n; ++j) {
+      if ((in[i + j] & 0xc0) != 0x80)
+        return false;
+      cp = (cp << 6) | (in[i + j] & 0x3f);
+    }
+    size_t want = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+    if (want != n || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+      return false;
+    i += n;
+  }
+  return true;
+}
+
+static void CheckUTF8(const std::vector<uint8_t>& in) {
+  const uint8_t* p = in.data();
+  bool valid = utf::IsValidUTF8Scalar(p, in.size());
+  if (valid != unicode_inc::isLegalUTF8String(p, p + in.size()))
+    Fail("IsValidUTF8Scalar vs. isLegalUTF8String", in);
+  if (valid != NaiveIsValidUTF8(in))
+    Fail("IsValidUTF8Scalar", in);
+#if UTF_X86
+  int level = utf::CpuLevel();
+  if (level >= 1 && utf::IsValidUTF8SSE4(p, in.size()) != valid)
+    Fail("IsValidUTF8SSE4", in);
+  if (level >= 2 && utf::IsValidUTF8AVX2(p, in.size()) != valid)
+    Fail("IsValidUTF8AVX2", in);
+#endif
+  if (!valid)
+    return;
+
+  std::vector<uint16_t> want(in.size()), got(in.size());
+  size_t n = utf::UTF8ToUTF16Scalar(p, in.size(), want.data());
+  want.resize(n);
+
+  // The old converter wants room for a whole surrogate pair plus one unit.
+  std::vector<uint16_t> ref(in.size() + 1);
+  const unicode_inc::UTF8* src = p;
+  unicode_inc::UTF16* dst = ref.data();
+  if (unicode_inc::ConvertUTF8toUTF16(&src, p + in.size(), &dst,
+                                      ref.data() + ref.size(),
+                                      unicode_inc::strictConversion) !=
+      unicode_inc::conversionOK)
+    Fail("ConvertUTF8toUTF16", in);
+  ref.resize(dst - ref.data());
+  if (want != ref)
+    Fail("UTF8ToUTF16Scalar vs. ConvertUTF8toUTF16", in);
+#if UTF_X86
+  if (level >= 1) {
+    got.resize(in.size());
+    got.resize(utf::UTF8ToUTF16SSE4(p, in.size(), got.data()));
+    if (got != want)
+      Fail("UTF8ToUTF16SSE4", in);
+  }
+  if (level >= 2) {
+    got.resize(in.size());
+    got.resize(utf::UTF8ToUTF16AVX2(p, in.size(), got.data()));
+    if (got != want)
+      Fail("UTF8ToUTF16AVX2", in);
+  }
+#endif
+
+  // Round-trip through UTF-16LE, which stops at \0.
+  if (std::find(in.begin(), in.end(), 0) != in.end())
+    return;
+  std::vector<uint8_t> le;
+  for (uint16_t u : want) {
+    le.push_back(u & 0xff);
+    le.push_back(u >> 8);
+  }
+  std::string back;
+  if (!utf::UTF16LEToUTF8(le.data(), le.size(), &back, 0) ||
+      back != std::string(in.begin(), in.end()))
+    Fail("UTF16LEToUTF8 round trip", in);
+}
+
+static void CheckUTF16(const std::vector<uint8_t>& in) {
+  // Reference: the code units up to the first \0, an odd trailing byte being
+  // a unit with high byte 0, through the old strict converter.
+  std::vector<uint16_t> units;
+  for (size_t i = 0; i < in.size(); i += 2) {
+    uint16_t u = in[i] | (i + 1 < in.size() ? in[i + 1] << 8 : 0);
+    if (u == 0)
+      break;
+    units.push_back(u);
+  }
+  std::string want(3 * units.size(), '\0');
+  const unicode_inc::UTF16* src = units.data();
+  unicode_inc::UTF8* dst = (unicode_inc::UTF8*)&want[0];
+  bool ok = unicode_inc::ConvertUTF16toUTF8(
+                &src, units.data() + units.size(), &dst,
+                (unicode_inc::UTF8*)&want[0] + want.size(),
+                unicode_inc::strictConversion) == unicode_inc::conversionOK;
+  want.resize(dst - (unicode_inc::UTF8*)&want[0]);
+
+  for (int level = 0; level <= 2; ++level) {
+#if UTF_X86
+    if (level > utf::CpuLevel())
+      break;
+#else
+    if (level > 0)
+      break;
+#endif
+    std::string got;
+    if (utf::UTF16LEToUTF8(in.data(), in.size(), &got, level) != ok ||
+        (ok && got != want))
+      Fail(level == 0 ? "UTF16LEToUTF8 scalar" : "UTF16LEToUTF8", in);
+  }
+}
+
+int main() {
+  std::mt19937 rng(1234);
+
+  // All 1 and 2 byte sequences, all 3 byte sequences with a leading byte
+  // >= 0xe0, and 4 byte sequences with leading byte >= 0xf0, each at
+  // various offsets so that they straddle 16 and 32 byte blocks.
+  std::vector<uint8_t> buf;
+  for (size_t pad : {0, 14, 30, 62}) {
+    for (int a = 0; a < 256; ++a) {
+      for (int b = 0; b < 256; ++b) {
+        buf.assign(pad, 'a');
+        buf.push_back(a);
+        buf.push_back(b);
+        CheckUTF8(buf);
+        if (b == 0) {
+          buf.pop_back();
+          CheckUTF8(buf);
+        }
+      }
+    }
+  }
+  for (size_t pad : {0, 13, 29}) {
+    for (int a = 0xe0; a < 256; ++a) {
+      for (int b = 0x70; b < 0xd0; ++b) {
+        for (int c = 0x70; c < 0xd0; ++c) {
+          buf.assign(pad, 'a');
+          buf.push_back(a);
+          buf.push_back(b);
+          buf.push_back(c);
+          CheckUTF8(buf);
+          buf.push_back(0x80 + (rng() & 0x3f));
+          CheckUTF8(buf);
+        }
+      }
+    }
+  }
+
+  // Random strings of valid code points, with occasional corruption.
+  static const uint32_t kRanges[][2] = {
+    {0, 0x7f}, {0x80, 0x7ff}, {0x800, 0xd7ff}, {0xe000, 0xffff},
+    {0x10000, 0x10ffff},
+  };
+  for (int iter = 0; iter < 200000; ++iter) {
+    buf.clear();
+    size_t len = rng() % 100;
+    bool mostly_ascii = rng() % 2;
+    for (size_t i = 0; i < len; ++i) {
+      int r = mostly_ascii && rng() % 8 ? 0 : rng() % 5;
+      uint32_t cp = kRanges[r][0] + rng() % (kRanges[r][1] - kRanges[r][0] + 1);
+      if (cp < 0x80) {
+        buf.push_back(cp);
+      } else if (cp < 0x800) {
+        buf.push_back(0xc0 | (cp >> 6));
+        buf.push_back(0x80 | (cp & 0x3f));
+      } else if (cp < 0x10000) {
+        buf.push_back(0xe0 | (cp >> 12));
+        buf.push_back(0x80 | ((cp >> 6) & 0x3f));
+        buf.push_back(0x80 | (cp & 0x3f));
+      } else {
+        buf.push_back(0xf0 | (cp >> 18));
+        buf.push_back(0x80 | ((cp >> 12) & 0x3f));
+        buf.push_back(0x80 | ((cp >> 6) & 0x3f));
+        buf.push_back(0x80 | (cp & 0x3f));
+      }
+    }
+    if (!buf.empty() && rng() % 2) {
+      int n = 1 + rng() % 3;
+      for (int i = 0; i < n; ++i)
+        buf[rng() % buf.size()] = rng();
+    }
+    if (!buf.empty() && rng() % 8 == 0)
+      buf.resize(rng() % buf.size());
+    CheckUTF8(buf);
+  }
+
+  // Random UTF-16LE: mostly ASCII, with surrogates, \0 units, and odd sizes.
+  for (int iter = 0; iter < 200000; ++iter) {
+    buf.clear();
+    size_t len = rng() % 80;
+    for (size_t i = 0; i < len; ++i) {
+      uint32_t u;
+      switch (rng() % 16) {
+        case 0: u = 0xd800 + rng() % 0x400; break;
+        case 1: u = 0xdc00 + rng() % 0x400; break;
+        case 2: u = rng() & 0xffff; break;
+        case 3: u = 0x80 + rng() % 0x780; break;
+        case 4: u = rng() % 64 == 0 ? 0 : 0x7f; break;
+        case 5: {
+          uint32_t cp = rng() % 0x100000;
+          buf.push_back((0xd800 + (cp >> 10)) & 0xff);
+          buf.push_back((0xd800 + (cp >> 10)) >> 8);
+          u = 0xdc00 + (cp & 0x3ff);
+          break;
+        }
+        default: u = 1 + rng() % 0x7f;
+      }
+      buf.push_back(u & 0xff);
+      buf.push_back(u >> 8);
+    }
+    if (!buf.empty() && rng() % 4 == 0)
+      buf.pop_back();
+    CheckUTF16(buf);
+  }
+
+  // Long ASCII input that spans several conversion chunks.
+  buf.assign(2 * 3 * utf::kUTF16ChunkUnits + 6, 'x');
+  for (size_t i = 1; i < buf.size(); i += 2)
+    buf[i] = 0;
+  CheckUTF16(buf);
+  buf[2 * utf::kUTF16ChunkUnits - 2] = 0x3d;  // High surrogate across chunks.
+  buf[2 * utf::kUTF16ChunkUnits - 1] = 0xd8;
+  buf[2 * utf::kUTF16ChunkUnits + 1] = 0xdc;
+  CheckUTF16(buf);
+
+  if (g_failures) {
+    fprintf(stderr, "%d failures\n", g_failures);
+    return 1;
+  }
+  printf("passed\n");
+}